@@ -0,0 +1,335 @@
+// Headless batch runner, spreads emulation runs over every core with a work-stealing pool
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "nes.h"
+#include "movie.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BATCH_DEFAULT_FRAMES    600
+
+typedef struct BATCH_JOB
+{
+    char* rom;
+    uint32_t frames;
+    uint64_t seed;
+    NES_MOVIE* movie;   // Inputs and seed to play back, NULL runs without input
+
+    uint32_t frames_run;
+    uint64_t hash;      // Hash of the memory after the last frame
+    bool failed;
+} BATCH_JOB;
+
+// Job indices owned by one worker ; it pops from the bottom and the others steal from the top
+typedef struct BATCH_QUEUE
+{
+    pthread_mutex_t lock;
+    uint32_t* jobs;
+    uint32_t top, bottom;
+} BATCH_QUEUE;
+
+typedef struct BATCH BATCH;
+
+typedef struct BATCH_WORKER
+{
+    pthread_t thread;
+    uint32_t id;
+    BATCH_QUEUE queue;
+
+    uint64_t frames;
+    uint32_t runs, steals;
+
+    BATCH* batch;
+} BATCH_WORKER;
+
+struct BATCH
+{
+    BATCH_JOB* jobs;
+    uint32_t num_jobs, max_jobs;
+
+    BATCH_WORKER* workers;
+    uint32_t num_workers;
+};
+
+double batch_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.;
+}
+
+void batch_add_job(BATCH* batch, const char* rom, uint32_t frames, uint64_t seed, NES_MOVIE* movie)
+{
+    if (batch->num_jobs == batch->max_jobs)
+    {
+        batch->max_jobs = batch->max_jobs ? batch->max_jobs * 2 : 64;
+        batch->jobs = (BATCH_JOB*)realloc(batch->jobs, batch->max_jobs * sizeof(BATCH_JOB));
+    }
+
+    BATCH_JOB* job = &batch->jobs[batch->num_jobs++];
+    memset(job, 0, sizeof(BATCH_JOB));
+    job->rom = strdup(rom);
+    job->frames = frames;
+    job->seed = seed;
+    job->movie = movie;
+}
+
+// One "<rom> [frames]" job per line
+bool batch_read_job_list(BATCH* batch, const char* path, uint32_t frames, uint32_t runs, NES_MOVIE* movie)
+{
+    FILE* f = fopen(path, "r");
+    if (f == NULL)
+    {
+        fprintf(stderr, "Couldn't open job list \"%s\"\n", path);
+        return false;
+    }
+
+    char line[1024];
+    while (fgets(line, sizeof(line), f))
+    {
+        char rom[1024];
+        unsigned int job_frames = frames;
+        if (line[0] == '#' || sscanf(line, "%1023s %u", rom, &job_frames) < 1)
+            continue;
+        for (uint32_t i = 0; i < runs; i++)
+            batch_add_job(batch, rom, job_frames, i, movie);
+    }
+
+    fclose(f);
+    return true;
+}
+
+bool batch_next_job(BATCH_WORKER* worker, uint32_t* job)
+{
+    BATCH_QUEUE* queue = &worker->queue;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->bottom > queue->top)
+    {
+        *job = queue->jobs[--queue->bottom];
+        pthread_mutex_unlock(&queue->lock);
+        return true;
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    // Own queue is empty, steal from the others
+    BATCH* batch = worker->batch;
+    for (uint32_t i = 1; i < batch->num_workers; i++)
+    {
+        BATCH_QUEUE* victim = &batch->workers[(worker->id + i) % batch->num_workers].queue;
+
+        pthread_mutex_lock(&victim->lock);
+        if (victim->bottom > victim->top)
+        {
+            *job = victim->jobs[victim->top++];
+            pthread_mutex_unlock(&victim->lock);
+            worker->steals++;
+            return true;
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+
+    return false;   // Jobs are never added after the start so everything is done
+}
+
+void batch_run_job(NES* nes, BATCH_JOB* job)
+{
+    *nes = nes_create();
+    nes->verbose = false;
+    nes_seed(nes, job->seed);
+    nes_init(nes);
+
+    if (!nes_load_game(nes, job->rom))
+    {
+        job->failed = true;
+        nes_destroy(nes);
+        return;
+    }
+
+    if (job->movie != NULL)
+    {
+        if (!nes_movie_power_up(job->movie, nes))
+        {
+            job->failed = true;
+            nes_destroy(nes);
+            return;
+        }
+    }
+    else
+        nes_power_up(nes);
+    nes->emulation_running = true;
+    nes->render_interval = 0;   // Only the memory is looked at
+
+    for (job->frames_run = 0; job->frames_run < job->frames; job->frames_run++)
+    {
+        if (job->movie != NULL)
+            nes_set_input(nes, nes_movie_input(job->movie, job->frames_run));
+        nes_run_frame(nes);
+    }
+
+    job->hash = 0xcbf29ce484222325;     // FNV-1a
+    job->hash = nes_hash(job->hash, nes->cpu.memory_low, sizeof(nes->cpu.memory_low));
+    job->hash = nes_hash(job->hash, nes->ppu.VRAM, sizeof(nes->ppu.VRAM));
+    job->hash = nes_hash(job->hash, nes->ppu.oam_memory, sizeof(nes->ppu.oam_memory));
+    job->hash = nes_hash(job->hash, nes->ppu.palette_ram, sizeof(nes->ppu.palette_ram));
+    nes_destroy(nes);
+}
+
+void* batch_worker(void* arg)
+{
+    BATCH_WORKER* worker = (BATCH_WORKER*)arg;
+    NES* nes = (NES*)malloc(sizeof(NES));
+
+    uint32_t index;
+    while (batch_next_job(worker, &index))
+    {
+        BATCH_JOB* job = &worker->batch->jobs[index];
+        batch_run_job(nes, job);
+        worker->frames += job->frames_run;
+        worker->runs++;
+    }
+
+    free(nes);
+    return NULL;
+}
+
+void batch_usage()
+{
+    fprintf(stderr, "Usage: simple-nes-batch [-j threads] [-n frames] [-r runs] [-m movie] [-v] <rom | @job_list>...\n");
+    fprintf(stderr, "    -j  worker threads (default: number of cores)\n");
+    fprintf(stderr, "    -n  frames per run (default: %u)\n", BATCH_DEFAULT_FRAMES);
+    fprintf(stderr, "    -r  runs per rom, each with its own power up seed (default: 1)\n");
+    fprintf(stderr, "    -m  play back a movie on the roms that follow, for its whole length and with its seed\n");
+    fprintf(stderr, "    -v  print the result of every run\n");
+}
+
+int main(int argc, char** argv)
+{
+    BATCH batch = { 0 };
+    long num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t num_threads = num_cores > 0 ? num_cores : 1;
+    uint32_t frames = BATCH_DEFAULT_FRAMES, runs = 1;
+    bool verbose = false;
+    NES_MOVIE movie = { 0 };
+    bool movie_loaded = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+            num_threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            frames = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+            runs = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+        {
+            if (movie_loaded)
+            {
+                fprintf(stderr, "Only one movie can be played back\n");
+                return 1;
+            }
+            if (!nes_movie_load(&movie, argv[++i]))
+                return 1;
+            movie_loaded = true;
+        }
+        else if (strcmp(argv[i], "-v") == 0)
+            verbose = true;
+        else if (argv[i][0] == '-')
+        {
+            batch_usage();
+            return 1;
+        }
+        else if (argv[i][0] == '@')
+        {
+            if (!batch_read_job_list(&batch, &argv[i][1], movie_loaded ? movie.frames : frames, movie_loaded ? 1 : runs, movie_loaded ? &movie : NULL))
+                return 1;
+        }
+        else
+        {
+            if (movie_loaded)
+                batch_add_job(&batch, argv[i], movie.frames, movie.seed, &movie);
+            else
+                for (uint32_t j = 0; j < runs; j++)
+                    batch_add_job(&batch, argv[i], frames, j, NULL);
+        }
+    }
+
+    if (batch.num_jobs == 0 || num_threads == 0)
+    {
+        batch_usage();
+        return 1;
+    }
+
+    if (num_threads > batch.num_jobs)
+        num_threads = batch.num_jobs;
+
+    // Deal the jobs round robin, stealing takes care of the imbalance
+    batch.num_workers = num_threads;
+    batch.workers = (BATCH_WORKER*)calloc(num_threads, sizeof(BATCH_WORKER));
+    for (uint32_t i = 0; i < num_threads; i++)
+    {
+        BATCH_WORKER* worker = &batch.workers[i];
+        worker->id = i;
+        worker->batch = &batch;
+        worker->queue.jobs = (uint32_t*)malloc((batch.num_jobs / num_threads + 1) * sizeof(uint32_t));
+        pthread_mutex_init(&worker->queue.lock, NULL);
+    }
+    for (uint32_t i = 0; i < batch.num_jobs; i++)
+    {
+        BATCH_QUEUE* queue = &batch.workers[i % num_threads].queue;
+        queue->jobs[queue->bottom++] = i;
+    }
+
+    double start = batch_time();
+
+    for (uint32_t i = 0; i < num_threads; i++)
+        pthread_create(&batch.workers[i].thread, NULL, batch_worker, &batch.workers[i]);
+    for (uint32_t i = 0; i < num_threads; i++)
+        pthread_join(batch.workers[i].thread, NULL);
+
+    double elapsed = batch_time() - start;
+
+    uint64_t total_frames = 0;
+    uint32_t failed = 0, steals = 0;
+    for (uint32_t i = 0; i < num_threads; i++)
+    {
+        total_frames += batch.workers[i].frames;
+        steals += batch.workers[i].steals;
+    }
+
+    for (uint32_t i = 0; i < batch.num_jobs; i++)
+    {
+        BATCH_JOB* job = &batch.jobs[i];
+        failed += job->failed;
+        if (verbose)
+        {
+            if (job->failed)
+                printf("%s | seed %llu | failed\n", job->rom, (unsigned long long)job->seed);
+            else
+                printf("%s | seed %llu | %u frames | %016llx\n", job->rom, (unsigned long long)job->seed, job->frames_run, (unsigned long long)job->hash);
+        }
+    }
+
+    printf("Runs: %u (%u failed) | Threads: %u | Steals: %u\n", batch.num_jobs, failed, num_threads, steals);
+    printf("Frames: %llu in %.3f s | %.1f frames/s (%.1f frames/s per thread)\n", (unsigned long long)total_frames, elapsed,
+        total_frames / elapsed, total_frames / elapsed / num_threads);
+
+    for (uint32_t i = 0; i < num_threads; i++)
+    {
+        pthread_mutex_destroy(&batch.workers[i].queue.lock);
+        free(batch.workers[i].queue.jobs);
+    }
+    free(batch.workers);
+    for (uint32_t i = 0; i < batch.num_jobs; i++)
+        free(batch.jobs[i].rom);
+    free(batch.jobs);
+    nes_movie_free(&movie);
+
+    return failed != 0;
+}
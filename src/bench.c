@@ -0,0 +1,256 @@
+// Headless benchmark, runs a rom (optionally playing back a movie) uncapped and prints the throughput as JSON
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "nes.h"
+#include "movie.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_DEFAULT_FRAMES    1800
+
+typedef struct BENCH_RUN
+{
+    double seconds;
+    uint32_t frames;
+    uint64_t instructions;
+    uint64_t dots;          // Ppu dots
+    uint64_t cpu_cycles;
+    uint64_t idle_skipped;  // Cpu cycles of idle loops that were skipped
+    bool jammed;            // The cpu ran into a JAM opcode
+    CPU_JIT jit;            // Statistics of the jit engine, zero when it didn't run
+    uint64_t idioms[CPU_IDIOM_COUNT];   // Superinstructions run, by idiom
+    NES_PROFILE profile;
+} BENCH_RUN;
+
+double bench_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.;
+}
+
+// Every run starts from the same power up so the profiled one does the exact same work
+bool bench_run(NES* nes, char* rom, NES_MOVIE* movie, uint64_t seed, uint32_t frames, uint32_t render_interval, CPU_ENGINE engine, bool jit_check, char* recomp_directory, bool idle_skip, bool profile, BENCH_RUN* run)
+{
+    *nes = nes_create();
+    nes->verbose = false;
+    nes->cpu.engine = engine;
+    nes->cpu.jit_check = jit_check;
+    nes->recomp_directory = recomp_directory;
+    nes->idle.enabled = idle_skip;
+    nes_seed(nes, seed);
+    nes_init(nes);
+
+    if (!nes_load_game(nes, rom))
+        return false;
+
+    if (movie != NULL)
+    {
+        if (!nes_movie_power_up(movie, nes))
+        {
+            nes_destroy(nes);
+            return false;
+        }
+    }
+    else
+        nes_power_up(nes);
+    nes->emulation_running = true;
+    nes->render_interval = render_interval;
+    nes->profile.enabled = profile;
+
+    uint64_t ppu_timestamp = nes->ppu_timestamp, cpu_timestamp = nes->cpu_timestamp;
+    double start = bench_time();
+
+    for (run->frames = 0; run->frames < frames; run->frames++)
+    {
+        if (movie != NULL)
+            nes_set_input(nes, nes_movie_input(movie, run->frames));
+        nes_run_frame(nes);
+    }
+
+    run->seconds = bench_time() - start;
+    run->instructions = nes->cpu.instructions;
+    run->dots = (nes->ppu_timestamp - ppu_timestamp) / nes_ppu_divider(nes);
+    run->cpu_cycles = (nes->cpu_timestamp - cpu_timestamp) / nes_cpu_divider(nes);
+    run->idle_skipped = nes->idle.skipped_cycles;
+    run->jammed = nes->cpu.jammed;
+    run->profile = nes->profile;
+    memcpy(run->idioms, nes->cpu.idioms, sizeof(run->idioms));
+    if (nes->cpu.jit != NULL)
+        run->jit = *nes->cpu.jit;
+
+    nes_destroy(nes);
+    return true;
+}
+
+void bench_print_string(const char* string)
+{
+    putchar('"');
+    for (; *string; string++)
+    {
+        if (*string == '"' || *string == '\\')
+            putchar('\\');
+        putchar(*string);
+    }
+    putchar('"');
+}
+
+static const char* bench_engine_names[3] = { "interpreter", "specialized", "jit" };
+
+void bench_usage()
+{
+    fprintf(stderr, "Usage: simple-nes-bench [-n frames] [-m movie] [-s seed] [-r render_interval] [-e engine] [--jit-check] [--recomp directory] [--no-idle-skip] [--no-profile] <rom>\n");
+    fprintf(stderr, "    -n  frames to run (default: %u, or the length of the movie)\n", BENCH_DEFAULT_FRAMES);
+    fprintf(stderr, "    -m  play back a movie, its seed replaces -s\n");
+    fprintf(stderr, "    -s  power up seed (default: 0)\n");
+    fprintf(stderr, "    -r  draw 1 frame in N, 0 never draws (default: 1)\n");
+    fprintf(stderr, "    -e  cpu engine, interpreter, specialized or jit (default: %s)\n", bench_engine_names[CPU_DEFAULT_ENGINE]);
+    fprintf(stderr, "    --jit-check  run every translated block against the interpreter and report the differences\n");
+    fprintf(stderr, "    --recomp  run the blocks of the module simple-nes-recomp wrote for the rom, from that directory\n");
+    fprintf(stderr, "    --no-idle-skip  run idle loops instruction by instruction\n");
+    fprintf(stderr, "    --no-profile  skip the second, profiled run that splits the time between the cpu, ppu, apu and scheduler\n");
+}
+
+int main(int argc, char** argv)
+{
+    char* rom = NULL;
+    char* path_to_movie = NULL;
+    char* recomp_directory = NULL;
+    uint32_t frames = 0, render_interval = 1;
+    uint64_t seed = 0;
+    bool profile = true, idle_skip = true, jit_check = false;
+    CPU_ENGINE engine = CPU_DEFAULT_ENGINE;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            frames = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+            path_to_movie = argv[++i];
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+            seed = strtoull(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+            render_interval = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc)
+        {
+            i++;
+            for (engine = 0; engine < 3 && strcmp(argv[i], bench_engine_names[engine]) != 0; engine++);
+            if (engine == 3)
+            {
+                bench_usage();
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--jit-check") == 0)
+            jit_check = true;
+        else if (strcmp(argv[i], "--recomp") == 0 && i + 1 < argc)
+            recomp_directory = argv[++i];
+        else if (strcmp(argv[i], "--no-idle-skip") == 0)
+            idle_skip = false;
+        else if (strcmp(argv[i], "--no-profile") == 0)
+            profile = false;
+        else if (argv[i][0] != '-' && rom == NULL)
+            rom = argv[i];
+        else
+        {
+            bench_usage();
+            return 1;
+        }
+    }
+
+    if (rom == NULL)
+    {
+        bench_usage();
+        return 1;
+    }
+
+    NES_MOVIE movie = { 0 };
+    if (path_to_movie != NULL)
+    {
+        if (!nes_movie_load(&movie, path_to_movie))
+            return 1;
+        seed = movie.seed;
+    }
+    if (frames == 0)
+        frames = path_to_movie != NULL ? movie.frames : BENCH_DEFAULT_FRAMES;
+
+    NES* nes = (NES*)malloc(sizeof(NES));
+    BENCH_RUN run = { 0 }, profiled = { 0 };
+    if (!bench_run(nes, rom, path_to_movie != NULL ? &movie : NULL, seed, frames, render_interval, engine, jit_check, recomp_directory, idle_skip, false, &run) ||
+        (profile && !bench_run(nes, rom, path_to_movie != NULL ? &movie : NULL, seed, frames, render_interval, engine, jit_check, recomp_directory, idle_skip, true, &profiled)))
+    {
+        free(nes);
+        nes_movie_free(&movie);
+        return 1;
+    }
+
+    printf("{\n");
+    printf("  \"rom\": ");
+    bench_print_string(rom);
+    printf(",\n  \"movie\": ");
+    if (path_to_movie != NULL)
+        bench_print_string(path_to_movie);
+    else
+        printf("null");
+    printf(",\n  \"seed\": %llu,\n", (unsigned long long)seed);
+    printf("  \"render_interval\": %u,\n", render_interval);
+    printf("  \"cpu_engine\": \"%s\",\n", bench_engine_names[engine]);
+    printf("  \"frames\": %u,\n", run.frames);
+    printf("  \"instructions\": %llu,\n", (unsigned long long)run.instructions);
+    printf("  \"ppu_dots\": %llu,\n", (unsigned long long)run.dots);
+    printf("  \"cpu_cycles\": %llu,\n", (unsigned long long)run.cpu_cycles);
+    printf("  \"idle_skipped_cycles\": %llu,\n", (unsigned long long)run.idle_skipped);
+    printf("  \"cpu_jammed\": %s,\n", run.jammed ? "true" : "false");
+    printf("  \"seconds\": %.6f,\n", run.seconds);
+    printf("  \"frames_per_second\": %.2f,\n", run.frames / run.seconds);
+    printf("  \"instructions_per_second\": %.0f,\n", run.instructions / run.seconds);
+    printf("  \"ppu_dots_per_second\": %.0f", run.dots / run.seconds);
+
+    if (engine == CPU_ENGINE_JIT || recomp_directory != NULL)
+    {
+        printf(",\n  \"jit\": {\n");
+        printf("    \"blocks\": %llu,\n", (unsigned long long)run.jit.blocks);
+        printf("    \"recompiled_blocks\": %llu,\n", (unsigned long long)run.jit.recompiled);
+        printf("    \"block_runs\": %llu,\n", (unsigned long long)run.jit.runs);
+        printf("    \"translated_share\": %.4f,\n", run.instructions != 0 ? (double)run.jit.instructions / run.instructions : 0.);
+        printf("    \"flushes\": %llu,\n", (unsigned long long)run.jit.flushes);
+        printf("    \"mismatches\": %llu\n", (unsigned long long)run.jit.mismatches);
+        printf("  }");
+    }
+
+    // Hit rate of each idiom, the share of the instructions that ran fused in it
+    if (engine != CPU_ENGINE_INTERPRETER)
+    {
+        printf(",\n  \"superinstructions\": {");
+        for (int i = 0; i < CPU_IDIOM_COUNT; i++)
+        {
+            printf("%s\n    \"%s\": { \"runs\": %llu, \"share\": %.4f }", i != 0 ? "," : "", cpu_idiom_text[i], (unsigned long long)run.idioms[i],
+                   run.instructions != 0 ? (double)run.idioms[i] * cpu_idiom_length[i] / run.instructions : 0.);
+        }
+        printf("\n  }");
+    }
+
+    // Shares of the profiled run, its timers slow it down so only the split is meaningful
+    if (profile && profiled.profile.total != 0)
+    {
+        double total = profiled.profile.total;
+        uint64_t scheduler = profiled.profile.total - profiled.profile.cpu - profiled.profile.ppu - profiled.profile.apu;
+        printf(",\n  \"profile\": {\n");
+        printf("    \"seconds\": %.6f,\n", profiled.seconds);
+        printf("    \"overhead\": %.3f,\n", profiled.seconds / run.seconds);
+        printf("    \"cpu\": %.4f,\n", profiled.profile.cpu / total);
+        printf("    \"ppu\": %.4f,\n", profiled.profile.ppu / total);
+        printf("    \"apu\": %.4f,\n", profiled.profile.apu / total);
+        printf("    \"scheduler\": %.4f\n", scheduler / total);
+        printf("  }");
+    }
+    printf("\n}\n");
+
+    free(nes);
+    nes_movie_free(&movie);
+    return 0;
+}
@@ -1,5 +0,0 @@
-#include "emulation.h"
-
-float emulation_speed = 1;
-bool emulation_running = false;
-bool window_focus = false;
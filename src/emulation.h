@@ -1,7 +0,0 @@
-#pragma once
-
-#include <stdbool.h>
-
-extern float emulation_speed;
-extern bool emulation_running;
-extern bool window_focus;
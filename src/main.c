@@ -3,7 +3,11 @@
 #include "rp_2a03_cpu.h"
 #include "ppu.h"
 #include "nes.h"
-#include "emulation.h"
+#include "rewind.h"
+#include "run_ahead.h"
+#include "movie.h"
+
+#include <SFML/Graphics.h>
 
 #include <string.h>
 #include <stdio.h>
@@ -11,6 +15,8 @@
 #include <time.h>
 
 #define NES_ASPECT_RATIO    (256.f / 240.f)
+#define HOST_FRAME_RATE     60.1f
+#define FAST_FORWARD_SPEED  4.f
 
 // TODO: Embed those in the executable and remove those messy relative paths
 char* palettes[5] =
@@ -18,6 +24,121 @@ char* palettes[5] =
     "../../palettes/nes_classic.pal", "../../palettes/yuv.pal"};
 uint8_t palette_number = 2;
 
+static const sfKeyCode keymap[8] =
+{
+    sfKeyC,     // A
+    sfKeyX,     // B
+    sfKeyLControl, // Select
+    sfKeyLShift,   // Start
+    sfKeyUp,     // Up
+    sfKeyDown,   // Down
+    sfKeyLeft,   // Left
+    sfKeyRight   // Right
+};
+
+typedef struct EMULATION_THREAD
+{
+    NES* nes;
+    NES_RUN_AHEAD* run_ahead;
+    NES_MOVIE* movie;   // Recorded when not NULL
+    bool quit;      // Set by the ui thread, read atomically
+    bool rewinding; // Same
+    bool jammed;    // Copy of nes->cpu.jammed for the ui thread, written atomically by the emulation thread
+} EMULATION_THREAD;
+
+uint8_t read_controller()
+{
+    uint8_t buttons = 0;
+    for (uint8_t j = 0; j < 8; j++)
+    {
+        buttons <<= 1;
+        buttons |= sfKeyboard_isKeyPressed(keymap[j]);
+    }
+    return buttons;
+}
+
+// Paced on the console frame rate, independently of the host refresh rate
+void emulation_thread(void* data)
+{
+    EMULATION_THREAD* thread = (EMULATION_THREAD*)data;
+    NES* nes = thread->nes;
+    NES_RUN_AHEAD* run_ahead = thread->run_ahead;
+    NES_MOVIE* movie = thread->movie;
+
+    sfClock* clock = sfClock_create();
+    double next_frame_time = 0;
+
+    NES_REWIND history;
+    bool history_enabled = nes_rewind_init(&history, REWIND_DEFAULT_BUDGET, REWIND_KEYFRAME_INTERVAL);
+    bool was_rewinding = false;
+
+    while (!__atomic_load_n(&thread->quit, __ATOMIC_ACQUIRE))
+    {
+        nes_process_commands(nes);
+        __atomic_store_n(&thread->jammed, nes->cpu.jammed, __ATOMIC_RELEASE);
+
+        double time = sfClock_getElapsedTime(clock).microseconds / 1000000.;
+        if (!nes->emulation_running)
+        {
+            next_frame_time = time;
+            sfSleep(sfMilliseconds(1));
+            continue;
+        }
+
+        if (time < next_frame_time)
+        {
+            sfSleep(sfMicroseconds((next_frame_time - time) * 1000000.));
+            continue;
+        }
+
+        bool rewinding = history_enabled && __atomic_load_n(&thread->rewinding, __ATOMIC_ACQUIRE);
+        if (rewinding)
+        {
+            // Two snapshots back then one frame forward, so the restored frame gets drawn
+            if (nes_rewind_step(&history, nes) && nes_rewind_step(&history, nes))
+            {
+                nes->ppu.skip_render = false;
+                if (movie != NULL)
+                    nes_movie_record(movie, nes->ppu.frame_count, nes->key_status_control);
+                nes_run_ahead_frame(run_ahead, nes);
+                nes_rewind_push(&history, nes);
+            }
+        }
+        else
+        {
+            if (was_rewinding)
+            {
+                NES_REWIND_USAGE usage = nes_rewind_usage(&history);
+                printf("Rewind buffer: %.1f / %.1f MB | %u snapshots (%u keyframes)\n", usage.used / 1048576., usage.budget / 1048576.,
+                    usage.snapshots, usage.keyframes);
+            }
+
+            // Frames the host has no time to show are only emulated
+            nes->render_interval = nes->emulation_speed > 1 ? (uint32_t)nes->emulation_speed : 1;
+            if (movie != NULL)
+                nes_movie_record(movie, nes->ppu.frame_count, nes->key_status_control);
+            nes_run_ahead_frame(run_ahead, nes);
+            if (history_enabled)
+                nes_rewind_push(&history, nes);
+        }
+        was_rewinding = rewinding;
+
+        next_frame_time += 1. / (nes->emulation_speed * (nes->system == TV_NTSC ? NTSC_FRAME_RATE : PAL_FRAME_RATE));
+        if (time - next_frame_time > 0.1)   // Too far behind, don't try to catch up
+            next_frame_time = time;
+    }
+
+    if (history_enabled)
+        nes_rewind_destroy(&history);
+    sfClock_destroy(clock);
+}
+
+void send_command(NES* nes, NES_COMMAND command)
+{
+    while (!nes_push_command(nes, command))
+        sfSleep(sfMilliseconds(1));
+}
+
 int main(int argc, char** argv)
 {
     if (sizeof(struct PPU_SCROLL_ADDRESS) != 2 || sizeof(APU_STATUS) != 1) // ! - Compiler did not pack the bitfields correctly
@@ -34,13 +155,46 @@ int main(int argc, char** argv)
     }
 
     char* path_to_rom = argv[1];
+    uint32_t run_ahead_frames = 0;
+    bool run_ahead_thread = false;
+    char* path_to_movie = NULL;
+    char* path_to_code_log = NULL;
+    char* recomp_directory = NULL;
+    for (int i = 2; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--run-ahead") == 0 && i + 1 < argc)
+            run_ahead_frames = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--run-ahead-thread") == 0)
+            run_ahead_thread = true;
+        else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc)
+            path_to_movie = argv[++i];
+        else if (strcmp(argv[i], "--code-log") == 0 && i + 1 < argc)
+            path_to_code_log = argv[++i];
+        else if (strcmp(argv[i], "--recomp") == 0 && i + 1 < argc)
+            recomp_directory = argv[++i];
+    }
+    char path_to_state[1024];
+    snprintf(path_to_state, sizeof(path_to_state), "%s.state", path_to_rom);
 
-    NES nes = nes_create();
+    static NES nes;     // Too big for the stack
+    nes = nes_create();
+    nes_seed(&nes, time(0));
     nes_init(&nes);
     ppu_load_palette(&nes.ppu, palettes[palette_number]);
 
+    nes.recomp_directory = recomp_directory;
     nes_load_game(&nes, path_to_rom);
     nes_power_up(&nes);
+    if (path_to_code_log != NULL)
+        nes_start_code_log(&nes);
+
+    static NES_MOVIE movie;
+    if (path_to_movie != NULL)
+        nes_movie_begin(&movie, &nes);
+
+    static NES_RUN_AHEAD run_ahead;
+    if (!nes_run_ahead_init(&run_ahead, path_to_rom, run_ahead_frames, run_ahead_thread))
+        nes_run_ahead_init(&run_ahead, path_to_rom, run_ahead_frames, false);
 
     char title_buffer[128] = {0};
 
@@ -50,21 +204,30 @@ int main(int argc, char** argv)
 
     sfRenderWindow_setActive(window, true);
 
-    sfRenderWindow_setFramerateLimit(window, 60.1f);
+    sfRenderWindow_setFramerateLimit(window, HOST_FRAME_RATE);
 
     if (!window)
         return 1;
-    srand(time(0));
 
     bool fullscreen_state = false;
+    bool window_focus = false;
+
+    // Owned by the emulation thread from now on, only the mirrors below are read here
+    bool emulation_running = nes.emulation_running;
+    TV_SYSTEM system = nes.system;
+
+    EMULATION_THREAD thread_data = { &nes, &run_ahead, path_to_movie != NULL ? &movie : NULL, false, false, false };
+    sfThread* thread = sfThread_create(emulation_thread, &thread_data);
+    sfThread_launch(thread);
 
     uint32_t space_pressed = 0, reset_pressed = 0,
     palette_pressed = 0, system_pressed = 0, power_pressed = 0,
-    fullscreen_pressed = 0;
+    fullscreen_pressed = 0, save_pressed = 0, load_pressed = 0;
+    bool fast_forward = false, rewinding = false;
 
     sfTexture* screen_texture = sfTexture_create(256, 240);
+    static uint8_t screen_pixels[256 * 240 * 4];
     sfRectangleShape* screen_rect = sfRectangleShape_create();
-    sfImage* screen_pixels = sfImage_createFromPixels(256, 240, (sfUint8*)&nes.ppu.screen_buffer);
     sfRectangleShape_setTexture(screen_rect, screen_texture, false);
 
     sfClock* timer = sfClock_create();
@@ -73,7 +236,7 @@ int main(int argc, char** argv)
         double delta_time = sfClock_restart(timer).microseconds / 1000000.;
         float fps = (float)(1. / delta_time);
 
-        snprintf(&title_buffer[0], 127, "Simple NES | %.1f FPS", fps);
+        snprintf(&title_buffer[0], 127, "Simple NES | %.1f FPS%s", fps, __atomic_load_n(&thread_data.jammed, __ATOMIC_ACQUIRE) ? " | CPU jammed" : "");
         sfRenderWindow_setTitle(window, &title_buffer[0]);
 
         while (sfRenderWindow_pollEvent(window, &event))
@@ -98,6 +261,16 @@ int main(int argc, char** argv)
             else
                 space_pressed = 0;
 
+            if (sfKeyboard_isKeyPressed(sfKeyF5))
+                save_pressed++;
+            else
+                save_pressed = 0;
+
+            if (sfKeyboard_isKeyPressed(sfKeyF7))
+                load_pressed++;
+            else
+                load_pressed = 0;
+
             if (sfKeyboard_isKeyPressed(sfKeyLControl))
             {
                 if (sfKeyboard_isKeyPressed(sfKeyR))
@@ -135,6 +308,20 @@ int main(int argc, char** argv)
             space_pressed = 0;
             system_pressed = 0;
             power_pressed = 0;
+            save_pressed = 0;
+            load_pressed = 0;
+        }
+
+        if ((window_focus && sfKeyboard_isKeyPressed(sfKeyTab)) != fast_forward)
+        {
+            fast_forward ^= true;
+            send_command(&nes, (NES_COMMAND){ .type = NES_CMD_SET_SPEED, .speed = fast_forward ? FAST_FORWARD_SPEED : 1 });
+        }
+
+        if ((window_focus && sfKeyboard_isKeyPressed(sfKeyBackspace)) != rewinding)
+        {
+            rewinding ^= true;
+            __atomic_store_n(&thread_data.rewinding, rewinding, __ATOMIC_RELEASE);
         }
 
         if (sfKeyboard_isKeyPressed(sfKeyF11))
@@ -145,32 +332,47 @@ int main(int argc, char** argv)
         if (space_pressed == 1)
         {
             emulation_running ^= true;
+            send_command(&nes, (NES_COMMAND){ .type = NES_CMD_SET_RUNNING, .running = emulation_running });
             printf("Game status | emulation_running : %u\n", emulation_running);
         }
 
+        // A movie only holds the inputs since the power up, anything else would make it desync
+        if (path_to_movie != NULL && (system_pressed == 1 || reset_pressed == 1 || power_pressed == 1 || load_pressed == 1))
+        {
+            printf("Ignored while recording a movie\n");
+            system_pressed = reset_pressed = power_pressed = load_pressed = 2;
+        }
+
         if (system_pressed == 1)
         {
-            nes.system ^= 1;
-            printf("Switched to %s system\n", system_text[nes.system]);
+            system ^= 1;
+            send_command(&nes, (NES_COMMAND){ .type = NES_CMD_SET_SYSTEM, .system = system });
+            printf("Switched to %s system\n", system_text[system]);
         }
 
         if (reset_pressed == 1)
         {
-            nes_reset(&nes);
+            send_command(&nes, (NES_COMMAND){ .type = NES_CMD_RESET });
             printf("NES reset\n");
         }
 
         if (power_pressed == 1 || system_pressed == 1)
         {
-            nes_power_up(&nes);
+            send_command(&nes, (NES_COMMAND){ .type = NES_CMD_POWER_UP });
             printf("NES powered up\n");
         }
 
+        if (save_pressed == 1)
+            send_command(&nes, (NES_COMMAND){ .type = NES_CMD_SAVE_STATE, .path = path_to_state });
+
+        if (load_pressed == 1)
+            send_command(&nes, (NES_COMMAND){ .type = NES_CMD_LOAD_STATE, .path = path_to_state });
+
         if (palette_pressed == 1)
         {
             palette_number++;
             palette_number %= 5;
-            ppu_load_palette(&nes.ppu, palettes[palette_number]);
+            send_command(&nes, (NES_COMMAND){ .type = NES_CMD_LOAD_PALETTE, .path = palettes[palette_number] });
             // printf("Switched to palette \"%s\"\n", palettes[palette_number]);
         }
 
@@ -181,29 +383,20 @@ int main(int argc, char** argv)
             window = sfRenderWindow_create(mode, &title_buffer[0], fullscreen_state ? sfFullscreen : (sfClose | sfResize), NULL);
             sfRenderWindow_setActive(window, true);
 
-            sfRenderWindow_setFramerateLimit(window, 60.1f);
+            sfRenderWindow_setFramerateLimit(window, HOST_FRAME_RATE);
         }
 
         if (window_focus)
-            nes_handle_controls(&nes);
-        if (emulation_running)
-        {
-            // for (uint32_t i = 0; i < 341 * 262; i++)
-            for (uint32_t i = 0; i < (nes.system == TV_NTSC ? NTSC_MASTER_FREQUENCY : PAL_MASTER_FREQUENCY) * emulation_speed / 60; i++)    // Assumes 60.1 FPS so not vertically synced
-                nes_cycle(&nes);
-        }
+            send_command(&nes, (NES_COMMAND){ .type = NES_CMD_SET_INPUT, .buttons = read_controller() });
 
         sfRenderWindow_clear(window, sfBlack);
 
         {
             sfVector2u window_size = sfRenderWindow_getSize(window);
             float screen_size = window_size.x / NES_ASPECT_RATIO < window_size.y ? window_size.x / NES_ASPECT_RATIO : window_size.y;
-            if (nes.ppu.frame_finished)
-            {
-                nes.ppu.frame_finished = false;
-                memcpy((void*)sfImage_getPixelsPtr(screen_pixels), (void*)&nes.ppu.screen_buffer, 256 * 240 * 4);
-            }
-            sfTexture_updateFromImage(screen_texture, screen_pixels, 0, 0);
+            PPU* screen_ppu = nes_run_ahead_screen(&run_ahead, &nes);
+            ppu_convert_frame(ppu_latest_frame(screen_ppu), PF_RGBA8888, screen_pixels);  // Newest frame only, the others were never shown
+            sfTexture_updateFromPixels(screen_texture, screen_pixels, 256, 240, 0, 0);
             sfVector2f rect_size = {screen_size * NES_ASPECT_RATIO, screen_size};
             sfVector2f rect_origin = {rect_size.x / 2., rect_size.y / 2.};
             sfVector2f rect_pos = {window_size.x / 2., window_size.y / 2.};
@@ -218,11 +411,26 @@ int main(int argc, char** argv)
         sfRenderWindow_display(window);
     }
 
+    __atomic_store_n(&thread_data.quit, true, __ATOMIC_RELEASE);
+    sfThread_wait(thread);
+    sfThread_destroy(thread);
+
+    NES_RUN_AHEAD_STATS stats = nes_run_ahead_stats(&run_ahead);
+    if (stats.runs != 0)
+        printf("Run-ahead: %u frames%s | save %.1f us | restore %.1f us | %.1f us per speculative frame | %.1f us extra per frame\n",
+            run_ahead.frames, run_ahead.shadow != NULL ? " on a second instance" : "", stats.save_us, stats.load_us, stats.frame_us, stats.total_us);
+    nes_run_ahead_destroy(&run_ahead);
+
+    if (path_to_movie != NULL && nes_movie_save(&movie, path_to_movie))
+        printf("Recorded %u frames to \"%s\"\n", movie.frames, path_to_movie);
+    if (path_to_code_log != NULL)
+        nes_save_code_log(&nes, path_to_code_log);
+    nes_movie_free(&movie);
+
     nes_destroy(&nes);
 
     sfTexture_destroy(screen_texture);
     sfRectangleShape_destroy(screen_rect);
-    sfImage_destroy(screen_pixels);
     sfClock_destroy(timer);
 
     sfRenderWindow_setActive(window, false);
@@ -0,0 +1,161 @@
+#include "movie.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void movie_put(uint8_t* data, uint64_t value, uint8_t size)
+{
+    for (uint8_t i = 0; i < size; i++)
+        data[i] = value >> (8 * i);
+}
+
+static uint64_t movie_get(const uint8_t* data, uint8_t size)
+{
+    uint64_t value = 0;
+    for (uint8_t i = 0; i < size; i++)
+        value |= (uint64_t)data[i] << (8 * i);
+    return value;
+}
+
+// Starts a recording, to be called right after the power up of a seeded nes ; the movie is zeroed or was used before
+void nes_movie_begin(NES_MOVIE* movie, NES* nes)
+{
+    nes_movie_free(movie);
+    movie->rom_hash = nes->rom_hash;
+    movie->seed = nes->rng_seed;
+    movie->system = nes->system;
+}
+
+// Frame is the ppu frame count when the buttons are set, a rewind records over the frames after it
+// False when the frame couldn't be recorded, the movie keeps the frames before it
+bool nes_movie_record(NES_MOVIE* movie, uint32_t frame, uint8_t buttons)
+{
+    if (frame > movie->frames)
+        return false;   // Can't leave holes
+
+    if (frame >= movie->capacity)
+    {
+        uint32_t capacity = movie->capacity ? movie->capacity * 2 : 3600;
+        uint8_t* inputs = (uint8_t*)realloc(movie->inputs, capacity);
+        if (inputs == NULL)
+        {
+            printf("Couldn't allocate the movie, frame %u isn't recorded\n", frame);
+            return false;
+        }
+        movie->inputs = inputs;
+        movie->capacity = capacity;
+    }
+
+    movie->inputs[frame] = buttons;
+    movie->frames = frame + 1;
+    return true;
+}
+
+// Powers up a nes that loaded the game of the movie the way the recording started
+bool nes_movie_power_up(NES_MOVIE* movie, NES* nes)
+{
+    if (movie->rom_hash != nes->rom_hash)
+    {
+        printf("The movie was recorded with another game\n");
+        return false;
+    }
+
+    nes_seed(nes, movie->seed);
+    nes->system = movie->system;
+    nes_power_up(nes);
+    return true;
+}
+
+uint8_t nes_movie_input(NES_MOVIE* movie, uint32_t frame)
+{
+    return frame < movie->frames ? movie->inputs[frame] : 0;
+}
+
+bool nes_movie_save(NES_MOVIE* movie, const char* path)
+{
+    FILE* f = fopen(path, "wb");
+    if (f == NULL)
+    {
+        printf("Couldn't open movie \"%s\" for writing\n", path);
+        return false;
+    }
+
+    uint8_t header[MOVIE_HEADER_SIZE];
+    memcpy(header, MOVIE_MAGIC, 4);
+    movie_put(&header[4], MOVIE_VERSION, 4);
+    movie_put(&header[8], movie->rom_hash, 8);
+    movie_put(&header[16], movie->seed, 8);
+    header[24] = movie->system;
+    movie_put(&header[25], movie->frames, 4);
+
+    bool success = fwrite(header, 1, sizeof(header), f) == sizeof(header) &&
+        fwrite(movie->inputs, 1, movie->frames, f) == movie->frames;
+    fclose(f);
+
+    if (!success)
+        printf("Couldn't write movie \"%s\"\n", path);
+    return success;
+}
+
+bool nes_movie_load(NES_MOVIE* movie, const char* path)
+{
+    FILE* f = fopen(path, "rb");
+    if (f == NULL)
+    {
+        printf("Couldn't open movie \"%s\"\n", path);
+        return false;
+    }
+
+    uint8_t header[MOVIE_HEADER_SIZE];
+    if (fread(header, 1, sizeof(header), f) != sizeof(header) || memcmp(header, MOVIE_MAGIC, 4) != 0)
+    {
+        printf("\"%s\" isn't a movie\n", path);
+        fclose(f);
+        return false;
+    }
+
+    uint32_t version = movie_get(&header[4], 4);
+    if (version > MOVIE_VERSION)
+    {
+        printf("Movie version %u is newer than this emulator (%u)\n", version, MOVIE_VERSION);
+        fclose(f);
+        return false;
+    }
+
+    // The frame count comes from the file, no more than the bytes left in it are allocated
+    long start = ftell(f), end = -1;
+    if (start < 0 || fseek(f, 0, SEEK_END) != 0 || (end = ftell(f)) < start || fseek(f, start, SEEK_SET) != 0)
+    {
+        printf("Couldn't read movie \"%s\"\n", path);
+        fclose(f);
+        return false;
+    }
+    uint32_t frames = movie_get(&header[25], 4);
+    uint32_t available = (uint64_t)(end - start) < frames ? (uint32_t)(end - start) : frames;
+
+    nes_movie_free(movie);
+    movie->inputs = (uint8_t*)malloc(available ? available : 1);
+    if (movie->inputs == NULL)
+    {
+        printf("Couldn't allocate movie \"%s\", %u frames\n", path, frames);
+        fclose(f);
+        return false;
+    }
+    movie->rom_hash = movie_get(&header[8], 8);
+    movie->seed = movie_get(&header[16], 8);
+    movie->system = header[24] ? TV_PAL : TV_NTSC;
+    movie->capacity = available;
+    movie->frames = fread(movie->inputs, 1, available, f);
+    fclose(f);
+
+    if (movie->frames != frames)
+        printf("Movie \"%s\" is truncated, %u of %u frames\n", path, movie->frames, frames);
+    return true;
+}
+
+void nes_movie_free(NES_MOVIE* movie)
+{
+    free(movie->inputs);
+    memset(movie, 0, sizeof(NES_MOVIE));
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "nes.h"
+
+// File layout : "SNMV" | version (u32) | rom hash (u64) | seed (u64) | system (u8) | frames (u32) | one controller byte per frame
+// Everything is little endian ; the seed and system are what nes_power_up needs to start the same way every time
+#define MOVIE_MAGIC         "SNMV"
+#define MOVIE_VERSION       1
+#define MOVIE_HEADER_SIZE   29
+
+typedef struct NES_MOVIE
+{
+    uint64_t rom_hash;
+    uint64_t seed;
+    TV_SYSTEM system;
+
+    uint8_t* inputs;    // Buttons set before each frame, in the order of nes_set_input
+    uint32_t frames, capacity;
+} NES_MOVIE;
+
+void nes_movie_begin(NES_MOVIE* movie, NES* nes);
+bool nes_movie_record(NES_MOVIE* movie, uint32_t frame, uint8_t buttons);
+bool nes_movie_power_up(NES_MOVIE* movie, NES* nes);
+uint8_t nes_movie_input(NES_MOVIE* movie, uint32_t frame);
+bool nes_movie_save(NES_MOVIE* movie, const char* path);
+bool nes_movie_load(NES_MOVIE* movie, const char* path);
+void nes_movie_free(NES_MOVIE* movie);
@@ -1,15 +1,28 @@
 #include "nes.h"
 #include "ines.h"
+#include "save_state.h"
+#include "recomp.h"
 
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define nes_ticks() __rdtsc()
+#else
+#define nes_ticks() ((uint64_t)clock())
+#endif
 
 NES nes_create()
 {
     NES nes;
+    memset(&nes, 0, sizeof(NES));   // No leftover stack data in the ram so runs are reproducible
     nes.mapper = MP_UNSUPPORTED;
     nes.master_clock = 0;
+    nes.cpu_timestamp = nes.ppu_timestamp = 0;
 
     nes.PRG_ROM_data = NULL;
     nes.PRG_ROM_size = 0;
@@ -19,6 +32,15 @@ NES nes_create()
 
     nes.PRG_RAM_data = NULL;
 
+    nes_seed(&nes, 0);
+
+    nes.cpu.engine = CPU_DEFAULT_ENGINE;
+    nes.idle.enabled = true;
+    nes.emulation_speed = 1;
+    nes.render_interval = 1;
+    nes.emulation_running = false;
+    nes.verbose = true;
+
     nes.created = NES_CREATED_MAGIC_DWORD;
 
     return nes;
@@ -30,6 +52,12 @@ void nes_init(NES* nes)
     nes->ppu.nes = nes;
     nes->apu.nes = nes;
 
+    // Set once, a power up mustn't pull a buffer from under the renderer
+    nes->ppu.frame_buffers.back = 0;
+    nes->ppu.frame_buffers.ready = 1;
+    nes->ppu.frame_buffers.front = 2;
+    ppu_build_palette_lut(&nes->ppu);   // Black until a palette is loaded
+
     apu_init(&nes->apu);
 }
 
@@ -45,8 +73,17 @@ void nes_destroy(NES* nes)
     nes->PRG_ROM_data = NULL;
     free(nes->CHR_ROM_data);
     nes->CHR_ROM_data = NULL;
+    ppu_destroy_tiles(&nes->ppu);
+    ppu_destroy_frames(&nes->ppu);
     free(nes->PRG_RAM_data);
     nes->PRG_RAM_data = NULL;
+    free(nes->dirty_prg_ram);
+    nes->dirty_prg_ram = NULL;
+    free(nes->cpu.decoded);
+    nes->cpu.decoded = NULL;
+    free(nes->cpu.code_log);
+    nes->cpu.code_log = NULL;
+    cpu_jit_destroy(&nes->cpu);
 
     apu_destroy(&nes->apu);
 
@@ -63,6 +100,8 @@ void nes_reset(NES* nes)
     }
 
     nes_init_mmc1(nes);
+    cpu_map_memory(&nes->cpu);
+    nes->idle.armed = false;
 
     cpu_reset(&nes->cpu);
     apu_reset(&nes->apu);
@@ -81,62 +120,311 @@ void nes_power_up(NES* nes)
     }
 
     nes_init_mmc1(nes);
+    cpu_map_memory(&nes->cpu);
+    nes->idle.armed = false;
 
     cpu_power_up(&nes->cpu);
     apu_reset(&nes->apu);
     ppu_power_up(&nes->ppu);
 
-    nes->master_clock = rand() % (nes->system == TV_NTSC ? 4 : 5);
+    nes->master_clock = nes_random(nes) % nes_ppu_divider(nes);
+
+    // First cpu and ppu cycles after the master clock
+    nes->cpu_timestamp = (nes->master_clock / nes_cpu_divider(nes) + 1) * nes_cpu_divider(nes);
+    nes->ppu_timestamp = (nes->master_clock / nes_ppu_divider(nes) + 1) * nes_ppu_divider(nes);
+}
+
+void nes_set_input(NES* nes, uint8_t buttons)
+{
+    if ((buttons & NES_BUTTON_UP) && (buttons & NES_BUTTON_DOWN))
+        buttons &= ~(NES_BUTTON_UP | NES_BUTTON_DOWN);
+    if ((buttons & NES_BUTTON_LEFT) && (buttons & NES_BUTTON_RIGHT))
+        buttons &= ~(NES_BUTTON_LEFT | NES_BUTTON_RIGHT);
+
+    nes->key_status_control = buttons;
+}
+
+void nes_seed(NES* nes, uint64_t seed)
+{
+    nes->rng_seed = nes->rng_state = seed;
+}
+
+// splitmix64
+uint32_t nes_random(NES* nes)
+{
+    uint64_t z = (nes->rng_state += 0x9e3779b97f4a7c15);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return (z ^ (z >> 31)) >> 32;
+}
+
+// FNV-1a
+uint64_t nes_hash(uint64_t hash, const uint8_t* data, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= data[i];
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+void nes_mark_all_dirty(NES* nes)
+{
+    memset(nes->dirty_ram, 0xff, sizeof(nes->dirty_ram));
+    memset(nes->dirty_vram, 0xff, sizeof(nes->dirty_vram));
+    memset(nes->dirty_chr_ram, 0xff, sizeof(nes->dirty_chr_ram));
+    if (nes->dirty_prg_ram != NULL)
+        memset(nes->dirty_prg_ram, 0xff, nes_dirty_words(nes->PRG_RAM_size) * sizeof(uint64_t));
 }
 
-void nes_handle_controls(NES* nes)
+// Producer side, fails if the emulation thread is too far behind
+bool nes_push_command(NES* nes, NES_COMMAND command)
 {
-    for (uint8_t j = 0; j < 8; j++)
+    uint32_t tail = nes->commands.tail;
+    if (tail - __atomic_load_n(&nes->commands.head, __ATOMIC_ACQUIRE) >= NES_COMMAND_QUEUE_SIZE)
+        return false;
+
+    nes->commands.commands[tail % NES_COMMAND_QUEUE_SIZE] = command;
+    __atomic_store_n(&nes->commands.tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Consumer side, applies every pending command in order ; to be called between frames
+uint32_t nes_process_commands(NES* nes)
+{
+    uint32_t head = nes->commands.head;
+    uint32_t tail = __atomic_load_n(&nes->commands.tail, __ATOMIC_ACQUIRE);
+    uint32_t processed = tail - head;
+
+    for (; head != tail; head++)
     {
-        nes->key_status_control <<= 1;
-        nes->key_status_control |= sfKeyboard_isKeyPressed(keymap[j]);
+        NES_COMMAND* command = &nes->commands.commands[head % NES_COMMAND_QUEUE_SIZE];
+        switch (command->type)
+        {
+        case NES_CMD_RESET:
+            nes_reset(nes);
+            break;
+        case NES_CMD_POWER_UP:
+            nes_power_up(nes);
+            break;
+        case NES_CMD_SET_INPUT:
+            nes_set_input(nes, command->buttons);
+            break;
+        case NES_CMD_SET_SYSTEM:
+            nes->system = command->system;
+            break;
+        case NES_CMD_LOAD_PALETTE:
+            ppu_load_palette(&nes->ppu, command->path);
+            break;
+        case NES_CMD_SET_RUNNING:
+            nes->emulation_running = command->running;
+            break;
+        case NES_CMD_SET_SPEED:
+            nes->emulation_speed = command->speed;
+            break;
+        case NES_CMD_SAVE_STATE:
+            nes_save_state_file(nes, command->path);
+            break;
+        case NES_CMD_LOAD_STATE:
+            nes_load_state_file(nes, command->path);
+            break;
+        }
     }
 
-    if (((nes->key_status_control & 0b00001000) != 0) && ((nes->key_status_control & 0b00000100) != 0)) // up and down
-        nes->key_status_control &= 0b11110011;
-    if (((nes->key_status_control & 0b00000010) != 0) && ((nes->key_status_control & 0b00000001) != 0)) // left and right
-        nes->key_status_control &= 0b11111100;
+    __atomic_store_n(&nes->commands.head, head, __ATOMIC_RELEASE);
+    return processed;
 }
 
-void nes_cycle(NES* nes)
+// Runs every ppu dot up to (and including) the given master cycle
+static inline void nes_sync_ppu(NES* nes, uint64_t timestamp)
+{
+    uint8_t divider = nes_ppu_divider(nes);
+    while (nes->ppu_timestamp <= timestamp)
+    {
+        ppu_cycle(&nes->ppu);
+        nes->ppu_timestamp += divider;
+    }
+}
+
+static void nes_idle_snapshot(CPU* cpu, NES_IDLE_CPU* snapshot)
+{
+    memset(snapshot, 0, sizeof(NES_IDLE_CPU));  // Compared with memcmp
+    snapshot->PC = cpu->PC;
+    snapshot->cycle = cpu->cycle;
+    snapshot->operand_address = cpu->operand_address;
+    snapshot->A = cpu->A;
+    snapshot->X = cpu->X;
+    snapshot->Y = cpu->Y;
+    snapshot->S = cpu->S;
+    snapshot->P = cpu_get_flags(cpu);
+    snapshot->page_boundary_crossed = cpu->page_boundary_crossed;
+    snapshot->addressing_mode = cpu->addressing_mode;
+    snapshot->nmi = cpu->nmi;
+    snapshot->nmi_last_requested_state = cpu->nmi_last_requested_state;
+    snapshot->nmi_requested = cpu->nmi_requested;
+    snapshot->nmi_last_requested = cpu->nmi_last_requested;
+    snapshot->dma = cpu->dma;
+}
+
+// Called when the cpu just jumped back a few bytes : if the state is the same as the last time it jumped there and
+// nothing was written since, every iteration until the ppu changes what the cpu reads is identical so they are skipped
+static void nes_skip_idle_loop(NES* nes, uint64_t target)
+{
+    NES_IDLE_LOOP* idle = &nes->idle;
+    NES_IDLE_CPU snapshot;
+    nes_idle_snapshot(&nes->cpu, &snapshot);
+
+    bool repeated = idle->armed && !(nes->cpu.bus_flags & (CPU_BUS_WRITE | CPU_BUS_IO)) &&
+        memcmp(&snapshot, &idle->cpu, sizeof(NES_IDLE_CPU)) == 0;
+
+    // Sprite 0 hit and overflow can change on any dot while rendering
+    if ((nes->cpu.bus_flags & CPU_BUS_STATUS) && (nes->ppu.PPUMASK.enable_bg || nes->ppu.PPUMASK.enable_sprites || ppu_rendering_enabled(&nes->ppu)) &&
+        (nes->ppu.scanline < 240 || nes->ppu.scanline == ppu_prerender_scanline(&nes->ppu)))
+        repeated = false;
+
+    if (repeated)
+    {
+        uint64_t period = nes->cpu_timestamp - idle->timestamp;
+        uint64_t limit = idle->deadline < target ? idle->deadline : target;
+
+        // Whole iterations only, each of them starting and ending at the same point of the loop
+        uint64_t iterations = limit > nes->cpu_timestamp ? (limit - nes->cpu_timestamp) / period : 0;
+        if (iterations > 0)
+        {
+            uint32_t cycles = (uint32_t)(iterations * period / nes_cpu_divider(nes));
+            apu_run(&nes->apu, cycles);
+            nes->cpu.instructions += iterations * (nes->cpu.instructions - idle->instructions);
+            nes->cpu_timestamp += iterations * period;
+            idle->skipped_cycles += cycles;
+        }
+    }
+
+    idle->armed = true;
+    idle->cpu = snapshot;
+    idle->timestamp = nes->cpu_timestamp;
+    idle->instructions = nes->cpu.instructions;
+    idle->deadline = nes->ppu_timestamp + (uint64_t)ppu_dots_until_status_change(&nes->ppu) * nes_ppu_divider(nes);
+    nes->cpu.bus_flags = 0;
+}
+
+// Runs every master cycle up to (and including) target ; inlined once with and once without the profiling
+static inline NES_RUN_RESULT nes_run_loop(NES* nes, uint64_t target, const bool profile)
+{
+    NES_RUN_RESULT result = { target - nes->master_clock, 0 };
+    uint64_t frame_count = nes->ppu.frame_count;
+    uint8_t cpu_divider = nes_cpu_divider(nes);
+    uint64_t start = profile ? nes_ticks() : 0, ticks = start;
+
+    // The cpu is the only component that reads or writes the others so everything is scheduled around its events
+    // The ppu is caught up right before each of them (on the same master cycle the ppu goes first)
+    while (nes->cpu_timestamp <= target)
+    {
+        if (profile)
+            ticks = nes_ticks();
+        nes_sync_ppu(nes, nes->cpu_timestamp);
+        if (profile)
+            nes->profile.ppu += nes_ticks() - ticks;
+
+        uint64_t max_cycles = (target - nes->cpu_timestamp) / cpu_divider + 1;
+        uint16_t pc = nes->cpu.PC;
+        uint64_t instructions = nes->cpu.instructions;
+        if (profile)
+            ticks = nes_ticks();
+        uint16_t cycles = cpu_run(&nes->cpu, max_cycles > 0xffff ? 0xffff : max_cycles);
+        if (profile)
+        {
+            uint64_t now = nes_ticks();
+            nes->profile.cpu += now - ticks;
+            ticks = now;
+        }
+        apu_run(&nes->apu, cycles);
+        if (profile)
+            nes->profile.apu += nes_ticks() - ticks;
+
+        nes->cpu_timestamp += (uint64_t)cycles * cpu_divider;
+
+        if (nes->idle.enabled && nes->cpu.instructions != instructions && (uint16_t)(pc - nes->cpu.PC) <= NES_IDLE_LOOP_MAX_BYTES)
+            nes_skip_idle_loop(nes, target);
+    }
+
+    if (profile)
+        ticks = nes_ticks();
+    nes_sync_ppu(nes, target);
+    if (profile)
+    {
+        uint64_t now = nes_ticks();
+        nes->profile.ppu += now - ticks;
+        nes->profile.total += now - start;
+    }
+    nes->master_clock = target;
+
+    result.frames = nes->ppu.frame_count - frame_count;
+    return result;
+}
+
+static NES_RUN_RESULT nes_run_until(NES* nes, uint64_t target)
+{
+    return nes->profile.enabled ? nes_run_loop(nes, target, true) : nes_run_loop(nes, target, false);
+}
+
+NES_RUN_RESULT nes_run_cycles(NES* nes, uint64_t master_cycles)
 {
     if (nes->created != NES_CREATED_MAGIC_DWORD)
     {
         printf("NES object used while not initialized\n");
-        return;
+        return (NES_RUN_RESULT){ 0, 0 };
     }
 
-    if (nes->key_strobe)
-        nes->key_status = nes->key_status_control;
+    return nes_run_until(nes, nes->master_clock + master_cycles);
+}
 
-    nes->master_clock++;
+// Stops right after the dot on which the ppu wraps past the prerender scanline
+NES_RUN_RESULT nes_run_frame(NES* nes)
+{
+    NES_RUN_RESULT result = { 0, 0 };
 
-    if (nes->master_clock % (nes->system == TV_NTSC ? 4 : 5) == 0)
-        ppu_cycle(&nes->ppu);
+    if (nes->created != NES_CREATED_MAGIC_DWORD)
+    {
+        printf("NES object used while not initialized\n");
+        return result;
+    }
 
-    if (nes->master_clock % (nes->system == TV_NTSC ? 12 : 16) == 0)
+    while (result.frames == 0)
     {
-        cpu_cycle(&nes->cpu);
-        nes->apu.cpu_cycles++;
-        nes->apu.cpu_cycles %= (nes->system == TV_NTSC ? (nes->apu.sequencer_mode ? 18641 : 14915) : (nes->apu.sequencer_mode ? 20783 : 16627)) * 2;   // those are in apu cycles
-        apu_cycle(&nes->apu);
+        uint32_t dots = ppu_dots_until_frame_end(&nes->ppu);
+        NES_RUN_RESULT run = nes_run_until(nes, nes->ppu_timestamp + (uint64_t)(dots - 1) * nes_ppu_divider(nes));
+        result.cycles += run.cycles;
+        result.frames += run.frames;
     }
+
+    return result;
+}
+
+// Module of simple-nes-recomp named after the hash of the rom, if there is one
+static void nes_load_recomp(NES* nes)
+{
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%016llx%s", nes->recomp_directory, (unsigned long long)nes->rom_hash, RECOMP_MODULE_SUFFIX);
+
+    FILE* f = fopen(path, "rb");
+    if (f == NULL)
+        return;
+    fclose(f);
+
+    if (cpu_jit_load_module(&nes->cpu, path))
+        nes_log(nes, "    Recompiled blocks: %llu from %s\n", (unsigned long long)nes->cpu.jit->recompiled, path);
 }
 
-void nes_load_game(NES* nes, char* path_to_rom)
+bool nes_load_game(NES* nes, char* path_to_rom)
 {
     if (nes->created != NES_CREATED_MAGIC_DWORD)
     {
         printf("NES object used while not initialized\n");
-        return;
+        return false;
     }
 
-    printf("Loading rom \"%s\"\n", path_to_rom);
+    nes_log(nes, "Loading rom \"%s\"\n", path_to_rom);
 
     struct iNES_HEADER header;
     uint16_t mapper_number = 0xffff;
@@ -146,7 +434,7 @@ void nes_load_game(NES* nes, char* path_to_rom)
     if (f == NULL)
     {
         printf("Couldn't load rom.\n");
-        return;
+        return false;
     }
 
     if (fread(&header, sizeof(header), 1, f) != 1)
@@ -155,31 +443,40 @@ void nes_load_game(NES* nes, char* path_to_rom)
     if (header.flags_6.trainer)
     {
         fseek(f, 512, SEEK_CUR);     // Skip the trainer
-        printf("    Skipping trainer\n");
+        nes_log(nes, "    Skipping trainer\n");
     }
 
+    // The pages point into the memory of the previous game until the new one is mapped
+    memset(nes->cpu.pages, 0, sizeof(nes->cpu.pages));
+
     if (nes->PRG_ROM_data != NULL)
     {
-        printf("    PRG ROM data already allocated\n");
+        nes_log(nes, "    PRG ROM data already allocated\n");
         free(nes->PRG_ROM_data);
     }
 
     nes->PRG_ROM_size = 16384 * header.prg_rom;
-    printf("    Allocating %u bytes of PRG ROM data\n", nes->PRG_ROM_size);
+    nes_log(nes, "    Allocating %u bytes of PRG ROM data\n", nes->PRG_ROM_size);
     nes->PRG_ROM_data = (uint8_t*)malloc(nes->PRG_ROM_size);
 
     if (nes->PRG_ROM_data == NULL)
     {
         printf("    Couldn't allocate data for the PRG ROM\n");
-        return;
+        return false;
     }
 
     if (fread(nes->PRG_ROM_data, nes->PRG_ROM_size, 1, f) != 1)
         goto read_error;
 
+    free(nes->cpu.decoded);
+    nes->cpu.decoded = (CPU_DECODED*)calloc(nes->PRG_ROM_size, sizeof(CPU_DECODED));  // Without it every instruction is decoded
+    cpu_jit_destroy(&nes->cpu);     // Translated from the previous game, the next run of the jit starts over
+    free(nes->cpu.code_log);
+    nes->cpu.code_log = NULL;
+
     if (nes->CHR_ROM_data != NULL)
     {
-        printf("    CHR ROM data already allocated\n");
+        nes_log(nes, "    CHR ROM data already allocated\n");
         free(nes->CHR_ROM_data);
     }
 
@@ -190,35 +487,46 @@ void nes_load_game(NES* nes, char* path_to_rom)
         nes->CHR_ROM_size = 8192;
         nes->CHR_RAM = true;
     }
-    printf("    Allocating %u bytes of CHR R%cM data\n", nes->CHR_ROM_size, nes->CHR_RAM ? 'A' : 'O');
+    nes_log(nes, "    Allocating %u bytes of CHR R%cM data\n", nes->CHR_ROM_size, nes->CHR_RAM ? 'A' : 'O');
     nes->CHR_ROM_data = (uint8_t*)malloc(nes->CHR_ROM_size);
 
     if (nes->CHR_ROM_data == NULL)
     {
         printf("    Couldn't allocate data for the CHR ROM\n");
-        return;
+        return false;
     }
 
     if (!nes->CHR_RAM)
         if (fread(nes->CHR_ROM_data, nes->CHR_ROM_size, 1, f) != 1)
             goto read_error;
 
+    if (!ppu_init_tiles(&nes->ppu, nes->CHR_ROM_size))
+    {
+        printf("    Couldn't allocate the tile cache\n");
+        fclose(f);
+        return false;
+    }
+
     fclose(f);
 
+    nes->rom_hash = nes_hash(0xcbf29ce484222325, nes->PRG_ROM_data, nes->PRG_ROM_size);
+    if (!nes->CHR_RAM)
+        nes->rom_hash = nes_hash(nes->rom_hash, nes->CHR_ROM_data, nes->CHR_ROM_size);
+
     bool nes_20 = header.flags_7.NES_20 == 2;   // https://www.nesdev.org/wiki/INES#Flags_7 says 2 but then says 1 later in the article
 
     if (nes_20)
     {
-        printf("    NES 2.0 file format\n");
+        nes_log(nes, "    NES 2.0 file format\n");
         // return;
     }
 
     mapper_number = header.flags_6.mapper_lo | (header.flags_7.mapper_hi << 4);
 
-    printf("    Mapper: %u\n", mapper_number);
+    nes_log(nes, "    Mapper: %u\n", mapper_number);
 
     nes->system = (header.flags_9.tv_system & 1) | (header.flags_10.tv_system == 2) | (header.flags_12 & 1);
-    printf("    TV system: %s\n", system_text[nes->system]);
+    nes_log(nes, "    TV system: %s\n", system_text[nes->system]);
 
     if (mapper_number == 71)    mapper_number = 2;
 
@@ -226,7 +534,7 @@ void nes_load_game(NES* nes, char* path_to_rom)
     {
         nes->mapper = MP_UNSUPPORTED;
         printf("Mapper unsupported\n");
-        return;
+        return false;
     }
     else
         nes->mapper = (MAPPER)mapper_number;
@@ -241,16 +549,20 @@ void nes_load_game(NES* nes, char* path_to_rom)
     nes->PRG_RAM_size = (uint32_t)header.flags_8.prg_ram_size * 8192;
     if (nes->PRG_RAM_size == 0) nes->PRG_RAM_size = 8192;
 
-    printf("    Allocating %u bytes of PRG RAM\n", nes->PRG_RAM_size);
+    nes_log(nes, "    Allocating %u bytes of PRG RAM\n", nes->PRG_RAM_size);
     if (nes->PRG_RAM_data == NULL)
         nes->PRG_RAM_data = (uint8_t*)malloc(nes->PRG_RAM_size);
     else
     {
-        printf("    PRG RAM already allocated\n");
+        nes_log(nes, "    PRG RAM already allocated\n");
         free(nes->PRG_RAM_data);
         nes->PRG_RAM_data = (uint8_t*)malloc(nes->PRG_RAM_size);
     }
 
+    free(nes->dirty_prg_ram);
+    nes->dirty_prg_ram = (uint64_t*)malloc(nes_dirty_words(nes->PRG_RAM_size) * sizeof(uint64_t));
+    nes_mark_all_dirty(nes);
+
     nes->selected_prgrom_bank_0 = nes->selected_prgram_bank = nes->selected_chrrom_bank_0 = nes->selected_chrrom_bank_1 = 0;
 
     if (mapper_number == 1)
@@ -259,15 +571,91 @@ void nes_load_game(NES* nes, char* path_to_rom)
     if (mapper_number == 7)
         nes->ppu.mirroring = MR_ONESCREEN_LOWER;
 
-    printf("    Mirroring: %s\n", mirroring_text[(uint8_t)mirroring]);
-    printf("    Entry point: 0x%x\n", cpu_read_word(&nes->cpu, CPU_RESET_VECTOR));
+    cpu_map_memory(&nes->cpu);
+
+    if (nes->recomp_directory != NULL)
+        nes_load_recomp(nes);
 
-    printf("Loading successful\n");
+    nes_log(nes, "    Mirroring: %s\n", mirroring_text[(uint8_t)mirroring]);
+    nes_log(nes, "    Entry point: 0x%x\n", cpu_read_word(&nes->cpu, CPU_RESET_VECTOR));
 
-    return;
+    nes_log(nes, "Loading successful\n");
+
+    return true;
 
 read_error:
     printf("Error reading file.\n");
     fclose(f);
-    return;
+    return false;
+}
+
+// Starts marking the rom the cpu runs as code, until the next game is loaded
+bool nes_start_code_log(NES* nes)
+{
+    if (nes->cpu.code_log == NULL)
+        nes->cpu.code_log = (uint8_t*)calloc(nes->PRG_ROM_size, 1);
+    return nes->cpu.code_log != NULL;
+}
+
+// Adds a code/data log of an earlier run of the same game to the current one
+bool nes_merge_code_log(NES* nes, const char* path)
+{
+    FILE* f = fopen(path, "rb");
+    if (f == NULL || !nes_start_code_log(nes))
+    {
+        printf("Couldn't read the code/data log %s\n", path);
+        if (f != NULL)
+            fclose(f);
+        return false;
+    }
+
+    uint8_t buffer[4096];
+    uint32_t offset = 0;
+    while (offset < nes->PRG_ROM_size)
+    {
+        size_t size = nes->PRG_ROM_size - offset < sizeof(buffer) ? nes->PRG_ROM_size - offset : sizeof(buffer);
+        if (fread(buffer, size, 1, f) != 1)
+            break;
+        for (size_t i = 0; i < size; i++)
+            nes->cpu.code_log[offset + i] |= buffer[i];
+        offset += size;
+    }
+    fclose(f);
+
+    if (offset < nes->PRG_ROM_size)
+    {
+        printf("%s isn't a code/data log of this game\n", path);
+        return false;
+    }
+    return true;
+}
+
+// Writes the log in the layout of a .cdl file of FCEUX, with what the file already had ; the CHR ROM part stays empty
+bool nes_save_code_log(NES* nes, const char* path)
+{
+    if (!nes_start_code_log(nes))
+        return false;
+
+    FILE* f = fopen(path, "rb");
+    if (f != NULL)
+    {
+        fclose(f);
+        nes_merge_code_log(nes, path);
+    }
+
+    f = fopen(path, "wb");
+    if (f == NULL)
+    {
+        printf("Couldn't write the code/data log to %s\n", path);
+        return false;
+    }
+
+    bool written = fwrite(nes->cpu.code_log, nes->PRG_ROM_size, 1, f) == 1;
+    for (uint32_t i = 0; written && !nes->CHR_RAM && i < nes->CHR_ROM_size; i++)
+        written = fputc(0, f) != EOF;
+    fclose(f);
+
+    if (!written)
+        printf("Couldn't write the code/data log to %s\n", path);
+    return written;
 }
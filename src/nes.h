@@ -5,17 +5,119 @@
 #include "ppu.h"
 #include "ines.h"
 
-#include <SFML/Graphics.h>
 #include <stdbool.h>
+#include <stdio.h>
 
 #define NES_CREATED_MAGIC_DWORD  0x12345678
 
+// Controller buttons, in the order they are shifted out of $4016
+#define NES_BUTTON_A        0b10000000
+#define NES_BUTTON_B        0b01000000
+#define NES_BUTTON_SELECT   0b00100000
+#define NES_BUTTON_START    0b00010000
+#define NES_BUTTON_UP       0b00001000
+#define NES_BUTTON_DOWN     0b00000100
+#define NES_BUTTON_LEFT     0b00000010
+#define NES_BUTTON_RIGHT    0b00000001
+
 #define NTSC_MASTER_FREQUENCY       (236250000 / 11.f) // Hz
 #define NTSC_CPU_FREQUENCY          1789773 // Hz
 
 #define PAL_MASTER_FREQUENCY        26601712.5 // Hz
 #define PAL_CPU_FREQUENCY           (26600000 / 16.f) // Hz
 
+#define NTSC_FRAME_RATE             60.0988 // Hz
+#define PAL_FRAME_RATE              50.0070 // Hz
+
+// Master clock dividers
+#define NTSC_CPU_DIVIDER            12
+#define NTSC_PPU_DIVIDER            4
+#define PAL_CPU_DIVIDER             16
+#define PAL_PPU_DIVIDER             5
+
+#define nes_cpu_divider(nes_ptr)    ((nes_ptr)->system == TV_NTSC ? NTSC_CPU_DIVIDER : PAL_CPU_DIVIDER)
+#define nes_ppu_divider(nes_ptr)    ((nes_ptr)->system == TV_NTSC ? NTSC_PPU_DIVIDER : PAL_PPU_DIVIDER)
+
+// Write tracking, one bit per page written since the map was last cleared
+#define NES_DIRTY_PAGE_SHIFT        6   // 64 byte pages
+#define nes_dirty_words(size)       ((((size) >> NES_DIRTY_PAGE_SHIFT) + 63) / 64)
+#define nes_mark_dirty(map, offset) ((map)[(offset) >> (NES_DIRTY_PAGE_SHIFT + 6)] |= 1ull << (((offset) >> NES_DIRTY_PAGE_SHIFT) & 63))
+
+#define nes_log(nes_ptr, ...)       do { if ((nes_ptr)->verbose) printf(__VA_ARGS__); } while (0)
+
+typedef struct NES_RUN_RESULT
+{
+    uint64_t cycles;    // Master cycles executed
+    uint32_t frames;    // Frames completed
+} NES_RUN_RESULT;
+
+// Where the time of the scheduler loop goes, in host ticks ; only measured while enabled
+typedef struct NES_PROFILE
+{
+    bool enabled;
+    uint64_t cpu, ppu, apu;
+    uint64_t total;     // The rest is the scheduler itself
+} NES_PROFILE;
+
+// Idle loop skipping : a short backward jump that brings the cpu back to the same state, without writing anything or
+// reading more than ram, rom and $2002, repeats the same way until the ppu changes something the cpu can see
+#define NES_IDLE_LOOP_MAX_BYTES     16
+
+typedef struct NES_IDLE_CPU
+{
+    uint16_t PC, cycle, operand_address;
+    uint8_t A, X, Y, S, P, page_boundary_crossed;
+    CPU_ADDRESSING_MODE addressing_mode;
+    bool nmi, nmi_last_requested_state, nmi_requested, nmi_last_requested, dma;
+} NES_IDLE_CPU;
+
+typedef struct NES_IDLE_LOOP
+{
+    bool enabled;
+    bool armed;             // The start of a loop was recorded
+    NES_IDLE_CPU cpu;       // State of the cpu the last time it jumped back to the start
+    uint64_t timestamp;     // Master cycle it did
+    uint64_t instructions;  // Instructions executed by then
+    uint64_t deadline;      // Master cycle from which the ppu may change what the loop reads, the iteration after it isn't a repeat
+    uint64_t skipped_cycles;    // Cpu cycles skipped since the nes was created
+} NES_IDLE_LOOP;
+
+typedef enum NES_COMMAND_TYPE
+{
+    NES_CMD_RESET = 0,
+    NES_CMD_POWER_UP = 1,
+    NES_CMD_SET_INPUT = 2,
+    NES_CMD_SET_SYSTEM = 3,
+    NES_CMD_LOAD_PALETTE = 4,
+    NES_CMD_SET_RUNNING = 5,
+    NES_CMD_SET_SPEED = 6,
+    NES_CMD_SAVE_STATE = 7,
+    NES_CMD_LOAD_STATE = 8
+} NES_COMMAND_TYPE;
+
+typedef struct NES_COMMAND
+{
+    NES_COMMAND_TYPE type;
+    union
+    {
+        uint8_t buttons;        // NES_CMD_SET_INPUT
+        TV_SYSTEM system;       // NES_CMD_SET_SYSTEM
+        char* path;             // NES_CMD_LOAD_PALETTE, NES_CMD_SAVE_STATE, NES_CMD_LOAD_STATE ; must outlive the command
+        bool running;           // NES_CMD_SET_RUNNING
+        float speed;            // NES_CMD_SET_SPEED
+    };
+} NES_COMMAND;
+
+#define NES_COMMAND_QUEUE_SIZE  64  // Power of two
+
+// Single producer (ui thread) single consumer (emulation thread) ring buffer
+typedef struct NES_COMMAND_QUEUE
+{
+    NES_COMMAND commands[NES_COMMAND_QUEUE_SIZE];
+    uint32_t head;      // Next command to apply, only written by the consumer
+    uint32_t tail;      // Next free slot, only written by the producer
+} NES_COMMAND_QUEUE;
+
 typedef struct NES
 {
     CPU cpu;
@@ -23,7 +125,9 @@ typedef struct NES
     PPU ppu;
 
     MAPPER mapper;      // Mapper used by currently loaded game
-    uint64_t master_clock;
+    uint64_t master_clock;  // Every master cycle up to this one has been emulated
+    uint64_t cpu_timestamp; // Master cycle of the next cpu event
+    uint64_t ppu_timestamp; // Master cycle of the next ppu dot
 
     uint8_t* PRG_ROM_data;
     uint8_t* CHR_ROM_data;
@@ -32,6 +136,13 @@ typedef struct NES
     uint8_t* PRG_RAM_data;
     uint32_t PRG_RAM_size;
     bool CHR_RAM;
+    uint64_t rom_hash;  // FNV-1a of the PRG and CHR ROM, identifies the game
+
+    // Pages written since the last snapshot of the rewind buffer
+    uint64_t dirty_ram[nes_dirty_words(0x800)];
+    uint64_t dirty_vram[nes_dirty_words(0x1000)];
+    uint64_t dirty_chr_ram[nes_dirty_words(0x2000)];
+    uint64_t* dirty_prg_ram;
 
     uint8_t selected_prgrom_bank_0;
     // uint8_t selected_prgrom_bank_1;
@@ -49,27 +160,38 @@ typedef struct NES
 
     TV_SYSTEM system;
 
+    uint64_t rng_seed;
+    uint64_t rng_state;
+
+    float emulation_speed;
+    uint32_t render_interval;   // Draw 1 frame in N, 0 never draws ; the others only emulate what the game can observe
+    bool emulation_running;
+    bool verbose;       // Print loading messages
+    char* recomp_directory;     // Where nes_load_game looks for the module of simple-nes-recomp, NULL doesn't look
+
+    NES_COMMAND_QUEUE commands;
+    NES_PROFILE profile;
+    NES_IDLE_LOOP idle;
+
     uint32_t created;   // To check if the nes has been initialized
 } NES;
 
-static const sfKeyCode keymap[8] =
-{
-    sfKeyC,     // A
-    sfKeyX,     // B
-    sfKeyLControl, // Select
-    sfKeyLShift,   // Start
-    sfKeyUp,     // Up
-    sfKeyDown,   // Down
-    sfKeyLeft,   // Left
-    sfKeyRight   // Right
-};
-
 NES nes_create();
 
 void nes_init(NES* nes);
 void nes_reset(NES* nes);
 void nes_power_up(NES* nes);
-void nes_load_game(NES* nes, char* path_to_rom);
+bool nes_load_game(NES* nes, char* path_to_rom);
 void nes_destroy(NES* nes);
-void nes_cycle(NES* nes);
-void nes_handle_controls(NES* nes);
+NES_RUN_RESULT nes_run_cycles(NES* nes, uint64_t master_cycles);
+NES_RUN_RESULT nes_run_frame(NES* nes);
+void nes_set_input(NES* nes, uint8_t buttons);
+void nes_seed(NES* nes, uint64_t seed);
+uint32_t nes_random(NES* nes);
+uint64_t nes_hash(uint64_t hash, const uint8_t* data, size_t size);
+void nes_mark_all_dirty(NES* nes);
+bool nes_start_code_log(NES* nes);
+bool nes_merge_code_log(NES* nes, const char* path);
+bool nes_save_code_log(NES* nes, const char* path);
+bool nes_push_command(NES* nes, NES_COMMAND command);
+uint32_t nes_process_commands(NES* nes);
@@ -2,15 +2,21 @@
 #include "ppu.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define PPU_AVX2    // Picked at run time by ppu_convert_frame
+#endif
+
 void ppu_reset(PPU* ppu)
 {
     *(uint8_t*)&ppu->PPUCTRL = 0;
     *(uint8_t*)&ppu->PPUMASK = 0;
     *(uint16_t*)&ppu->t = 0;
     ppu->x = 0;
-    ppu->fine_x = 0;
+    memset(ppu->bg_tiles, 0, sizeof(ppu->bg_tiles));
     ppu->PPUDATA = 0;
 
     ppu->w = 0;
@@ -20,6 +26,7 @@ void ppu_reset(PPU* ppu)
     ppu->scanline = 0;
     ppu->cycle = 1;
     ppu->frame_finished = false;
+    ppu->skip_render = false;
     ppu->can_nmi = true;
 
     ppu->horizontal_increment = ppu->vertical_increment = false;
@@ -30,6 +37,7 @@ void ppu_power_up(PPU* ppu)
     *(uint8_t*)&ppu->PPUSTATUS = 0b10100000;
     ppu->OAMADDR = 0;
     *(uint16_t*)&ppu->v = 0;
+    ppu->frame_count = 0;
     ppu_reset(ppu);
 
     // From https://github.com/christopherpow/nes-test-roms/blob/master/blargg_ppu_tests_2005.09.15b/source/power_up_palette.asm
@@ -41,32 +49,28 @@ void ppu_power_up(PPU* ppu)
     memcpy(&ppu->palette_ram, &power_up_palette, 32);
 }
 
-uint8_t ppu_read_byte(PPU* ppu, uint16_t address)
+// Offset in the CHR data of a pattern table address, through the banks of the mapper
+static inline uint32_t ppu_chr_index(PPU* ppu, uint16_t address)
 {
-    address &= 0x3fff;
+    NES* nes = ppu->nes;
 
-    if (address < 0x2000)
+    if (nes->mapper == MP_MMC1)
     {
-        switch (ppu->nes->mapper)
-        {
-        case MP_NROM:
-            return ppu->nes->CHR_ROM_data[address % ppu->nes->CHR_ROM_size];
-
-        case MP_MMC1:
-            if (!(ppu->nes->mmc1_control & 0b10000))
-                return ppu->nes->CHR_ROM_data[(address + 0x1000 * (ppu->nes->selected_chrrom_bank_0 & 0b11110)) % ppu->nes->CHR_ROM_size];
-            if (address < 0x1000)
-                return ppu->nes->CHR_ROM_data[(address + 0x1000 * ppu->nes->selected_chrrom_bank_0) % ppu->nes->CHR_ROM_size];
-            return ppu->nes->CHR_ROM_data[(address - 0x1000 + 0x1000 * ppu->nes->selected_chrrom_bank_1) % ppu->nes->CHR_ROM_size];
+        if (!(nes->mmc1_control & 0b10000))
+            return (address + 0x1000 * (nes->selected_chrrom_bank_0 & 0b11110)) % nes->CHR_ROM_size;
+        if (address < 0x1000)
+            return (address + 0x1000 * nes->selected_chrrom_bank_0) % nes->CHR_ROM_size;
+        return (address - 0x1000 + 0x1000 * nes->selected_chrrom_bank_1) % nes->CHR_ROM_size;
+    }
+    return address % nes->CHR_ROM_size;     // NROM, UxROM, AxROM
+}
 
-        case MP_UxROM:
-            return ppu->nes->CHR_ROM_data[address % ppu->nes->CHR_ROM_size];
+uint8_t ppu_read_byte(PPU* ppu, uint16_t address)
+{
+    address &= 0x3fff;
 
-        case MP_AxROM:
-            return ppu->nes->CHR_ROM_data[address % ppu->nes->CHR_ROM_size];
-        }
-        return 0;
-    }
+    if (address < 0x2000)
+        return ppu->nes->CHR_ROM_data[ppu_chr_index(ppu, address)];
 
     if (address < 0x3f00)
     {
@@ -107,34 +111,10 @@ void ppu_write_byte(PPU* ppu, uint16_t address, uint8_t byte)
     {
         if (ppu->nes->CHR_RAM)
         {
-            switch (ppu->nes->mapper)
-            {
-            case MP_NROM:
-                ppu->nes->CHR_ROM_data[address % ppu->nes->CHR_ROM_size] = byte;
-                return;
-
-            case MP_MMC1:
-                if (!(ppu->nes->mmc1_control & 0b10000))
-                {
-                    ppu->nes->CHR_ROM_data[(address + 0x1000 * (ppu->nes->selected_chrrom_bank_0 & 0b11110)) % ppu->nes->CHR_ROM_size] = byte;
-                    return;
-                }
-                if (address < 0x1000)
-                {
-                    ppu->nes->CHR_ROM_data[(address + 0x1000 * ppu->nes->selected_chrrom_bank_0) % ppu->nes->CHR_ROM_size] = byte;
-                    return;
-                }
-                ppu->nes->CHR_ROM_data[(address - 0x1000 + 0x1000 * ppu->nes->selected_chrrom_bank_1) % ppu->nes->CHR_ROM_size] = byte;
-                return;
-
-            case MP_UxROM:
-                ppu->nes->CHR_ROM_data[address % ppu->nes->CHR_ROM_size] = byte;
-                return;
-
-            case MP_AxROM:
-                ppu->nes->CHR_ROM_data[address % ppu->nes->CHR_ROM_size] = byte;
-                return;
-            }
+            uint32_t index = ppu_chr_index(ppu, address);
+            ppu->nes->CHR_ROM_data[index] = byte;
+            nes_mark_dirty(ppu->nes->dirty_chr_ram, index);
+            ppu->tiles_valid[index >> 10] &= ~(1ull << ((index >> 4) & 63));
         }
         return;
     }
@@ -164,6 +144,7 @@ void ppu_write_byte(PPU* ppu, uint16_t address, uint8_t byte)
             address = 0xc00 + ((address - 0x2000) % 0x400);
         }
         ppu->VRAM[address % 0x1000] = byte;
+        nes_mark_dirty(ppu->nes->dirty_vram, address % 0x1000);
         return;
     }
 
@@ -173,14 +154,18 @@ void ppu_write_byte(PPU* ppu, uint16_t address, uint8_t byte)
         ppu->palette_ram[(address - 0x3f00) % 32] = byte;
 }
 
+// Rendering lookup, unlike ppu_read_byte it leaves the PPUDATA read buffer alone
 uint8_t ppu_read_palette(PPU* ppu, PALETTE_BG_SPRITE background_sprite, uint8_t palette_number, uint8_t index)
 {
-    return ppu_read_byte(ppu, (0x3f00 | (((uint16_t)background_sprite & 0b1) << 4) | ((palette_number & 0b11) << 2) | (index & 0b11))) & 0b111111;
+    uint8_t address = (((uint8_t)background_sprite & 0b1) << 4) | ((palette_number & 0b11) << 2) | (index & 0b11);
+    if (address == 0x10)
+        address = 0;
+    return ppu->palette_ram[address] & 0b111111;
 }
 
 void ppu_load_palette(PPU* ppu, char* path_to_palette)
 {
-    printf("Loading palette \"%s\"\n", path_to_palette);
+    nes_log(ppu->nes, "Loading palette \"%s\"\n", path_to_palette);
 
     FILE* f = fopen(path_to_palette, "rb");
 
@@ -190,7 +175,8 @@ void ppu_load_palette(PPU* ppu, char* path_to_palette)
         return;
     }
 
-    if (fread(&ppu->ntsc_palette[0], 192, 1, f) != 1)
+    uint8_t palette[192];
+    if (fread(palette, 192, 1, f) != 1)
     {
         printf("Couldn't load palette.\n");
         fclose(f);
@@ -198,8 +184,29 @@ void ppu_load_palette(PPU* ppu, char* path_to_palette)
     }
 
     fclose(f);
+    memcpy(ppu->ntsc_palette, palette, 192);
+    ppu_build_palette_lut(ppu);
 
-    printf("Loading successful\n");
+    nes_log(ppu->nes, "Loading successful\n");
+}
+
+// Emphasis dims the channels that aren't emphasized, all of them when the 3 bits are set, except on the black columns
+void ppu_build_palette_lut(PPU* ppu)
+{
+    for (uint8_t emphasis = 0; emphasis < 8; emphasis++)
+    {
+        for (uint8_t color = 0; color < 64; color++)
+        {
+            uint8_t rgba[4] = { ppu->ntsc_palette[color * 3 + 0], ppu->ntsc_palette[color * 3 + 1], ppu->ntsc_palette[color * 3 + 2], 0xff };
+            if (emphasis != 0 && (color & 0x0f) != 0x0f)
+            {
+                for (uint8_t channel = 0; channel < 3; channel++)
+                    if (emphasis == 0b111 || !(emphasis & (1 << channel)))
+                        rgba[channel] *= 0.816328;
+            }
+            memcpy(&ppu->palette_lut[emphasis][color], rgba, 4);
+        }
+    }
 }
 
 uint8_t ppu_read_pattern_table_plane_0(PPU* ppu, PATTERN_TABLE_SIDE side, uint8_t tile, uint8_t off_y)
@@ -216,9 +223,70 @@ uint8_t ppu_read_pattern_table_plane_1(PPU* ppu, PATTERN_TABLE_SIDE side, uint8_
 
 uint8_t ppu_read_pattern_table(PPU* ppu, PATTERN_TABLE_SIDE side, uint8_t tile, uint8_t off_x, uint8_t off_y)
 {
-    off_x &= 0b111;
-    off_y &= 0b111;
-    return ((ppu_read_pattern_table_plane_0(ppu, side, tile, off_y) >> (7 - off_x)) & 0b1) | (((ppu_read_pattern_table_plane_1(ppu, side, tile, off_y) >> (7 - off_x)) << 1) & 0b10);
+    return ppu_read_tile_row(ppu, side, tile, off_y, false)[off_x & 0b111];
+}
+
+// Row off_y of a tile, 8 color indices from left to right, decoded from both planes the first time the tile is used
+const uint8_t* ppu_read_tile_row(PPU* ppu, PATTERN_TABLE_SIDE side, uint8_t tile, uint8_t off_y, bool flip_x)
+{
+    uint32_t index = ppu_chr_index(ppu, (((uint16_t)side & 0b1) * 0x1000) | ((uint16_t)tile << 4)) >> 4;
+    PPU_TILE* decoded = &ppu->tiles[index];
+
+    if (!(ppu->tiles_valid[index >> 6] & (1ull << (index & 63))))
+    {
+        const uint8_t* planes = &ppu->nes->CHR_ROM_data[index << 4];
+        for (uint8_t y = 0; y < 8; y++)
+        {
+            for (uint8_t x = 0; x < 8; x++)
+            {
+                uint8_t color = ((planes[y] >> (7 - x)) & 0b1) | (((planes[8 + y] >> (7 - x)) << 1) & 0b10);
+                decoded->rows[0][y][x] = color;
+                decoded->rows[1][y][7 - x] = color;
+            }
+        }
+        ppu->tiles_valid[index >> 6] |= 1ull << (index & 63);
+    }
+    return decoded->rows[flip_x][off_y & 0b111];
+}
+
+// One entry per 16 bytes of CHR data, called once it is allocated
+bool ppu_init_tiles(PPU* ppu, uint32_t chr_size)
+{
+    ppu_destroy_tiles(ppu);
+    ppu->tile_count = chr_size / 16;
+    ppu->tiles = (PPU_TILE*)malloc(ppu->tile_count * sizeof(PPU_TILE));
+    ppu->tiles_valid = (uint64_t*)calloc((ppu->tile_count + 63) / 64, sizeof(uint64_t));
+    if (ppu->tiles == NULL || ppu->tiles_valid == NULL)
+    {
+        ppu_destroy_tiles(ppu);
+        return false;
+    }
+    return true;
+}
+
+// The CHR data was replaced as a whole, by loading a state
+void ppu_flush_tiles(PPU* ppu)
+{
+    if (ppu->tiles_valid != NULL)
+        memset(ppu->tiles_valid, 0, (ppu->tile_count + 63) / 64 * sizeof(uint64_t));
+}
+
+void ppu_destroy_tiles(PPU* ppu)
+{
+    free(ppu->tiles);
+    free(ppu->tiles_valid);
+    ppu->tiles = NULL;
+    ppu->tiles_valid = NULL;
+    ppu->tile_count = 0;
+}
+
+void ppu_destroy_frames(PPU* ppu)
+{
+    for (uint8_t i = 0; i < 3; i++)
+    {
+        free(ppu->frames[i].overflow_emphasis);
+        ppu->frames[i].overflow_emphasis = NULL;
+    }
 }
 
 uint8_t ppu_read_nametable(PPU* ppu, uint8_t nametable, uint16_t bg_tile)
@@ -226,192 +294,388 @@ uint8_t ppu_read_nametable(PPU* ppu, uint8_t nametable, uint16_t bg_tile)
     return ppu_read_byte(ppu, 0x2000 + (nametable & 0b11) * 0x400 + bg_tile);
 }
 
-void ppu_cycle(PPU* ppu)
+// Number of dots until the ppu wraps back to scanline 0
+// On NTSC the odd frame dot skip is only decided on dot 338 of the prerender scanline so until then this stops there
+uint32_t ppu_dots_until_frame_end(PPU* ppu)
 {
-    ppu->cycle++;
-    if (ppu->cycle > 340)
+    if (ppu->nes->system == TV_NTSC && (ppu->scanline < 261 || (ppu->scanline == 261 && ppu->cycle < 338)))
+        return (261 - ppu->scanline) * 341 + 338 - ppu->cycle;
+    return (ppu_prerender_scanline(ppu) - ppu->scanline) * 341 + 341 - ppu->cycle;
+}
+
+// Number of dots the ppu is sure to run without setting vblank and nmi (scanline 241) or clearing the status (prerender scanline)
+// Sprite 0 hit and overflow aren't accounted for ; can be a few dots early, never late
+uint32_t ppu_dots_until_status_change(PPU* ppu)
+{
+    uint16_t prerender = ppu_prerender_scanline(ppu);
+    uint32_t dots;
+
+    if (ppu->scanline < 241)
+        dots = (241 - ppu->scanline) * 341 - ppu->cycle;
+    else if (ppu->scanline == 241 && ppu->cycle <= 1)
+        return 0;
+    else if (ppu->scanline < prerender)
+        dots = (prerender - ppu->scanline) * 341 - ppu->cycle;
+    else if (ppu->cycle <= 1)
+        return 0;
+    else
+        dots = 341 - ppu->cycle + 241 * 341 - 1;    // Odd frames may skip a dot
+
+    return dots > 2 ? dots - 2 : 0;
+}
+
+// Per pixel emphasis of a mixed line
+static inline uint8_t* ppu_emphasis_row(const PPU_FRAME* frame, uint8_t y)
+{
+    uint8_t row = frame->emphasis[y] & ~PPU_EMPHASIS_MIXED;
+    return row != PPU_EMPHASIS_OVERFLOW ? (uint8_t*)frame->emphasis_rows[row] : &frame->overflow_emphasis[y * 256];
+}
+
+// Consumer side of the frame buffers, the returned frame stays untouched until the next call
+const PPU_FRAME* ppu_latest_frame(PPU* ppu)
+{
+    if (__atomic_load_n(&ppu->frame_buffers.ready, __ATOMIC_ACQUIRE) & PPU_FRAME_NEW)
+        ppu->frame_buffers.front = __atomic_exchange_n(&ppu->frame_buffers.ready, ppu->frame_buffers.front, __ATOMIC_ACQ_REL) & ~PPU_FRAME_NEW;
+    return &ppu->frames[ppu->frame_buffers.front];
+}
+
+// Entry of each emphasis and color in the format, from the RGBA of the frame's palette
+static void ppu_format_lut(const uint32_t palette[8][64], PPU_PIXEL_FORMAT format, uint32_t lut[8 * 64])
+{
+    for (uint16_t i = 0; i < 8 * 64; i++)
     {
-        ppu->cycle = 0;
-        ppu->scanline++;
-        if (ppu->scanline > ppu_prerender_scanline(ppu))
+        uint8_t rgba[4];
+        memcpy(rgba, &palette[i >> 6][i & 63], 4);
+        switch (format)
         {
-            ppu->scanline = 0;
-            memcpy(ppu->screen_buffer, ppu->screen, 256 * 240 * 4);
-            ppu->frame_finished = true;
+        case PF_RGBA8888:
+            lut[i] = palette[i >> 6][i & 63];
+            break;
+
+        case PF_XRGB8888:
+            lut[i] = 0xff000000 | (uint32_t)rgba[0] << 16 | (uint32_t)rgba[1] << 8 | rgba[2];
+            break;
+
+        case PF_RGB565:
+            lut[i] = (rgba[0] >> 3) << 11 | (rgba[1] >> 2) << 5 | rgba[2] >> 3;
+            break;
+
+        case PF_GRAYSCALE:
+            lut[i] = (rgba[0] * 77 + rgba[1] * 150 + rgba[2] * 29) >> 8;    // BT.601 luma
+            break;
         }
     }
+}
 
-    if (ppu->scanline < 240)
+// Line of 256 pixels, emphasis is NULL when the whole line has the one lut starts at
+static void ppu_convert_line(const uint8_t* pixels, const uint8_t* emphasis, const uint32_t* lut, uint8_t size, void* line)
+{
+    uint16_t index[256];
+    for (uint16_t x = 0; x < 256; x++)
+        index[x] = (emphasis != NULL ? emphasis[x] << 6 : 0) | pixels[x];
+
+    switch (size)
     {
-        if (ppu->cycle >= 1 && ppu->cycle <= 256)
+    case 4:
+        for (uint16_t x = 0; x < 256; x++)
+            ((uint32_t*)line)[x] = lut[index[x]];
+        break;
+
+    case 2:
+        for (uint16_t x = 0; x < 256; x++)
+            ((uint16_t*)line)[x] = lut[index[x]];
+        break;
+
+    default:
+        for (uint16_t x = 0; x < 256; x++)
+            ((uint8_t*)line)[x] = lut[index[x]];
+        break;
+    }
+}
+
+#ifdef PPU_AVX2
+// Same with a gather of 8 table entries at a time, then narrowed to the size of the format
+__attribute__((target("avx2")))
+static void ppu_convert_line_avx2(const uint8_t* pixels, const uint8_t* emphasis, const uint32_t* lut, uint8_t size, void* line)
+{
+    for (uint16_t x = 0; x < 256; x += 8)
+    {
+        __m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)&pixels[x]));
+        if (emphasis != NULL)
+            index = _mm256_or_si256(index, _mm256_slli_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)&emphasis[x])), 6));
+        __m256i value = _mm256_i32gather_epi32((const int*)lut, index, 4);
+
+        if (size == 4)
         {
-            uint8_t color_code = 0, bg_color_code = 0, sprite_color_code = 0;
-            uint8_t image_pix_x = (uint8_t)(ppu->cycle - 1);
-            uint8_t image_pix_y = (uint8_t)ppu->scanline;
+            _mm256_storeu_si256((__m256i*)&((uint32_t*)line)[x], value);
+            continue;
+        }
+        __m128i narrow = _mm256_castsi256_si128(_mm256_permute4x64_epi64(_mm256_packus_epi32(value, value), 0b1000));
+        if (size == 2)
+            _mm_storeu_si128((__m128i*)&((uint16_t*)line)[x], narrow);
+        else
+            _mm_storel_epi64((__m128i*)&((uint8_t*)line)[x], _mm_packus_epi16(narrow, narrow));
+    }
+}
+#endif
 
-            struct OAM_SPRITE_ENTRY rendered_sprite;
-            rendered_sprite.attributes.priority = 1;
+// Conversion of a frame for a consumer, pixels holds 256 * 240 of the format
+void ppu_convert_frame(const PPU_FRAME* frame, PPU_PIXEL_FORMAT format, void* pixels)
+{
+    static const uint8_t sizes[] = { 4, 4, 2, 1 };
+    uint32_t lut[8 * 64];
+    ppu_format_lut(frame->palette, format, lut);
 
-            bool sprite_transparent_pixel = true, bg_transparent_pixel = true;
+    void (*convert_line)(const uint8_t*, const uint8_t*, const uint32_t*, uint8_t, void*) = &ppu_convert_line;
+#ifdef PPU_AVX2
+    if (__builtin_cpu_supports("avx2"))
+        convert_line = &ppu_convert_line_avx2;
+#endif
 
-            if (ppu->PPUMASK.enable_bg && (ppu->PPUMASK.show_bg_left || image_pix_x >= 8))
-            {
-                uint8_t pix_x = ppu->v.coarse_x * 8 + ppu->fine_x;
-                uint8_t pix_y = ppu->v.coarse_y * 8 + ppu->v.fine_y;
+    for (uint16_t y = 0; y < 240; y++)
+    {
+        bool mixed = frame->emphasis[y] & PPU_EMPHASIS_MIXED;
+        convert_line(&frame->pixels[y * 256], mixed ? ppu_emphasis_row(frame, y) : NULL, mixed ? lut : &lut[(frame->emphasis[y] & 0b111) * 64],
+            sizes[format], (uint8_t*)pixels + y * 256 * sizes[format]);
+    }
+}
+
+// Draws the sprites fetched for a line into sprite_line, the lowest index in front : the line after the current one
+// from dot 257 on, when they are fetched, the current one before
+// On frames that aren't drawn only sprite 0 is, for its hit
+void ppu_build_sprite_line(PPU* ppu)
+{
+    uint16_t line = ppu->cycle >= 257 ? ppu->scanline + 1 : ppu->scanline;
+    uint8_t count = ppu->skip_render ? ppu->sprite_0_rendered && ppu->num_sprites_to_render != 0 : ppu->num_sprites_to_render;
+
+    memset(ppu->sprite_line, 0, sizeof(ppu->sprite_line));
+    for (uint8_t i = 0; i < count; i++)
+    {
+        uint8_t index = count - i - 1;
+        struct OAM_SPRITE_ENTRY sprite = ppu->sprites_to_render[index];
+        int16_t off_y = line - sprite.sprite_y - 1;
+        const uint8_t* row;
+
+        if (sprite.attributes.flip_y)
+        {
+            if (ppu->PPUCTRL.sprite_size)   // 8x16 sprite
+                off_y = 15 - off_y;
+            else
+                off_y = 7 - off_y;
+        }
+        if (ppu->PPUCTRL.sprite_size)
+        {
+            if (off_y >= 8)
+                row = ppu_read_tile_row(ppu, (sprite.tile_index & 1), (sprite.tile_index & 0b11111110) | 1, off_y - 8, sprite.attributes.flip_x);
+            else
+                row = ppu_read_tile_row(ppu, (sprite.tile_index & 1), (sprite.tile_index & 0b11111110), off_y, sprite.attributes.flip_x);
+        }
+        else
+            row = ppu_read_tile_row(ppu, ppu->PPUCTRL.sprite_pattern_table_address, sprite.tile_index, off_y, sprite.attributes.flip_x);
 
-                uint16_t bg_tile = ppu->v.coarse_x + 32 * ppu->v.coarse_y;
-                uint16_t palette_tile = (pix_x / 32) + ((pix_y / 32) * 8);
-                uint8_t palette_off_x = pix_x % 32;
-                uint8_t palette_off_y = pix_y % 32;
+        uint8_t attributes = sprite.attributes.palette << 2 | (sprite.attributes.priority ? PPU_SPRITE_BEHIND : 0);
+        for (uint8_t off_x = 0; off_x < 8 && sprite.sprite_x + off_x < 256; off_x++)
+        {
+            if (row[off_x] == 0)
+                continue;
+            uint8_t* pixel = &ppu->sprite_line[sprite.sprite_x + off_x];
+            *pixel = (*pixel & PPU_SPRITE_0) | attributes | row[off_x];
+            if (index == 0 && ppu->sprite_0_rendered)
+                *pixel |= PPU_SPRITE_0;
+        }
+    }
+}
 
-                uint8_t pattern_tile = ppu_read_nametable(ppu, ppu->v.nametable_select, bg_tile);
-                uint8_t off_x = ppu->fine_x;
-                uint8_t off_y = ppu->v.fine_y;
+// On frames that aren't drawn a pixel still matters if it can set the sprite 0 hit flag
+// or if it is a backdrop override, which reads the palette through ppu_read_byte
+static inline bool ppu_pixel_observable(PPU* ppu, uint8_t image_pix_x)
+{
+    if ((ppu->sprite_line[image_pix_x] & PPU_SPRITE_0) && !ppu->PPUSTATUS.sprite_0_hit && ppu->PPUMASK.enable_bg && ppu->PPUMASK.enable_sprites)
+        return true;
+    return ppu_forced_blanking(ppu) && *(uint16_t*)&ppu->v >= 0x3f00;
+}
 
-                uint8_t palette_byte = ppu_read_nametable(ppu, ppu->v.nametable_select, 960 + palette_tile);
-                uint8_t palette = 0;
+// Background fetches of a rendering line, on the dots the ppu does them : nametable, attribute and pattern of a tile every
+// 8 dots, loaded behind the tile being drawn from the next 8 dots on ; the first two tiles of a line are fetched on dots
+// 321 to 336 of the line before. The cached row of the tile stands for both pattern fetches
+static void ppu_fetch_background(PPU* ppu)
+{
+    uint16_t dot = ppu->cycle;
 
-                if (palette_off_x < 16 && palette_off_y < 16)
-                    palette = palette_byte & 0b11;
-                if (palette_off_x >= 16 && palette_off_y < 16)
-                    palette = (palette_byte >> 2) & 0b11;
-                if (palette_off_x < 16 && palette_off_y >= 16)
-                    palette = (palette_byte >> 4) & 0b11;
-                if (palette_off_x >= 16 && palette_off_y >= 16)
-                    palette = (palette_byte >> 6) & 0b11;
+    if (dot == 0 || (dot > 257 && dot < 321) || dot > 337)
+        return;
 
-                uint8_t index = ppu_read_pattern_table(ppu, ppu->PPUCTRL.background_pattern_table_address, pattern_tile, off_x, off_y);
+    switch (dot & 0b111)
+    {
+    case 1:
+        if (dot >= 9 && dot != 321)     // 9 to 257, 329 and 337
+        {
+            memcpy(ppu->bg_tiles[0], ppu->bg_tiles[1], 8);
+            for (uint8_t x = 0; x < 8; x++)
+                ppu->bg_tiles[1][x] = ppu->bg_next_palette << 2 | ppu->bg_next_row[x];
+        }
+        if (dot != 257 && dot != 337)
+            ppu->bg_next_tile = ppu_read_nametable(ppu, ppu->v.nametable_select, ppu->v.coarse_x + 32 * ppu->v.coarse_y);
+        break;
 
-                if (index != 0)
-                {
-                    bg_color_code = ppu_read_palette(ppu, PL_BACKGROUND, palette, index);
-                    bg_transparent_pixel = false;
-                }
-            }
+    case 3:
+    {
+        // A byte for each 4x4 tiles, 2 bits for each 2x2 quarter of them
+        uint8_t attribute = ppu_read_nametable(ppu, ppu->v.nametable_select, 960 + (ppu->v.coarse_y >> 2) * 8 + (ppu->v.coarse_x >> 2));
+        ppu->bg_next_palette = (attribute >> ((ppu->v.coarse_y & 0b10) << 1 | (ppu->v.coarse_x & 0b10))) & 0b11;
+        break;
+    }
 
-            if (ppu->PPUMASK.enable_sprites && ppu->scanline != 0 && (ppu->PPUMASK.show_sprites_left || image_pix_x >= 8))
-            {
-                uint8_t index;
-                int16_t off_x, off_y;
-                uint8_t palette_index;
-                struct OAM_SPRITE_ENTRY sprite;
-                for (uint8_t i = 0; i < ppu->num_sprites_to_render; i++)
-                {
-                    index = ppu->num_sprites_to_render - i - 1;
-                    sprite = ppu->sprites_to_render[index];
+    case 5:
+        memcpy(ppu->bg_next_row, ppu_read_tile_row(ppu, ppu->PPUCTRL.background_pattern_table_address, ppu->bg_next_tile, ppu->v.fine_y, false), 8);
+        break;
 
-                    off_x = image_pix_x - sprite.sprite_x;
-                    off_y = image_pix_y - sprite.sprite_y - 1;
-                    if (off_x >= 0 && off_x < 8)
-                    {
-                        if (sprite.attributes.flip_x)
-                            off_x = 7 - off_x;
-                        if (sprite.attributes.flip_y)
-                        {
-                            if (ppu->PPUCTRL.sprite_size)   // 8x16 sprite
-                                off_y = 15 - off_y;
-                            else
-                                off_y = 7 - off_y;
-                        }
-                        if (ppu->PPUCTRL.sprite_size)
-                        {
-                            if (off_y >= 8)
-                                palette_index = ppu_read_pattern_table(ppu, (sprite.tile_index & 1), (sprite.tile_index & 0b11111110) | 1, off_x, off_y - 8);
-                            else
-                                palette_index = ppu_read_pattern_table(ppu, (sprite.tile_index & 1), (sprite.tile_index & 0b11111110), off_x, off_y);
-                        }
-                        else
-                            palette_index = ppu_read_pattern_table(ppu, ppu->PPUCTRL.sprite_pattern_table_address, sprite.tile_index, off_x, off_y);
+    case 0:
+        ppu->horizontal_increment = true;
+        break;
+    }
+}
 
-                        if (palette_index != 0)
-                        {
-                            sprite_transparent_pixel = false;
-                            sprite_color_code = ppu_read_palette(ppu, PL_SPRITE, sprite.attributes.palette, palette_index);
-                            rendered_sprite = sprite;
+// Composes one pixel, on frames that aren't drawn it is only called when the result can be observed by the game
+static void ppu_render_pixel(PPU* ppu, uint8_t image_pix_x, uint8_t image_pix_y)
+{
+    uint8_t color_code = 0, bg_color_code = 0, sprite_color_code = 0;
 
-                            if (index == 0 && ppu->sprite_0_rendered && !bg_transparent_pixel && image_pix_x != 255) // Sprite 0 hit
-                                ppu->PPUSTATUS.sprite_0_hit = true;
-                        }
-                    }
-                }
-            }
+    bool sprite_transparent_pixel = true, bg_transparent_pixel = true, sprite_behind = true;
+
+    if (ppu->PPUMASK.enable_bg && (ppu->PPUMASK.show_bg_left || image_pix_x >= 8))
+    {
+        uint8_t offset = (image_pix_x & 0b111) + ppu->x;
+        uint8_t bg_pixel = ppu->bg_tiles[offset >> 3][offset & 0b111];
 
-            if ((!sprite_transparent_pixel) || (!bg_transparent_pixel))
+        if (bg_pixel & 0b11)
+        {
+            bg_color_code = ppu_read_palette(ppu, PL_BACKGROUND, bg_pixel >> 2, bg_pixel);
+            bg_transparent_pixel = false;
+        }
+    }
+
+    if (ppu->PPUMASK.enable_sprites && ppu->scanline != 0 && (ppu->PPUMASK.show_sprites_left || image_pix_x >= 8))
+    {
+        uint8_t sprite = ppu->sprite_line[image_pix_x];
+        if (sprite & 0b11)
+        {
+            sprite_transparent_pixel = false;
+            sprite_color_code = ppu_read_palette(ppu, PL_SPRITE, sprite >> 2, sprite);
+            sprite_behind = sprite & PPU_SPRITE_BEHIND;
+        }
+        if ((sprite & PPU_SPRITE_0) && !bg_transparent_pixel && image_pix_x != 255)    // Sprite 0 hit
+            ppu->PPUSTATUS.sprite_0_hit = true;
+    }
+
+    if ((!sprite_transparent_pixel) || (!bg_transparent_pixel))
+    {
+        if (!bg_transparent_pixel)
+        {
+            if ((!sprite_transparent_pixel) && (!sprite_behind))
             {
-                if (!bg_transparent_pixel)
-                {
-                    if ((!sprite_transparent_pixel) && (!rendered_sprite.attributes.priority))
-                    {
-                        color_code = sprite_color_code;
-                    }
-                    else
-                    {
-                        color_code = bg_color_code;
-                    }
-                }
-                else
-                    color_code = sprite_color_code;
+                color_code = sprite_color_code;
             }
             else
             {
-                if (*(uint16_t*)&ppu->v >= 0x3f00 && ppu_forced_blanking(ppu))  // Backdrop override
-                    color_code = ppu_read_byte(ppu, *(uint16_t*)&ppu->v);
-                else
-                    color_code = ppu_read_palette(ppu, PL_SPRITE, 0, 0);
+                color_code = bg_color_code;
             }
+        }
+        else
+            color_code = sprite_color_code;
+    }
+    else
+    {
+        if (*(uint16_t*)&ppu->v >= 0x3f00 && ppu_forced_blanking(ppu))  // Backdrop override
+            color_code = ppu_read_byte(ppu, *(uint16_t*)&ppu->v);
+        else
+            color_code = ppu_read_palette(ppu, PL_SPRITE, 0, 0);
+    }
 
-            if (ppu->PPUMASK.grayscale)
-                color_code &= 0x30;
-            uint8_t r = ppu->ntsc_palette[(color_code * 3 + 0) % 192], g = ppu->ntsc_palette[(color_code * 3 + 1) % 192], b = ppu->ntsc_palette[(color_code * 3 + 2) % 192];
-            if ((ppu->PPUMASK.emphasize_red || ppu->PPUMASK.emphasize_green || ppu->PPUMASK.emphasize_blue) && (color_code & 0x0f) != 0x0f)
-            {
-                if (ppu->PPUMASK.emphasize_red && ppu->PPUMASK.emphasize_green && ppu->PPUMASK.emphasize_blue)
-                {
-                    r *= 0.816328;
-                    g *= 0.816328;
-                    b *= 0.816328;
-                }
-                else
-                {
-                    if (!ppu->PPUMASK.emphasize_red)
-                        r *= 0.816328;
-                    if (!ppu->PPUMASK.emphasize_green)
-                        g *= 0.816328;
-                    if (!ppu->PPUMASK.emphasize_blue)
-                        b *= 0.816328;
-                }
-            }
+    if (ppu->skip_render)
+        return;
 
-            ppu->screen[4 * ((uint16_t)image_pix_y * 256 + image_pix_x) + 0] = r;
-            ppu->screen[4 * ((uint16_t)image_pix_y * 256 + image_pix_x) + 1] = g;
-            ppu->screen[4 * ((uint16_t)image_pix_y * 256 + image_pix_x) + 2] = b;
+    PPU_FRAME* frame = &ppu->frames[ppu->frame_buffers.back];
+    uint16_t pixel = (uint16_t)image_pix_y * 256 + image_pix_x;
+    uint8_t emphasis = *(uint8_t*)&ppu->PPUMASK >> 5;
+    uint8_t* line_emphasis = &frame->emphasis[image_pix_y];
 
-            ppu->screen[4 * ((uint16_t)image_pix_y * 256 + image_pix_x) + 3] = 0xff;
+    frame->pixels[pixel] = color_code & (ppu->PPUMASK.grayscale ? 0x30 : 0x3f);
+    if (image_pix_x == 0)
+    {
+        *line_emphasis = emphasis;
+        if (image_pix_y == 0)
+            frame->emphasis_row_count = 0;
+    }
+    else if (*line_emphasis != emphasis && !(*line_emphasis & PPU_EMPHASIS_MIXED))
+    {
+        // Changed along the line, the pixels already drawn keep the emphasis it started with
+        uint8_t row = PPU_EMPHASIS_OVERFLOW;
+        if (frame->emphasis_row_count < PPU_EMPHASIS_ROWS)
+            row = frame->emphasis_row_count++;
+        else if (frame->overflow_emphasis == NULL)
+            frame->overflow_emphasis = (uint8_t*)malloc(256 * 240);
+        if (row != PPU_EMPHASIS_OVERFLOW || frame->overflow_emphasis != NULL)   // Out of memory, the line keeps its first emphasis
+        {
+            uint8_t start = *line_emphasis;
+            *line_emphasis = PPU_EMPHASIS_MIXED | row;
+            memset(ppu_emphasis_row(frame, image_pix_y), start, image_pix_x);
+        }
+    }
+    if (*line_emphasis & PPU_EMPHASIS_MIXED)
+        ppu_emphasis_row(frame, image_pix_y)[image_pix_x] = emphasis;
+}
 
-            if (ppu_rendering_enabled(ppu))
+void ppu_cycle(PPU* ppu)
+{
+    ppu->cycle++;
+    if (ppu->cycle > 340)
+    {
+        ppu->cycle = 0;
+        ppu->scanline++;
+        if (ppu->scanline > ppu_prerender_scanline(ppu))
+        {
+            ppu->scanline = 0;
+            if (!ppu->skip_render)
             {
-                ppu->horizontal_increment = true;
-
-                if (ppu->cycle == 256)
-                    ppu->vertical_increment = true;
+                // Publish the frame with the palette it was drawn with and draw the next one in the buffer given back
+                memcpy(ppu->frames[ppu->frame_buffers.back].palette, ppu->palette_lut, sizeof(ppu->palette_lut));
+                ppu->frame_buffers.back = __atomic_exchange_n(&ppu->frame_buffers.ready, ppu->frame_buffers.back | PPU_FRAME_NEW, __ATOMIC_ACQ_REL) & ~PPU_FRAME_NEW;
+                ppu->frame_finished = true;
             }
+            ppu->frame_count++;
+            ppu->skip_render = ppu->nes->render_interval == 0 || ppu->frame_count % ppu->nes->render_interval != 0;
+        }
+    }
+
+    if (ppu_is_rendering(ppu))
+    {
+        ppu_fetch_background(ppu);
+        if (ppu->scanline < 240 && ppu->cycle == 256)
+            ppu->vertical_increment = true;
+    }
+
+    if (ppu->scanline < 240)
+    {
+        if (ppu->cycle >= 1 && ppu->cycle <= 256)
+        {
+            uint8_t image_pix_x = (uint8_t)(ppu->cycle - 1);
+            uint8_t image_pix_y = (uint8_t)ppu->scanline;
+
+            if (!ppu->skip_render || ppu_pixel_observable(ppu, image_pix_x))
+                ppu_render_pixel(ppu, image_pix_x, image_pix_y);
         }
     }
 
     if (ppu->horizontal_increment)
     {
-        ppu->fine_x++;
-        if (ppu->fine_x > 0b111)
+        if (ppu->v.coarse_x == 0b11111)
         {
-            ppu->fine_x = 0;
-            if (ppu->v.coarse_x == 0b11111)
-            {
-                ppu->v.coarse_x = 0;
-                ppu->v.nametable_select ^= 0b01;    // Switch horizontal nametable
-            }
-            else
-                ppu->v.coarse_x++;
+            ppu->v.coarse_x = 0;
+            ppu->v.nametable_select ^= 0b01;    // Switch horizontal nametable
         }
+        else
+            ppu->v.coarse_x++;
     }
 
     if (ppu->vertical_increment)
@@ -468,6 +732,7 @@ void ppu_cycle(PPU* ppu)
                 memcpy(&ppu->sprites_to_render[0], &ppu->secondary_oam_memory, 32);
                 ppu->num_sprites_to_render = (ppu->secondary_oam_addr >> 2);
                 ppu->sprite_0_rendered = ppu->sprite_0_prepared;
+                ppu_build_sprite_line(ppu);
             }
 
             if (ppu->cycle >= 65 && ppu->cycle <= 256)
@@ -574,7 +839,6 @@ void ppu_cycle(PPU* ppu)
         {
             if (ppu->cycle == 257)
             {
-                ppu->fine_x = ppu->x;
                 ppu->v.coarse_x = ppu->t.coarse_x;
                 ppu->v.nametable_select = (ppu->t.nametable_select & 0b01) | (ppu->v.nametable_select & 0b10);
             }
@@ -79,6 +79,51 @@ struct PPU_CONTROL
     uint8_t nmi_enable : 1;
 } __attribute__((packed));
 
+// Lock-free handoff of finished frames between the emulation thread and the renderer
+// Each side owns one buffer, the third one is the latest finished frame and is swapped atomically
+typedef struct PPU_FRAME_BUFFERS
+{
+    uint8_t back;       // Being drawn by the ppu
+    uint8_t ready;      // Latest finished frame, | PPU_FRAME_NEW until the consumer picks it up
+    uint8_t front;      // Being displayed by the consumer
+} PPU_FRAME_BUFFERS;
+
+#define PPU_FRAME_NEW   0x80
+
+#define PPU_EMPHASIS_MIXED      0x80    // | index in emphasis_rows, or PPU_EMPHASIS_OVERFLOW
+#define PPU_EMPHASIS_ROWS       16      // Mixed lines a frame keeps in its pool
+#define PPU_EMPHASIS_OVERFLOW   0x7f    // Mixed line past the pool, in its row of overflow_emphasis
+
+#define PPU_SPRITE_BEHIND   0x10    // Sprite pixel behind the background
+#define PPU_SPRITE_0        0x20    // Opaque pixel of sprite 0, whatever is in front of it
+
+// Frame as the ppu draws it, ppu_convert_frame turns it into the pixel format a consumer wants
+// Emphasis (PPUMASK >> 5) is kept per line, a line where it changes while drawn keeps it per pixel in a row of the pool,
+// or of a whole plane allocated the first time a frame has more of them
+typedef struct PPU_FRAME
+{
+    uint8_t pixels[256 * 240];          // Color index, grayscale applied
+    uint8_t emphasis[240];              // Of each line, PPU_EMPHASIS_MIXED | row for the ones in emphasis_rows
+    uint8_t emphasis_rows[PPU_EMPHASIS_ROWS][256];  // Per pixel emphasis of the mixed lines
+    uint8_t emphasis_row_count;         // Rows used by the frame
+    uint8_t* overflow_emphasis;         // 256 * 240, NULL until needed
+    uint32_t palette[8][64];            // palette_lut it was drawn with, copied when published so the consumer never reads the ppu's
+} PPU_FRAME;
+
+typedef enum PPU_PIXEL_FORMAT
+{
+    PF_RGBA8888 = 0,    // Bytes r, g, b, a
+    PF_XRGB8888 = 1,    // uint32_t 0xffRRGGBB
+    PF_RGB565 = 2,      // uint16_t
+    PF_GRAYSCALE = 3    // Luma byte
+} PPU_PIXEL_FORMAT;
+
+// Pattern tile decoded to 2 bit color indices, one byte per pixel, as drawn and mirrored horizontally
+typedef struct PPU_TILE
+{
+    uint8_t rows[2][8][8];  // [flip_x][y][x]
+} PPU_TILE;
+
 typedef struct PPU_MASK
 {
     uint8_t grayscale : 1;
@@ -109,9 +154,15 @@ typedef struct RP_2C02_PPU
     bool w;
     struct PPU_SCROLL_ADDRESS t;
     struct PPU_SCROLL_ADDRESS v;
-    uint8_t x, fine_x;
+    uint8_t x;
     bool odd_frame;
 
+    // Background fetch pipeline : the tile being drawn and the next one as palette << 2 | color, x picks the pixel out of both
+    // The fetches for the tile after them wait in the latches until it is loaded
+    uint8_t bg_tiles[2][8];
+    uint8_t bg_next_tile, bg_next_palette;
+    uint8_t bg_next_row[8];
+
     uint8_t last_read;
 
     uint8_t VRAM[0x1000];
@@ -128,6 +179,7 @@ typedef struct RP_2C02_PPU
     uint8_t overflow_copy_counter;
 
     uint8_t ntsc_palette[192];
+    uint32_t palette_lut[8][64];    // RGBA bytes of each color under each emphasis (PPUMASK >> 5), built from ntsc_palette
 
     uint16_t scanline;
     uint16_t cycle;
@@ -135,16 +187,25 @@ typedef struct RP_2C02_PPU
     struct OAM_SPRITE_ENTRY sprites_to_render[8];
     uint8_t num_sprites_to_render;
     uint8_t sprite_0_rendered;
+    uint8_t sprite_line[256];   // Sprite pixel in front at each x : palette << 2 | color, PPU_SPRITE_BEHIND, PPU_SPRITE_0 ; 0 when transparent
 
-    uint8_t screen[256 * 240 * 4];
-    uint8_t screen_buffer[256 * 240 * 4];
+    PPU_FRAME frames[3];
+    PPU_FRAME_BUFFERS frame_buffers;
 
-    bool frame_finished;
+    bool frame_finished;    // Only set for drawn frames
+    bool skip_render;       // Current frame isn't drawn, set from render_interval at the start of each frame and can be overridden before running it
+    uint64_t frame_count;   // Frames completed since power up
     bool can_nmi;
     bool horizontal_increment, vertical_increment;
 
     bool rendering_enabled, last_frame_rendering_enabled;
 
+    // Cache of the tiles of the CHR data, indexed by their offset in it so bank switches keep it valid
+    // Built the first time a tile is drawn, a write to the CHR RAM invalidates the tile it lands in
+    PPU_TILE* tiles;
+    uint64_t* tiles_valid;
+    uint32_t tile_count;
+
     NES* nes;
 } PPU;
 
@@ -159,9 +220,20 @@ void ppu_power_up(PPU* ppu);
 uint8_t ppu_read_byte(PPU* ppu, uint16_t address);
 void ppu_write_byte(PPU* ppu, uint16_t address, uint8_t byte);
 void ppu_load_palette(PPU* ppu, char* path_to_palette);
+void ppu_build_palette_lut(PPU* ppu);
 uint8_t ppu_read_palette(PPU* ppu, PALETTE_BG_SPRITE background_sprite, uint8_t palette_number, uint8_t index);
 uint8_t ppu_read_pattern_table_plane_0(PPU* ppu, PATTERN_TABLE_SIDE side, uint8_t tile, uint8_t off_y);
 uint8_t ppu_read_pattern_table_plane_1(PPU* ppu, PATTERN_TABLE_SIDE side, uint8_t tile, uint8_t off_y);
 uint8_t ppu_read_pattern_table(PPU* ppu, PATTERN_TABLE_SIDE side, uint8_t tile, uint8_t off_x, uint8_t off_y);
+const uint8_t* ppu_read_tile_row(PPU* ppu, PATTERN_TABLE_SIDE side, uint8_t tile, uint8_t off_y, bool flip_x);
+bool ppu_init_tiles(PPU* ppu, uint32_t chr_size);
+void ppu_flush_tiles(PPU* ppu);
+void ppu_destroy_tiles(PPU* ppu);
+void ppu_destroy_frames(PPU* ppu);
 uint8_t ppu_read_nametable(PPU* ppu, uint8_t nametable, uint16_t bg_tile);
+uint32_t ppu_dots_until_frame_end(PPU* ppu);
+uint32_t ppu_dots_until_status_change(PPU* ppu);
+const PPU_FRAME* ppu_latest_frame(PPU* ppu);
+void ppu_convert_frame(const PPU_FRAME* frame, PPU_PIXEL_FORMAT format, void* pixels);
+void ppu_build_sprite_line(PPU* ppu);
 void ppu_cycle(PPU* ppu);
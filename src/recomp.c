@@ -0,0 +1,787 @@
+// Ahead of time recompiler : finds the rom code reachable from the vectors and from code/data logs of earlier runs, and
+// writes its blocks as C functions for the jit entries (recomp.h)
+// The output builds as a shared library named after the hash of the rom, nes_load_game picks it up from
+// nes->recomp_directory ; the blocks follow the same rules as the jit so anything they leave runs on the cpu engine
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "nes.h"
+#include "movie.h"
+#include "recomp.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RECOMP_DEFAULT_FRAMES   600
+
+// What the disassembly found at each PRG ROM byte
+#define RECOMP_INSTRUCTION  0x01    // An instruction starts here
+#define RECOMP_COVERED      0x02    // Byte of an instruction
+#define RECOMP_LEADER       0x04    // A block starts here
+
+#define RECOMP_NAME_ENTRY(opcode, instruction, mode)    #instruction,
+#define RECOMP_UNKNOWN_NAME_ENTRY(opcode)               "???",
+
+static const char* recomp_names[256] = { CPU_OPCODES(RECOMP_NAME_ENTRY, RECOMP_UNKNOWN_NAME_ENTRY) };
+
+static const char* recomp_mode_names[13] =
+{
+    "AM_A", "AM_ABS", "AM_ABS_X", "AM_ABS_Y", "AM_IMM", "AM_IMPL", "AM_IND", "AM_X_IND", "AM_IND_Y", "AM_REL", "AM_ZPG", "AM_ZPG_X", "AM_ZPG_Y"
+};
+
+typedef struct RECOMP
+{
+    NES* nes;
+    CPU_PAGE pages[CPU_PAGE_COUNT];     // Mapping at power up, for the vectors
+    uint8_t* flags;         // RECOMP_* of each PRG ROM byte
+    uint16_t* addresses;    // Cpu address of each instruction found
+    int32_t* logged;        // PRG ROM offset the code log saw at each address of $8000-$FFFF, -1 none, -2 several
+    uint32_t* work;         // Instructions left to follow
+    uint32_t work_count;
+    uint32_t instructions, leaders;
+} RECOMP;
+
+// Text of a block, written once its locals are known
+typedef struct RECOMP_TEXT
+{
+    char* data;
+    size_t size, capacity;
+} RECOMP_TEXT;
+
+typedef enum RECOMP_LOCATION
+{
+    RECOMP_LOCATION_RAM,        // Internal ram at a known address
+    RECOMP_LOCATION_ZERO_PAGE,  // Zero page address in address
+    RECOMP_LOCATION_PAGED       // Memory behind page
+} RECOMP_LOCATION;
+
+typedef struct RECOMP_BLOCK_WRITER
+{
+    RECOMP_TEXT text;
+    const CPU_JIT_INSTRUCTION* instructions;
+    uint32_t count;
+    bool loops;
+    bool exits[CPU_JIT_MAX_INSTRUCTIONS];
+    bool uses_value, uses_address, uses_crossed, uses_carry, uses_result, uses_page;
+} RECOMP_BLOCK_WRITER;
+
+void recomp_print(RECOMP_TEXT* text, const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int size = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+
+    if (text->size + size + 1 > text->capacity)
+    {
+        text->capacity = (text->size + size + 1) * 2;
+        text->data = (char*)realloc(text->data, text->capacity);
+    }
+
+    va_start(args, format);
+    vsnprintf(&text->data[text->size], size + 1, format, args);
+    va_end(args);
+    text->size += size;
+}
+
+// PRG ROM offset of a jump target, from the offset and address of the instruction jumping ; -1 if unknown
+int64_t recomp_locate(RECOMP* r, uint32_t from_offset, uint16_t from_address, uint16_t target)
+{
+    if (target < 0x8000)
+        return -1;
+
+    // Every mapper switches at least 8KB at a time
+    if ((target & 0xe000) == (from_address & 0xe000))
+    {
+        int64_t offset = (int64_t)from_offset + target - from_address;
+        return offset >= 0 && offset < r->nes->PRG_ROM_size ? offset : -1;
+    }
+
+    if (r->logged[target - 0x8000] >= 0)
+        return r->logged[target - 0x8000];
+
+    CPU_DECODED* decoded = r->pages[target >> CPU_PAGE_SHIFT].decoded;
+    return decoded != NULL ? (decoded - r->nes->cpu.decoded) + (target & (CPU_PAGE_SIZE - 1)) : -1;
+}
+
+void recomp_visit(RECOMP* r, int64_t offset, uint16_t address, bool leader)
+{
+    // The page table maps 1KB at a time, a block only runs from where the rom has the same place in its page
+    if (offset < 0 || (offset & (CPU_PAGE_SIZE - 1)) != (address & (CPU_PAGE_SIZE - 1)))
+        return;
+
+    uint8_t* flags = &r->flags[offset];
+    if (*flags & RECOMP_INSTRUCTION)
+    {
+        if (leader && r->addresses[offset] == address)
+            *flags |= RECOMP_LEADER;
+        return;
+    }
+
+    *flags |= RECOMP_INSTRUCTION | (leader ? RECOMP_LEADER : 0);
+    r->addresses[offset] = address;
+    r->work[r->work_count++] = (uint32_t)offset;
+    r->instructions++;
+}
+
+void recomp_visit_target(RECOMP* r, uint32_t from_offset, uint16_t from_address, uint16_t target)
+{
+    recomp_visit(r, recomp_locate(r, from_offset, from_address, target), target, true);
+}
+
+// Follows every instruction reachable from the ones queued
+void recomp_follow(RECOMP* r)
+{
+    NES* nes = r->nes;
+
+    while (r->work_count > 0)
+    {
+        uint32_t offset = r->work[--r->work_count];
+        uint16_t address = r->addresses[offset];
+        uint8_t opcode = nes->PRG_ROM_data[offset];
+        CPU_ADDRESSING_MODE mode = cpu_instructions[opcode].addressing_mode;
+        uint8_t length = instruction_length[mode];
+
+        if (offset + length > nes->PRG_ROM_size)
+            continue;
+        for (uint8_t i = 0; i < length; i++)
+            r->flags[offset + i] |= RECOMP_COVERED;
+
+        uint16_t operand = length > 1 ? nes->PRG_ROM_data[offset + 1] | (length > 2 ? nes->PRG_ROM_data[offset + 2] << 8 : 0) : 0;
+        uint16_t next = address + length;
+        uint8_t op = cpu_jit_ops[opcode];
+
+        switch (op)
+        {
+        case JIT_OP_NONE:
+        case JIT_OP_BRK:
+        case JIT_OP_RTI:
+        case JIT_OP_RTS:
+            break;
+
+        case JIT_OP_JMP:    // Indirect jumps are left to the code logs
+            if (mode == AM_ABS)
+                recomp_visit_target(r, offset, address, operand);
+            break;
+
+        case JIT_OP_JSR:
+            recomp_visit_target(r, offset, address, operand);
+            recomp_visit(r, offset + length, next, true);
+            break;
+
+        case JIT_OP_BPL: case JIT_OP_BMI: case JIT_OP_BVC: case JIT_OP_BVS:
+        case JIT_OP_BCC: case JIT_OP_BCS: case JIT_OP_BNE: case JIT_OP_BEQ:
+            recomp_visit_target(r, offset, address, next + (int8_t)operand);
+            recomp_visit(r, offset + length, next, true);
+            break;
+
+        default:
+        {
+            // Blocks stop before an instruction they can't run and at the end of a page, the next one starts another
+            CPU_JIT_INSTRUCTION block[CPU_JIT_MAX_INSTRUCTIONS];
+            uint32_t count;
+            cpu_jit_decode(&nes->PRG_ROM_data[offset & ~(CPU_PAGE_SIZE - 1)], address, block, &count);
+
+            bool leader = count == 0 || (next & (CPU_PAGE_SIZE - 1)) < (address & (CPU_PAGE_SIZE - 1));
+            // An indexed access that reaches a register leaves the block as well
+            if ((mode == AM_ABS_X || mode == AM_ABS_Y) && operand >= 0x2000 && operand < 0x6000)
+                leader = true;
+            recomp_visit(r, offset + length, next, leader);
+        }
+        }
+    }
+}
+
+// A block that stops on its instruction limit continues in another one
+void recomp_chain_blocks(RECOMP* r)
+{
+    NES* nes = r->nes;
+    bool added = true;
+
+    while (added)
+    {
+        added = false;
+        for (uint32_t offset = 0; offset < nes->PRG_ROM_size; offset++)
+        {
+            if (!(r->flags[offset] & RECOMP_LEADER))
+                continue;
+
+            CPU_JIT_INSTRUCTION block[CPU_JIT_MAX_INSTRUCTIONS];
+            uint32_t count;
+            cpu_jit_decode(&nes->PRG_ROM_data[offset & ~(CPU_PAGE_SIZE - 1)], r->addresses[offset], block, &count);
+            if (count < CPU_JIT_MAX_INSTRUCTIONS)
+                continue;
+
+            const CPU_JIT_INSTRUCTION* last = &block[count - 1];
+            uint32_t next = offset + (uint16_t)(last->address - r->addresses[offset]) + instruction_length[last->mode];
+            if (next < nes->PRG_ROM_size && (r->flags[next] & (RECOMP_INSTRUCTION | RECOMP_LEADER)) == RECOMP_INSTRUCTION)
+            {
+                r->flags[next] |= RECOMP_LEADER;
+                added = true;
+            }
+        }
+    }
+}
+
+// What the cpu shows after instruction i : its operand, mode and the instructions run since the top of the block
+void recomp_write_last_instruction(RECOMP_BLOCK_WRITER* w, uint32_t i, const char* indent)
+{
+    const CPU_JIT_INSTRUCTION* instruction = &w->instructions[i];
+
+    recomp_print(&w->text, "%scpu->addressing_mode = %s;\n", indent, recomp_mode_names[instruction->mode]);
+    if (cpu_jit_static_operand(instruction->mode))
+        recomp_print(&w->text, "%scpu->operand_address = 0x%04X;\n", indent, instruction->operand_address);
+    recomp_print(&w->text, "%scpu->instructions += %u;\n", indent, i + 1);
+}
+
+// Leaves after instruction i, with PC already stored when pc is negative
+void recomp_write_leave(RECOMP_BLOCK_WRITER* w, uint32_t i, int32_t pc, const char* indent)
+{
+    if (pc >= 0)
+        recomp_print(&w->text, "%scpu->PC = 0x%04X;\n", indent, pc);
+    recomp_write_last_instruction(w, i, indent);
+    recomp_print(&w->text, "%sgoto leave;\n", indent);
+}
+
+// Back to the top of the block after instruction i, if another pass fits the budget
+void recomp_write_loop(RECOMP_BLOCK_WRITER* w, uint32_t i, const char* indent)
+{
+    w->loops = true;
+    recomp_write_last_instruction(w, i, indent);
+    recomp_print(&w->text, "%sif (cycles <= limit)\n%s    goto top;\n", indent, indent);
+    recomp_print(&w->text, "%scpu->PC = 0x%04X;\n%sgoto leave;\n", indent, w->instructions[0].address, indent);
+}
+
+// Finds where the operand is, leaving the block before the instruction if it isn't ram, rom or PRG RAM
+RECOMP_LOCATION recomp_write_address(RECOMP_BLOCK_WRITER* w, uint32_t i, CPU_JIT_ACCESS access)
+{
+    const CPU_JIT_INSTRUCTION* instruction = &w->instructions[i];
+    const char* field = access == JIT_ACCESS_READ ? "read" : "write";
+    const char* index = (instruction->mode == AM_ZPG_Y || instruction->mode == AM_ABS_Y) ? "y" : "x";
+    uint16_t operand = instruction->operand;
+
+    switch (instruction->mode)
+    {
+    case AM_ZPG:
+        return RECOMP_LOCATION_RAM;
+
+    case AM_ABS:
+        if (operand < 0x2000)
+            return RECOMP_LOCATION_RAM;
+        w->uses_page = w->exits[i] = true;
+        recomp_print(&w->text, "    page = &cpu->pages[%u];\n", operand >> CPU_PAGE_SHIFT);
+        recomp_print(&w->text, "    if (page->%s == NULL)\n        goto exit_%u;\n", field, i);
+        return RECOMP_LOCATION_PAGED;
+
+    case AM_ZPG_X:
+    case AM_ZPG_Y:
+        w->uses_address = true;
+        recomp_print(&w->text, "    address = (uint8_t)(%s + 0x%02X);\n", index, operand & 0xff);
+        recomp_print(&w->text, "    cpu->operand_address = address;\n");
+        return RECOMP_LOCATION_ZERO_PAGE;
+
+    case AM_ABS_X:
+    case AM_ABS_Y:
+        w->uses_crossed = true;
+        recomp_print(&w->text, "    address = 0x%04X + %s;\n", operand, index);
+        recomp_print(&w->text, "    crossed = (0x%02X + %s) >> 8;\n", operand & 0xff, index);
+        break;
+
+    case AM_IND_Y:
+        w->uses_crossed = w->uses_value = true;
+        recomp_print(&w->text, "    value = cpu->memory_low[0x%02X];\n", operand & 0xff);
+        recomp_print(&w->text, "    address = (value | cpu->memory_low[0x%02X] << 8) + y;\n", (operand + 1) & 0xff);
+        recomp_print(&w->text, "    crossed = (value + y) >> 8;\n");
+        break;
+
+    case AM_X_IND:
+        w->uses_value = true;
+        recomp_print(&w->text, "    value = x + 0x%02X;\n", operand & 0xff);
+        recomp_print(&w->text, "    address = cpu->memory_low[value] | cpu->memory_low[(uint8_t)(value + 1)] << 8;\n");
+        break;
+
+    default:
+        return RECOMP_LOCATION_RAM;
+    }
+
+    w->uses_address = w->uses_page = w->exits[i] = true;
+    recomp_print(&w->text, "    page = &cpu->pages[address >> CPU_PAGE_SHIFT];\n");
+    recomp_print(&w->text, "    if (page->%s == NULL)\n        goto exit_%u;\n", field, i);
+    recomp_print(&w->text, "    cpu->operand_address = address;\n");
+    if (instruction->mode != AM_X_IND)
+    {
+        recomp_print(&w->text, "    cpu->page_boundary_crossed = crossed;\n");
+        if (cpu_page_cycles[instruction->opcode])
+            recomp_print(&w->text, "    cycles += crossed;\n");
+    }
+    return RECOMP_LOCATION_PAGED;
+}
+
+// Where the operand is, as a C expression
+void recomp_location(char* buffer, size_t size, const CPU_JIT_INSTRUCTION* instruction, RECOMP_LOCATION location, CPU_JIT_ACCESS access)
+{
+    switch (location)
+    {
+    case RECOMP_LOCATION_RAM:
+        snprintf(buffer, size, "cpu->memory_low[0x%03X]", instruction->operand & 0x7ff);
+        break;
+    case RECOMP_LOCATION_ZERO_PAGE:
+        snprintf(buffer, size, "cpu->memory_low[address]");
+        break;
+    case RECOMP_LOCATION_PAGED:
+        if (instruction->mode == AM_ABS)
+            snprintf(buffer, size, "page->%s[0x%03X]", access == JIT_ACCESS_READ ? "read" : "write", instruction->operand & (CPU_PAGE_SIZE - 1));
+        else
+            snprintf(buffer, size, "page->%s[address & (CPU_PAGE_SIZE - 1)]", access == JIT_ACCESS_READ ? "read" : "write");
+        break;
+    }
+}
+
+void recomp_write_store(RECOMP_BLOCK_WRITER* w, const CPU_JIT_INSTRUCTION* instruction, RECOMP_LOCATION location, const char* value)
+{
+    switch (location)
+    {
+    case RECOMP_LOCATION_RAM:
+        recomp_print(&w->text, "    recomp_store_ram(cpu, 0x%03X, %s);\n", instruction->operand & 0x7ff, value);
+        break;
+    case RECOMP_LOCATION_ZERO_PAGE:
+        recomp_print(&w->text, "    recomp_store_ram(cpu, address, %s);\n", value);
+        break;
+    case RECOMP_LOCATION_PAGED:
+        if (instruction->mode == AM_ABS)
+            recomp_print(&w->text, "    recomp_store_page(cpu, page, 0x%03X, %s);\n", instruction->operand & (CPU_PAGE_SIZE - 1), value);
+        else
+            recomp_print(&w->text, "    recomp_store_page(cpu, page, address & (CPU_PAGE_SIZE - 1), %s);\n", value);
+        break;
+    }
+}
+
+// Where the blocks keep each flag a branch tests, by CPU_FLAG_*
+static const char* recomp_flag_tests[256] =
+{
+    [CPU_FLAG_C] = "c",
+    [CPU_FLAG_Z] = "recomp_z(nz)",
+    [CPU_FLAG_V] = "cpu->V",
+    [CPU_FLAG_N] = "recomp_n(nz)"
+};
+
+void recomp_write_branch(RECOMP_BLOCK_WRITER* w, uint32_t i, uint8_t flag, bool taken_if_set)
+{
+    const CPU_JIT_INSTRUCTION* instruction = &w->instructions[i];
+    uint16_t target = instruction->operand_address + 2;
+
+    recomp_print(&w->text, "    cycles += 2;\n");
+    recomp_print(&w->text, "    if (%s%s)\n    {\n", taken_if_set ? "" : "!", recomp_flag_tests[flag]);
+    recomp_print(&w->text, "        cycles += %u;\n", 1 + (((instruction->address + 2) & 0xff00) != (target & 0xff00)));
+    if (target == w->instructions[0].address)
+        recomp_write_loop(w, i, "        ");
+    else
+        recomp_write_leave(w, i, target, "        ");
+    recomp_print(&w->text, "    }\n");
+}
+
+void recomp_write_instruction(RECOMP_BLOCK_WRITER* w, uint32_t i)
+{
+    const CPU_JIT_INSTRUCTION* instruction = &w->instructions[i];
+    CPU_JIT_ACCESS access = cpu_jit_access(instruction);
+    RECOMP_LOCATION location = RECOMP_LOCATION_RAM;
+    char operand[64];
+
+    recomp_print(&w->text, "    // $%04X %s\n", instruction->address, recomp_names[instruction->opcode]);
+
+    if (access != JIT_ACCESS_NONE)
+        location = recomp_write_address(w, i, access);
+
+    // Nothing leaves the block from here on
+    if (instruction->mode != AM_REL && cpu_base_cycles[instruction->opcode] > 0)
+        recomp_print(&w->text, "    cycles += %u;\n", cpu_base_cycles[instruction->opcode]);
+
+    if (access == JIT_ACCESS_READ || access == JIT_ACCESS_RMW)
+        recomp_location(operand, sizeof(operand), instruction, location, access);
+    else if (instruction->mode == AM_IMM)
+        snprintf(operand, sizeof(operand), "0x%02X", instruction->operand & 0xff);
+    else if (instruction->mode == AM_A)
+        snprintf(operand, sizeof(operand), "a");
+
+    switch (instruction->op)
+    {
+    case JIT_OP_LDA:    recomp_print(&w->text, "    a = %s;\n    nz = a;\n", operand); break;
+    case JIT_OP_LDX:    recomp_print(&w->text, "    x = %s;\n    nz = x;\n", operand); break;
+    case JIT_OP_LDY:    recomp_print(&w->text, "    y = %s;\n    nz = y;\n", operand); break;
+    case JIT_OP_STA:    recomp_write_store(w, instruction, location, "a"); break;
+    case JIT_OP_STX:    recomp_write_store(w, instruction, location, "x"); break;
+    case JIT_OP_STY:    recomp_write_store(w, instruction, location, "y"); break;
+
+    case JIT_OP_ORA:    recomp_print(&w->text, "    a |= %s;\n    nz = a;\n", operand); break;
+    case JIT_OP_AND:    recomp_print(&w->text, "    a &= %s;\n    nz = a;\n", operand); break;
+    case JIT_OP_EOR:    recomp_print(&w->text, "    a ^= %s;\n    nz = a;\n", operand); break;
+
+    case JIT_OP_ADC:
+    case JIT_OP_SBC:    // Subtracting is adding the complement
+        w->uses_value = w->uses_result = true;
+        recomp_print(&w->text, "    value = %s%s;\n", instruction->op == JIT_OP_SBC ? "(uint8_t)~" : "", operand);
+        recomp_print(&w->text, "    result = a + value + c;\n");
+        recomp_print(&w->text, "    cpu->V = (~(a ^ value) & (a ^ result) & 0x80) >> 7;\n");
+        recomp_print(&w->text, "    c = result >> 8;\n    a = result;\n    nz = a;\n");
+        break;
+
+    case JIT_OP_CMP:
+    case JIT_OP_CPX:
+    case JIT_OP_CPY:
+    {
+        const char* reg = instruction->op == JIT_OP_CMP ? "a" : instruction->op == JIT_OP_CPX ? "x" : "y";
+        w->uses_value = true;
+        recomp_print(&w->text, "    value = %s;\n", operand);
+        recomp_print(&w->text, "    c = %s >= value;\n    nz = (uint8_t)(%s - value);\n", reg, reg);
+        break;
+    }
+
+    case JIT_OP_BIT:
+        w->uses_value = true;
+        recomp_print(&w->text, "    value = %s;\n", operand);
+        recomp_print(&w->text, "    nz = (a & value) | (value & 0x80) << 8;\n    cpu->V = (value >> 6) & 1;\n");
+        break;
+
+    case JIT_OP_ASL:
+    case JIT_OP_LSR:
+    case JIT_OP_ROL:
+    case JIT_OP_ROR:
+        w->uses_value = w->uses_carry = true;
+        recomp_print(&w->text, "    value = %s;\n", operand);
+        if (instruction->op == JIT_OP_ASL)
+            recomp_print(&w->text, "    carry = value >> 7;\n    value <<= 1;\n");
+        else if (instruction->op == JIT_OP_LSR)
+            recomp_print(&w->text, "    carry = value & 0x01;\n    value >>= 1;\n");
+        else if (instruction->op == JIT_OP_ROL)
+            recomp_print(&w->text, "    carry = value >> 7;\n    value = value << 1 | c;\n");
+        else
+            recomp_print(&w->text, "    carry = value & 0x01;\n    value = value >> 1 | c << 7;\n");
+        recomp_print(&w->text, "    c = carry;\n    nz = value;\n");
+        if (instruction->mode == AM_A)
+            recomp_print(&w->text, "    a = value;\n");
+        else
+            recomp_write_store(w, instruction, location, "value");
+        break;
+
+    case JIT_OP_INC:
+    case JIT_OP_DEC:
+        w->uses_value = true;
+        recomp_print(&w->text, "    value = %s %c 1;\n", operand, instruction->op == JIT_OP_INC ? '+' : '-');
+        recomp_write_store(w, instruction, location, "value");
+        recomp_print(&w->text, "    nz = value;\n");
+        break;
+
+    case JIT_OP_INX:    recomp_print(&w->text, "    x++;\n    nz = x;\n"); break;
+    case JIT_OP_INY:    recomp_print(&w->text, "    y++;\n    nz = y;\n"); break;
+    case JIT_OP_DEX:    recomp_print(&w->text, "    x--;\n    nz = x;\n"); break;
+    case JIT_OP_DEY:    recomp_print(&w->text, "    y--;\n    nz = y;\n"); break;
+
+    case JIT_OP_TAX:    recomp_print(&w->text, "    x = a;\n    nz = x;\n"); break;
+    case JIT_OP_TAY:    recomp_print(&w->text, "    y = a;\n    nz = y;\n"); break;
+    case JIT_OP_TXA:    recomp_print(&w->text, "    a = x;\n    nz = a;\n"); break;
+    case JIT_OP_TYA:    recomp_print(&w->text, "    a = y;\n    nz = a;\n"); break;
+    case JIT_OP_TXS:    recomp_print(&w->text, "    cpu->S = x;\n"); break;
+    case JIT_OP_TSX:    recomp_print(&w->text, "    x = cpu->S;\n    nz = x;\n"); break;
+
+    case JIT_OP_CLC:    recomp_print(&w->text, "    c = 0;\n"); break;
+    case JIT_OP_SEC:    recomp_print(&w->text, "    c = 1;\n"); break;
+    case JIT_OP_CLI:    recomp_print(&w->text, "    cpu->I = 0;\n"); break;
+    case JIT_OP_SEI:    recomp_print(&w->text, "    cpu->I = 1;\n"); break;
+    case JIT_OP_CLD:    recomp_print(&w->text, "    cpu->D = 0;\n"); break;
+    case JIT_OP_SED:    recomp_print(&w->text, "    cpu->D = 1;\n"); break;
+    case JIT_OP_CLV:    recomp_print(&w->text, "    cpu->V = 0;\n"); break;
+
+    case JIT_OP_PHA:    recomp_print(&w->text, "    recomp_push(cpu, a);\n"); break;
+    case JIT_OP_PHP:    recomp_print(&w->text, "    recomp_push(cpu, recomp_flags(cpu, c, nz) | CPU_FLAG_B);\n"); break;
+    case JIT_OP_PLA:    recomp_print(&w->text, "    a = recomp_pop(cpu);\n    nz = a;\n"); break;
+    case JIT_OP_PLP:
+        w->uses_value = true;
+        recomp_print(&w->text, "    value = recomp_pop(cpu);\n    recomp_set_flags(cpu, c, nz, value);\n");
+        break;
+
+    case JIT_OP_NOP:    break;
+
+    case JIT_OP_BPL:    recomp_write_branch(w, i, CPU_FLAG_N, false); break;
+    case JIT_OP_BMI:    recomp_write_branch(w, i, CPU_FLAG_N, true); break;
+    case JIT_OP_BVC:    recomp_write_branch(w, i, CPU_FLAG_V, false); break;
+    case JIT_OP_BVS:    recomp_write_branch(w, i, CPU_FLAG_V, true); break;
+    case JIT_OP_BCC:    recomp_write_branch(w, i, CPU_FLAG_C, false); break;
+    case JIT_OP_BCS:    recomp_write_branch(w, i, CPU_FLAG_C, true); break;
+    case JIT_OP_BNE:    recomp_write_branch(w, i, CPU_FLAG_Z, false); break;
+    case JIT_OP_BEQ:    recomp_write_branch(w, i, CPU_FLAG_Z, true); break;
+
+    case JIT_OP_JMP:
+        if (instruction->operand == w->instructions[0].address)
+            recomp_write_loop(w, i, "    ");
+        else
+            recomp_write_leave(w, i, instruction->operand, "    ");
+        break;
+
+    case JIT_OP_JSR:    // Pushes the address of its last byte
+        recomp_print(&w->text, "    recomp_push(cpu, 0x%02X);\n", ((instruction->address + 2) >> 8) & 0xff);
+        recomp_print(&w->text, "    recomp_push(cpu, 0x%02X);\n", (instruction->address + 2) & 0xff);
+        recomp_write_leave(w, i, instruction->operand, "    ");
+        break;
+
+    case JIT_OP_RTS:
+        w->uses_value = true;
+        recomp_print(&w->text, "    value = recomp_pop(cpu);\n");
+        recomp_print(&w->text, "    cpu->PC = (value | recomp_pop(cpu) << 8) + 1;\n");
+        recomp_write_leave(w, i, -1, "    ");
+        break;
+    }
+}
+
+// One C function per block, named after its offset in the PRG ROM
+bool recomp_write_block(FILE* out, RECOMP* r, uint32_t offset, uint16_t* max_cycles)
+{
+    CPU_JIT_INSTRUCTION instructions[CPU_JIT_MAX_INSTRUCTIONS];
+    RECOMP_BLOCK_WRITER writer;
+    RECOMP_BLOCK_WRITER* w = &writer;
+
+    memset(w, 0, sizeof(RECOMP_BLOCK_WRITER));
+    *max_cycles = cpu_jit_decode(&r->nes->PRG_ROM_data[offset & ~(CPU_PAGE_SIZE - 1)], r->addresses[offset], instructions, &w->count);
+    if (w->count == 0)
+        return false;
+    w->instructions = instructions;
+
+    for (uint32_t i = 0; i < w->count; i++)
+        recomp_write_instruction(w, i);
+
+    const CPU_JIT_INSTRUCTION* last = &instructions[w->count - 1];
+    if (last->op != JIT_OP_JMP && last->op != JIT_OP_JSR && last->op != JIT_OP_RTS)
+        recomp_write_leave(w, w->count - 1, (uint16_t)(last->address + instruction_length[last->mode]), "    ");
+
+    // Exits before an instruction whose operand isn't ram, rom or PRG RAM, so the cpu engine runs it
+    for (uint32_t i = 0; i < w->count; i++)
+    {
+        if (!w->exits[i])
+            continue;
+        recomp_print(&w->text, "\nexit_%u:\n    cpu->PC = 0x%04X;\n", i, instructions[i].address);
+        if (i > 0)
+            recomp_write_last_instruction(w, i - 1, "    ");
+        recomp_print(&w->text, "    goto leave;\n");
+    }
+    recomp_print(&w->text, "\nleave:\n    cpu->A = a;\n    cpu->X = x;\n    cpu->Y = y;\n    cpu->C = c;\n    cpu->nz = nz;\n    return cycles;\n");
+
+    fprintf(out, "// $%04X, PRG ROM $%05X\n", r->addresses[offset], offset);
+    fprintf(out, "static uint32_t block_%05x(CPU* cpu, uint32_t limit)\n{\n", offset);
+    fprintf(out, "    uint8_t a = cpu->A, x = cpu->X, y = cpu->Y, c = cpu->C%s%s%s;\n",
+        w->uses_value ? ", value" : "", w->uses_carry ? ", carry" : "", w->uses_crossed ? ", crossed" : "");
+    fprintf(out, "    uint16_t nz = cpu->nz;\n");
+    fprintf(out, "    uint32_t cycles = 0%s;\n", w->uses_result ? ", result" : "");
+    if (w->uses_address)
+        fprintf(out, "    uint16_t address;\n");
+    if (w->uses_page)
+        fprintf(out, "    CPU_PAGE* page;\n");
+    if (!w->loops)
+        fprintf(out, "    (void)limit;\n");
+    fprintf(out, "%s\n", w->loops ? "\ntop:" : "");
+    fwrite(w->text.data, 1, w->text.size, out);
+    fprintf(out, "}\n\n");
+
+    free(w->text.data);
+    return true;
+}
+
+bool recomp_write(RECOMP* r, const char* path)
+{
+    NES* nes = r->nes;
+    FILE* out = fopen(path, "w");
+    if (out == NULL)
+    {
+        printf("Couldn't write %s\n", path);
+        return false;
+    }
+
+    uint32_t* blocks = (uint32_t*)malloc(r->leaders * sizeof(uint32_t));
+    uint16_t* max_cycles = (uint16_t*)malloc(r->leaders * sizeof(uint16_t));
+    uint32_t block_count = 0;
+
+    fprintf(out, "// Written by simple-nes-recomp, rom %016llx\n", (unsigned long long)nes->rom_hash);
+    fprintf(out, "// Build as a shared library named %016llx%s, with the sources of the emulator in the include path\n\n",
+        (unsigned long long)nes->rom_hash, RECOMP_MODULE_SUFFIX);
+    fprintf(out, "#include \"recomp.h\"\n\n");
+
+    for (uint32_t offset = 0; offset < nes->PRG_ROM_size; offset++)
+    {
+        if ((r->flags[offset] & RECOMP_LEADER) && recomp_write_block(out, r, offset, &max_cycles[block_count]))
+            blocks[block_count++] = offset;
+    }
+
+    fprintf(out, "static const RECOMP_BLOCK blocks[] =\n{\n");
+    for (uint32_t i = 0; i < block_count; i++)
+        fprintf(out, "    { 0x%05x, 0x%04X, %u, block_%05x },\n", blocks[i], r->addresses[blocks[i]], max_cycles[i], blocks[i]);
+    if (block_count == 0)
+        fprintf(out, "    { 0, 0, 0, NULL }\n");
+    fprintf(out, "};\n\n");
+
+    fprintf(out, "RECOMP_EXPORT const RECOMP_MODULE simple_nes_recomp_module =\n{\n");
+    fprintf(out, "    RECOMP_VERSION, sizeof(CPU), sizeof(NES), 0x%016llxull, 0x%x, %u, blocks\n};\n",
+        (unsigned long long)nes->rom_hash, nes->PRG_ROM_size, block_count);
+
+    bool written = !ferror(out);
+    fclose(out);
+    free(blocks);
+    free(max_cycles);
+
+    printf("%u instructions found, %u blocks written to %s\n", r->instructions, block_count, path);
+    return written;
+}
+
+void recomp_usage()
+{
+    fprintf(stderr, "Usage: simple-nes-recomp [-c code_log]... [-n frames] [-m movie] [-s seed] [-o output] <rom>\n");
+    fprintf(stderr, "    -c  code/data log of earlier runs (.cdl of FCEUX or --code-log of simple-nes), can be repeated\n");
+    fprintf(stderr, "    -n  frames to run first to log the code reached (default: %u, or the length of the movie)\n", RECOMP_DEFAULT_FRAMES);
+    fprintf(stderr, "    -m  play back a movie during that run, its seed replaces -s\n");
+    fprintf(stderr, "    -s  power up seed (default: 0)\n");
+    fprintf(stderr, "    -o  C file to write (default: <rom hash>.c)\n");
+}
+
+int main(int argc, char** argv)
+{
+    char* rom = NULL;
+    char* path_to_movie = NULL;
+    char* output = NULL;
+    char** code_logs = (char**)calloc(argc, sizeof(char*));
+    uint32_t code_log_count = 0;
+    int32_t frames = -1;
+    uint64_t seed = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+            code_logs[code_log_count++] = argv[++i];
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            frames = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+            path_to_movie = argv[++i];
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+            seed = strtoull(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            output = argv[++i];
+        else if (argv[i][0] != '-' && rom == NULL)
+            rom = argv[i];
+        else
+        {
+            recomp_usage();
+            return 1;
+        }
+    }
+
+    if (rom == NULL)
+    {
+        recomp_usage();
+        return 1;
+    }
+
+    NES_MOVIE movie = { 0 };
+    if (path_to_movie != NULL)
+    {
+        if (!nes_movie_load(&movie, path_to_movie))
+            return 1;
+        seed = movie.seed;
+    }
+    if (frames < 0)
+        frames = path_to_movie != NULL ? (int32_t)movie.frames : RECOMP_DEFAULT_FRAMES;
+
+    NES* nes = (NES*)malloc(sizeof(NES));
+    *nes = nes_create();
+    nes->verbose = false;
+    nes->cpu.engine = CPU_ENGINE_SPECIALIZED;   // Every instruction goes through cpu_run and is logged
+    nes_seed(nes, seed);
+    nes_init(nes);
+    if (!nes_load_game(nes, rom))
+        return 1;
+    if (path_to_movie != NULL)
+    {
+        if (!nes_movie_power_up(&movie, nes))
+            return 1;
+    }
+    else
+        nes_power_up(nes);
+
+    RECOMP recomp = { 0 };
+    RECOMP* r = &recomp;
+    r->nes = nes;
+    memcpy(r->pages, nes->cpu.pages, sizeof(r->pages));
+    r->flags = (uint8_t*)calloc(nes->PRG_ROM_size, 1);
+    r->addresses = (uint16_t*)calloc(nes->PRG_ROM_size, sizeof(uint16_t));
+    r->logged = (int32_t*)malloc(0x8000 * sizeof(int32_t));
+    r->work = (uint32_t*)malloc(nes->PRG_ROM_size * sizeof(uint32_t));
+    if (!nes_start_code_log(nes) || r->flags == NULL || r->addresses == NULL || r->logged == NULL || r->work == NULL)
+    {
+        printf("Out of memory\n");
+        return 1;
+    }
+
+    for (uint32_t i = 0; i < code_log_count; i++)
+        if (!nes_merge_code_log(nes, code_logs[i]))
+            return 1;
+
+    nes->emulation_running = true;
+    nes->render_interval = 0;
+    for (int32_t frame = 0; frame < frames; frame++)
+    {
+        if (path_to_movie != NULL)
+            nes_set_input(nes, nes_movie_input(&movie, frame));
+        nes_run_frame(nes);
+    }
+
+    // Where the logged code ran from
+    uint8_t* code_log = nes->cpu.code_log;
+    for (uint32_t i = 0; i < 0x8000; i++)
+        r->logged[i] = -1;
+    for (uint32_t offset = 0; offset < nes->PRG_ROM_size; offset++)
+    {
+        if (!(code_log[offset] & CPU_CODE_LOG_CODE))
+            continue;
+        uint16_t address = ((code_log[offset] >> CPU_CODE_LOG_WINDOW_SHIFT) & 3) << 13 | (offset & 0x1fff);
+        r->logged[address] = r->logged[address] == -1 || r->logged[address] == (int32_t)offset ? (int32_t)offset : -2;
+    }
+
+    uint16_t vectors[3] = { CPU_RESET_VECTOR, CPU_NMI_VECTOR, CPU_IRQ_VECTOR };
+    for (uint8_t i = 0; i < 3; i++)
+    {
+        CPU_PAGE* page = &r->pages[vectors[i] >> CPU_PAGE_SHIFT];
+        uint16_t in_page = vectors[i] & (CPU_PAGE_SIZE - 1);
+        uint16_t target = page->read[in_page] | page->read[in_page + 1] << 8;
+        recomp_visit_target(r, (page->decoded - nes->cpu.decoded) + in_page, vectors[i], target);
+        recomp_follow(r);
+    }
+
+    // Code the disassembly didn't reach (indirect jumps, jump tables through rts), in order so operands are covered first
+    for (uint32_t offset = 0; offset < nes->PRG_ROM_size; offset++)
+    {
+        if ((code_log[offset] & CPU_CODE_LOG_CODE) && !(r->flags[offset] & (RECOMP_INSTRUCTION | RECOMP_COVERED)))
+        {
+            recomp_visit(r, offset, 0x8000 | ((code_log[offset] >> CPU_CODE_LOG_WINDOW_SHIFT) & 3) << 13 | (offset & 0x1fff), true);
+            recomp_follow(r);
+        }
+    }
+
+    recomp_chain_blocks(r);
+    for (uint32_t offset = 0; offset < nes->PRG_ROM_size; offset++)
+        r->leaders += (r->flags[offset] & RECOMP_LEADER) != 0;
+
+    char default_output[32];
+    if (output == NULL)
+    {
+        snprintf(default_output, sizeof(default_output), "%016llx.c", (unsigned long long)nes->rom_hash);
+        output = default_output;
+    }
+    bool written = recomp_write(r, output);
+
+    free(r->flags);
+    free(r->addresses);
+    free(r->logged);
+    free(r->work);
+    free(code_logs);
+    nes_destroy(nes);
+    free(nes);
+    nes_movie_free(&movie);
+    return written ? 0 : 1;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+// Modules written by simple-nes-recomp : the blocks of one rom compiled ahead of time to C, built as a shared library
+// named after the hash of the rom that nes_load_game finds in nes->recomp_directory
+// Each block follows the contract of the jit (CPU_JIT_CODE) and is run by cpu_jit_run from the same entries
+
+#include "nes.h"
+
+#define RECOMP_VERSION          2
+#define RECOMP_MODULE_SYMBOL    "simple_nes_recomp_module"
+
+#ifdef _WIN32
+#define RECOMP_MODULE_SUFFIX    ".dll"
+#define RECOMP_EXPORT           __declspec(dllexport)
+#else
+#define RECOMP_MODULE_SUFFIX    ".so"
+#define RECOMP_EXPORT           __attribute__((visibility("default")))
+#endif
+
+typedef struct RECOMP_BLOCK
+{
+    uint32_t offset;        // In the PRG ROM
+    uint16_t address;       // Cpu address it was recompiled for
+    uint16_t max_cycles;    // Longest pass through the block
+    CPU_JIT_CODE code;
+} RECOMP_BLOCK;
+
+typedef struct RECOMP_MODULE
+{
+    uint32_t version;       // RECOMP_VERSION
+    uint32_t cpu_size;      // sizeof(CPU) and sizeof(NES), the blocks use their layout
+    uint32_t nes_size;
+    uint64_t rom_hash;
+    uint32_t prg_rom_size;
+    uint32_t block_count;
+    const RECOMP_BLOCK* blocks;
+} RECOMP_MODULE;
+
+// What the blocks share, the generated code is built from these
+// Flags : C and nz are locals of the block, the others stay in the cpu
+#define recomp_n(nz)                    (((nz) & 0x8080) != 0)
+#define recomp_z(nz)                    (((nz) & 0xff) == 0)
+#define recomp_flags(cpu, c, nz) \
+    ((c) | recomp_z(nz) << 1 | (cpu)->I << 2 | (cpu)->D << 3 | CPU_FLAG_RESERVED | (cpu)->V << 6 | recomp_n(nz) << 7)
+#define recomp_set_flags(cpu, c, nz, P) \
+    do { (c) = (P) & 1; (cpu)->I = ((P) >> 2) & 1; (cpu)->D = ((P) >> 3) & 1; (cpu)->V = ((P) >> 6) & 1; \
+         (nz) = ((P) & CPU_FLAG_N) << 8 | (~(P) & CPU_FLAG_Z); } while (0)
+
+// Store to the ram, to a zero page address, or to the memory behind a page, marked written like cpu_write_byte
+#define recomp_store_ram(cpu, address, value) \
+    do { (cpu)->memory_low[(address)] = (value); nes_mark_dirty((cpu)->nes->dirty_ram, (address)); (cpu)->bus_flags |= CPU_BUS_WRITE; } while (0)
+#define recomp_store_page(cpu, page, offset, value) \
+    do { (page)->write[(offset)] = (value); nes_mark_dirty((page)->dirty, (page)->dirty_offset + (offset)); (cpu)->bus_flags |= CPU_BUS_WRITE; } while (0)
+
+#define recomp_push(cpu, value) \
+    do { recomp_store_ram((cpu), 0x100 + (cpu)->S, (value)); (cpu)->S--; } while (0)
+#define recomp_pop(cpu)                 ((cpu)->memory_low[0x100 + ++(cpu)->S])
@@ -0,0 +1,420 @@
+#include "rewind.h"
+#include "save_state.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define REWIND_PAGE_SIZE        (1 << NES_DIRTY_PAGE_SHIFT)
+#define REWIND_MIN_ZERO_RUN     3   // Shorter zero runs are left inside literals
+
+// RLE of the XOR between an image and its keyframe : tokens of (zero run, literal length, literal bytes)
+typedef struct REWIND_ENCODER
+{
+    uint8_t* out;
+    uint32_t size;
+    uint32_t zeros;         // Zeros before the pending literal
+    uint8_t* literal;
+    uint32_t literal_size;
+} REWIND_ENCODER;
+
+static void rewind_put_varint(REWIND_ENCODER* encoder, uint32_t value)
+{
+    while (value >= 0x80)
+    {
+        encoder->out[encoder->size++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    encoder->out[encoder->size++] = value;
+}
+
+static uint32_t rewind_get_varint(const uint8_t* data, uint32_t* position)
+{
+    uint32_t value = 0;
+    for (uint8_t shift = 0; shift < 35; shift += 7)
+    {
+        uint8_t byte = data[(*position)++];
+        value |= (uint32_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            break;
+    }
+    return value;
+}
+
+static void rewind_flush_literal(REWIND_ENCODER* encoder)
+{
+    if (encoder->literal_size == 0)
+        return;
+
+    rewind_put_varint(encoder, encoder->zeros);
+    rewind_put_varint(encoder, encoder->literal_size);
+    memcpy(&encoder->out[encoder->size], encoder->literal, encoder->literal_size);
+    encoder->size += encoder->literal_size;
+
+    encoder->zeros = encoder->literal_size = 0;
+}
+
+static void rewind_encode_zeros(REWIND_ENCODER* encoder, uint32_t count)
+{
+    if (encoder->literal_size != 0 && count < REWIND_MIN_ZERO_RUN)
+    {
+        memset(&encoder->literal[encoder->literal_size], 0, count);
+        encoder->literal_size += count;
+        return;
+    }
+
+    rewind_flush_literal(encoder);
+    encoder->zeros += count;
+}
+
+// key can be NULL for keyframes
+static void rewind_encode_span(REWIND_ENCODER* encoder, const uint8_t* image, const uint8_t* key, uint32_t start, uint32_t end)
+{
+    uint32_t zeros = 0;
+    for (uint32_t i = start; i < end; i++)
+    {
+        uint8_t byte = key != NULL ? image[i] ^ key[i] : image[i];
+        if (byte == 0)
+        {
+            zeros++;
+            continue;
+        }
+
+        if (zeros != 0)
+            rewind_encode_zeros(encoder, zeros);
+        zeros = 0;
+        encoder->literal[encoder->literal_size++] = byte;
+    }
+
+    if (zeros != 0)
+        rewind_encode_zeros(encoder, zeros);
+}
+
+static void rewind_decode(const uint8_t* data, uint32_t size, uint8_t* image)
+{
+    uint32_t position = 0, offset = 0;
+    while (position < size)
+    {
+        offset += rewind_get_varint(data, &position);
+        uint32_t length = rewind_get_varint(data, &position);
+        for (uint32_t i = 0; i < length; i++)
+            image[offset++] ^= data[position++];
+    }
+}
+
+// Fills the image through nes_save_state, tracked memory only gets its dirty pages copied
+typedef struct REWIND_WRITER
+{
+    NES_REWIND* history;
+    uint32_t position;
+    bool full;
+    bool failed;
+} REWIND_WRITER;
+
+static size_t rewind_write(void* user, const void* data, size_t size)
+{
+    REWIND_WRITER* writer = (REWIND_WRITER*)user;
+    NES_REWIND* history = writer->history;
+
+    if (writer->position + size > history->image_capacity)
+    {
+        if (!writer->full)
+        {
+            writer->failed = true;  // Layout changed, needs a keyframe
+            return 0;
+        }
+
+        uint32_t capacity = history->image_capacity ? history->image_capacity : 0x8000;
+        while (capacity < writer->position + size)
+            capacity *= 2;
+        history->key = (uint8_t*)realloc(history->key, capacity);
+        history->image = (uint8_t*)realloc(history->image, capacity);
+        history->scratch = (uint8_t*)realloc(history->scratch, 2 * capacity + 64);  // Worst case encoding
+        history->image_capacity = capacity;
+    }
+
+    for (uint32_t i = 0; i < history->num_regions; i++)
+    {
+        REWIND_REGION* region = &history->regions[i];
+        if (data != region->memory || size != region->size)
+            continue;
+
+        if (writer->full)
+        {
+            region->offset = writer->position;
+            break;
+        }
+        if (region->offset != writer->position)
+        {
+            writer->failed = true;
+            return 0;
+        }
+
+        for (uint32_t word = 0; word < nes_dirty_words(size); word++)
+        {
+            uint64_t dirty = region->dirty[word];
+            region->changed[word] |= dirty;
+            while (dirty)
+            {
+                uint32_t page_offset = (word * 64 + __builtin_ctzll(dirty)) * REWIND_PAGE_SIZE;
+                uint32_t page_size = size - page_offset < REWIND_PAGE_SIZE ? size - page_offset : REWIND_PAGE_SIZE;
+                memcpy(&history->image[writer->position + page_offset], &region->memory[page_offset], page_size);
+                dirty &= dirty - 1;
+            }
+        }
+
+        writer->position += size;
+        return size;
+    }
+
+    memcpy(&history->image[writer->position], data, size);
+    writer->position += size;
+    return size;
+}
+
+static void rewind_find_regions(NES_REWIND* history, NES* nes)
+{
+    REWIND_REGION regions[REWIND_MAX_REGIONS] =
+    {
+        { nes->cpu.memory_low, sizeof(nes->cpu.memory_low), 0, nes->dirty_ram, NULL },
+        { nes->ppu.VRAM, sizeof(nes->ppu.VRAM), 0, nes->dirty_vram, NULL },
+        { nes->PRG_RAM_data, nes->PRG_RAM_size, 0, nes->dirty_prg_ram, NULL },
+        { nes->CHR_ROM_data, nes->CHR_ROM_size, 0, nes->dirty_chr_ram, NULL }
+    };
+    uint32_t count = (nes->PRG_RAM_data != NULL ? 3 : 2) + (nes->CHR_RAM ? 1 : 0);
+    if (nes->PRG_RAM_data == NULL)
+        regions[2] = regions[3];
+
+    for (uint32_t i = 0; i < REWIND_MAX_REGIONS; i++)
+    {
+        free(history->regions[i].changed);
+        history->regions[i].changed = NULL;
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        history->regions[i] = regions[i];
+        history->regions[i].changed = (uint64_t*)calloc(nes_dirty_words(regions[i].size), sizeof(uint64_t));
+    }
+    history->num_regions = count;
+}
+
+static bool rewind_snapshot(NES_REWIND* history, NES* nes, bool full)
+{
+    if (full)
+        rewind_find_regions(history, nes);
+
+    REWIND_WRITER writer = { history, 0, full, false };
+    NES_STREAM stream = { &rewind_write, NULL, &writer };
+    if (!nes_save_state(nes, &stream) || writer.failed || (!full && writer.position != history->image_size))
+        return false;
+
+    history->image_size = writer.position;
+    for (uint32_t i = 0; i < history->num_regions; i++)
+        memset(history->regions[i].dirty, 0, nes_dirty_words(history->regions[i].size) * sizeof(uint64_t));
+    return true;
+}
+
+static uint32_t rewind_encode(NES_REWIND* history, bool keyframe)
+{
+    REWIND_ENCODER encoder = { history->scratch, 0, 0, &history->scratch[history->image_capacity + 32], 0 };
+    const uint8_t* key = keyframe ? NULL : history->key;
+
+    // Untracked bytes (registers, OAM, palette) are always compared, tracked memory only where it changed
+    uint32_t position = 0;
+    for (uint32_t i = 0; i < history->num_regions; i++)
+    {
+        REWIND_REGION* region = &history->regions[i];
+        rewind_encode_span(&encoder, history->image, key, position, region->offset);
+
+        for (uint32_t page = 0; page * REWIND_PAGE_SIZE < region->size; page++)
+        {
+            uint32_t start = region->offset + page * REWIND_PAGE_SIZE;
+            uint32_t end = page * REWIND_PAGE_SIZE + REWIND_PAGE_SIZE < region->size ? start + REWIND_PAGE_SIZE : region->offset + region->size;
+            if (keyframe || (region->changed[page / 64] >> (page % 64)) & 1)
+                rewind_encode_span(&encoder, history->image, key, start, end);
+            else
+                rewind_encode_zeros(&encoder, end - start);
+        }
+        position = region->offset + region->size;
+    }
+    rewind_encode_span(&encoder, history->image, key, position, history->image_size);
+    rewind_flush_literal(&encoder);     // Trailing zeros aren't needed
+
+    return encoder.size;
+}
+
+// Drops the oldest record, and the deltas left without their keyframe
+static void rewind_evict(NES_REWIND* history)
+{
+    REWIND_RECORD* record = &history->records[history->first % history->max_records];
+    history->used -= record->size;
+    if (record->keyframe == history->first)
+        history->keyframes--;
+    history->first++;
+
+    while (history->first < history->next && history->records[history->first % history->max_records].keyframe < history->first)
+    {
+        history->used -= history->records[history->first % history->max_records].size;
+        history->first++;
+    }
+
+    if (history->key_record < history->first)
+        history->need_keyframe = true;
+}
+
+static bool rewind_store(NES_REWIND* history, uint32_t size, bool keyframe)
+{
+    if (size > history->capacity)
+        return false;
+
+    if (history->next - history->first == history->max_records)
+        rewind_evict(history);
+
+    // Records sit in sequence order around the ring, whatever is between head and the oldest one is free
+    if (history->head + size > history->capacity)
+    {
+        while (history->first < history->next && history->records[history->first % history->max_records].offset >= history->head)
+            rewind_evict(history);
+        history->head = 0;
+    }
+    while (history->first < history->next)
+    {
+        REWIND_RECORD* oldest = &history->records[history->first % history->max_records];
+        if (oldest->offset < history->head || oldest->offset >= history->head + size)
+            break;
+        rewind_evict(history);
+    }
+
+    if (keyframe)
+    {
+        history->key_record = history->next;
+        history->keyframes++;
+    }
+    else if (history->key_record < history->first)
+        return false;   // Its keyframe was just evicted, the budget is way too small
+
+    REWIND_RECORD* record = &history->records[history->next % history->max_records];
+    record->offset = history->head;
+    record->size = size;
+    record->image_size = history->image_size;
+    record->keyframe = history->key_record;
+    memcpy(&history->buffer[history->head], history->scratch, size);
+
+    history->head += size;
+    history->used += size;
+    history->next++;
+    return true;
+}
+
+bool nes_rewind_init(NES_REWIND* history, size_t budget, uint32_t keyframe_interval)
+{
+    memset(history, 0, sizeof(NES_REWIND));
+    history->capacity = budget;
+    history->buffer = (uint8_t*)malloc(budget);
+    history->max_records = budget / 256 + 1;
+    history->records = (REWIND_RECORD*)malloc(history->max_records * sizeof(REWIND_RECORD));
+    history->keyframe_interval = keyframe_interval ? keyframe_interval : 1;
+    history->need_keyframe = true;
+
+    if (history->buffer == NULL || history->records == NULL)
+    {
+        printf("Couldn't allocate the rewind buffer\n");
+        nes_rewind_destroy(history);
+        return false;
+    }
+    return true;
+}
+
+void nes_rewind_destroy(NES_REWIND* history)
+{
+    free(history->buffer);
+    free(history->records);
+    free(history->key);
+    free(history->image);
+    free(history->scratch);
+    for (uint32_t i = 0; i < REWIND_MAX_REGIONS; i++)
+        free(history->regions[i].changed);
+    memset(history, 0, sizeof(NES_REWIND));
+}
+
+// To be called when another game is loaded
+void nes_rewind_clear(NES_REWIND* history)
+{
+    history->first = history->next = 0;
+    history->head = history->used = 0;
+    history->keyframes = 0;
+    history->need_keyframe = true;
+}
+
+// Takes a snapshot of the frame that just ended
+bool nes_rewind_push(NES_REWIND* history, NES* nes)
+{
+    bool keyframe = history->need_keyframe || history->frames_since_keyframe + 1 >= history->keyframe_interval;
+
+    if (!rewind_snapshot(history, nes, keyframe))
+    {
+        if (keyframe || !rewind_snapshot(history, nes, true))
+            return false;
+        keyframe = true;
+    }
+
+    if (keyframe)
+    {
+        memcpy(history->key, history->image, history->image_size);
+        for (uint32_t i = 0; i < history->num_regions; i++)
+            memset(history->regions[i].changed, 0, nes_dirty_words(history->regions[i].size) * sizeof(uint64_t));
+    }
+
+    if (!rewind_store(history, rewind_encode(history, keyframe), keyframe))
+    {
+        history->need_keyframe = true;
+        return false;
+    }
+
+    history->need_keyframe = false;
+    history->frames_since_keyframe = keyframe ? 0 : history->frames_since_keyframe + 1;
+    return true;
+}
+
+// Drops the newest snapshot and restores the one before it, false once the history is exhausted
+bool nes_rewind_step(NES_REWIND* history, NES* nes)
+{
+    if (history->next - history->first < 2)
+        return false;
+
+    history->next--;
+    REWIND_RECORD* dropped = &history->records[history->next % history->max_records];
+    history->head = dropped->offset;
+    history->used -= dropped->size;
+    if (dropped->keyframe == history->next)
+        history->keyframes--;
+
+    REWIND_RECORD* record = &history->records[(history->next - 1) % history->max_records];
+    REWIND_RECORD* key = &history->records[record->keyframe % history->max_records];
+    if (record->image_size > history->image_capacity)
+        return false;
+
+    memset(history->scratch, 0, key->image_size);
+    rewind_decode(&history->buffer[key->offset], key->size, history->scratch);
+    if (record != key)
+        rewind_decode(&history->buffer[record->offset], record->size, history->scratch);
+
+    NES_MEMORY_STREAM memory = { history->scratch, record->image_size, history->image_capacity, 0 };
+    NES_STREAM stream = nes_memory_stream(&memory);
+    bool success = nes_load_state(nes, &stream);
+
+    // The image and keyframe no longer match the machine
+    history->need_keyframe = true;
+    return success;
+}
+
+NES_REWIND_USAGE nes_rewind_usage(NES_REWIND* history)
+{
+    NES_REWIND_USAGE usage;
+    usage.used = history->used;
+    usage.budget = history->capacity;
+    usage.overhead = history->max_records * sizeof(REWIND_RECORD) + 4 * (size_t)history->image_capacity;
+    usage.snapshots = history->next - history->first;
+    usage.keyframes = history->keyframes;
+    return usage;
+}
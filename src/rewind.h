@@ -0,0 +1,66 @@
+#pragma once
+
+#include "nes.h"
+
+#include <stddef.h>
+
+#define REWIND_DEFAULT_BUDGET       (64 * 1024 * 1024)  // Bytes of encoded snapshots
+#define REWIND_KEYFRAME_INTERVAL    60                  // Frames
+#define REWIND_MAX_REGIONS          4
+
+// One snapshot in the ring ; keyframes are RLE encoded save states, the others are XOR deltas against their keyframe
+typedef struct REWIND_RECORD
+{
+    size_t offset;          // In the ring
+    uint32_t size;
+    uint32_t image_size;    // Decoded size
+    uint64_t keyframe;      // Sequence number of the keyframe (its own for keyframes)
+} REWIND_RECORD;
+
+// Tracked memory inside the state image, only its dirty pages are copied and compared
+typedef struct REWIND_REGION
+{
+    uint8_t* memory;
+    uint32_t size;
+    uint32_t offset;        // In the state image
+    uint64_t* dirty;        // Write map of the NES, cleared after every snapshot
+    uint64_t* changed;      // Pages written since the keyframe
+} REWIND_REGION;
+
+typedef struct NES_REWIND
+{
+    uint8_t* buffer;        // Encoded snapshots, used as a ring
+    size_t capacity;
+    size_t head;            // Where the next record goes
+    size_t used;            // Bytes taken by live records
+
+    REWIND_RECORD* records; // Ring indexed by sequence number
+    uint32_t max_records;
+    uint64_t first, next;   // Sequence numbers of the oldest record and of the next one
+    uint32_t keyframes;
+
+    uint8_t* key;           // Decoded current keyframe
+    uint8_t* image;         // Decoded last snapshot, kept up to date through the dirty pages
+    uint8_t* scratch;       // Encoder / decoder output
+    uint32_t image_size, image_capacity;
+    uint64_t key_record;
+    bool need_keyframe;
+    uint32_t keyframe_interval, frames_since_keyframe;
+
+    REWIND_REGION regions[REWIND_MAX_REGIONS];
+    uint32_t num_regions;
+} NES_REWIND;
+
+typedef struct NES_REWIND_USAGE
+{
+    size_t used, budget;    // Bytes of encoded snapshots
+    size_t overhead;        // Record index and decoded images
+    uint32_t snapshots, keyframes;
+} NES_REWIND_USAGE;
+
+bool nes_rewind_init(NES_REWIND* history, size_t budget, uint32_t keyframe_interval);
+void nes_rewind_destroy(NES_REWIND* history);
+void nes_rewind_clear(NES_REWIND* history);
+bool nes_rewind_push(NES_REWIND* history, NES* nes);
+bool nes_rewind_step(NES_REWIND* history, NES* nes);
+NES_REWIND_USAGE nes_rewind_usage(NES_REWIND* history);
@@ -1,8 +1,6 @@
 #include "rp_2a03_apu.h"
 #include "nes.h"
 
-bool audio_initialised = false, audio_destroyed = false;
-
 void apu_reset(APU* apu)
 {
     apu_init_pulse_channel(apu->nes, &apu->pulse1);
@@ -109,64 +107,59 @@ void apu_quarter_frame(APU* apu)
     apu_pulse_channel_quarter_frame(&apu->pulse2);
 }
 
-void apu_pulse_cycle(APU_PULSE_CHANNEL* channel)
+void apu_pulse_advance(APU_PULSE_CHANNEL* channel, uint32_t clocks)
 {
-    if (channel->timer == 0)
+    if (clocks <= channel->timer)
     {
-        channel->timer = channel->timer_period;
-        channel->sequencer = (channel->sequencer << 1) | (channel->sequencer >> 7);
-        // apu_pulse_channel_update_smooth_timer(channel);
+        channel->timer -= clocks;
+        return;
     }
-    else
-        channel->timer--;
+
+    clocks -= channel->timer + 1;   // First reload
+    uint32_t period = (uint32_t)channel->timer_period + 1;
+    uint8_t steps = (1 + clocks / period) % 8;
+    channel->timer = channel->timer_period - clocks % period;
+    if (steps != 0)
+        channel->sequencer = (channel->sequencer << steps) | (channel->sequencer >> (8 - steps));
 }
 
-void apu_cycle(APU* apu)
+void apu_run(APU* apu, uint32_t cpu_cycles)
 {
-    apu_pulse_channel_cycle(apu, &apu->pulse1);
-    apu_pulse_channel_cycle(apu, &apu->pulse2);
-
-    if (apu->cpu_cycles % 2 == 0)
-    {
-        apu_pulse_cycle(&apu->pulse1);
-        apu_pulse_cycle(&apu->pulse2);
-    }
+    const uint16_t* steps = apu_frame_steps[apu->nes->system][apu->sequencer_mode];
+    uint8_t num_steps = apu_frame_step_count[apu->nes->system][apu->sequencer_mode];
+    uint32_t sequence_length = 2 * (apu->nes->system == TV_NTSC ? (apu->sequencer_mode ? 18641 : 14915) : (apu->sequencer_mode ? 20783 : 16627));  // those are in apu cycles
 
-    if (apu->sequencer_mode)    // 5 step sequence
+    while (cpu_cycles > 0)
     {
-        if (apu->nes->system == TV_NTSC)
+        // Jump to the next frame counter step
+        uint32_t run = cpu_cycles;
+        int8_t step = -1;
+        for (uint8_t i = 0; i < num_steps; i++)
         {
-            if (apu->cpu_cycles == 7456.5 * 2 || apu->cpu_cycles == 18640.5 * 2)
-                apu_half_frame(apu);
-
-            if (apu->cpu_cycles == 3728.5 * 2 || apu->cpu_cycles == 7456.5 * 2 ||
-                apu->cpu_cycles == 11185.5 * 2 || apu->cpu_cycles == 18640.5 * 2)
-                apu_quarter_frame(apu);
+            uint32_t distance = steps[i] > apu->cpu_cycles ? steps[i] - apu->cpu_cycles : sequence_length - apu->cpu_cycles + steps[i];
+            if (distance <= run)
+            {
+                run = distance;
+                step = i;
+            }
         }
-        else
-        {
-            if (apu->cpu_cycles == 8313.5 * 2 || apu->cpu_cycles == 20782.5 * 2)
-                apu_half_frame(apu);
 
-            if (apu->cpu_cycles == 4156.5 * 2 || apu->cpu_cycles == 8313.5 * 2 ||
-                apu->cpu_cycles == 12469.5 * 2 || apu->cpu_cycles == 20782.5 * 2)
-                apu_quarter_frame(apu);
-        }
-    }
-    else
-    {
-        if (apu->nes->system == TV_NTSC)
-        {
-            if (apu->cpu_cycles == 7456.5 * 2 || apu->cpu_cycles == 14914.5 * 2)
-                apu_half_frame(apu);
+        // Pulse timers are clocked every other cpu cycle
+        uint32_t clocks = (uint32_t)((apu->cpu_cycles + run) / 2 - apu->cpu_cycles / 2);
+        apu_pulse_advance(&apu->pulse1, clocks);
+        apu_pulse_advance(&apu->pulse2, clocks);
 
-            if (apu->cpu_cycles == 3728.5 * 2 || apu->cpu_cycles == 7456.5 * 2 ||
-                apu->cpu_cycles == 11185.5 * 2 || apu->cpu_cycles == 14914.5 * 2)
-                apu_quarter_frame(apu);
-        }
-        else
-        {
+        apu->cpu_cycles = (apu->cpu_cycles + run) % sequence_length;
+        cpu_cycles -= run;
+
+        apu_pulse_channel_cycle(apu, &apu->pulse1);
+        apu_pulse_channel_cycle(apu, &apu->pulse2);
 
+        if (step >= 0)
+        {
+            if (step & 1)
+                apu_half_frame(apu);
+            apu_quarter_frame(apu);
         }
     }
 }
@@ -211,7 +204,8 @@ void apu_pulse_channel_register_3_write(APU* apu, APU_PULSE_CHANNEL* channel, ui
 
 void apu_init(APU* apu)
 {
-    audio_initialised = true;
+    apu->audio_initialised = true;
+    apu->audio_destroyed = false;
 }
 
 float apu_get_pulse_channel_output(APU* apu, APU_PULSE_CHANNEL* channel, bool status)
@@ -266,5 +260,5 @@ void apu_pulse_channel_handle_smooth_sequencing(NES* nes, APU_PULSE_CHANNEL* cha
 
 void apu_destroy(APU* apu)
 {
-
+    apu->audio_destroyed = true;
 }
@@ -67,6 +67,8 @@ typedef struct RP_2A03_APU
     APU_PULSE_CHANNEL pulse1;
     APU_PULSE_CHANNEL pulse2;
 
+    bool audio_initialised, audio_destroyed;
+
     NES* nes;
 } APU;
 
@@ -81,7 +83,18 @@ static const uint8_t pulse_duty_cycles[4] =
     0b01000000, 0b01100000, 0b01111000, 0b10011111
 };
 
-extern bool audio_initialised, audio_destroyed;
+// Frame counter steps in cpu cycles [system][sequencer_mode] ; odd steps also clock the half frame units
+static const uint16_t apu_frame_steps[2][2][4] =
+{
+    { { 7457, 14913, 22371, 29829 }, { 7457, 14913, 22371, 37281 } },
+    { { 8313, 16627, 24939, 33253 }, { 8313, 16627, 24939, 41565 } }
+};
+
+static const uint8_t apu_frame_step_count[2][2] =
+{
+    { 4, 4 },
+    { 4, 4 }
+};
 
 void apu_reset(APU* apu);
 void apu_init_pulse_channel(NES* nes, APU_PULSE_CHANNEL* channel);
@@ -90,7 +103,8 @@ void apu_pulse_channel_half_frame(APU* apu, APU_PULSE_CHANNEL* channel);
 void apu_pulse_channel_cycle(APU* apu, APU_PULSE_CHANNEL* channel);
 void apu_half_frame(APU* apu);
 void apu_quarter_frame(APU* apu);
-void apu_cycle(APU* apu);
+void apu_pulse_advance(APU_PULSE_CHANNEL* channel, uint32_t clocks);
+void apu_run(APU* apu, uint32_t cpu_cycles);
 void apu_pulse_channel_register_0_write(NES* nes, APU_PULSE_CHANNEL* channel, uint8_t value);
 void apu_pulse_channel_register_1_write(APU_PULSE_CHANNEL* channel, uint8_t value);
 void apu_pulse_channel_register_2_write(APU* apu, APU_PULSE_CHANNEL* channel, uint8_t value);
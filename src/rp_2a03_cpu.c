@@ -4,12 +4,14 @@
 #include "log.h"
 
 #include <stdio.h>
+#include <string.h>
 
 void cpu_reset(CPU* cpu)
 {
     cpu->PC = cpu_read_word(cpu, CPU_RESET_VECTOR);
     cpu->S -= 3;
-    cpu->P.I = 1;
+    cpu->I = 1;
+    cpu->jammed = false;
     cpu->dma = false;
     cpu->nmi = cpu->nmi_requested = cpu->nmi_last_requested_state = false;
     cpu->apu_counter = 0;
@@ -22,16 +24,108 @@ void cpu_power_up(CPU* cpu)
 {
     cpu->A = cpu->X = cpu->Y = 0;
     cpu->S = 0;
-    *(uint8_t*)&cpu->P = 0;
+    cpu_set_flags(cpu, 0);
     cpu_reset(cpu);
 }
 
+// Offset of $6000-$7FFF in the PRG RAM, for the mappers that have some
+static uint32_t cpu_prg_ram_offset(NES* nes, uint16_t address)
+{
+    if (nes->mapper == MP_MMC1)
+        return (address - 0x6000 + nes->selected_prgram_bank * 0x2000) % nes->PRG_RAM_size;
+    return (address - 0x6000) % nes->PRG_RAM_size;
+}
+
+// Offset of $8000-$FFFF in the PRG ROM with the banks currently selected
+static uint32_t cpu_prg_rom_offset(NES* nes, uint16_t address)
+{
+    switch (nes->mapper)
+    {
+    case MP_MMC1:
+        if ((nes->mmc1_control & 0b01000) == 0)     // PRG-ROM bank mode is 0 or 1 -> 32KB bankswitching
+            return (address - 0x8000 + (nes->selected_prgrom_bank_0 & 0b1110) * 0x4000) % nes->PRG_ROM_size;
+
+        if (address < 0xc000)
+        {
+            if (((nes->mmc1_control & 0b01100) >> 2) == 0b10)   // First bank fixed second switchable
+                return (address - 0x8000) % nes->PRG_ROM_size;
+            return (address - 0x8000 + nes->selected_prgrom_bank_0 * 0x4000) % nes->PRG_ROM_size;
+        }
+
+        if (((nes->mmc1_control & 0b01100) >> 2) == 0b11)   // Second bank fixed first switchable
+            return ((address - 0xc000) + nes->PRG_ROM_size - 0x4000) % nes->PRG_ROM_size;
+        return (address - 0xc000 + nes->selected_prgrom_bank_0 * 0x4000) % nes->PRG_ROM_size;
+
+    case MP_UxROM:
+        if (address < 0xc000)
+            return ((address - 0x8000) + 0x4000 * nes->selected_prgrom_bank_0) % nes->PRG_ROM_size;
+        return ((address - 0xc000) + nes->PRG_ROM_size - 0x4000) % nes->PRG_ROM_size;
+    case MP_AxROM:
+        return ((address - 0x8000) + 0x8000 * nes->selected_prgrom_bank_0) % nes->PRG_ROM_size;
+    default:    // NROM
+        return (address - 0x8000) % nes->PRG_ROM_size;
+    }
+}
+
+// Builds the whole page table, after loading a game or a state
+void cpu_map_memory(CPU* cpu)
+{
+    // 2KB Internal RAM, mirrored up to $1FFF
+    for (uint8_t i = 0; i < (0x2000 >> CPU_PAGE_SHIFT); i++)
+    {
+        CPU_PAGE* page = &cpu->pages[i];
+        page->dirty_offset = (i * CPU_PAGE_SIZE) % 0x800;
+        page->read = page->write = &cpu->memory_low[page->dirty_offset];
+        page->dirty = cpu->nes->dirty_ram;
+    }
+
+    // Registers and open bus are always decoded
+    for (uint8_t i = (0x2000 >> CPU_PAGE_SHIFT); i < (0x6000 >> CPU_PAGE_SHIFT); i++)
+        memset(&cpu->pages[i], 0, sizeof(CPU_PAGE));
+
+    cpu_map_prg(cpu);
+}
+
+// Rebuilds $6000-$FFFF, on every bank switch
+void cpu_map_prg(CPU* cpu)
+{
+    NES* nes = cpu->nes;
+    bool prg_ram = (nes->mapper == MP_NROM || nes->mapper == MP_MMC1) && nes->PRG_RAM_data != NULL;
+    bool prg_rom = nes->mapper != MP_UNSUPPORTED && nes->PRG_ROM_data != NULL;
+
+    for (uint32_t address = 0x6000; address < 0x10000; address += CPU_PAGE_SIZE)
+    {
+        CPU_PAGE* page = &cpu->pages[address >> CPU_PAGE_SHIFT];
+        memset(page, 0, sizeof(CPU_PAGE));
+
+        if (address < 0x8000 && prg_ram)
+        {
+            page->dirty_offset = cpu_prg_ram_offset(nes, address);
+            page->read = page->write = &nes->PRG_RAM_data[page->dirty_offset];
+            page->dirty = nes->dirty_prg_ram;
+        }
+        else if (address >= 0x8000 && prg_rom)
+        {
+            uint32_t offset = cpu_prg_rom_offset(nes, address);
+            page->read = &nes->PRG_ROM_data[offset];    // Writes go to the mapper
+            if (cpu->decoded != NULL)
+                page->decoded = &cpu->decoded[offset];
+        }
+    }
+}
+
 uint8_t cpu_read_byte(CPU* cpu, uint16_t address)
 {
+    uint8_t* page = cpu->pages[address >> CPU_PAGE_SHIFT].read;
+    if (page != NULL)
+        return page[address & (CPU_PAGE_SIZE - 1)];
+
     // 2KB Internal RAM
     if (address < 0x2000)
         return cpu->memory_low[address % 0x800];
 
+    cpu->bus_flags |= (address == 0x2002 ? CPU_BUS_STATUS : CPU_BUS_IO);
+
     if (address < 0x4020)
     {
         if (address < 0x2008)   // PPU Registers
@@ -99,6 +193,8 @@ uint8_t cpu_read_byte(CPU* cpu, uint16_t address)
 
         if (address == 0x4016)  // Controller status
         {
+            if (cpu->nes->key_strobe)   // Shift register is continuously reloaded while strobe is high
+                cpu->nes->key_status = cpu->nes->key_status_control;
             uint8_t tmp = (cpu->nes->key_status >> 7);
             cpu->nes->key_status <<= 1;
             cpu->nes->key_status |= 1;
@@ -110,45 +206,19 @@ uint8_t cpu_read_byte(CPU* cpu, uint16_t address)
 
     switch (cpu->nes->mapper)
     {
-    case MP_NROM:
-        if (address < 0x6000)
-            return 0;
-        if (address < 0x8000)   // Family Basic only
-            return cpu->nes->PRG_RAM_data[(address - 0x6000) % cpu->nes->PRG_RAM_size];
-
-        return cpu->nes->PRG_ROM_data[(address - 0x8000) % cpu->nes->PRG_ROM_size];
-
+    case MP_NROM:   // PRG RAM is Family Basic only
     case MP_MMC1:
         if (address < 0x6000)
             return 0;
-
         if (address < 0x8000)
-            return cpu->nes->PRG_RAM_data[(address - 0x6000 + cpu->nes->selected_prgram_bank * 0x2000) % cpu->nes->PRG_RAM_size];
-
-        if ((cpu->nes->mmc1_control & 0b01000) == 0)     // PRG-ROM bank mode is 0 or 1 -> 32KB bankswitching
-            return cpu->nes->PRG_ROM_data[(address - 0x8000 + (cpu->nes->selected_prgrom_bank_0 & 0b1110) * 0x4000) % cpu->nes->PRG_ROM_size];
-
-        if (address < 0xc000)
-        {
-            if (((cpu->nes->mmc1_control & 0b01100) >> 2) == 0b10)   // First bank fixed second switchable
-                return cpu->nes->PRG_ROM_data[(address - 0x8000) % cpu->nes->PRG_ROM_size];
-            return cpu->nes->PRG_ROM_data[(address - 0x8000 + cpu->nes->selected_prgrom_bank_0 * 0x4000) % cpu->nes->PRG_ROM_size];
-        }
-
-        if (((cpu->nes->mmc1_control & 0b01100) >> 2) == 0b11)   // Second bank fixed first switchable
-            return cpu->nes->PRG_ROM_data[((address - 0xc000) + cpu->nes->PRG_ROM_size - 0x4000) % cpu->nes->PRG_ROM_size];
-        return cpu->nes->PRG_ROM_data[(address - 0xc000 + cpu->nes->selected_prgrom_bank_0 * 0x4000) % cpu->nes->PRG_ROM_size];
+            return cpu->nes->PRG_RAM_data[cpu_prg_ram_offset(cpu->nes, address)];
+        return cpu->nes->PRG_ROM_data[cpu_prg_rom_offset(cpu->nes, address)];
 
     case MP_UxROM:
-        if (address < 0x8000)
-            return 0;
-        if (address < 0xc000)
-            return cpu->nes->PRG_ROM_data[((address - 0x8000) + 0x4000 * cpu->nes->selected_prgrom_bank_0) % cpu->nes->PRG_ROM_size];
-        return cpu->nes->PRG_ROM_data[((address - 0xc000) + cpu->nes->PRG_ROM_size - 0x4000) % cpu->nes->PRG_ROM_size];
     case MP_AxROM:
         if (address < 0x8000)
             return 0;
-        return cpu->nes->PRG_ROM_data[((address - 0x8000) + 0x8000 * cpu->nes->selected_prgrom_bank_0) % cpu->nes->PRG_ROM_size];
+        return cpu->nes->PRG_ROM_data[cpu_prg_rom_offset(cpu->nes, address)];
     default:
         return 0;
     }
@@ -156,10 +226,21 @@ uint8_t cpu_read_byte(CPU* cpu, uint16_t address)
 
 void cpu_write_byte(CPU* cpu, uint16_t address, uint8_t value)
 {
+    cpu->bus_flags |= CPU_BUS_WRITE;
+
+    CPU_PAGE* page = &cpu->pages[address >> CPU_PAGE_SHIFT];
+    if (page->write != NULL)
+    {
+        page->write[address & (CPU_PAGE_SIZE - 1)] = value;
+        nes_mark_dirty(page->dirty, page->dirty_offset + (address & (CPU_PAGE_SIZE - 1)));
+        return;
+    }
+
     // 2KB Internal RAM
     if (address < 0x2000)
     {
         cpu->memory_low[address % 0x800] = value;
+        nes_mark_dirty(cpu->nes->dirty_ram, address % 0x800);
         return;
     }
 
@@ -198,7 +279,6 @@ void cpu_write_byte(CPU* cpu, uint16_t address, uint8_t value)
                 if (cpu->nes->ppu.w == 0)
                 {
                     cpu->nes->ppu.x = (value & 0b111);
-                    cpu->nes->ppu.fine_x = cpu->nes->ppu.x;
                     cpu->nes->ppu.t.coarse_x = (value >> 3);
                 }
                 else
@@ -305,6 +385,8 @@ void cpu_write_byte(CPU* cpu, uint16_t address, uint8_t value)
 
         if (address == 0x4016)  // Controller strobe
         {
+            if (cpu->nes->key_strobe)
+                cpu->nes->key_status = cpu->nes->key_status_control;
             cpu->nes->key_strobe = (value & 1);
             return;
         }
@@ -326,7 +408,9 @@ void cpu_write_byte(CPU* cpu, uint16_t address, uint8_t value)
             return;
         if (address < 0x8000)   // Family Basic only
         {
-            cpu->nes->PRG_RAM_data[(address - 0x6000) % cpu->nes->PRG_RAM_size] = value; // PRG RAM
+            uint32_t index = cpu_prg_ram_offset(cpu->nes, address);
+            cpu->nes->PRG_RAM_data[index] = value; // PRG RAM
+            nes_mark_dirty(cpu->nes->dirty_prg_ram, index);
             return;
         }
         break;
@@ -336,7 +420,9 @@ void cpu_write_byte(CPU* cpu, uint16_t address, uint8_t value)
             return;
         if (address < 0x8000)
         {
-            cpu->nes->PRG_RAM_data[(address - 0x6000 + cpu->nes->selected_prgram_bank * 0x2000) % cpu->nes->PRG_RAM_size] = value;
+            uint32_t index = cpu_prg_ram_offset(cpu->nes, address);
+            cpu->nes->PRG_RAM_data[index] = value;
+            nes_mark_dirty(cpu->nes->dirty_prg_ram, index);
             return;
         }
 
@@ -351,6 +437,7 @@ void cpu_write_byte(CPU* cpu, uint16_t address, uint8_t value)
             cpu->nes->mmc1_shift_register = 0;
             cpu->nes->mmc1_bits_shifted = 0;
             cpu->nes->mmc1_control |= 0b01100;
+            cpu_map_prg(cpu);
             return;
         }
 
@@ -376,6 +463,7 @@ void cpu_write_byte(CPU* cpu, uint16_t address, uint8_t value)
                     cpu->nes->ppu.mirroring = MR_HORIZONTAL;
                     break;
                 }
+                cpu_map_prg(cpu);
                 // printf("MMC1: %s mirroring selected\n", mirroring_text[cpu->nes->ppu.mirroring]);
                 return;
             }
@@ -393,6 +481,7 @@ void cpu_write_byte(CPU* cpu, uint16_t address, uint8_t value)
             }
 
             cpu->nes->selected_prgrom_bank_0 = cpu->nes->mmc1_shift_register & 0b1111;
+            cpu_map_prg(cpu);
             return;
         }
 
@@ -402,6 +491,7 @@ void cpu_write_byte(CPU* cpu, uint16_t address, uint8_t value)
         if (address < 0x8000)
             return;
         cpu->nes->selected_prgrom_bank_0 = (value & 0x0f) % (cpu->nes->PRG_ROM_size / 0x4000);
+        cpu_map_prg(cpu);
         break;
 
     case MP_AxROM:
@@ -409,6 +499,7 @@ void cpu_write_byte(CPU* cpu, uint16_t address, uint8_t value)
             return;
         cpu->nes->selected_prgrom_bank_0 = (value & 0b111) % (cpu->nes->PRG_ROM_size / 0x8000);
         cpu->nes->ppu.mirroring = (value & 0b10000) ? MR_ONESCREEN_HIGHER : MR_ONESCREEN_LOWER;
+        cpu_map_prg(cpu);
         break;
     }
 }
@@ -450,17 +541,30 @@ uint16_t cpu_pop_word(CPU* cpu)
     return word | ((uint16_t)cpu_pop_byte(cpu) << 8);
 }
 
+// P as pushed, without B
+uint8_t cpu_get_flags(CPU* cpu)
+{
+    return cpu->C | (cpu_flag_z(cpu) << 1) | (cpu->I << 2) | (cpu->D << 3) | CPU_FLAG_RESERVED | (cpu->V << 6) | (cpu_flag_n(cpu) << 7);
+}
+
+void cpu_set_flags(CPU* cpu, uint8_t P)
+{
+    cpu->C = P & 1;
+    cpu->I = (P >> 2) & 1;
+    cpu->D = (P >> 3) & 1;
+    cpu->V = (P >> 6) & 1;
+    cpu->nz = ((P & CPU_FLAG_N) << 8) | (~P & CPU_FLAG_Z);
+}
+
 void cpu_throw_interrupt(CPU* cpu, uint16_t handler_address, uint16_t return_address, bool b_flag, bool nmi)
 {
-    if (cpu->P.I && !nmi)
+    if (cpu->I && !nmi)
     {
         cpu->cycle = 1;
         return;
     }
-    cpu->P.B = b_flag;
-    cpu->P.reserved = 1;
     cpu_push_word(cpu, return_address);
-    cpu_push_byte(cpu, *(uint8_t*)&cpu->P);
+    cpu_push_byte(cpu, cpu_get_flags(cpu) | (b_flag ? CPU_FLAG_B : 0));
 
     cpu->PC = handler_address;
 
@@ -514,6 +618,77 @@ uint16_t cpu_fetch_operands(CPU* cpu, CPU_INSTRUCTION instruction)
     }
 }
 
+// Executes the instruction at PC through the handler table, the reference the other engines are checked against
+void cpu_execute_interpreter(CPU* cpu)
+{
+    uint8_t opcode = cpu_read_byte(cpu, cpu->PC);
+    CPU_INSTRUCTION instruction = cpu_instructions[opcode];
+    cpu->operand_address = cpu_fetch_operands(cpu, instruction);
+    LOG("0x%x | 0x%x : ", cpu->PC, opcode);
+    cpu->addressing_mode = instruction.addressing_mode;
+    (*instruction.instruction_handler)(cpu);
+    cpu->PC += instruction_length[instruction.addressing_mode];
+    cpu->instructions++;
+
+    LOG(" | %s\n", addressing_mode_text[instruction.addressing_mode]);
+}
+
+// Whether the 256 bytes of an OAM DMA can be copied at once : the page has to be ram or rom, and nothing may see when
+// each byte is copied, so the ppu mustn't read OAM or move OAMADDR (it does while rendering the visible lines, which
+// the copy mustn't reach) nor the nmi line before the cpu is released
+static bool cpu_oam_dma_bulk(CPU* cpu, uint16_t cycles)
+{
+    NES* nes = cpu->nes;
+    PPU* ppu = &nes->ppu;
+
+    if (cpu->pages[(cpu->dma_page << 8) >> CPU_PAGE_SHIFT].read == NULL)
+        return false;
+    if (cpu->nmi_requested || cpu->nmi_last_requested || cpu->nmi_last_requested_state != cpu->nmi)
+        return false;
+    if (ppu_rendering_enabled(ppu) && ppu->scanline < 240)
+        return false;
+
+    if (ppu_rendering_enabled(ppu) || cpu->nmi || ppu->PPUCTRL.nmi_enable)
+    {
+        uint32_t dots = ppu_dots_until_status_change(ppu);
+        if (ppu_rendering_enabled(ppu))
+        {
+            uint32_t visible = (ppu_prerender_scanline(ppu) + 1 - ppu->scanline) * 341 - ppu->cycle - 1;    // Odd frames may skip a dot
+            if (visible < dots)
+                dots = visible;
+        }
+        uint64_t deadline = nes->ppu_timestamp + (uint64_t)dots * nes_ppu_divider(nes);
+        if (deadline < nes->cpu_timestamp + (uint64_t)cycles * nes_cpu_divider(nes))
+            return false;
+    }
+    return true;
+}
+
+// OAM DMA : the cpu halts for a cycle, one more on odd cycles to line up with the reads, then copies a byte every 2 cycles,
+// 513 or 514 cycles in all
+static void cpu_oam_dma(CPU* cpu)
+{
+    NES* nes = cpu->nes;
+    uint8_t alignment = cpu->dma_counter == 0 ? 1 + (nes->cpu_timestamp / nes_cpu_divider(nes)) % 2 : 0;
+
+    if (cpu->dma_counter == 0 && cpu_oam_dma_bulk(cpu, 512 + alignment))
+    {
+        const uint8_t* page = &cpu->pages[(cpu->dma_page << 8) >> CPU_PAGE_SHIFT].read[(cpu->dma_page << 8) & (CPU_PAGE_SIZE - 1)];
+        uint8_t start = nes->ppu.OAMADDR;
+        memcpy(&nes->ppu.oam_memory[start], page, 256 - start);
+        memcpy(&nes->ppu.oam_memory[0], &page[256 - start], start);
+        cpu->dma = false;
+        cpu->cycle = 512 + alignment;
+        return;
+    }
+
+    nes->ppu.oam_memory[(nes->ppu.OAMADDR + cpu->dma_counter) % 256] = cpu_read_byte(cpu, 0x100 * cpu->dma_page + cpu->dma_counter);
+    cpu->dma_counter++;
+    cpu->cycle = 2 + alignment;
+    if (cpu->dma_counter == 0)
+        cpu->dma = false;
+}
+
 void cpu_cycle(CPU* cpu)
 {
     if (cpu->cycle == 1)    // Second to last cycle
@@ -529,7 +704,7 @@ void cpu_cycle(CPU* cpu)
     {
         uint16_t cycles = cpu->cycle + 7;
         cpu_throw_interrupt(cpu, cpu_read_word(cpu, CPU_NMI_VECTOR), cpu->PC, false, true);
-        cpu->P.I = true;
+        cpu->I = true;
         cpu->nmi_requested = false;
         cpu->cycle = cycles;
     }
@@ -537,44 +712,94 @@ void cpu_cycle(CPU* cpu)
     if (cpu->cycle == 0)
     {
         if (cpu->dma)
-        {
-            cpu->nes->ppu.oam_memory[(cpu->nes->ppu.OAMADDR + cpu->dma_counter) % 256] = cpu_read_byte(cpu, 0x100 * cpu->dma_page + cpu->dma_counter);
-            cpu->dma_counter++;
-            cpu->cycle = 2;
-            if (cpu->dma_counter == 0)
-                cpu->dma = false;
-        }
-        else
-        {
-            uint8_t opcode = cpu_read_byte(cpu, cpu->PC);
-            CPU_INSTRUCTION instruction = cpu_instructions[opcode];
-            cpu->operand_address = cpu_fetch_operands(cpu, instruction);
-            LOG("0x%x | 0x%x : ", cpu->PC, opcode);
-            if (instruction.instruction_handler == NULL)
-            {
-                printf("Invalid or illegal instruction\r");
-                cpu->cycle = 1;
-                return;
-            }
-            cpu->addressing_mode = instruction.addressing_mode;
-            (*instruction.instruction_handler)(cpu);
-            cpu->PC += instruction_length[instruction.addressing_mode];
-
-            LOG(" | %s\n", addressing_mode_text[instruction.addressing_mode]);
-        }
+            cpu_oam_dma(cpu);
+        else if (cpu->engine == CPU_ENGINE_INTERPRETER)
+            cpu_execute_interpreter(cpu);
+        else    // The jit runs its blocks from cpu_run, anything else goes through the specialized engine
+            cpu_execute_specialized(cpu);
     }
     cpu->cycle--;
 }
 
+// Marks the bytes of the instruction at PC as code run from its 8KB window, when it's in rom
+static void cpu_log_code(CPU* cpu)
+{
+    CPU_DECODED* decoded = cpu->pages[cpu->PC >> CPU_PAGE_SHIFT].decoded;
+    if (decoded == NULL)
+        return;
+
+    uint16_t in_page = cpu->PC & (CPU_PAGE_SIZE - 1);
+    uint32_t offset = (decoded - cpu->decoded) + in_page;
+    CPU_ADDRESSING_MODE mode = cpu_instructions[cpu->nes->PRG_ROM_data[offset]].addressing_mode;
+    uint8_t length = instruction_length[mode];
+    uint8_t flags = CPU_CODE_LOG_CODE | (((cpu->PC >> 13) & 3) << CPU_CODE_LOG_WINDOW_SHIFT);
+
+    for (uint8_t i = 0; i < length && in_page + i < CPU_PAGE_SIZE; i++)
+        cpu->code_log[offset + i] |= flags;
+}
+
+// Cycles a block or a superinstruction may take from here, running all its instructions at once : up to max_cycles and
+// before the ppu may move the nmi line, so the nmi polls it skips would have changed nothing ; 0 when an nmi or a dma is
+// pending
+uint32_t cpu_block_budget(CPU* cpu, uint32_t max_cycles)
+{
+    if (cpu->dma || cpu->nmi_requested || cpu->nmi_last_requested || cpu->nmi_last_requested_state != cpu->nmi)
+        return 0;
+
+    // The ppu only moves the nmi line when vblank starts (if enabled) and on the prerender scanline (if raised)
+    NES* nes = cpu->nes;
+    uint32_t budget = max_cycles;
+    if (cpu->nmi || nes->ppu.PPUCTRL.nmi_enable)
+    {
+        uint64_t deadline = nes->ppu_timestamp + (uint64_t)ppu_dots_until_status_change(&nes->ppu) * nes_ppu_divider(nes);
+        uint64_t cycles = deadline > nes->cpu_timestamp ? (deadline - nes->cpu_timestamp) / nes_cpu_divider(nes) : 0;
+        if (cycles < budget)
+            budget = (uint32_t)cycles;
+    }
+    return budget;
+}
+
+uint16_t cpu_run(CPU* cpu, uint16_t max_cycles)
+{
+    bool grouped = false;
+
+    // Only a reset gets a jammed cpu going again, all its cycles pass at once
+    if (cpu->jammed)
+        return max_cycles;
+
+    // A translated block or a superinstruction runs all its instructions at once, its total is then counted down like a
+    // single instruction ; recompiled blocks run with any engine, superinstructions with all but the interpreter
+    // The code log marks one instruction at a time
+    if (cpu->cycle == 0 && cpu->code_log != NULL)
+        cpu_log_code(cpu);
+    else if (cpu->cycle == 0)
+    {
+        grouped = ((cpu->engine == CPU_ENGINE_JIT || (cpu->jit != NULL && cpu->jit->module != NULL)) && cpu_jit_run(cpu, max_cycles)) ||
+                  (cpu->engine != CPU_ENGINE_INTERPRETER && cpu_execute_superinstruction(cpu, max_cycles));
+    }
+
+    if (grouped)
+        cpu->cycle--;
+    else
+        cpu_cycle(cpu);
+
+    // Nothing happens until the second to last cycle of the instruction (nmi polling) so skip straight to it
+    uint16_t idle_cycles = cpu->cycle > 1 ? cpu->cycle - 1 : 0;
+    if (idle_cycles > max_cycles - 1)
+        idle_cycles = max_cycles - 1;
+    cpu->cycle -= idle_cycles;
+
+    return 1 + idle_cycles;
+}
+
 void BIT(CPU* cpu)
 {
     LOG("BIT");
 
     uint8_t tmp = cpu_read_byte(cpu, cpu->operand_address);
 
-    cpu->P.N = (tmp >> 7);
-    cpu->P.V = (tmp >> 6) & 1;
-    cpu->P.Z = ((tmp & cpu->A) == 0);
+    cpu->nz = (tmp & cpu->A) | ((tmp & 0x80) << 8);    // N from the operand even when Z is set
+    cpu->V = (tmp >> 6) & 1;
 
     if (cpu->addressing_mode == AM_ZPG)
         cpu->cycle = 3;
@@ -588,9 +813,8 @@ void CMP(CPU* cpu)
 
     uint8_t tmp = cpu_read_byte(cpu, cpu->operand_address);
 
-    cpu->P.N = ((cpu->A - tmp) >> 7);
-    cpu->P.Z = (tmp == cpu->A);
-    cpu->P.C = (cpu->A >= tmp);
+    cpu->nz = (uint8_t)(cpu->A - tmp);
+    cpu->C = (cpu->A >= tmp);
 
     switch (cpu->addressing_mode)
     {
@@ -627,9 +851,8 @@ void CPX(CPU* cpu)
 
     uint8_t tmp = cpu_read_byte(cpu, cpu->operand_address);
 
-    cpu->P.N = ((cpu->X - tmp) >> 7);
-    cpu->P.Z = (tmp == cpu->X);
-    cpu->P.C = (cpu->X >= tmp);
+    cpu->nz = (uint8_t)(cpu->X - tmp);
+    cpu->C = (cpu->X >= tmp);
 
     switch (cpu->addressing_mode)
     {
@@ -651,9 +874,8 @@ void CPY(CPU* cpu)
 
     uint8_t tmp = cpu_read_byte(cpu, cpu->operand_address);
 
-    cpu->P.N = ((cpu->Y - tmp) >> 7);
-    cpu->P.Z = (tmp == cpu->Y);
-    cpu->P.C = (cpu->Y >= tmp);
+    cpu->nz = (uint8_t)(cpu->Y - tmp);
+    cpu->C = (cpu->Y >= tmp);
 
     switch (cpu->addressing_mode)
     {
@@ -673,7 +895,7 @@ void CLI(CPU* cpu)
 {
     LOG("CLI");
 
-    cpu->P.I = 0;
+    cpu->I = 0;
 
     cpu->cycle = 2;
 }
@@ -682,7 +904,7 @@ void SEI(CPU* cpu)
 {
     LOG("SEI");
 
-    cpu->P.I = 1;
+    cpu->I = 1;
 
     cpu->cycle = 2;
 }
@@ -691,7 +913,7 @@ void CLD(CPU* cpu)
 {
     LOG("CLD");
 
-    cpu->P.D = 0;
+    cpu->D = 0;
 
     cpu->cycle = 2;
 }
@@ -700,7 +922,7 @@ void SED(CPU* cpu)
 {
     LOG("SED");
 
-    cpu->P.D = 1;
+    cpu->D = 1;
 
     cpu->cycle = 2;
 }
@@ -709,7 +931,7 @@ void SEC(CPU* cpu)
 {
     LOG("SEC");
 
-    cpu->P.C = 1;
+    cpu->C = 1;
 
     cpu->cycle = 2;
 }
@@ -718,7 +940,7 @@ void CLC(CPU* cpu)
 {
     LOG("CLC");
 
-    cpu->P.C = 0;
+    cpu->C = 0;
 
     cpu->cycle = 2;
 }
@@ -727,7 +949,7 @@ void CLV(CPU* cpu)
 {
     LOG("CLV");
 
-    cpu->P.V = 0;
+    cpu->V = 0;
 
     cpu->cycle = 2;
 }
@@ -736,9 +958,7 @@ void PHP(CPU* cpu)
 {
     LOG("PHP");
 
-    cpu->P.B = 1;
-    cpu->P.reserved = 1;
-    cpu_push_byte(cpu, *(uint8_t*)&cpu->P);
+    cpu_push_byte(cpu, cpu_get_flags(cpu) | CPU_FLAG_B);
 
     cpu->cycle = 3;
 }
@@ -747,7 +967,7 @@ void PLP(CPU* cpu)
 {
     LOG("PLP");
 
-    *(uint8_t*)&cpu->P = cpu_pop_byte(cpu);
+    cpu_set_flags(cpu, cpu_pop_byte(cpu));
 
     cpu->cycle = 4;
 }
@@ -767,8 +987,7 @@ void PLA(CPU* cpu)
 
     cpu->A = cpu_pop_byte(cpu);
 
-    cpu->P.N = (cpu->A >> 7);
-    cpu->P.Z = (cpu->A == 0);
+    cpu->nz = cpu->A;
 
     cpu->cycle = 4;
 }
@@ -779,8 +998,7 @@ void ORA(CPU* cpu)
 
     cpu->A |= cpu_read_byte(cpu, cpu->operand_address);
 
-    cpu->P.N = (cpu->A >> 7);
-    cpu->P.Z = (cpu->A == 0);
+    cpu->nz = cpu->A;
 
     switch(cpu->addressing_mode)
     {
@@ -817,8 +1035,7 @@ void AND(CPU* cpu)
 
     cpu->A &= cpu_read_byte(cpu, cpu->operand_address);
 
-    cpu->P.N = (cpu->A >> 7);
-    cpu->P.Z = (cpu->A == 0);
+    cpu->nz = cpu->A;
 
     switch(cpu->addressing_mode)
     {
@@ -855,8 +1072,7 @@ void EOR(CPU* cpu)
 
     cpu->A ^= cpu_read_byte(cpu, cpu->operand_address);
 
-    cpu->P.N = (cpu->A >> 7);
-    cpu->P.Z = (cpu->A == 0);
+    cpu->nz = cpu->A;
 
     switch(cpu->addressing_mode)
     {
@@ -893,11 +1109,10 @@ void ASL(CPU* cpu)
 
     uint8_t tmp = (cpu->addressing_mode == AM_A ? cpu->A : cpu_read_byte(cpu, cpu->operand_address));
 
-    cpu->P.C = (tmp >> 7);
+    cpu->C = (tmp >> 7);
     tmp <<= 1;
 
-    cpu->P.N = (tmp >> 7);
-    cpu->P.Z = (tmp == 0);
+    cpu->nz = tmp;
 
     if (cpu->addressing_mode == AM_A)
         cpu->A = tmp;
@@ -930,11 +1145,10 @@ void LSR(CPU* cpu)
 
     uint8_t tmp = (cpu->addressing_mode == AM_A ? cpu->A : cpu_read_byte(cpu, cpu->operand_address));
 
-    cpu->P.C = (tmp & 1);
+    cpu->C = (tmp & 1);
     tmp >>= 1;
 
-    cpu->P.N = 0;
-    cpu->P.Z = (tmp == 0);
+    cpu->nz = tmp;
 
     if (cpu->addressing_mode == AM_A)
         cpu->A = tmp;
@@ -967,13 +1181,12 @@ void ROL(CPU* cpu)
 
     uint8_t tmp = (cpu->addressing_mode == AM_A ? cpu->A : cpu_read_byte(cpu, cpu->operand_address));
 
-    uint8_t tmp_c = cpu->P.C;
-    cpu->P.C = (tmp >> 7);
+    uint8_t tmp_c = cpu->C;
+    cpu->C = (tmp >> 7);
     tmp <<= 1;
     tmp |= tmp_c;
 
-    cpu->P.N = (tmp >> 7);
-    cpu->P.Z = (tmp == 0);
+    cpu->nz = tmp;
 
     if (cpu->addressing_mode == AM_A)
         cpu->A = tmp;
@@ -1006,13 +1219,12 @@ void ROR(CPU* cpu)
 
     uint8_t tmp = (cpu->addressing_mode == AM_A ? cpu->A : cpu_read_byte(cpu, cpu->operand_address));
 
-    uint8_t tmp_c = cpu->P.C;
-    cpu->P.C = (tmp & 1);
+    uint8_t tmp_c = cpu->C;
+    cpu->C = (tmp & 1);
     tmp >>= 1;
     tmp |= (tmp_c << 7);
 
-    cpu->P.N = (tmp >> 7);
-    cpu->P.Z = (tmp == 0);
+    cpu->nz = tmp;
 
     if (cpu->addressing_mode == AM_A)
         cpu->A = tmp;
@@ -1044,15 +1256,14 @@ void ADC(CPU* cpu)
     LOG("ADC");
 
     uint8_t value = cpu_read_byte(cpu, cpu->operand_address);
-    uint16_t tmp = cpu->A + value + cpu->P.C;
+    uint16_t tmp = cpu->A + value + cpu->C;
 
-    cpu->P.V = ((cpu->A ^ tmp) & (value ^ tmp)) >> 7;
+    cpu->V = (((cpu->A ^ tmp) & (value ^ tmp)) >> 7) & 1;
 
     cpu->A = (uint8_t)tmp;
 
-    cpu->P.N = (cpu->A >> 7);
-    cpu->P.Z = (cpu->A == 0);
-    cpu->P.C = (tmp >> 8) & 1;
+    cpu->nz = cpu->A;
+    cpu->C = (tmp >> 8) & 1;
 
     switch(cpu->addressing_mode)
     {
@@ -1088,15 +1299,14 @@ void SBC(CPU* cpu)
     LOG("SBC");
 
     uint8_t value = cpu_read_byte(cpu, cpu->operand_address);
-    int16_t tmp = cpu->A - value - 1 + cpu->P.C;
+    int16_t tmp = cpu->A - value - 1 + cpu->C;
 
-    cpu->P.V = ((cpu->A ^ value) & 0x80) != 0 && ((cpu->A ^ (uint8_t)tmp) & 0x80) != 0;
+    cpu->V = ((cpu->A ^ value) & 0x80) != 0 && ((cpu->A ^ (uint8_t)tmp) & 0x80) != 0;
 
     cpu->A = (uint8_t)tmp;
 
-    cpu->P.N = (cpu->A >> 7);
-    cpu->P.Z = (cpu->A == 0);
-    cpu->P.C = tmp >= 0;
+    cpu->nz = cpu->A;
+    cpu->C = tmp >= 0;
 
     switch(cpu->addressing_mode)
     {
@@ -1135,8 +1345,7 @@ void DEC(CPU* cpu)
 
     cpu_write_byte(cpu, cpu->operand_address, tmp);
 
-    cpu->P.N = (tmp >> 7);
-    cpu->P.Z = (tmp == 0);
+    cpu->nz = tmp;
 
     switch (cpu->addressing_mode)
     {
@@ -1163,8 +1372,7 @@ void INC(CPU* cpu)
 
     cpu_write_byte(cpu, cpu->operand_address, tmp);
 
-    cpu->P.N = (tmp >> 7);
-    cpu->P.Z = (tmp == 0);
+    cpu->nz = tmp;
 
     switch (cpu->addressing_mode)
     {
@@ -1189,8 +1397,7 @@ void DEY(CPU* cpu)
 
     cpu->Y--;
 
-    cpu->P.N = (cpu->Y >> 7);
-    cpu->P.Z = (cpu->Y == 0);
+    cpu->nz = cpu->Y;
 
     cpu->cycle = 2;
 }
@@ -1201,8 +1408,7 @@ void INY(CPU* cpu)
 
     cpu->Y++;
 
-    cpu->P.N = (cpu->Y >> 7);
-    cpu->P.Z = (cpu->Y == 0);
+    cpu->nz = cpu->Y;
 
     cpu->cycle = 2;
 }
@@ -1213,8 +1419,7 @@ void DEX(CPU* cpu)
 
     cpu->X--;
 
-    cpu->P.N = (cpu->X >> 7);
-    cpu->P.Z = (cpu->X == 0);
+    cpu->nz = cpu->X;
 
     cpu->cycle = 2;
 }
@@ -1225,8 +1430,7 @@ void INX(CPU* cpu)
 
     cpu->X++;
 
-    cpu->P.N = (cpu->X >> 7);
-    cpu->P.Z = (cpu->X == 0);
+    cpu->nz = cpu->X;
 
     cpu->cycle = 2;
 }
@@ -1237,8 +1441,7 @@ void LDA(CPU* cpu)
 
     cpu->A = cpu_read_byte(cpu, cpu->operand_address);
 
-    cpu->P.N = (cpu->A >> 7);
-    cpu->P.Z = (cpu->A == 0);
+    cpu->nz = cpu->A;
 
     switch(cpu->addressing_mode)
     {
@@ -1275,8 +1478,7 @@ void LDX(CPU* cpu)
 
     cpu->X = cpu_read_byte(cpu, cpu->operand_address);
 
-    cpu->P.N = (cpu->X >> 7);
-    cpu->P.Z = (cpu->X == 0);
+    cpu->nz = cpu->X;
 
     switch(cpu->addressing_mode)
     {
@@ -1304,8 +1506,7 @@ void LDY(CPU* cpu)
 
     cpu->Y = cpu_read_byte(cpu, cpu->operand_address);
 
-    cpu->P.N = (cpu->Y >> 7);
-    cpu->P.Z = (cpu->Y == 0);
+    cpu->nz = cpu->Y;
 
     switch(cpu->addressing_mode)
     {
@@ -1405,8 +1606,7 @@ void TXA(CPU* cpu)
 
     cpu->A = cpu->X;
 
-    cpu->P.N = (cpu->A >> 7);
-    cpu->P.Z = (cpu->A == 0);
+    cpu->nz = cpu->A;
 
     cpu->cycle = 2;
 }
@@ -1417,8 +1617,7 @@ void TAX(CPU* cpu)
 
     cpu->X = cpu->A;
 
-    cpu->P.N = (cpu->X >> 7);
-    cpu->P.Z = (cpu->X == 0);
+    cpu->nz = cpu->X;
 
     cpu->cycle = 2;
 }
@@ -1429,8 +1628,7 @@ void TYA(CPU* cpu)
 
     cpu->A = cpu->Y;
 
-    cpu->P.N = (cpu->A >> 7);
-    cpu->P.Z = (cpu->A == 0);
+    cpu->nz = cpu->A;
 
     cpu->cycle = 2;
 }
@@ -1441,8 +1639,7 @@ void TAY(CPU* cpu)
 
     cpu->Y = cpu->A;
 
-    cpu->P.N = (cpu->Y >> 7);
-    cpu->P.Z = (cpu->Y == 0);
+    cpu->nz = cpu->Y;
 
     cpu->cycle = 2;
 }
@@ -1462,8 +1659,7 @@ void TSX(CPU* cpu)
 
     cpu->X = cpu->S;
 
-    cpu->P.N = (cpu->X >> 7);
-    cpu->P.Z = (cpu->X == 0);
+    cpu->nz = cpu->X;
 
     cpu->cycle = 2;
 }
@@ -1474,7 +1670,7 @@ void BPL(CPU* cpu)
 
     cpu->cycle = 2;
 
-    if (!cpu->P.N)
+    if (!cpu_flag_n(cpu))
     {
         cpu->cycle++;
         if (((cpu->PC + 2) & 0xff00) != ((cpu->operand_address + 2) & 0xff00))
@@ -1489,7 +1685,7 @@ void BMI(CPU* cpu)
 
     cpu->cycle = 2;
 
-    if (cpu->P.N)
+    if (cpu_flag_n(cpu))
     {
         cpu->cycle++;
         if (((cpu->PC + 2) & 0xff00) != ((cpu->operand_address + 2) & 0xff00))
@@ -1504,7 +1700,7 @@ void BVC(CPU* cpu)
 
     cpu->cycle = 2;
 
-    if (!cpu->P.V)
+    if (!cpu->V)
     {
         cpu->cycle++;
         if (((cpu->PC + 2) & 0xff00) != ((cpu->operand_address + 2) & 0xff00))
@@ -1519,7 +1715,7 @@ void BVS(CPU* cpu)
 
     cpu->cycle = 2;
 
-    if (cpu->P.V)
+    if (cpu->V)
     {
         cpu->cycle++;
         if (((cpu->PC + 2) & 0xff00) != ((cpu->operand_address + 2) & 0xff00))
@@ -1534,7 +1730,7 @@ void BCC(CPU* cpu)
 
     cpu->cycle = 2;
 
-    if (!cpu->P.C)
+    if (!cpu->C)
     {
         cpu->cycle++;
         if (((cpu->PC + 2) & 0xff00) != ((cpu->operand_address + 2) & 0xff00))
@@ -1549,7 +1745,7 @@ void BCS(CPU* cpu)
 
     cpu->cycle = 2;
 
-    if (cpu->P.C)
+    if (cpu->C)
     {
         cpu->cycle++;
         if (((cpu->PC + 2) & 0xff00) != ((cpu->operand_address + 2) & 0xff00))
@@ -1564,7 +1760,7 @@ void BNE(CPU* cpu)
 
     cpu->cycle = 2;
 
-    if (!cpu->P.Z)
+    if (!cpu_flag_z(cpu))
     {
         cpu->cycle++;
         if (((cpu->PC + 2) & 0xff00) != ((cpu->operand_address + 2) & 0xff00))
@@ -1579,7 +1775,7 @@ void BEQ(CPU* cpu)
 
     cpu->cycle = 2;
 
-    if (cpu->P.Z)
+    if (cpu_flag_z(cpu))
     {
         cpu->cycle++;
         if (((cpu->PC + 2) & 0xff00) != ((cpu->operand_address + 2) & 0xff00))
@@ -1628,7 +1824,7 @@ void BRK(CPU* cpu)
     if (cpu->nmi_requested)
     {
         cpu_throw_interrupt(cpu, cpu_read_word(cpu, CPU_NMI_VECTOR), cpu->PC + 2, true, false);
-        cpu->P.I = true;
+        cpu->I = true;
         cpu->nmi_requested = false;
     }
     else
@@ -1641,7 +1837,7 @@ void RTI(CPU* cpu)
 {
     LOG("RTI");
 
-    *(uint8_t*)&cpu->P = cpu_pop_byte(cpu);
+    cpu_set_flags(cpu, cpu_pop_byte(cpu));
     cpu->PC = cpu_pop_word(cpu) - 1;
 
     cpu->cycle = 6;
@@ -1653,3 +1849,345 @@ void NOP(CPU* cpu)
 
     cpu->cycle = 2;
 }
+
+// Cycles of the unofficial instructions that read their operand (or only store it, same timing), like LDA
+static void cpu_read_cycles(CPU* cpu)
+{
+    switch (cpu->addressing_mode)
+    {
+    case AM_IMM:
+        cpu->cycle = 2;
+        break;
+    case AM_ZPG:
+        cpu->cycle = 3;
+        break;
+    case AM_ZPG_X:
+    case AM_ZPG_Y:
+        cpu->cycle = 4;
+        break;
+    case AM_ABS:
+        cpu->cycle = 4;
+        break;
+    case AM_ABS_X:
+    case AM_ABS_Y:
+        cpu->cycle = 4 + cpu->page_boundary_crossed;
+        break;
+    case AM_X_IND:
+        cpu->cycle = 6;
+        break;
+    case AM_IND_Y:
+        cpu->cycle = 5 + cpu->page_boundary_crossed;
+        break;
+    default:
+        cpu->cycle = 2;
+    }
+}
+
+// Cycles of the unofficial read-modify-write instructions, indexed ones always take the extra cycle
+static void cpu_rmw_cycles(CPU* cpu)
+{
+    switch (cpu->addressing_mode)
+    {
+    case AM_ZPG:
+        cpu->cycle = 5;
+        break;
+    case AM_ZPG_X:
+        cpu->cycle = 6;
+        break;
+    case AM_ABS:
+        cpu->cycle = 6;
+        break;
+    case AM_ABS_X:
+    case AM_ABS_Y:
+        cpu->cycle = 7;
+        break;
+    case AM_X_IND:
+    case AM_IND_Y:
+        cpu->cycle = 8;
+        break;
+    default:
+        cpu->cycle = 2;
+    }
+}
+
+// ASL then ORA
+void SLO(CPU* cpu)
+{
+    LOG("SLO");
+
+    uint8_t tmp = cpu_read_byte(cpu, cpu->operand_address);
+
+    cpu->C = (tmp >> 7);
+    tmp <<= 1;
+    cpu_write_byte(cpu, cpu->operand_address, tmp);
+
+    cpu->A |= tmp;
+    cpu->nz = cpu->A;
+
+    cpu_rmw_cycles(cpu);
+}
+
+// ROL then AND
+void RLA(CPU* cpu)
+{
+    LOG("RLA");
+
+    uint8_t tmp = cpu_read_byte(cpu, cpu->operand_address);
+
+    uint8_t tmp_c = cpu->C;
+    cpu->C = (tmp >> 7);
+    tmp <<= 1;
+    tmp |= tmp_c;
+    cpu_write_byte(cpu, cpu->operand_address, tmp);
+
+    cpu->A &= tmp;
+    cpu->nz = cpu->A;
+
+    cpu_rmw_cycles(cpu);
+}
+
+// LSR then EOR
+void SRE(CPU* cpu)
+{
+    LOG("SRE");
+
+    uint8_t tmp = cpu_read_byte(cpu, cpu->operand_address);
+
+    cpu->C = (tmp & 1);
+    tmp >>= 1;
+    cpu_write_byte(cpu, cpu->operand_address, tmp);
+
+    cpu->A ^= tmp;
+    cpu->nz = cpu->A;
+
+    cpu_rmw_cycles(cpu);
+}
+
+// ROR then ADC
+void RRA(CPU* cpu)
+{
+    LOG("RRA");
+
+    uint8_t value = cpu_read_byte(cpu, cpu->operand_address);
+
+    uint8_t tmp_c = cpu->C;
+    cpu->C = (value & 1);
+    value >>= 1;
+    value |= (tmp_c << 7);
+    cpu_write_byte(cpu, cpu->operand_address, value);
+
+    uint16_t tmp = cpu->A + value + cpu->C;
+    cpu->V = (((cpu->A ^ tmp) & (value ^ tmp)) >> 7) & 1;
+    cpu->A = (uint8_t)tmp;
+    cpu->nz = cpu->A;
+    cpu->C = (tmp >> 8) & 1;
+
+    cpu_rmw_cycles(cpu);
+}
+
+void SAX(CPU* cpu)
+{
+    LOG("SAX");
+
+    cpu_write_byte(cpu, cpu->operand_address, cpu->A & cpu->X);
+
+    cpu_read_cycles(cpu);
+}
+
+void LAX(CPU* cpu)
+{
+    LOG("LAX");
+
+    cpu->A = cpu->X = cpu_read_byte(cpu, cpu->operand_address);
+
+    cpu->nz = cpu->A;
+
+    cpu_read_cycles(cpu);
+}
+
+// DEC then CMP
+void DCP(CPU* cpu)
+{
+    LOG("DCP");
+
+    uint8_t tmp = cpu_read_byte(cpu, cpu->operand_address) - 1;
+
+    cpu_write_byte(cpu, cpu->operand_address, tmp);
+
+    cpu->nz = (uint8_t)(cpu->A - tmp);
+    cpu->C = (cpu->A >= tmp);
+
+    cpu_rmw_cycles(cpu);
+}
+
+// INC then SBC
+void ISC(CPU* cpu)
+{
+    LOG("ISC");
+
+    uint8_t value = cpu_read_byte(cpu, cpu->operand_address) + 1;
+
+    cpu_write_byte(cpu, cpu->operand_address, value);
+
+    int16_t tmp = cpu->A - value - 1 + cpu->C;
+    cpu->V = ((cpu->A ^ value) & 0x80) != 0 && ((cpu->A ^ (uint8_t)tmp) & 0x80) != 0;
+    cpu->A = (uint8_t)tmp;
+    cpu->nz = cpu->A;
+    cpu->C = tmp >= 0;
+
+    cpu_rmw_cycles(cpu);
+}
+
+// AND with C set like an ASL would
+void ANC(CPU* cpu)
+{
+    LOG("ANC");
+
+    cpu->A &= cpu_read_byte(cpu, cpu->operand_address);
+
+    cpu->nz = cpu->A;
+    cpu->C = (cpu->A >> 7);
+
+    cpu->cycle = 2;
+}
+
+// AND then LSR A
+void ALR(CPU* cpu)
+{
+    LOG("ALR");
+
+    cpu->A &= cpu_read_byte(cpu, cpu->operand_address);
+
+    cpu->C = (cpu->A & 1);
+    cpu->A >>= 1;
+    cpu->nz = cpu->A;
+
+    cpu->cycle = 2;
+}
+
+// AND then ROR A, with C and V from bits 6 and 5 of the result
+void ARR(CPU* cpu)
+{
+    LOG("ARR");
+
+    cpu->A &= cpu_read_byte(cpu, cpu->operand_address);
+
+    cpu->A = (cpu->A >> 1) | (cpu->C << 7);
+    cpu->nz = cpu->A;
+    cpu->C = (cpu->A >> 6) & 1;
+    cpu->V = ((cpu->A >> 6) ^ (cpu->A >> 5)) & 1;
+
+    cpu->cycle = 2;
+}
+
+void ANE(CPU* cpu)
+{
+    LOG("ANE");
+
+    cpu->A = (cpu->A | CPU_UNSTABLE_MAGIC) & cpu->X & cpu_read_byte(cpu, cpu->operand_address);
+
+    cpu->nz = cpu->A;
+
+    cpu->cycle = 2;
+}
+
+void LXA(CPU* cpu)
+{
+    LOG("LXA");
+
+    cpu->A = cpu->X = (cpu->A | CPU_UNSTABLE_MAGIC) & cpu_read_byte(cpu, cpu->operand_address);
+
+    cpu->nz = cpu->A;
+
+    cpu->cycle = 2;
+}
+
+// X = A & X minus the operand, without borrow, C like CMP
+void SBX(CPU* cpu)
+{
+    LOG("SBX");
+
+    uint8_t value = cpu_read_byte(cpu, cpu->operand_address);
+    uint8_t tmp = cpu->A & cpu->X;
+
+    cpu->X = tmp - value;
+    cpu->nz = cpu->X;
+    cpu->C = (tmp >= value);
+
+    cpu->cycle = 2;
+}
+
+void LAS(CPU* cpu)
+{
+    LOG("LAS");
+
+    cpu->A = cpu->X = cpu->S = cpu_read_byte(cpu, cpu->operand_address) & cpu->S;
+
+    cpu->nz = cpu->A;
+
+    cpu_read_cycles(cpu);
+}
+
+// SHA, SHX, SHY and TAS store a register ANDed with the high byte of the base address plus 1, which also becomes the
+// high byte of the address when indexing crossed a page
+static void cpu_store_and_high(CPU* cpu, uint8_t index, uint8_t value)
+{
+    uint16_t address = cpu->operand_address;
+
+    value &= ((uint16_t)(address - index) >> 8) + 1;
+    if (cpu->page_boundary_crossed)
+        address = (value << 8) | (address & 0xff);
+    cpu_write_byte(cpu, address, value);
+
+    cpu->cycle = cpu->addressing_mode == AM_IND_Y ? 6 : 5;
+}
+
+void TAS(CPU* cpu)
+{
+    LOG("TAS");
+
+    cpu->S = cpu->A & cpu->X;
+    cpu_store_and_high(cpu, cpu->Y, cpu->S);
+}
+
+void SHA(CPU* cpu)
+{
+    LOG("SHA");
+
+    cpu_store_and_high(cpu, cpu->Y, cpu->A & cpu->X);
+}
+
+void SHX(CPU* cpu)
+{
+    LOG("SHX");
+
+    cpu_store_and_high(cpu, cpu->Y, cpu->X);
+}
+
+void SHY(CPU* cpu)
+{
+    LOG("SHY");
+
+    cpu_store_and_high(cpu, cpu->X, cpu->Y);
+}
+
+// NOP that reads its operand, registers see the read
+void IGN(CPU* cpu)
+{
+    LOG("IGN");
+
+    cpu_read_byte(cpu, cpu->operand_address);
+
+    cpu_read_cycles(cpu);
+}
+
+// Stops the cpu until the next reset, cpu_run lets the time pass
+void JAM(CPU* cpu)
+{
+    LOG("JAM");
+
+    cpu->jammed = true;
+    cpu->PC--;  // Stays on the opcode
+
+    cpu->cycle = 2;
+}
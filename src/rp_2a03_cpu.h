@@ -25,23 +25,78 @@ typedef enum CPU_ADDRESSING_MODE
     AM_REL = 9,
     AM_ZPG = 10,
     AM_ZPG_X = 11,
-    AM_ZPG_Y = 12,
-    AM_UK = -1
+    AM_ZPG_Y = 12
 } CPU_ADDRESSING_MODE;
 
-typedef struct RP_2A03_FLAGS
+// Bits of P as pushed on the stack
+#define CPU_FLAG_C          0x01    // Carry
+#define CPU_FLAG_Z          0x02    // Zero
+#define CPU_FLAG_I          0x04    // Interrupt disable
+#define CPU_FLAG_D          0x08    // Decimal mode ; Not supported by the 2A03
+#define CPU_FLAG_B          0x10    // Break flag, only exists on the stack
+#define CPU_FLAG_RESERVED   0x20    // Always pushed as 1
+#define CPU_FLAG_V          0x40    // Overflow
+#define CPU_FLAG_N          0x80    // Negative
+
+// Constant ORed with A by the unstable ANE and LXA, it differs from one chip to another
+#define CPU_UNSTABLE_MAGIC  0xEE
+
+// N and Z of the last result, see CPU.nz
+#define cpu_flag_n(cpu_ptr)     (((cpu_ptr)->nz & 0x8080) != 0)
+#define cpu_flag_z(cpu_ptr)     (((cpu_ptr)->nz & 0xff) == 0)
+
+typedef enum CPU_ENGINE
+{
+    CPU_ENGINE_INTERPRETER = 0,     // Handler table, operands and cycles decoded from the addressing mode at run time
+    CPU_ENGINE_SPECIALIZED = 1,     // One fused handler per opcode, dispatched with computed goto
+    CPU_ENGINE_JIT = 2              // Hot rom blocks translated to x86-64 code (Linux only), the rest on the specialized engine
+} CPU_ENGINE;
+
+#ifndef CPU_DEFAULT_ENGINE
+#define CPU_DEFAULT_ENGINE  CPU_ENGINE_SPECIALIZED
+#endif
+
+// Address space in 1KB pages, a NULL pointer sends the access through the full decoding of cpu_read_byte / cpu_write_byte
+#define CPU_PAGE_SHIFT      10
+#define CPU_PAGE_SIZE       (1 << CPU_PAGE_SHIFT)
+#define CPU_PAGE_COUNT      (0x10000 >> CPU_PAGE_SHIFT)
+
+// Instruction decoded by the specialized engine, one per PRG ROM byte so a bank switch only moves the page to other entries
+typedef struct CPU_DECODED
 {
-    uint8_t C   : 1;    // Carry
-    uint8_t Z   : 1;    // Zero
-    uint8_t I   : 1;    // Interrupt disable
-    uint8_t D   : 1;    // Decimal mode ; Not supported by the 2A03
+    uint16_t operand;   // Operand bytes, little endian
+    uint8_t opcode;
+    bool valid;
+    uint8_t superinstruction;   // Idiom starting here, index in the superinstructions of the specialized engine, 0 if none
+} CPU_DECODED;
+
+// Idioms the specialized engine runs as one superinstruction when they only touch ram, rom and PRG RAM
+typedef enum CPU_IDIOM
+{
+    CPU_IDIOM_STEP_BRANCH = 0,          // DEX / BNE countdown loops
+    CPU_IDIOM_LOAD_STORE = 1,           // LDA / STA copies, indexed table copies included
+    CPU_IDIOM_COMPARE_BRANCH = 2,       // CMP / BEQ chains
+    CPU_IDIOM_STEP_COMPARE_BRANCH = 3,  // INX / CPX #n / BNE loop ends
+    CPU_IDIOM_COUNT
+} CPU_IDIOM;
+
+#define CPU_SUPERINSTRUCTION_MAX_CYCLES     10  // Longest, LDA abs,X / STA abs,Y crossing a page
 
-    uint8_t B   : 1;        // Break flag
-    uint8_t reserved : 1;   // Always pushed as 1
+// What the bus was used for since the idle loop detection last cleared it
+#define CPU_BUS_WRITE       0b001
+#define CPU_BUS_STATUS      0b010   // $2002 read
+#define CPU_BUS_IO          0b100   // Any other register or unmapped read
+
+typedef struct CPU_PAGE
+{
+    uint8_t* read;
+    uint8_t* write;
+    uint64_t* dirty;        // Write tracking map of the memory behind write
+    uint32_t dirty_offset;  // Offset of the page in that memory
+    CPU_DECODED* decoded;   // Rom pages only, ram is decoded every time
+} CPU_PAGE;
 
-    uint8_t V   : 1;    // Overflow
-    uint8_t N   : 1;    // Negative
-} CPU_FLAGS;
+typedef struct CPU_JIT CPU_JIT;
 
 typedef struct RP_2A03_CPU
 {
@@ -51,9 +106,12 @@ typedef struct RP_2A03_CPU
     uint8_t A, X, Y;    // Accumulator, X index, Y index
     uint16_t PC;        // Program counter
     uint8_t S;          // Stack pointer
-    CPU_FLAGS P;        // Flags
+    // Flags, P is only packed when pushed or saved (cpu_get_flags / cpu_set_flags)
+    uint8_t C, I, D, V; // 0 or 1
+    uint16_t nz;        // Last result : Z when its low byte is 0, N when bit 7 or 15 is set so BIT and PLP can set N with Z
 
     uint16_t cycle;     // How many cycles the cpu needs to execute to finish the current instruction
+    bool jammed;        // Stopped by a JAM opcode until the next reset, PC stays on it
 
     // Effective address of instruction / address of operand
     uint16_t operand_address;
@@ -68,9 +126,94 @@ typedef struct RP_2A03_CPU
 
     uint32_t apu_counter;
 
+    uint64_t instructions;  // Executed since the nes was created, for the benchmarks
+    uint64_t idioms[CPU_IDIOM_COUNT];   // Superinstructions run, by idiom
+    CPU_ENGINE engine;
+    uint8_t bus_flags;      // CPU_BUS_*
+
+    // Points into the nes (ram, rom, prg ram) so it's rebuilt by cpu_map_memory, never saved or copied
+    CPU_PAGE pages[CPU_PAGE_COUNT];
+    CPU_DECODED* decoded;   // As many as PRG ROM bytes, allocated with the game
+    CPU_JIT* jit;           // Translated blocks, created by the first run of the jit engine or with a recompiled module
+    bool jit_check;         // Runs every block again on the interpreter and reports any difference
+    uint8_t* code_log;      // CPU_CODE_LOG_* of each PRG ROM byte run so far, NULL when not logging
+
     NES* nes;
 } CPU;
 
+// Code/data log in the layout of the .cdl files of FCEUX, one byte per PRG ROM byte ; only code is logged
+#define CPU_CODE_LOG_CODE           0x01
+#define CPU_CODE_LOG_WINDOW_SHIFT   2       // Bits 2-3, 8KB window of $8000-$FFFF the byte ran from
+
+// Translated block : runs from the PC it was translated at and returns the cycles it took, 0 if it left before its first
+// instruction ; it loops back to its start as long as it has used at most limit cycles
+// Recompiled modules (recomp.h) provide blocks with the same contract
+typedef uint32_t (*CPU_JIT_CODE)(CPU* cpu, uint32_t limit);
+
+typedef struct CPU_JIT_ENTRY
+{
+    CPU_JIT_CODE code;
+    uint16_t address;       // Cpu address of the block, the same rom can be mapped at several
+    uint16_t max_cycles;    // Longest pass through the block
+    uint16_t runs;          // Counts up to CPU_JIT_HOT_RUNS before the block is translated
+    bool failed;            // Starts with an instruction that can't be translated
+    bool recompiled;        // From the module, kept for its address and across flushes
+} CPU_JIT_ENTRY;
+
+typedef struct CPU_JIT
+{
+    uint8_t* code;          // Executable buffer, emptied when full ; allocated by the first translation
+    uint32_t code_size;
+    CPU_JIT_ENTRY* entries; // One per PRG ROM byte like the decoded cache, so bank switches move pages to other entries
+    uint8_t* check_ram;     // PRG RAM before and after a block, for jit_check
+    void* module;           // Library of the recompiled blocks, NULL if there is none
+
+    uint64_t blocks;        // Translated
+    uint64_t runs;          // Of blocks
+    uint64_t instructions;  // Executed by blocks
+    uint64_t flushes;       // Of the code buffer
+    uint64_t mismatches;    // Found by jit_check
+    uint64_t recompiled;    // Blocks installed from the module
+} CPU_JIT;
+
+#define CPU_JIT_MAX_INSTRUCTIONS    64  // Per block
+
+// What an opcode does in a block, its CPU_ADDRESSING_MODE gives the operand
+typedef enum CPU_JIT_OP
+{
+    JIT_OP_NONE = 0,
+    JIT_OP_ADC, JIT_OP_AND, JIT_OP_ASL, JIT_OP_BCC, JIT_OP_BCS, JIT_OP_BEQ, JIT_OP_BIT, JIT_OP_BMI,
+    JIT_OP_BNE, JIT_OP_BPL, JIT_OP_BRK, JIT_OP_BVC, JIT_OP_BVS, JIT_OP_CLC, JIT_OP_CLD, JIT_OP_CLI,
+    JIT_OP_CLV, JIT_OP_CMP, JIT_OP_CPX, JIT_OP_CPY, JIT_OP_DEC, JIT_OP_DEX, JIT_OP_DEY, JIT_OP_EOR,
+    JIT_OP_INC, JIT_OP_INX, JIT_OP_INY, JIT_OP_JMP, JIT_OP_JSR, JIT_OP_LDA, JIT_OP_LDX, JIT_OP_LDY,
+    JIT_OP_LSR, JIT_OP_NOP, JIT_OP_ORA, JIT_OP_PHA, JIT_OP_PHP, JIT_OP_PLA, JIT_OP_PLP, JIT_OP_ROL,
+    JIT_OP_ROR, JIT_OP_RTI, JIT_OP_RTS, JIT_OP_SBC, JIT_OP_SEC, JIT_OP_SED, JIT_OP_SEI, JIT_OP_STA,
+    JIT_OP_STX, JIT_OP_STY, JIT_OP_TAX, JIT_OP_TAY, JIT_OP_TSX, JIT_OP_TXA, JIT_OP_TXS, JIT_OP_TYA,
+    // Unofficial, left to the specialized engine
+    JIT_OP_ALR, JIT_OP_ANC, JIT_OP_ANE, JIT_OP_ARR, JIT_OP_DCP, JIT_OP_IGN, JIT_OP_ISC, JIT_OP_LAS,
+    JIT_OP_LAX, JIT_OP_LXA, JIT_OP_RLA, JIT_OP_RRA, JIT_OP_SAX, JIT_OP_SBX, JIT_OP_SHA, JIT_OP_SHX,
+    JIT_OP_SHY, JIT_OP_SLO, JIT_OP_SRE, JIT_OP_TAS
+} CPU_JIT_OP;
+
+typedef enum CPU_JIT_ACCESS
+{
+    JIT_ACCESS_NONE,
+    JIT_ACCESS_READ,
+    JIT_ACCESS_WRITE,
+    JIT_ACCESS_RMW
+} CPU_JIT_ACCESS;
+
+// Instruction of a block as decoded for the jit and the recompiler
+typedef struct CPU_JIT_INSTRUCTION
+{
+    uint16_t address;
+    uint16_t operand;
+    uint16_t operand_address;   // For the modes that don't depend on registers or memory
+    uint8_t opcode;
+    uint8_t op;
+    CPU_ADDRESSING_MODE mode;
+} CPU_JIT_INSTRUCTION;
+
 static const uint8_t instruction_length[13] =
 {
     1,
@@ -88,6 +231,48 @@ static const uint8_t instruction_length[13] =
     2
 };
 
+// Cycles of each opcode, branches are 2 when not taken ; the jams stop the cpu after theirs
+static const uint8_t cpu_base_cycles[256] =
+{
+    7, 6, 2, 8, 3, 3, 5, 5, 3, 2, 2, 2, 4, 4, 6, 6,
+    2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,
+    6, 6, 2, 8, 3, 3, 5, 5, 4, 2, 2, 2, 4, 4, 6, 6,
+    2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,
+    6, 6, 2, 8, 3, 3, 5, 5, 3, 2, 2, 2, 3, 4, 6, 6,
+    2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,
+    6, 6, 2, 8, 3, 3, 5, 5, 4, 2, 2, 2, 5, 4, 6, 6,
+    2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,
+    2, 6, 2, 6, 3, 3, 3, 3, 2, 2, 2, 2, 4, 4, 4, 4,
+    2, 6, 2, 6, 4, 4, 4, 4, 2, 5, 2, 5, 5, 5, 5, 5,
+    2, 6, 2, 6, 3, 3, 3, 3, 2, 2, 2, 2, 4, 4, 4, 4,
+    2, 5, 2, 5, 4, 4, 4, 4, 2, 4, 2, 4, 4, 4, 4, 4,
+    2, 6, 2, 8, 3, 3, 5, 5, 2, 2, 2, 2, 4, 4, 6, 6,
+    2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,
+    2, 6, 2, 8, 3, 3, 5, 5, 2, 2, 2, 2, 4, 4, 6, 6,
+    2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7
+};
+
+// Opcodes taking one more cycle when their indexed operand crosses a page
+static const uint8_t cpu_page_cycles[256] =
+{
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 1, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 1, 1, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 1, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 1, 1, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 1, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 1, 1, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 1, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 1, 1, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 1, 0, 1, 0, 0, 0, 0, 0, 1, 0, 1, 1, 1, 1, 1,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 1, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 1, 1, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 1, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 1, 1, 0, 0
+};
+
 typedef struct CPU_INSTRUCTION
 {
     void (*instruction_handler)(CPU* cpu);
@@ -111,13 +296,44 @@ static const char* addressing_mode_text[13] =
     "Zeropage, Y"
 };
 
+static const char* cpu_idiom_text[CPU_IDIOM_COUNT] =
+{
+    "step_branch",
+    "load_store",
+    "compare_branch",
+    "step_compare_branch"
+};
+
+// Instructions in one superinstruction of each idiom
+static const uint8_t cpu_idiom_length[CPU_IDIOM_COUNT] = { 2, 2, 2, 3 };
+
 void cpu_reset(CPU* cpu);
 void cpu_power_up(CPU* cpu);
+void cpu_map_memory(CPU* cpu);
+void cpu_map_prg(CPU* cpu);
 uint8_t cpu_read_byte(CPU* cpu, uint16_t address);
 void cpu_write_byte(CPU* cpu, uint16_t address, uint8_t value);
 uint16_t cpu_read_word(CPU* cpu, uint16_t address);
 void cpu_write_word(CPU* cpu, uint16_t address, uint16_t value);
+void cpu_push_byte(CPU* cpu, uint8_t byte);
+uint8_t cpu_pop_byte(CPU* cpu);
+void cpu_push_word(CPU* cpu, uint16_t word);
+uint16_t cpu_pop_word(CPU* cpu);
+uint8_t cpu_get_flags(CPU* cpu);
+void cpu_set_flags(CPU* cpu, uint8_t P);
+void cpu_throw_interrupt(CPU* cpu, uint16_t handler_address, uint16_t return_address, bool b_flag, bool nmi);
 void cpu_cycle(CPU* cpu);
+uint16_t cpu_run(CPU* cpu, uint16_t max_cycles);
+void cpu_execute_interpreter(CPU* cpu);
+void cpu_execute_specialized(CPU* cpu);
+bool cpu_execute_superinstruction(CPU* cpu, uint16_t max_cycles);
+uint32_t cpu_block_budget(CPU* cpu, uint32_t max_cycles);
+bool cpu_jit_run(CPU* cpu, uint16_t max_cycles);
+void cpu_jit_destroy(CPU* cpu);
+bool cpu_jit_load_module(CPU* cpu, const char* path);
+uint32_t cpu_jit_decode(const uint8_t* page, uint16_t address, CPU_JIT_INSTRUCTION* instructions, uint32_t* count);
+CPU_JIT_ACCESS cpu_jit_access(const CPU_JIT_INSTRUCTION* instruction);
+bool cpu_jit_static_operand(CPU_ADDRESSING_MODE mode);
 
 void BIT(CPU* cpu);
 void CMP(CPU* cpu);
@@ -193,23 +409,62 @@ void RTI(CPU* cpu);
 
 void NOP(CPU* cpu);
 
+// Unofficial instructions, https://www.nesdev.org/wiki/Programming_with_unofficial_opcodes
+void SLO(CPU* cpu);
+void RLA(CPU* cpu);
+void SRE(CPU* cpu);
+void RRA(CPU* cpu);
+void SAX(CPU* cpu);
+void LAX(CPU* cpu);
+void DCP(CPU* cpu);
+void ISC(CPU* cpu);
+
+void ANC(CPU* cpu);
+void ALR(CPU* cpu);
+void ARR(CPU* cpu);
+void ANE(CPU* cpu);
+void LXA(CPU* cpu);
+void SBX(CPU* cpu);
+
+void LAS(CPU* cpu);
+void TAS(CPU* cpu);
+void SHA(CPU* cpu);
+void SHX(CPU* cpu);
+void SHY(CPU* cpu);
+
+void IGN(CPU* cpu);
+void JAM(CPU* cpu);
+
+// Every opcode in order, X(opcode, instruction, addressing mode) for the ones that run, unofficial ones included, and
+// U(opcode) for the ones that jam the cpu
+// Both cpu engines are generated from it
+#define CPU_OPCODES(X, U) \
+    X(0x00, BRK, IMPL) X(0x01, ORA, X_IND) U(0x02)           X(0x03, SLO, X_IND) X(0x04, IGN, ZPG)   X(0x05, ORA, ZPG)   X(0x06, ASL, ZPG)   X(0x07, SLO, ZPG)   X(0x08, PHP, IMPL) X(0x09, ORA, IMM)   X(0x0A, ASL, A)    X(0x0B, ANC, IMM)   X(0x0C, IGN, ABS)   X(0x0D, ORA, ABS)   X(0x0E, ASL, ABS)   X(0x0F, SLO, ABS) \
+    X(0x10, BPL, REL)  X(0x11, ORA, IND_Y) U(0x12)           X(0x13, SLO, IND_Y) X(0x14, IGN, ZPG_X) X(0x15, ORA, ZPG_X) X(0x16, ASL, ZPG_X) X(0x17, SLO, ZPG_X) X(0x18, CLC, IMPL) X(0x19, ORA, ABS_Y) X(0x1A, NOP, IMPL) X(0x1B, SLO, ABS_Y) X(0x1C, IGN, ABS_X) X(0x1D, ORA, ABS_X) X(0x1E, ASL, ABS_X) X(0x1F, SLO, ABS_X) \
+    X(0x20, JSR, ABS)  X(0x21, AND, X_IND) U(0x22)           X(0x23, RLA, X_IND) X(0x24, BIT, ZPG)   X(0x25, AND, ZPG)   X(0x26, ROL, ZPG)   X(0x27, RLA, ZPG)   X(0x28, PLP, IMPL) X(0x29, AND, IMM)   X(0x2A, ROL, A)    X(0x2B, ANC, IMM)   X(0x2C, BIT, ABS)   X(0x2D, AND, ABS)   X(0x2E, ROL, ABS)   X(0x2F, RLA, ABS) \
+    X(0x30, BMI, REL)  X(0x31, AND, IND_Y) U(0x32)           X(0x33, RLA, IND_Y) X(0x34, IGN, ZPG_X) X(0x35, AND, ZPG_X) X(0x36, ROL, ZPG_X) X(0x37, RLA, ZPG_X) X(0x38, SEC, IMPL) X(0x39, AND, ABS_Y) X(0x3A, NOP, IMPL) X(0x3B, RLA, ABS_Y) X(0x3C, IGN, ABS_X) X(0x3D, AND, ABS_X) X(0x3E, ROL, ABS_X) X(0x3F, RLA, ABS_X) \
+    X(0x40, RTI, IMPL) X(0x41, EOR, X_IND) U(0x42)           X(0x43, SRE, X_IND) X(0x44, IGN, ZPG)   X(0x45, EOR, ZPG)   X(0x46, LSR, ZPG)   X(0x47, SRE, ZPG)   X(0x48, PHA, IMPL) X(0x49, EOR, IMM)   X(0x4A, LSR, A)    X(0x4B, ALR, IMM)   X(0x4C, JMP, ABS)   X(0x4D, EOR, ABS)   X(0x4E, LSR, ABS)   X(0x4F, SRE, ABS) \
+    X(0x50, BVC, REL)  X(0x51, EOR, IND_Y) U(0x52)           X(0x53, SRE, IND_Y) X(0x54, IGN, ZPG_X) X(0x55, EOR, ZPG_X) X(0x56, LSR, ZPG_X) X(0x57, SRE, ZPG_X) X(0x58, CLI, IMPL) X(0x59, EOR, ABS_Y) X(0x5A, NOP, IMPL) X(0x5B, SRE, ABS_Y) X(0x5C, IGN, ABS_X) X(0x5D, EOR, ABS_X) X(0x5E, LSR, ABS_X) X(0x5F, SRE, ABS_X) \
+    X(0x60, RTS, IMPL) X(0x61, ADC, X_IND) U(0x62)           X(0x63, RRA, X_IND) X(0x64, IGN, ZPG)   X(0x65, ADC, ZPG)   X(0x66, ROR, ZPG)   X(0x67, RRA, ZPG)   X(0x68, PLA, IMPL) X(0x69, ADC, IMM)   X(0x6A, ROR, A)    X(0x6B, ARR, IMM)   X(0x6C, JMP, IND)   X(0x6D, ADC, ABS)   X(0x6E, ROR, ABS)   X(0x6F, RRA, ABS) \
+    X(0x70, BVS, REL)  X(0x71, ADC, IND_Y) U(0x72)           X(0x73, RRA, IND_Y) X(0x74, IGN, ZPG_X) X(0x75, ADC, ZPG_X) X(0x76, ROR, ZPG_X) X(0x77, RRA, ZPG_X) X(0x78, SEI, IMPL) X(0x79, ADC, ABS_Y) X(0x7A, NOP, IMPL) X(0x7B, RRA, ABS_Y) X(0x7C, IGN, ABS_X) X(0x7D, ADC, ABS_X) X(0x7E, ROR, ABS_X) X(0x7F, RRA, ABS_X) \
+    X(0x80, IGN, IMM)  X(0x81, STA, X_IND) X(0x82, IGN, IMM) X(0x83, SAX, X_IND) X(0x84, STY, ZPG)   X(0x85, STA, ZPG)   X(0x86, STX, ZPG)   X(0x87, SAX, ZPG)   X(0x88, DEY, IMPL) X(0x89, IGN, IMM)   X(0x8A, TXA, IMPL) X(0x8B, ANE, IMM)   X(0x8C, STY, ABS)   X(0x8D, STA, ABS)   X(0x8E, STX, ABS)   X(0x8F, SAX, ABS) \
+    X(0x90, BCC, REL)  X(0x91, STA, IND_Y) U(0x92)           X(0x93, SHA, IND_Y) X(0x94, STY, ZPG_X) X(0x95, STA, ZPG_X) X(0x96, STX, ZPG_Y) X(0x97, SAX, ZPG_Y) X(0x98, TYA, IMPL) X(0x99, STA, ABS_Y) X(0x9A, TXS, IMPL) X(0x9B, TAS, ABS_Y) X(0x9C, SHY, ABS_X) X(0x9D, STA, ABS_X) X(0x9E, SHX, ABS_Y) X(0x9F, SHA, ABS_Y) \
+    X(0xA0, LDY, IMM)  X(0xA1, LDA, X_IND) X(0xA2, LDX, IMM) X(0xA3, LAX, X_IND) X(0xA4, LDY, ZPG)   X(0xA5, LDA, ZPG)   X(0xA6, LDX, ZPG)   X(0xA7, LAX, ZPG)   X(0xA8, TAY, IMPL) X(0xA9, LDA, IMM)   X(0xAA, TAX, IMPL) X(0xAB, LXA, IMM)   X(0xAC, LDY, ABS)   X(0xAD, LDA, ABS)   X(0xAE, LDX, ABS)   X(0xAF, LAX, ABS) \
+    X(0xB0, BCS, REL)  X(0xB1, LDA, IND_Y) U(0xB2)           X(0xB3, LAX, IND_Y) X(0xB4, LDY, ZPG_X) X(0xB5, LDA, ZPG_X) X(0xB6, LDX, ZPG_Y) X(0xB7, LAX, ZPG_Y) X(0xB8, CLV, IMPL) X(0xB9, LDA, ABS_Y) X(0xBA, TSX, IMPL) X(0xBB, LAS, ABS_Y) X(0xBC, LDY, ABS_X) X(0xBD, LDA, ABS_X) X(0xBE, LDX, ABS_Y) X(0xBF, LAX, ABS_Y) \
+    X(0xC0, CPY, IMM)  X(0xC1, CMP, X_IND) X(0xC2, IGN, IMM) X(0xC3, DCP, X_IND) X(0xC4, CPY, ZPG)   X(0xC5, CMP, ZPG)   X(0xC6, DEC, ZPG)   X(0xC7, DCP, ZPG)   X(0xC8, INY, IMPL) X(0xC9, CMP, IMM)   X(0xCA, DEX, IMPL) X(0xCB, SBX, IMM)   X(0xCC, CPY, ABS)   X(0xCD, CMP, ABS)   X(0xCE, DEC, ABS)   X(0xCF, DCP, ABS) \
+    X(0xD0, BNE, REL)  X(0xD1, CMP, IND_Y) U(0xD2)           X(0xD3, DCP, IND_Y) X(0xD4, IGN, ZPG_X) X(0xD5, CMP, ZPG_X) X(0xD6, DEC, ZPG_X) X(0xD7, DCP, ZPG_X) X(0xD8, CLD, IMPL) X(0xD9, CMP, ABS_Y) X(0xDA, NOP, IMPL) X(0xDB, DCP, ABS_Y) X(0xDC, IGN, ABS_X) X(0xDD, CMP, ABS_X) X(0xDE, DEC, ABS_X) X(0xDF, DCP, ABS_X) \
+    X(0xE0, CPX, IMM)  X(0xE1, SBC, X_IND) X(0xE2, IGN, IMM) X(0xE3, ISC, X_IND) X(0xE4, CPX, ZPG)   X(0xE5, SBC, ZPG)   X(0xE6, INC, ZPG)   X(0xE7, ISC, ZPG)   X(0xE8, INX, IMPL) X(0xE9, SBC, IMM)   X(0xEA, NOP, IMPL) X(0xEB, SBC, IMM)   X(0xEC, CPX, ABS)   X(0xED, SBC, ABS)   X(0xEE, INC, ABS)   X(0xEF, ISC, ABS) \
+    X(0xF0, BEQ, REL)  X(0xF1, SBC, IND_Y) U(0xF2)           X(0xF3, ISC, IND_Y) X(0xF4, IGN, ZPG_X) X(0xF5, SBC, ZPG_X) X(0xF6, INC, ZPG_X) X(0xF7, ISC, ZPG_X) X(0xF8, SED, IMPL) X(0xF9, SBC, ABS_Y) X(0xFA, NOP, IMPL) X(0xFB, ISC, ABS_Y) X(0xFC, IGN, ABS_X) X(0xFD, SBC, ABS_X) X(0xFE, INC, ABS_X) X(0xFF, ISC, ABS_X)
+
+#define CPU_INSTRUCTION_ENTRY(opcode, instruction, mode)    { &instruction, AM_##mode },
+#define CPU_JAM_ENTRY(opcode)                               { &JAM, AM_IMPL },
+
 static const CPU_INSTRUCTION cpu_instructions[256] =
 {
-            /*     0xX0        */  /*     0xX1      */ /* 0xX2      */  /* 0xX3  */  /*     0xX4      */   /*     0xX5      */  /*     0xX6      */ /* 0xX7  */  /*     0xX8      */     /*     0xX9      */   /*     0xXA      */ /* 0xXB  */  /*    0xXC     */  /*     0xXD      */  /*     0xXE      */   /* 0xXF  */
-/* 0x0X  */    { &BRK, AM_IMPL },  { &ORA, AM_X_IND }, { NULL, AM_UK },  { NULL, AM_UK }, { NULL, AM_UK },       { &ORA, AM_ZPG },    { &ASL, AM_ZPG },   { NULL, AM_UK }, { &PHP, AM_IMPL },      { &ORA, AM_IMM },     { &ASL, AM_A },     { NULL, AM_UK }, { NULL, AM_UK },   { &ORA, AM_ABS },    { &ASL, AM_ABS },     { NULL, AM_UK },
-/* 0x1X  */    { &BPL, AM_REL },   { &ORA, AM_IND_Y }, { NULL, AM_UK },  { NULL, AM_UK }, { NULL, AM_UK },       { &ORA, AM_ZPG_X },  { &ASL, AM_ZPG_X }, { NULL, AM_UK }, { &CLC, AM_IMPL },      { &ORA, AM_ABS_Y },   { NULL, AM_UK },    { NULL, AM_UK }, { NULL, AM_UK },   { &ORA, AM_ABS_X },  { &ASL, AM_ABS_X },   { NULL, AM_UK },
-/* 0x2X  */    { &JSR, AM_ABS },   { &AND, AM_X_IND }, { NULL, AM_UK },  { NULL, AM_UK }, { &BIT, AM_ZPG },      { &AND, AM_ZPG },    { &ROL, AM_ZPG },   { NULL, AM_UK }, { &PLP, AM_IMPL },      { &AND, AM_IMM },     { &ROL, AM_A },     { NULL, AM_UK }, { &BIT, AM_ABS },  { &AND, AM_ABS },    { &ROL, AM_ABS },     { NULL, AM_UK },
-/* 0x3X  */    { &BMI, AM_REL },   { &AND, AM_IND_Y }, { NULL, AM_UK },  { NULL, AM_UK }, { NULL, AM_UK },       { &AND, AM_ZPG_X },  { &ROL, AM_ZPG_X }, { NULL, AM_UK }, { &SEC, AM_IMPL },      { &AND, AM_ABS_Y },   { NULL, AM_UK },    { NULL, AM_UK }, { NULL, AM_UK },   { &AND, AM_ABS_X },  { &ROL, AM_ABS_X },   { NULL, AM_UK },
-/* 0x4X  */    { &RTI, AM_IMPL },  { &EOR, AM_X_IND }, { NULL, AM_UK },  { NULL, AM_UK }, { NULL, AM_UK },       { &EOR, AM_ZPG },    { &LSR, AM_ZPG },   { NULL, AM_UK }, { &PHA, AM_IMPL },      { &EOR, AM_IMM },     { &LSR, AM_A },     { NULL, AM_UK }, { &JMP, AM_ABS },  { &EOR, AM_ABS },    { &LSR, AM_ABS },     { NULL, AM_UK },
-/* 0x5X  */    { &BVC, AM_REL },   { &EOR, AM_IND_Y }, { NULL, AM_UK },  { NULL, AM_UK }, { NULL, AM_UK },       { &EOR, AM_ZPG_X },  { &LSR, AM_ZPG_X }, { NULL, AM_UK }, { &CLI, AM_IMPL },      { &EOR, AM_ABS_Y },   { NULL, AM_UK },    { NULL, AM_UK }, { NULL, AM_UK },   { &EOR, AM_ABS_X },  { &LSR, AM_ABS_X },   { NULL, AM_UK },
-/* 0x6X  */    { &RTS, AM_IMPL },  { &ADC, AM_X_IND }, { NULL, AM_UK },  { NULL, AM_UK }, { NULL, AM_UK },       { &ADC, AM_ZPG },    { &ROR, AM_ZPG },   { NULL, AM_UK }, { &PLA, AM_IMPL },      { &ADC, AM_IMM },     { &ROR, AM_A },     { NULL, AM_UK }, { &JMP, AM_IND },  { &ADC, AM_ABS },    { &ROR, AM_ABS },     { NULL, AM_UK },
-/* 0x7X  */    { &BVS, AM_REL },   { &ADC, AM_IND_Y }, { NULL, AM_UK },  { NULL, AM_UK }, { NULL, AM_UK },       { &ADC, AM_ZPG_X },  { &ROR, AM_ZPG_X }, { NULL, AM_UK }, { &SEI, AM_IMPL },      { &ADC, AM_ABS_Y },   { NULL, AM_UK },    { NULL, AM_UK }, { NULL, AM_UK },   { &ADC, AM_ABS_X },  { &ROR, AM_ABS_X },   { NULL, AM_UK },
-/* 0x8X  */    { NULL, AM_UK },    { &STA, AM_X_IND }, { NULL, AM_UK },  { NULL, AM_UK }, { &STY, AM_ZPG },      { &STA, AM_ZPG },    { &STX, AM_ZPG },   { NULL, AM_UK }, { &DEY, AM_IMPL },      { NULL, AM_UK },      { &TXA, AM_IMPL },  { NULL, AM_UK }, { &STY, AM_ABS },  { &STA, AM_ABS },    { &STX, AM_ABS },     { NULL, AM_UK },
-/* 0x9X  */    { &BCC, AM_REL },   { &STA, AM_IND_Y }, { NULL, AM_UK },  { NULL, AM_UK }, { &STY, AM_ZPG_X },    { &STA, AM_ZPG_X },  { &STX, AM_ZPG_Y }, { NULL, AM_UK }, { &TYA, AM_IMPL },      { &STA, AM_ABS_Y },   { &TXS, AM_IMPL },  { NULL, AM_UK }, { NULL, AM_UK },   { &STA, AM_ABS_X },  { NULL, AM_UK },      { NULL, AM_UK },
-/* 0xAX  */    { &LDY, AM_IMM },   { &LDA, AM_X_IND }, { &LDX, AM_IMM }, { NULL, AM_UK }, { &LDY, AM_ZPG },      { &LDA, AM_ZPG },    { &LDX, AM_ZPG },   { NULL, AM_UK }, { &TAY, AM_IMPL },      { &LDA, AM_IMM },     { &TAX, AM_IMPL },  { NULL, AM_UK }, { &LDY, AM_ABS },  { &LDA, AM_ABS },    { &LDX, AM_ABS },     { NULL, AM_UK },
-/* 0xBX  */    { &BCS, AM_REL },   { &LDA, AM_IND_Y }, { NULL, AM_UK },  { NULL, AM_UK }, { &LDY, AM_ZPG_X },    { &LDA, AM_ZPG_X },  { &LDX, AM_ZPG_Y }, { NULL, AM_UK }, { &CLV, AM_IMPL },      { &LDA, AM_ABS_Y },   { &TSX, AM_IMPL },  { NULL, AM_UK }, { &LDY, AM_ABS_X },{ &LDA, AM_ABS_X },  { &LDX, AM_ABS_Y },   { NULL, AM_UK },
-/* 0xCX  */    { &CPY, AM_IMM },   { &CMP, AM_X_IND }, { NULL, AM_UK },  { NULL, AM_UK }, { &CPY, AM_ZPG },      { &CMP, AM_ZPG },    { &DEC, AM_ZPG },   { NULL, AM_UK }, { &INY, AM_IMPL },      { &CMP, AM_IMM },     { &DEX, AM_IMPL },  { NULL, AM_UK }, { &CPY, AM_ABS },  { &CMP, AM_ABS },    { &DEC, AM_ABS },     { NULL, AM_UK },
-/* 0xDX  */    { &BNE, AM_REL },   { &CMP, AM_IND_Y }, { NULL, AM_UK },  { NULL, AM_UK }, { NULL, AM_UK },       { &CMP, AM_ZPG_X },  { &DEC, AM_ZPG_X }, { NULL, AM_UK }, { &CLD, AM_IMPL },      { &CMP, AM_ABS_Y },   { NULL, AM_UK },    { NULL, AM_UK }, { NULL, AM_UK },   { &CMP, AM_ABS_X },  { &DEC, AM_ABS_X },   { NULL, AM_UK },
-/* 0xEX  */    { &CPX, AM_IMM },   { &SBC, AM_X_IND }, { NULL, AM_UK },  { NULL, AM_UK }, { &CPX, AM_ZPG },      { &SBC, AM_ZPG },    { &INC, AM_ZPG },   { NULL, AM_UK }, { &INX, AM_IMPL },      { &SBC, AM_IMM },     { &NOP, AM_IMPL },  { NULL, AM_UK }, { &CPX, AM_ABS },  { &SBC, AM_ABS },    { &INC, AM_ABS },     { NULL, AM_UK },
-/* 0xFX  */    { &BEQ, AM_REL },   { &SBC, AM_IND_Y }, { NULL, AM_UK },  { NULL, AM_UK }, { NULL, AM_UK },       { &SBC, AM_ZPG_X },  { &INC, AM_ZPG_X }, { NULL, AM_UK }, { &SED, AM_IMPL },      { &SBC, AM_ABS_Y },   { NULL, AM_UK },    { NULL, AM_UK }, { NULL, AM_UK },   { &SBC, AM_ABS_X },  { &INC, AM_ABS_X },   { NULL, AM_UK }
+    CPU_OPCODES(CPU_INSTRUCTION_ENTRY, CPU_JAM_ENTRY)
 };
+
+#define CPU_JIT_OP_ENTRY(opcode, instruction, mode)     JIT_OP_##instruction,
+#define CPU_JIT_JAM_ENTRY(opcode)                       JIT_OP_NONE,
+
+static const uint8_t cpu_jit_ops[256] = { CPU_OPCODES(CPU_JIT_OP_ENTRY, CPU_JIT_JAM_ENTRY) };
@@ -0,0 +1,1183 @@
+// Jit engine : rom code that runs often is translated to x86-64 blocks that run several instructions per call
+// A block only touches ram, rom and PRG RAM, it stops before any instruction that may reach a register or a mapper so
+// those still run on the specialized engine right after the scheduler caught the ppu and apu up
+// The budget a block gets keeps every instruction it runs before the target of the scheduler and before the ppu may
+// move the nmi line, so the nmi polls it doesn't do would have changed nothing ; the result is the same as the other engines
+// Rom only, code in ram is never translated and can modify itself freely
+// Blocks recompiled ahead of time by simple-nes-recomp (recomp.h) go through the same entries and budget
+
+#if defined(__x86_64__) && defined(__linux__)
+#define _DEFAULT_SOURCE     // MAP_ANONYMOUS
+#endif
+
+#include "nes.h"
+#include "rp_2a03_cpu.h"
+#include "recomp.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#endif
+
+#define CPU_JIT_HOT_RUNS            32          // Runs of an address before its block is translated
+#define CPU_JIT_CODE_CAPACITY       (4 << 20)   // Bytes of x86 code, everything is dropped when it's full
+#define CPU_JIT_MAX_BLOCK_SIZE      (32 << 10)  // Upper bound of the code of one block
+
+static uint8_t* cpu_jit_alloc_code();
+static void cpu_jit_free_code(uint8_t* code);
+static bool cpu_jit_translate(CPU* cpu, CPU_JIT_ENTRY* entry);
+
+#ifdef _WIN32
+#define cpu_jit_open_module(path)               ((void*)LoadLibraryA(path))
+#define cpu_jit_module_symbol(module, name)     ((void*)GetProcAddress((HMODULE)(module), name))
+#define cpu_jit_close_module(module)            FreeLibrary((HMODULE)(module))
+#else
+#define cpu_jit_open_module(path)               dlopen(path, RTLD_NOW | RTLD_LOCAL)
+#define cpu_jit_module_symbol(module, name)     dlsym(module, name)
+#define cpu_jit_close_module(module)            dlclose(module)
+#endif
+
+static CPU_JIT* cpu_jit_create(CPU* cpu)
+{
+    CPU_JIT* jit = (CPU_JIT*)calloc(1, sizeof(CPU_JIT));
+    if (jit == NULL)
+        return NULL;
+
+    jit->entries = (CPU_JIT_ENTRY*)calloc(cpu->nes->PRG_ROM_size, sizeof(CPU_JIT_ENTRY));
+    if (jit->entries == NULL)
+    {
+        free(jit);
+        return NULL;
+    }
+
+    return jit;
+}
+
+void cpu_jit_destroy(CPU* cpu)
+{
+    if (cpu->jit == NULL)
+        return;
+
+    if (cpu->jit->code != NULL)
+        cpu_jit_free_code(cpu->jit->code);
+    if (cpu->jit->module != NULL)
+        cpu_jit_close_module(cpu->jit->module);
+    free(cpu->jit->entries);
+    free(cpu->jit->check_ram);
+    free(cpu->jit);
+    cpu->jit = NULL;
+}
+
+// Installs the blocks of a module written by simple-nes-recomp for the loaded game, they run whatever the engine
+bool cpu_jit_load_module(CPU* cpu, const char* path)
+{
+    void* module = cpu_jit_open_module(path);
+    if (module == NULL)
+        return false;
+
+    const RECOMP_MODULE* recomp = (const RECOMP_MODULE*)cpu_jit_module_symbol(module, RECOMP_MODULE_SYMBOL);
+    if (recomp == NULL || recomp->version != RECOMP_VERSION || recomp->cpu_size != sizeof(CPU) || recomp->nes_size != sizeof(NES))
+    {
+        printf("%s was recompiled for another version of the emulator\n", path);
+        cpu_jit_close_module(module);
+        return false;
+    }
+    if (recomp->rom_hash != cpu->nes->rom_hash || recomp->prg_rom_size != cpu->nes->PRG_ROM_size)
+    {
+        printf("%s was recompiled from another rom\n", path);
+        cpu_jit_close_module(module);
+        return false;
+    }
+
+    if (cpu->jit == NULL && (cpu->jit = cpu_jit_create(cpu)) == NULL)
+    {
+        cpu_jit_close_module(module);
+        return false;
+    }
+
+    CPU_JIT* jit = cpu->jit;
+    if (jit->module != NULL)
+        cpu_jit_close_module(jit->module);
+    jit->module = module;
+
+    for (uint32_t i = 0; i < recomp->block_count; i++)
+    {
+        const RECOMP_BLOCK* block = &recomp->blocks[i];
+        CPU_JIT_ENTRY* entry = &jit->entries[block->offset];
+        if (block->offset >= cpu->nes->PRG_ROM_size || entry->recompiled)
+            continue;
+
+        memset(entry, 0, sizeof(CPU_JIT_ENTRY));
+        entry->code = block->code;
+        entry->address = block->address;
+        entry->max_cycles = block->max_cycles;
+        entry->recompiled = true;
+        jit->recompiled++;
+    }
+
+    return true;
+}
+
+// Modes whose operand address is known when the block is decoded
+bool cpu_jit_static_operand(CPU_ADDRESSING_MODE mode)
+{
+    return mode != AM_ZPG_X && mode != AM_ZPG_Y && mode != AM_ABS_X && mode != AM_ABS_Y && mode != AM_IND_Y && mode != AM_X_IND && mode != AM_IND;
+}
+
+CPU_JIT_ACCESS cpu_jit_access(const CPU_JIT_INSTRUCTION* instruction)
+{
+    switch (instruction->op)
+    {
+    case JIT_OP_ADC: case JIT_OP_AND: case JIT_OP_BIT: case JIT_OP_CMP: case JIT_OP_CPX: case JIT_OP_CPY:
+    case JIT_OP_EOR: case JIT_OP_LDA: case JIT_OP_LDX: case JIT_OP_LDY: case JIT_OP_ORA: case JIT_OP_SBC:
+        return instruction->mode == AM_IMM ? JIT_ACCESS_NONE : JIT_ACCESS_READ;
+    case JIT_OP_STA: case JIT_OP_STX: case JIT_OP_STY:
+        return JIT_ACCESS_WRITE;
+    case JIT_OP_ASL: case JIT_OP_LSR: case JIT_OP_ROL: case JIT_OP_ROR: case JIT_OP_INC: case JIT_OP_DEC:
+        return instruction->mode == AM_A ? JIT_ACCESS_NONE : JIT_ACCESS_RMW;
+    default:
+        return JIT_ACCESS_NONE;
+    }
+}
+
+// Interrupts, indirect jumps, jams, unofficial opcodes and any access to a register or a mapper are left to the
+// specialized engine
+static bool cpu_jit_translatable(const CPU_JIT_INSTRUCTION* instruction)
+{
+    if (instruction->op == JIT_OP_NONE || instruction->op == JIT_OP_BRK || instruction->op == JIT_OP_RTI || instruction->op >= JIT_OP_ALR)
+        return false;
+    if (instruction->op == JIT_OP_JMP)
+        return instruction->mode == AM_ABS;
+
+    CPU_JIT_ACCESS access = cpu_jit_access(instruction);
+    if (instruction->mode == AM_ABS && access != JIT_ACCESS_NONE)
+    {
+        if (instruction->operand >= 0x2000 && instruction->operand < 0x6000)
+            return false;
+        if (access != JIT_ACCESS_READ && instruction->operand >= 0x8000)
+            return false;
+    }
+    return true;
+}
+
+// Reads the instructions of the block at address from its 1KB rom page, up to the first one that ends it or can't be
+// translated ; returns the cycles of the longest pass through them
+uint32_t cpu_jit_decode(const uint8_t* page, uint16_t address, CPU_JIT_INSTRUCTION* instructions, uint32_t* count)
+{
+    uint16_t pc = address;
+    uint32_t max_cycles = 0;
+
+    *count = 0;
+
+    while (*count < CPU_JIT_MAX_INSTRUCTIONS)
+    {
+        uint16_t offset = pc & (CPU_PAGE_SIZE - 1);
+        CPU_JIT_INSTRUCTION* instruction = &instructions[*count];
+        instruction->opcode = page[offset];
+        instruction->op = cpu_jit_ops[instruction->opcode];
+        instruction->mode = cpu_instructions[instruction->opcode].addressing_mode;
+        instruction->address = pc;
+
+        // The next page may be another bank
+        uint8_t length = instruction_length[instruction->mode];
+        if (offset + length > CPU_PAGE_SIZE)
+            break;
+
+        instruction->operand = (length > 1 ? page[offset + 1] : 0) | (length > 2 ? page[offset + 2] << 8 : 0);
+        if (!cpu_jit_translatable(instruction))
+            break;
+
+        switch (instruction->mode)
+        {
+        case AM_IMM:
+            instruction->operand_address = pc + 1;
+            break;
+        case AM_ZPG:
+            instruction->operand_address = instruction->operand & 0xff;
+            break;
+        case AM_ABS:
+            instruction->operand_address = instruction->operand;
+            break;
+        case AM_REL:
+            instruction->operand_address = pc + (int8_t)instruction->operand;
+            break;
+        default:
+            instruction->operand_address = 0;
+        }
+
+        max_cycles += cpu_base_cycles[instruction->opcode] + cpu_page_cycles[instruction->opcode] + (instruction->mode == AM_REL ? 2 : 0);
+        (*count)++;
+        pc += length;
+
+        if (instruction->op == JIT_OP_JMP || instruction->op == JIT_OP_JSR || instruction->op == JIT_OP_RTS)
+            break;
+        if ((pc & (CPU_PAGE_SIZE - 1)) == 0)    // Ends on the last byte of the page
+            break;
+    }
+
+    return max_cycles;
+}
+
+// Runs the block, then the same instructions again from the same state on the interpreter, whose result is kept
+static uint32_t cpu_jit_check(CPU* cpu, CPU_JIT_ENTRY* entry, uint32_t limit)
+{
+    CPU_JIT* jit = cpu->jit;
+    NES* nes = cpu->nes;
+    uint32_t ram_size = nes->PRG_RAM_data != NULL ? nes->PRG_RAM_size : 0;
+
+    if (ram_size > 0 && jit->check_ram == NULL)
+        jit->check_ram = (uint8_t*)malloc(2 * ram_size);
+    if (jit->check_ram == NULL)
+        ram_size = 0;
+
+    CPU before = *cpu;
+    memcpy(jit->check_ram, nes->PRG_RAM_data, ram_size);
+
+    uint32_t cycles = entry->code(cpu, limit);
+    if (cycles == 0)
+        return 0;
+
+    CPU translated = *cpu;
+    memcpy(&jit->check_ram[ram_size], nes->PRG_RAM_data, ram_size);
+    *cpu = before;
+    memcpy(nes->PRG_RAM_data, jit->check_ram, ram_size);
+
+    uint32_t expected = 0;
+    for (uint64_t i = before.instructions; i < translated.instructions; i++)
+    {
+        cpu_execute_interpreter(cpu);
+        expected += cpu->cycle;
+    }
+
+    const char* difference = NULL;
+    if (expected != cycles)
+        difference = "cycles";
+    else if (cpu->A != translated.A || cpu->X != translated.X || cpu->Y != translated.Y || cpu->S != translated.S)
+        difference = "registers";
+    else if (cpu_get_flags(cpu) != cpu_get_flags(&translated))
+        difference = "flags";
+    else if (cpu->PC != translated.PC)
+        difference = "PC";
+    else if (cpu->operand_address != translated.operand_address || cpu->addressing_mode != translated.addressing_mode ||
+             cpu->page_boundary_crossed != translated.page_boundary_crossed)
+        difference = "operand";
+    else if (cpu->bus_flags != translated.bus_flags)
+        difference = "bus";
+    else if (memcmp(cpu->memory_low, translated.memory_low, sizeof(cpu->memory_low)) != 0)
+        difference = "ram";
+    else if (memcmp(nes->PRG_RAM_data, &jit->check_ram[ram_size], ram_size) != 0)
+        difference = "PRG RAM";
+
+    if (difference != NULL)
+    {
+        jit->mismatches++;
+        printf("Jit mismatch in the block at $%04X (%s)\n", before.PC, difference);
+    }
+
+    return expected;
+}
+
+// Runs the block at PC if there is one and it fits the cycles left, the caller runs the instruction otherwise
+bool cpu_jit_run(CPU* cpu, uint16_t max_cycles)
+{
+    CPU_DECODED* decoded = cpu->pages[cpu->PC >> CPU_PAGE_SHIFT].decoded;
+
+    // Rom only, and nothing but the instruction may be pending
+    uint32_t budget = decoded != NULL ? cpu_block_budget(cpu, max_cycles) : 0;
+    if (budget == 0)
+        return false;
+
+    if (cpu->jit == NULL && (cpu->jit = cpu_jit_create(cpu)) == NULL)
+    {
+        cpu->engine = CPU_ENGINE_SPECIALIZED;
+        return false;
+    }
+
+    CPU_JIT* jit = cpu->jit;
+    CPU_JIT_ENTRY* entry = &jit->entries[(decoded - cpu->decoded) + (cpu->PC & (CPU_PAGE_SIZE - 1))];
+
+    if (entry->address != cpu->PC)  // Never run, or translated for another mirror of this rom
+    {
+        if (entry->recompiled)
+            return false;
+        memset(entry, 0, sizeof(CPU_JIT_ENTRY));
+        entry->address = cpu->PC;
+    }
+
+    // Only the jit engine translates, the others just run the recompiled blocks
+    if (entry->code == NULL)
+    {
+        if (cpu->engine != CPU_ENGINE_JIT || entry->failed || ++entry->runs < CPU_JIT_HOT_RUNS)
+            return false;
+        if (jit->code == NULL && (jit->code = cpu_jit_alloc_code()) == NULL)
+        {
+            printf("Couldn't start the jit, using the specialized engine\n");
+            cpu->engine = CPU_ENGINE_SPECIALIZED;
+            return false;
+        }
+        if (!cpu_jit_translate(cpu, entry))
+        {
+            entry->failed = true;
+            return false;
+        }
+    }
+
+    if (entry->max_cycles > budget)
+        return false;
+
+    uint64_t instructions = cpu->instructions;
+    uint32_t limit = budget - entry->max_cycles;
+    uint32_t cycles = cpu->jit_check ? cpu_jit_check(cpu, entry, limit) : entry->code(cpu, limit);
+    if (cycles == 0)
+        return false;
+
+    jit->runs++;
+    jit->instructions += cpu->instructions - instructions;
+    cpu->cycle = cycles;
+    return true;
+}
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <sys/mman.h>
+
+typedef enum X86_REGISTER
+{
+    X86_NONE = -1,
+    X86_RAX = 0, X86_RCX, X86_RDX, X86_RBX, X86_RSP, X86_RBP, X86_RSI, X86_RDI,
+    X86_R8, X86_R9, X86_R10, X86_R11, X86_R12, X86_R13, X86_R14, X86_R15
+} X86_REGISTER;
+
+// Where the cpu lives while a block runs, S, PC and the I, D and V flags stay in memory ; rax, rcx and rdx are scratch,
+// edx holds operands
+#define JIT_CPU     X86_RDI
+#define JIT_NZ      X86_RSI     // CPU.nz
+#define JIT_A       X86_R8
+#define JIT_X       X86_R9
+#define JIT_Y       X86_R10
+#define JIT_C       X86_R11
+#define JIT_CYCLES  X86_RBX
+#define JIT_LIMIT   X86_RBP
+#define JIT_PAGE    X86_R12     // CPU_PAGE of an access through the page table
+#define JIT_OFFSET  X86_R13     // Offset in that page, or zero page address
+#define JIT_MEMORY  X86_R14     // Memory behind that page
+
+#define X86_CC_O    0x0
+#define X86_CC_C    0x2
+#define X86_CC_NC   0x3
+#define X86_CC_Z    0x4
+#define X86_CC_NZ   0x5
+#define X86_CC_BE   0x6
+
+// Group 1 operations, the reg field of 0x80 / 0x81 / 0x83
+#define X86_ADD     0
+#define X86_OR      1
+#define X86_AND     4
+#define X86_SUB     5
+
+#define JIT_CPU_OFFSET(field)   ((int32_t)offsetof(CPU, field))
+#define JIT_PAGE_OFFSET(field)  ((int32_t)offsetof(CPU_PAGE, field))
+#define JIT_DIRTY_RAM           ((int32_t)(offsetof(NES, dirty_ram) - offsetof(NES, cpu)))
+
+// Jump to the exit taken before an instruction, patched once the exits are emitted after the block
+typedef struct JIT_EXIT
+{
+    uint32_t at;
+    uint8_t instruction;
+} JIT_EXIT;
+
+typedef struct JIT_EMITTER
+{
+    uint8_t* code;
+    uint32_t size;
+    uint32_t epilogue, top;
+
+    CPU_JIT_INSTRUCTION instructions[CPU_JIT_MAX_INSTRUCTIONS];
+    uint32_t count;
+    JIT_EXIT exits[2 * CPU_JIT_MAX_INSTRUCTIONS];
+    uint32_t exit_count;
+} JIT_EMITTER;
+
+typedef enum JIT_LOCATION
+{
+    JIT_LOCATION_RAM,           // Internal ram at a known address
+    JIT_LOCATION_ZERO_PAGE,     // Zero page address in JIT_OFFSET
+    JIT_LOCATION_PAGED          // JIT_PAGE, JIT_OFFSET and JIT_MEMORY
+} JIT_LOCATION;
+
+static uint8_t* cpu_jit_alloc_code()
+{
+    void* code = mmap(NULL, CPU_JIT_CODE_CAPACITY, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return code == MAP_FAILED ? NULL : (uint8_t*)code;
+}
+
+static void cpu_jit_free_code(uint8_t* code)
+{
+    munmap(code, CPU_JIT_CODE_CAPACITY);
+}
+
+static void jit_byte(JIT_EMITTER* e, uint8_t byte)
+{
+    e->code[e->size++] = byte;
+}
+
+static void jit_u16(JIT_EMITTER* e, uint16_t value)
+{
+    jit_byte(e, value & 0xff);
+    jit_byte(e, value >> 8);
+}
+
+static void jit_u32(JIT_EMITTER* e, uint32_t value)
+{
+    jit_u16(e, value & 0xffff);
+    jit_u16(e, value >> 16);
+}
+
+// REX prefix when needed, then the one or two bytes of the opcode
+static void jit_opcode(JIT_EMITTER* e, bool wide, uint16_t opcode, int reg, int index, int base)
+{
+    uint8_t rex = 0x40 | (wide << 3) | (((reg >> 3) & 1) << 2) | ((index != X86_NONE ? (index >> 3) & 1 : 0) << 1) | ((base >> 3) & 1);
+    if (rex != 0x40)
+        jit_byte(e, rex);
+    if (opcode > 0xff)
+        jit_byte(e, opcode >> 8);
+    jit_byte(e, opcode & 0xff);
+}
+
+// opcode reg, [base + index + disp]
+static void jit_mem(JIT_EMITTER* e, bool wide, uint16_t opcode, int reg, int base, int index, int32_t disp)
+{
+    jit_opcode(e, wide, opcode, reg, index, base);
+    if (index == X86_NONE && (base & 7) != X86_RSP)
+        jit_byte(e, 0x80 | ((reg & 7) << 3) | (base & 7));
+    else
+    {
+        jit_byte(e, 0x84 | ((reg & 7) << 3));
+        jit_byte(e, (((index == X86_NONE ? X86_RSP : index) & 7) << 3) | (base & 7));
+    }
+    jit_u32(e, (uint32_t)disp);
+}
+
+// opcode reg, rm
+static void jit_reg(JIT_EMITTER* e, bool wide, uint16_t opcode, int reg, int rm)
+{
+    jit_opcode(e, wide, opcode, reg, X86_NONE, rm);
+    jit_byte(e, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// Group 1 operation on a 32 bit register with an immediate
+static void jit_alu_imm(JIT_EMITTER* e, int operation, int rm, int32_t imm)
+{
+    if (imm >= -128 && imm <= 127)
+    {
+        jit_reg(e, false, 0x83, operation, rm);
+        jit_byte(e, (uint8_t)imm);
+    }
+    else
+    {
+        jit_reg(e, false, 0x81, operation, rm);
+        jit_u32(e, (uint32_t)imm);
+    }
+}
+
+static void jit_mov_imm(JIT_EMITTER* e, int reg, uint32_t imm)
+{
+    jit_opcode(e, false, 0xb8 + (reg & 7), 0, X86_NONE, reg);
+    jit_u32(e, imm);
+}
+
+static void jit_shift(JIT_EMITTER* e, bool left, int rm, uint8_t count)
+{
+    jit_reg(e, false, 0xc1, left ? 4 : 5, rm);
+    jit_byte(e, count);
+}
+
+static void jit_push(JIT_EMITTER* e, int reg)
+{
+    if (reg >= X86_R8)
+        jit_byte(e, 0x41);
+    jit_byte(e, 0x50 + (reg & 7));
+}
+
+static void jit_pop(JIT_EMITTER* e, int reg)
+{
+    if (reg >= X86_R8)
+        jit_byte(e, 0x41);
+    jit_byte(e, 0x58 + (reg & 7));
+}
+
+// Conditional jump to a known position
+static void jit_jump_to(JIT_EMITTER* e, int cc, uint32_t target)
+{
+    if (cc < 0)
+    {
+        jit_byte(e, 0xe9);
+        jit_u32(e, target - (e->size + 4));
+    }
+    else
+    {
+        jit_byte(e, 0x0f);
+        jit_byte(e, 0x80 | cc);
+        jit_u32(e, target - (e->size + 4));
+    }
+}
+
+// Conditional jump forward, returns where to patch it
+static uint32_t jit_jump_forward(JIT_EMITTER* e, int cc)
+{
+    jit_jump_to(e, cc, e->size + 6);
+    return e->size - 4;
+}
+
+static void jit_patch(JIT_EMITTER* e, uint32_t at)
+{
+    uint32_t rel = e->size - (at + 4);
+    memcpy(&e->code[at], &rel, 4);
+}
+
+// Leaves the block before the instruction if the last test found no memory behind the access
+static void jit_exit_if_zero(JIT_EMITTER* e, uint32_t instruction)
+{
+    e->exits[e->exit_count].at = jit_jump_forward(e, X86_CC_Z);
+    e->exits[e->exit_count++].instruction = instruction;
+}
+
+static void jit_add_cycles(JIT_EMITTER* e, uint8_t cycles)
+{
+    if (cycles > 0)
+        jit_alu_imm(e, X86_ADD, JIT_CYCLES, cycles);
+}
+
+// N and Z from a zero extended register
+static void jit_nz(JIT_EMITTER* e, int reg)
+{
+    jit_reg(e, false, 0x89, reg, JIT_NZ);
+}
+
+static void jit_set_flag(JIT_EMITTER* e, int32_t offset, uint8_t value)
+{
+    jit_mem(e, false, 0xc6, 0, JIT_CPU, X86_NONE, offset);
+    jit_byte(e, value);
+}
+
+static void jit_bus_write(JIT_EMITTER* e)
+{
+    jit_mem(e, false, 0x80, X86_OR, JIT_CPU, X86_NONE, JIT_CPU_OFFSET(bus_flags));
+    jit_byte(e, CPU_BUS_WRITE);
+}
+
+// Stores the operand address and page crossing of the indexed modes once the access is known to be translated
+static void jit_commit_address(JIT_EMITTER* e, const CPU_JIT_INSTRUCTION* instruction, int address)
+{
+    jit_byte(e, 0x66);
+    jit_mem(e, false, 0x89, address, JIT_CPU, X86_NONE, JIT_CPU_OFFSET(operand_address));
+    if (instruction->mode == AM_ABS_X || instruction->mode == AM_ABS_Y || instruction->mode == AM_IND_Y)
+    {
+        jit_mem(e, false, 0x88, X86_RDX, JIT_CPU, X86_NONE, JIT_CPU_OFFSET(page_boundary_crossed));
+        if (cpu_page_cycles[instruction->opcode])
+            jit_reg(e, false, 0x01, X86_RDX, JIT_CYCLES);
+    }
+}
+
+// Finds where the operand is, leaving the block before the instruction if it isn't ram, rom or PRG RAM
+static JIT_LOCATION jit_emit_address(JIT_EMITTER* e, uint32_t i, CPU_JIT_ACCESS access)
+{
+    const CPU_JIT_INSTRUCTION* instruction = &e->instructions[i];
+    int32_t memory_field = access == JIT_ACCESS_READ ? JIT_PAGE_OFFSET(read) : JIT_PAGE_OFFSET(write);
+    uint16_t operand = instruction->operand;
+    int index = (instruction->mode == AM_ZPG_Y || instruction->mode == AM_ABS_Y) ? JIT_Y : JIT_X;
+
+    switch (instruction->mode)
+    {
+    case AM_ZPG:
+        return JIT_LOCATION_RAM;
+
+    case AM_ABS:
+        if (operand < 0x2000)
+            return JIT_LOCATION_RAM;
+        jit_mem(e, true, 0x8d, JIT_PAGE, JIT_CPU, X86_NONE, JIT_CPU_OFFSET(pages) + (operand >> CPU_PAGE_SHIFT) * (int32_t)sizeof(CPU_PAGE));
+        jit_mem(e, true, 0x8b, JIT_MEMORY, JIT_PAGE, X86_NONE, memory_field);
+        jit_reg(e, true, 0x85, JIT_MEMORY, JIT_MEMORY);
+        jit_exit_if_zero(e, i);
+        jit_mov_imm(e, JIT_OFFSET, operand & (CPU_PAGE_SIZE - 1));
+        return JIT_LOCATION_PAGED;
+
+    case AM_ZPG_X:
+    case AM_ZPG_Y:
+        jit_mem(e, false, 0x8d, JIT_OFFSET, index, X86_NONE, operand & 0xff);
+        jit_reg(e, false, 0x0fb6, JIT_OFFSET, JIT_OFFSET);
+        jit_commit_address(e, instruction, JIT_OFFSET);
+        return JIT_LOCATION_ZERO_PAGE;
+
+    case AM_ABS_X:
+    case AM_ABS_Y:
+        jit_mem(e, false, 0x8d, X86_RAX, index, X86_NONE, operand);
+        jit_reg(e, false, 0x0fb7, X86_RAX, X86_RAX);
+        jit_mem(e, false, 0x8d, X86_RDX, index, X86_NONE, operand & 0xff);
+        jit_shift(e, false, X86_RDX, 8);
+        break;
+
+    case AM_IND_Y:
+        jit_mem(e, false, 0x0fb6, X86_RAX, JIT_CPU, X86_NONE, JIT_CPU_OFFSET(memory_low) + (operand & 0xff));
+        jit_mem(e, false, 0x0fb6, X86_RCX, JIT_CPU, X86_NONE, JIT_CPU_OFFSET(memory_low) + ((operand + 1) & 0xff));
+        jit_reg(e, false, 0x0fb6, X86_RDX, X86_RAX);
+        jit_reg(e, false, 0x01, JIT_Y, X86_RDX);
+        jit_shift(e, false, X86_RDX, 8);
+        jit_shift(e, true, X86_RCX, 8);
+        jit_reg(e, false, 0x09, X86_RCX, X86_RAX);
+        jit_reg(e, false, 0x01, JIT_Y, X86_RAX);
+        jit_reg(e, false, 0x0fb7, X86_RAX, X86_RAX);
+        break;
+
+    case AM_X_IND:
+        jit_mem(e, false, 0x8d, X86_RCX, JIT_X, X86_NONE, operand & 0xff);
+        jit_reg(e, false, 0x0fb6, X86_RCX, X86_RCX);
+        jit_mem(e, false, 0x0fb6, X86_RAX, JIT_CPU, X86_RCX, JIT_CPU_OFFSET(memory_low));
+        jit_alu_imm(e, X86_ADD, X86_RCX, 1);
+        jit_reg(e, false, 0x0fb6, X86_RCX, X86_RCX);
+        jit_mem(e, false, 0x0fb6, X86_RCX, JIT_CPU, X86_RCX, JIT_CPU_OFFSET(memory_low));
+        jit_shift(e, true, X86_RCX, 8);
+        jit_reg(e, false, 0x09, X86_RCX, X86_RAX);
+        break;
+
+    default:
+        return JIT_LOCATION_RAM;
+    }
+
+    // Address in eax, through the page table
+    jit_reg(e, false, 0x89, X86_RAX, X86_RCX);
+    jit_shift(e, false, X86_RCX, CPU_PAGE_SHIFT);
+    jit_reg(e, false, 0x69, X86_RCX, X86_RCX);     // imul ecx, ecx, sizeof(CPU_PAGE)
+    jit_u32(e, sizeof(CPU_PAGE));
+    jit_mem(e, true, 0x8d, JIT_PAGE, JIT_CPU, X86_RCX, JIT_CPU_OFFSET(pages));
+    jit_mem(e, true, 0x8b, JIT_MEMORY, JIT_PAGE, X86_NONE, memory_field);
+    jit_reg(e, true, 0x85, JIT_MEMORY, JIT_MEMORY);
+    jit_exit_if_zero(e, i);
+    jit_commit_address(e, instruction, X86_RAX);
+    jit_reg(e, false, 0x89, X86_RAX, JIT_OFFSET);
+    jit_alu_imm(e, X86_AND, JIT_OFFSET, CPU_PAGE_SIZE - 1);
+    return JIT_LOCATION_PAGED;
+}
+
+// Operand into edx
+static void jit_emit_load(JIT_EMITTER* e, const CPU_JIT_INSTRUCTION* instruction, JIT_LOCATION location)
+{
+    switch (location)
+    {
+    case JIT_LOCATION_RAM:
+        jit_mem(e, false, 0x0fb6, X86_RDX, JIT_CPU, X86_NONE, JIT_CPU_OFFSET(memory_low) + (instruction->operand & 0x7ff));
+        break;
+    case JIT_LOCATION_ZERO_PAGE:
+        jit_mem(e, false, 0x0fb6, X86_RDX, JIT_CPU, JIT_OFFSET, JIT_CPU_OFFSET(memory_low));
+        break;
+    case JIT_LOCATION_PAGED:
+        jit_mem(e, false, 0x0fb6, X86_RDX, JIT_MEMORY, JIT_OFFSET, 0);
+        break;
+    }
+}
+
+// Byte register into the operand, marking it written like cpu_write_byte
+static void jit_emit_store(JIT_EMITTER* e, const CPU_JIT_INSTRUCTION* instruction, JIT_LOCATION location, int reg)
+{
+    uint16_t address = instruction->operand & 0x7ff;
+
+    switch (location)
+    {
+    case JIT_LOCATION_RAM:
+        jit_mem(e, false, 0x88, reg, JIT_CPU, X86_NONE, JIT_CPU_OFFSET(memory_low) + address);
+        jit_mem(e, false, 0x81, X86_OR, JIT_CPU, X86_NONE, JIT_DIRTY_RAM);
+        jit_u32(e, 1u << (address >> NES_DIRTY_PAGE_SHIFT));
+        break;
+    case JIT_LOCATION_ZERO_PAGE:
+        jit_mem(e, false, 0x88, reg, JIT_CPU, JIT_OFFSET, JIT_CPU_OFFSET(memory_low));
+        jit_reg(e, false, 0x89, JIT_OFFSET, X86_RAX);
+        jit_shift(e, false, X86_RAX, NES_DIRTY_PAGE_SHIFT);
+        jit_mem(e, true, 0x0fab, X86_RAX, JIT_CPU, X86_NONE, JIT_DIRTY_RAM);      // bts
+        break;
+    case JIT_LOCATION_PAGED:
+        jit_mem(e, false, 0x88, reg, JIT_MEMORY, JIT_OFFSET, 0);
+        jit_mem(e, false, 0x8b, X86_RAX, JIT_PAGE, X86_NONE, JIT_PAGE_OFFSET(dirty_offset));
+        jit_reg(e, false, 0x01, JIT_OFFSET, X86_RAX);
+        jit_shift(e, false, X86_RAX, NES_DIRTY_PAGE_SHIFT);
+        jit_mem(e, true, 0x8b, X86_RCX, JIT_PAGE, X86_NONE, JIT_PAGE_OFFSET(dirty));
+        jit_mem(e, true, 0x0fab, X86_RAX, X86_RCX, X86_NONE, 0);
+        break;
+    }
+    jit_bus_write(e);
+}
+
+// Pushes a byte register (or an immediate if reg is X86_NONE) on the stack in ram
+static void jit_emit_push(JIT_EMITTER* e, int reg, uint8_t value)
+{
+    jit_mem(e, false, 0x0fb6, X86_RAX, JIT_CPU, X86_NONE, JIT_CPU_OFFSET(S));
+    if (reg == X86_NONE)
+    {
+        jit_mem(e, false, 0xc6, 0, JIT_CPU, X86_RAX, JIT_CPU_OFFSET(memory_low) + 0x100);
+        jit_byte(e, value);
+    }
+    else
+        jit_mem(e, false, 0x88, reg, JIT_CPU, X86_RAX, JIT_CPU_OFFSET(memory_low) + 0x100);
+    jit_alu_imm(e, X86_ADD, X86_RAX, 0x100);
+    jit_shift(e, false, X86_RAX, NES_DIRTY_PAGE_SHIFT);
+    jit_mem(e, true, 0x0fab, X86_RAX, JIT_CPU, X86_NONE, JIT_DIRTY_RAM);
+    jit_mem(e, false, 0xfe, 1, JIT_CPU, X86_NONE, JIT_CPU_OFFSET(S));     // dec byte [S]
+    jit_bus_write(e);
+}
+
+// Pops a byte from the stack in ram into a 32 bit register
+static void jit_emit_pop(JIT_EMITTER* e, int reg)
+{
+    jit_mem(e, false, 0xfe, 0, JIT_CPU, X86_NONE, JIT_CPU_OFFSET(S));     // inc byte [S]
+    jit_mem(e, false, 0x0fb6, X86_RAX, JIT_CPU, X86_NONE, JIT_CPU_OFFSET(S));
+    jit_mem(e, false, 0x0fb6, reg, JIT_CPU, X86_RAX, JIT_CPU_OFFSET(memory_low) + 0x100);
+}
+
+// C and V from the host flags after adc / sbb, then N and Z of A
+static void jit_emit_arithmetic_flags(JIT_EMITTER* e)
+{
+    jit_reg(e, false, 0x0f90 | X86_CC_C, 0, JIT_C);
+    jit_mem(e, false, 0x0f90 | X86_CC_O, 0, JIT_CPU, X86_NONE, JIT_CPU_OFFSET(V));
+    jit_nz(e, JIT_A);
+}
+
+static void jit_emit_compare(JIT_EMITTER* e, int reg)
+{
+    jit_reg(e, false, 0x89, reg, X86_RCX);
+    jit_reg(e, false, 0x28, X86_RDX, X86_RCX);      // sub cl, dl
+    jit_reg(e, false, 0x0f90 | X86_CC_NC, 0, JIT_C);
+    jit_reg(e, false, 0x0fb6, JIT_NZ, X86_RCX);
+}
+
+// P with B and reserved set in edx, for PHP
+static void jit_emit_pack_flags(JIT_EMITTER* e)
+{
+    static const uint8_t shifts[3] = { 2, 3, 6 };
+    const int32_t offsets[3] = { JIT_CPU_OFFSET(I), JIT_CPU_OFFSET(D), JIT_CPU_OFFSET(V) };
+
+    jit_reg(e, false, 0x89, JIT_C, X86_RDX);
+    jit_alu_imm(e, X86_OR, X86_RDX, CPU_FLAG_B | CPU_FLAG_RESERVED);
+    for (uint32_t i = 0; i < 3; i++)
+    {
+        jit_mem(e, false, 0x0fb6, X86_RCX, JIT_CPU, X86_NONE, offsets[i]);
+        jit_shift(e, true, X86_RCX, shifts[i]);
+        jit_reg(e, false, 0x09, X86_RCX, X86_RDX);
+    }
+
+    jit_reg(e, false, 0xf7, 0, JIT_NZ);     // test esi, 0xff
+    jit_u32(e, 0xff);
+    jit_reg(e, false, 0x0f90 | X86_CC_Z, 0, X86_RCX);
+    jit_reg(e, false, 0x0fb6, X86_RCX, X86_RCX);
+    jit_reg(e, false, 0x01, X86_RCX, X86_RCX);
+    jit_reg(e, false, 0x09, X86_RCX, X86_RDX);
+
+    jit_reg(e, false, 0xf7, 0, JIT_NZ);     // test esi, 0x8080
+    jit_u32(e, 0x8080);
+    jit_reg(e, false, 0x0f90 | X86_CC_NZ, 0, X86_RCX);
+    jit_reg(e, false, 0x0fb6, X86_RCX, X86_RCX);
+    jit_shift(e, true, X86_RCX, 7);
+    jit_reg(e, false, 0x09, X86_RCX, X86_RDX);
+}
+
+// Back from the P popped in edx, like cpu_set_flags
+static void jit_emit_unpack_flags(JIT_EMITTER* e)
+{
+    static const uint8_t shifts[3] = { 2, 3, 6 };
+    const int32_t offsets[3] = { JIT_CPU_OFFSET(I), JIT_CPU_OFFSET(D), JIT_CPU_OFFSET(V) };
+
+    jit_reg(e, false, 0x89, X86_RDX, JIT_C);
+    jit_alu_imm(e, X86_AND, JIT_C, 1);
+    for (uint32_t i = 0; i < 3; i++)
+    {
+        jit_reg(e, false, 0x89, X86_RDX, X86_RCX);
+        jit_shift(e, false, X86_RCX, shifts[i]);
+        jit_alu_imm(e, X86_AND, X86_RCX, 1);
+        jit_mem(e, false, 0x88, X86_RCX, JIT_CPU, X86_NONE, offsets[i]);
+    }
+
+    jit_reg(e, false, 0x89, X86_RDX, JIT_NZ);
+    jit_alu_imm(e, X86_AND, JIT_NZ, CPU_FLAG_N);
+    jit_shift(e, true, JIT_NZ, 8);
+    jit_reg(e, false, 0x89, X86_RDX, X86_RCX);
+    jit_reg(e, false, 0xf7, 2, X86_RCX);    // not ecx
+    jit_alu_imm(e, X86_AND, X86_RCX, CPU_FLAG_Z);
+    jit_reg(e, false, 0x09, X86_RCX, JIT_NZ);
+}
+
+// Shifts and rotations of edx, the carry goes through ecx
+static void jit_emit_shift(JIT_EMITTER* e, uint8_t op)
+{
+    bool left = (op == JIT_OP_ASL || op == JIT_OP_ROL);
+
+    jit_reg(e, false, 0x89, X86_RDX, X86_RCX);
+    if (left)
+        jit_shift(e, false, X86_RCX, 7);
+    else
+        jit_alu_imm(e, X86_AND, X86_RCX, 1);
+
+    if (op == JIT_OP_ROL || op == JIT_OP_ROR)
+    {
+        jit_reg(e, false, 0x89, JIT_C, X86_RAX);
+        if (!left)
+            jit_shift(e, true, X86_RAX, 7);
+    }
+
+    if (left)
+    {
+        jit_reg(e, false, 0x01, X86_RDX, X86_RDX);
+        if (op == JIT_OP_ROL)
+            jit_reg(e, false, 0x09, X86_RAX, X86_RDX);
+        jit_reg(e, false, 0x0fb6, X86_RDX, X86_RDX);
+    }
+    else
+    {
+        jit_shift(e, false, X86_RDX, 1);
+        if (op == JIT_OP_ROR)
+            jit_reg(e, false, 0x09, X86_RAX, X86_RDX);
+    }
+
+    jit_reg(e, false, 0x89, X86_RCX, JIT_C);
+    jit_nz(e, X86_RDX);
+}
+
+// What the cpu shows after instruction i : its operand, mode and the instructions run since the top of the block
+static void jit_emit_last_instruction(JIT_EMITTER* e, uint32_t i)
+{
+    const CPU_JIT_INSTRUCTION* instruction = &e->instructions[i];
+
+    jit_mem(e, false, 0xc7, 0, JIT_CPU, X86_NONE, JIT_CPU_OFFSET(addressing_mode));
+    jit_u32(e, (uint32_t)instruction->mode);
+    if (cpu_jit_static_operand(instruction->mode))
+    {
+        jit_byte(e, 0x66);
+        jit_mem(e, false, 0xc7, 0, JIT_CPU, X86_NONE, JIT_CPU_OFFSET(operand_address));
+        jit_u16(e, instruction->operand_address);
+    }
+    jit_mem(e, true, 0x83, X86_ADD, JIT_CPU, X86_NONE, JIT_CPU_OFFSET(instructions));
+    jit_byte(e, i + 1);
+}
+
+static void jit_emit_set_pc(JIT_EMITTER* e, uint16_t pc)
+{
+    jit_byte(e, 0x66);
+    jit_mem(e, false, 0xc7, 0, JIT_CPU, X86_NONE, JIT_CPU_OFFSET(PC));
+    jit_u16(e, pc);
+}
+
+// Leaves after instruction i, with PC already stored when pc is negative
+static void jit_emit_leave(JIT_EMITTER* e, uint32_t i, int32_t pc)
+{
+    if (pc >= 0)
+        jit_emit_set_pc(e, pc);
+    jit_emit_last_instruction(e, i);
+    jit_jump_to(e, -1, e->epilogue);
+}
+
+// Jump back to the start of the block after instruction i, if another pass fits the budget
+static void jit_emit_loop(JIT_EMITTER* e, uint32_t i)
+{
+    jit_emit_last_instruction(e, i);
+    jit_reg(e, false, 0x39, JIT_LIMIT, JIT_CYCLES);     // cmp ebx, ebp
+    jit_jump_to(e, X86_CC_BE, e->top);
+    jit_emit_set_pc(e, e->instructions[0].address);
+    jit_jump_to(e, -1, e->epilogue);
+}
+
+// flag is one of CPU_FLAG_*, tested where the block keeps it
+static void jit_emit_branch(JIT_EMITTER* e, uint32_t i, uint8_t flag, bool taken_if_set)
+{
+    const CPU_JIT_INSTRUCTION* instruction = &e->instructions[i];
+    uint16_t target = instruction->operand_address + 2;
+    int set = X86_CC_NZ;    // Host condition when the flag is set
+
+    jit_add_cycles(e, 2);
+    switch (flag)
+    {
+    case CPU_FLAG_N:
+        jit_reg(e, false, 0xf7, 0, JIT_NZ);     // test esi, 0x8080
+        jit_u32(e, 0x8080);
+        break;
+    case CPU_FLAG_Z:
+        jit_reg(e, false, 0xf7, 0, JIT_NZ);     // test esi, 0xff
+        jit_u32(e, 0xff);
+        set = X86_CC_Z;
+        break;
+    case CPU_FLAG_C:
+        jit_reg(e, false, 0x85, JIT_C, JIT_C);
+        break;
+    case CPU_FLAG_V:
+        jit_mem(e, false, 0x80, 7, JIT_CPU, X86_NONE, JIT_CPU_OFFSET(V));     // cmp byte [V], 0
+        jit_byte(e, 0);
+        break;
+    }
+    uint32_t not_taken = jit_jump_forward(e, taken_if_set ? set ^ 1 : set);
+
+    jit_add_cycles(e, 1 + (((instruction->address + 2) & 0xff00) != (target & 0xff00)));
+    if (target == e->instructions[0].address)
+        jit_emit_loop(e, i);
+    else
+        jit_emit_leave(e, i, target);
+
+    jit_patch(e, not_taken);
+}
+
+static void jit_emit_instruction(JIT_EMITTER* e, uint32_t i)
+{
+    const CPU_JIT_INSTRUCTION* instruction = &e->instructions[i];
+    CPU_JIT_ACCESS access = cpu_jit_access(instruction);
+    JIT_LOCATION location = JIT_LOCATION_RAM;
+
+    if (access != JIT_ACCESS_NONE)
+        location = jit_emit_address(e, i, access);
+
+    // Nothing leaves the block from here on
+    if (instruction->mode != AM_REL)
+        jit_add_cycles(e, cpu_base_cycles[instruction->opcode]);
+
+    if (access == JIT_ACCESS_READ || access == JIT_ACCESS_RMW)
+        jit_emit_load(e, instruction, location);
+    else if (instruction->mode == AM_IMM)
+        jit_mov_imm(e, X86_RDX, instruction->operand & 0xff);
+    else if (instruction->mode == AM_A)
+        jit_reg(e, false, 0x89, JIT_A, X86_RDX);
+
+    switch (instruction->op)
+    {
+    case JIT_OP_LDA:    jit_reg(e, false, 0x89, X86_RDX, JIT_A); jit_nz(e, JIT_A); break;
+    case JIT_OP_LDX:    jit_reg(e, false, 0x89, X86_RDX, JIT_X); jit_nz(e, JIT_X); break;
+    case JIT_OP_LDY:    jit_reg(e, false, 0x89, X86_RDX, JIT_Y); jit_nz(e, JIT_Y); break;
+    case JIT_OP_STA:    jit_emit_store(e, instruction, location, JIT_A); break;
+    case JIT_OP_STX:    jit_emit_store(e, instruction, location, JIT_X); break;
+    case JIT_OP_STY:    jit_emit_store(e, instruction, location, JIT_Y); break;
+
+    case JIT_OP_ORA:    jit_reg(e, false, 0x09, X86_RDX, JIT_A); jit_nz(e, JIT_A); break;
+    case JIT_OP_AND:    jit_reg(e, false, 0x21, X86_RDX, JIT_A); jit_nz(e, JIT_A); break;
+    case JIT_OP_EOR:    jit_reg(e, false, 0x31, X86_RDX, JIT_A); jit_nz(e, JIT_A); break;
+
+    case JIT_OP_ADC:
+        jit_reg(e, false, 0x0fba, 4, JIT_C);    // bt r11d, 0
+        jit_byte(e, 0);
+        jit_reg(e, false, 0x10, X86_RDX, JIT_A);    // adc r8b, dl
+        jit_emit_arithmetic_flags(e);
+        break;
+    case JIT_OP_SBC:    // The 6502 carry is the opposite of the x86 borrow
+        jit_reg(e, false, 0x0fba, 4, JIT_C);
+        jit_byte(e, 0);
+        jit_byte(e, 0xf5);  // cmc
+        jit_reg(e, false, 0x18, X86_RDX, JIT_A);    // sbb r8b, dl
+        jit_byte(e, 0xf5);
+        jit_emit_arithmetic_flags(e);
+        break;
+
+    case JIT_OP_CMP:    jit_emit_compare(e, JIT_A); break;
+    case JIT_OP_CPX:    jit_emit_compare(e, JIT_X); break;
+    case JIT_OP_CPY:    jit_emit_compare(e, JIT_Y); break;
+
+    case JIT_OP_BIT:    // N from the operand even when Z is set, like the handler
+        jit_reg(e, false, 0x89, X86_RDX, X86_RAX);
+        jit_alu_imm(e, X86_AND, X86_RAX, 0x80);
+        jit_shift(e, true, X86_RAX, 8);
+        jit_reg(e, false, 0x89, X86_RDX, JIT_NZ);
+        jit_reg(e, false, 0x21, JIT_A, JIT_NZ);
+        jit_reg(e, false, 0x09, X86_RAX, JIT_NZ);
+        jit_shift(e, false, X86_RDX, 6);
+        jit_alu_imm(e, X86_AND, X86_RDX, 1);
+        jit_mem(e, false, 0x88, X86_RDX, JIT_CPU, X86_NONE, JIT_CPU_OFFSET(V));
+        break;
+
+    case JIT_OP_ASL:
+    case JIT_OP_LSR:
+    case JIT_OP_ROL:
+    case JIT_OP_ROR:
+        jit_emit_shift(e, instruction->op);
+        if (instruction->mode == AM_A)
+            jit_reg(e, false, 0x89, X86_RDX, JIT_A);
+        else
+            jit_emit_store(e, instruction, location, X86_RDX);
+        break;
+
+    case JIT_OP_INC:
+    case JIT_OP_DEC:
+        jit_alu_imm(e, instruction->op == JIT_OP_INC ? X86_ADD : X86_SUB, X86_RDX, 1);
+        jit_reg(e, false, 0x0fb6, X86_RDX, X86_RDX);
+        jit_emit_store(e, instruction, location, X86_RDX);
+        jit_nz(e, X86_RDX);
+        break;
+
+    case JIT_OP_INX:    jit_reg(e, false, 0xfe, 0, JIT_X); jit_nz(e, JIT_X); break;
+    case JIT_OP_INY:    jit_reg(e, false, 0xfe, 0, JIT_Y); jit_nz(e, JIT_Y); break;
+    case JIT_OP_DEX:    jit_reg(e, false, 0xfe, 1, JIT_X); jit_nz(e, JIT_X); break;
+    case JIT_OP_DEY:    jit_reg(e, false, 0xfe, 1, JIT_Y); jit_nz(e, JIT_Y); break;
+
+    case JIT_OP_TAX:    jit_reg(e, false, 0x89, JIT_A, JIT_X); jit_nz(e, JIT_X); break;
+    case JIT_OP_TAY:    jit_reg(e, false, 0x89, JIT_A, JIT_Y); jit_nz(e, JIT_Y); break;
+    case JIT_OP_TXA:    jit_reg(e, false, 0x89, JIT_X, JIT_A); jit_nz(e, JIT_A); break;
+    case JIT_OP_TYA:    jit_reg(e, false, 0x89, JIT_Y, JIT_A); jit_nz(e, JIT_A); break;
+    case JIT_OP_TXS:    jit_mem(e, false, 0x88, JIT_X, JIT_CPU, X86_NONE, JIT_CPU_OFFSET(S)); break;
+    case JIT_OP_TSX:    jit_mem(e, false, 0x0fb6, JIT_X, JIT_CPU, X86_NONE, JIT_CPU_OFFSET(S)); jit_nz(e, JIT_X); break;
+
+    case JIT_OP_CLC:    jit_reg(e, false, 0x31, JIT_C, JIT_C); break;
+    case JIT_OP_SEC:    jit_mov_imm(e, JIT_C, 1); break;
+    case JIT_OP_CLI:    jit_set_flag(e, JIT_CPU_OFFSET(I), 0); break;
+    case JIT_OP_SEI:    jit_set_flag(e, JIT_CPU_OFFSET(I), 1); break;
+    case JIT_OP_CLD:    jit_set_flag(e, JIT_CPU_OFFSET(D), 0); break;
+    case JIT_OP_SED:    jit_set_flag(e, JIT_CPU_OFFSET(D), 1); break;
+    case JIT_OP_CLV:    jit_set_flag(e, JIT_CPU_OFFSET(V), 0); break;
+
+    case JIT_OP_PHA:    jit_emit_push(e, JIT_A, 0); break;
+    case JIT_OP_PHP:    jit_emit_pack_flags(e); jit_emit_push(e, X86_RDX, 0); break;
+    case JIT_OP_PLA:    jit_emit_pop(e, JIT_A); jit_nz(e, JIT_A); break;
+    case JIT_OP_PLP:    jit_emit_pop(e, X86_RDX); jit_emit_unpack_flags(e); break;
+
+    case JIT_OP_NOP:    break;
+
+    case JIT_OP_BPL:    jit_emit_branch(e, i, CPU_FLAG_N, false); break;
+    case JIT_OP_BMI:    jit_emit_branch(e, i, CPU_FLAG_N, true); break;
+    case JIT_OP_BVC:    jit_emit_branch(e, i, CPU_FLAG_V, false); break;
+    case JIT_OP_BVS:    jit_emit_branch(e, i, CPU_FLAG_V, true); break;
+    case JIT_OP_BCC:    jit_emit_branch(e, i, CPU_FLAG_C, false); break;
+    case JIT_OP_BCS:    jit_emit_branch(e, i, CPU_FLAG_C, true); break;
+    case JIT_OP_BNE:    jit_emit_branch(e, i, CPU_FLAG_Z, false); break;
+    case JIT_OP_BEQ:    jit_emit_branch(e, i, CPU_FLAG_Z, true); break;
+
+    case JIT_OP_JMP:
+        if (instruction->operand == e->instructions[0].address)
+            jit_emit_loop(e, i);
+        else
+            jit_emit_leave(e, i, instruction->operand);
+        break;
+
+    case JIT_OP_JSR:    // Pushes the address of its last byte
+        jit_emit_push(e, X86_NONE, (instruction->address + 2) >> 8);
+        jit_emit_push(e, X86_NONE, (instruction->address + 2) & 0xff);
+        jit_emit_leave(e, i, instruction->operand);
+        break;
+
+    case JIT_OP_RTS:
+        jit_emit_pop(e, X86_RCX);
+        jit_emit_pop(e, X86_RDX);
+        jit_shift(e, true, X86_RDX, 8);
+        jit_reg(e, false, 0x09, X86_RDX, X86_RCX);
+        jit_alu_imm(e, X86_ADD, X86_RCX, 1);
+        jit_byte(e, 0x66);
+        jit_mem(e, false, 0x89, X86_RCX, JIT_CPU, X86_NONE, JIT_CPU_OFFSET(PC));
+        jit_emit_leave(e, i, -1);
+        break;
+    }
+}
+static bool cpu_jit_translate(CPU* cpu, CPU_JIT_ENTRY* entry)
+{
+    CPU_JIT* jit = cpu->jit;
+    JIT_EMITTER emitter;
+    JIT_EMITTER* e = &emitter;
+    uint16_t address = cpu->PC;
+
+    memset(e, 0, sizeof(JIT_EMITTER));
+    uint32_t max_cycles = cpu_jit_decode(cpu->pages[address >> CPU_PAGE_SHIFT].read, address, e->instructions, &e->count);
+    if (e->count == 0)
+        return false;
+
+    if (jit->code_size + CPU_JIT_MAX_BLOCK_SIZE > CPU_JIT_CODE_CAPACITY)
+    {
+        for (uint32_t i = 0; i < cpu->nes->PRG_ROM_size; i++)
+        {
+            if (!jit->entries[i].recompiled)
+                memset(&jit->entries[i], 0, sizeof(CPU_JIT_ENTRY));
+        }
+        jit->code_size = 0;
+        jit->flushes++;
+    }
+    e->code = &jit->code[jit->code_size];
+
+    // Epilogue first so every exit jumps back to a known position
+    e->epilogue = e->size;
+    jit_mem(e, false, 0x88, JIT_A, JIT_CPU, X86_NONE, JIT_CPU_OFFSET(A));
+    jit_mem(e, false, 0x88, JIT_X, JIT_CPU, X86_NONE, JIT_CPU_OFFSET(X));
+    jit_mem(e, false, 0x88, JIT_Y, JIT_CPU, X86_NONE, JIT_CPU_OFFSET(Y));
+    jit_byte(e, 0x66);
+    jit_mem(e, false, 0x89, JIT_NZ, JIT_CPU, X86_NONE, JIT_CPU_OFFSET(nz));
+    jit_mem(e, false, 0x88, JIT_C, JIT_CPU, X86_NONE, JIT_CPU_OFFSET(C));
+    jit_reg(e, false, 0x89, JIT_CYCLES, X86_RAX);
+    jit_pop(e, X86_R14);
+    jit_pop(e, X86_R13);
+    jit_pop(e, X86_R12);
+    jit_pop(e, X86_RBP);
+    jit_pop(e, X86_RBX);
+    jit_byte(e, 0xc3);
+
+    uint32_t start = e->size;
+    jit_push(e, X86_RBX);
+    jit_push(e, X86_RBP);
+    jit_push(e, X86_R12);
+    jit_push(e, X86_R13);
+    jit_push(e, X86_R14);
+    jit_reg(e, false, 0x89, X86_RSI, JIT_LIMIT);
+    jit_reg(e, false, 0x31, JIT_CYCLES, JIT_CYCLES);
+    jit_mem(e, false, 0x0fb6, JIT_A, JIT_CPU, X86_NONE, JIT_CPU_OFFSET(A));
+    jit_mem(e, false, 0x0fb6, JIT_X, JIT_CPU, X86_NONE, JIT_CPU_OFFSET(X));
+    jit_mem(e, false, 0x0fb6, JIT_Y, JIT_CPU, X86_NONE, JIT_CPU_OFFSET(Y));
+    jit_mem(e, false, 0x0fb7, JIT_NZ, JIT_CPU, X86_NONE, JIT_CPU_OFFSET(nz));
+    jit_mem(e, false, 0x0fb6, JIT_C, JIT_CPU, X86_NONE, JIT_CPU_OFFSET(C));
+    e->top = e->size;
+
+    for (uint32_t i = 0; i < e->count; i++)
+        jit_emit_instruction(e, i);
+
+    const CPU_JIT_INSTRUCTION* last = &e->instructions[e->count - 1];
+    if (last->op != JIT_OP_JMP && last->op != JIT_OP_JSR && last->op != JIT_OP_RTS)
+        jit_emit_leave(e, e->count - 1, last->address + instruction_length[last->mode]);
+
+    // Exits before an instruction whose operand isn't ram, rom or PRG RAM, so the specialized engine runs it
+    uint32_t stubs[CPU_JIT_MAX_INSTRUCTIONS] = { 0 };
+    for (uint32_t i = 0; i < e->exit_count; i++)
+    {
+        uint8_t instruction = e->exits[i].instruction;
+        if (stubs[instruction] == 0)
+        {
+            stubs[instruction] = e->size;
+            jit_emit_set_pc(e, e->instructions[instruction].address);
+            if (instruction > 0)
+                jit_emit_last_instruction(e, instruction - 1);
+            jit_jump_to(e, -1, e->epilogue);
+        }
+        uint32_t rel = stubs[instruction] - (e->exits[i].at + 4);
+        memcpy(&e->code[e->exits[i].at], &rel, 4);
+    }
+
+    entry->code = (CPU_JIT_CODE)(void*)&e->code[start];
+    entry->address = address;
+    entry->max_cycles = max_cycles;
+    entry->runs = 0;
+    entry->failed = false;
+
+    jit->code_size += (e->size + 15) & ~15;
+    jit->blocks++;
+    return true;
+}
+
+#else
+
+static uint8_t* cpu_jit_alloc_code()
+{
+    printf("The jit engine needs Linux on x86-64\n");
+    return NULL;
+}
+
+static void cpu_jit_free_code(uint8_t* code)
+{
+    (void)code;
+}
+
+static bool cpu_jit_translate(CPU* cpu, CPU_JIT_ENTRY* entry)
+{
+    (void)cpu;
+    (void)entry;
+    return false;
+}
+
+#endif
@@ -0,0 +1,595 @@
+// Opcode specialized engine : every opcode of CPU_OPCODES gets its own handler with the operand fetch, the operation
+// and the cycle count fused, so nothing is decoded from the addressing mode at run time
+// Instructions in rom are only read from the bus the first time, after that they come from the decoded cache
+// Behaves exactly like the handlers of rp_2a03_cpu.c
+// Common idioms of 2 or 3 instructions also run as one superinstruction from cpu_run, when they fit before the next event
+
+#include "nes.h"
+#include "rp_2a03_cpu.h"
+#include "log.h"
+
+#include <stdio.h>
+
+// Ram and rom go straight through the page table, only registers need the whole address decoding
+static inline uint8_t cpu_fast_read(CPU* cpu, uint16_t address)
+{
+    uint8_t* page = cpu->pages[address >> CPU_PAGE_SHIFT].read;
+    if (page != NULL)
+        return page[address & (CPU_PAGE_SIZE - 1)];
+    return cpu_read_byte(cpu, address);
+}
+
+static inline uint16_t cpu_fast_read_word(CPU* cpu, uint16_t address)
+{
+    return cpu_fast_read(cpu, address) | ((uint16_t)cpu_fast_read(cpu, address + 1) << 8);
+}
+
+static inline void cpu_fast_write(CPU* cpu, uint16_t address, uint8_t value)
+{
+    cpu->bus_flags |= CPU_BUS_WRITE;
+
+    CPU_PAGE* page = &cpu->pages[address >> CPU_PAGE_SHIFT];
+    if (page->write != NULL)
+    {
+        page->write[address & (CPU_PAGE_SIZE - 1)] = value;
+        nes_mark_dirty(page->dirty, page->dirty_offset + (address & (CPU_PAGE_SIZE - 1)));
+        return;
+    }
+    cpu_write_byte(cpu, address, value);
+}
+
+// Operands, same as cpu_fetch_operands
+#define CPU_OPERAND_A       address = 0;
+#define CPU_OPERAND_IMPL    address = 0;
+#define CPU_OPERAND_IMM     address = cpu->PC + 1;
+#define CPU_OPERAND_ZPG     address = operand & 0xff;
+#define CPU_OPERAND_ZPG_X   address = (operand + cpu->X) & 0xff;
+#define CPU_OPERAND_ZPG_Y   address = (operand + cpu->Y) & 0xff;
+#define CPU_OPERAND_ABS     address = operand;
+#define CPU_OPERAND_ABS_X \
+    pointer = operand; \
+    cpu->page_boundary_crossed = ((pointer & 0xff00) != ((pointer + cpu->X) & 0xff00)); \
+    address = pointer + cpu->X;
+#define CPU_OPERAND_ABS_Y \
+    pointer = operand; \
+    cpu->page_boundary_crossed = ((pointer & 0xff00) != ((pointer + cpu->Y) & 0xff00)); \
+    address = pointer + cpu->Y;
+#define CPU_OPERAND_IND \
+    pointer = operand; \
+    address = (cpu_fast_read(cpu, (((pointer + 1) & 0xff) | (pointer & 0xff00))) << 8) | cpu_fast_read(cpu, pointer);
+#define CPU_OPERAND_X_IND \
+    pointer = ((operand + cpu->X) & 0xff); \
+    address = (cpu_fast_read(cpu, (((pointer + 1) & 0xff) | (pointer & 0xff00))) << 8) | cpu_fast_read(cpu, pointer);
+#define CPU_OPERAND_IND_Y \
+    zero_page = operand & 0xff; \
+    pointer = cpu_fast_read(cpu, zero_page) + cpu_fast_read(cpu, ((zero_page + 1) & 0xff)) * 256; \
+    cpu->page_boundary_crossed = ((pointer & 0xff00) != ((pointer + cpu->Y) & 0xff00)); \
+    address = pointer + cpu->Y;
+#define CPU_OPERAND_REL \
+    value = operand & 0xff; \
+    address = cpu->PC + (int16_t)*(int8_t*)&value;
+
+// Immediates are already in the decoded operand
+#define CPU_READ(mode)      (AM_##mode == AM_IMM ? (uint8_t)operand : cpu_fast_read(cpu, address))
+
+#define CPU_CYCLES(opcode)  cpu->cycle = cpu_base_cycles[opcode] + (cpu_page_cycles[opcode] ? cpu->page_boundary_crossed : 0);
+
+#define CPU_NZ(register)    cpu->nz = (register);
+
+// Operations, same as the handlers of rp_2a03_cpu.c
+#define CPU_OP_BIT(opcode, mode) \
+    value = cpu_fast_read(cpu, address); \
+    cpu->nz = (value & cpu->A) | ((value & 0x80) << 8); \
+    cpu->V = (value >> 6) & 1; \
+    CPU_CYCLES(opcode)
+
+#define CPU_COMPARE(opcode, mode, register) \
+    value = CPU_READ(mode); \
+    cpu->nz = (uint8_t)(register - value); \
+    cpu->C = (register >= value); \
+    CPU_CYCLES(opcode)
+#define CPU_OP_CMP(opcode, mode)    CPU_COMPARE(opcode, mode, cpu->A)
+#define CPU_OP_CPX(opcode, mode)    CPU_COMPARE(opcode, mode, cpu->X)
+#define CPU_OP_CPY(opcode, mode)    CPU_COMPARE(opcode, mode, cpu->Y)
+
+#define CPU_OP_CLI(opcode, mode)    cpu->I = 0; cpu->cycle = 2;
+#define CPU_OP_SEI(opcode, mode)    cpu->I = 1; cpu->cycle = 2;
+#define CPU_OP_CLD(opcode, mode)    cpu->D = 0; cpu->cycle = 2;
+#define CPU_OP_SED(opcode, mode)    cpu->D = 1; cpu->cycle = 2;
+#define CPU_OP_SEC(opcode, mode)    cpu->C = 1; cpu->cycle = 2;
+#define CPU_OP_CLC(opcode, mode)    cpu->C = 0; cpu->cycle = 2;
+#define CPU_OP_CLV(opcode, mode)    cpu->V = 0; cpu->cycle = 2;
+
+#define CPU_OP_PHP(opcode, mode) \
+    cpu_push_byte(cpu, cpu_get_flags(cpu) | CPU_FLAG_B); \
+    cpu->cycle = 3;
+#define CPU_OP_PLP(opcode, mode)    cpu_set_flags(cpu, cpu_pop_byte(cpu)); cpu->cycle = 4;
+#define CPU_OP_PHA(opcode, mode)    cpu_push_byte(cpu, cpu->A); cpu->cycle = 3;
+#define CPU_OP_PLA(opcode, mode)    cpu->A = cpu_pop_byte(cpu); CPU_NZ(cpu->A) cpu->cycle = 4;
+
+#define CPU_OP_ORA(opcode, mode)    cpu->A |= CPU_READ(mode); CPU_NZ(cpu->A) CPU_CYCLES(opcode)
+#define CPU_OP_AND(opcode, mode)    cpu->A &= CPU_READ(mode); CPU_NZ(cpu->A) CPU_CYCLES(opcode)
+#define CPU_OP_EOR(opcode, mode)    cpu->A ^= CPU_READ(mode); CPU_NZ(cpu->A) CPU_CYCLES(opcode)
+
+// Read-modify-write, on the accumulator or in memory
+#define CPU_RMW(opcode, mode, operation) \
+    value = (AM_##mode == AM_A ? cpu->A : cpu_fast_read(cpu, address)); \
+    operation \
+    CPU_NZ(value) \
+    if (AM_##mode == AM_A) \
+        cpu->A = value; \
+    else \
+        cpu_fast_write(cpu, address, value); \
+    CPU_CYCLES(opcode)
+#define CPU_OP_ASL(opcode, mode)    CPU_RMW(opcode, mode, cpu->C = (value >> 7); value <<= 1;)
+#define CPU_OP_LSR(opcode, mode)    CPU_RMW(opcode, mode, cpu->C = (value & 1); value >>= 1;)
+#define CPU_OP_ROL(opcode, mode)    CPU_RMW(opcode, mode, carry = cpu->C; cpu->C = (value >> 7); value <<= 1; value |= carry;)
+#define CPU_OP_ROR(opcode, mode)    CPU_RMW(opcode, mode, carry = cpu->C; cpu->C = (value & 1); value >>= 1; value |= (carry << 7);)
+
+#define CPU_OP_ADC(opcode, mode) \
+    value = CPU_READ(mode); \
+    sum = cpu->A + value + cpu->C; \
+    cpu->V = (((cpu->A ^ sum) & (value ^ sum)) >> 7) & 1; \
+    cpu->A = (uint8_t)sum; \
+    CPU_NZ(cpu->A) \
+    cpu->C = (sum >> 8) & 1; \
+    CPU_CYCLES(opcode)
+#define CPU_OP_SBC(opcode, mode) \
+    value = CPU_READ(mode); \
+    difference = cpu->A - value - 1 + cpu->C; \
+    cpu->V = ((cpu->A ^ value) & 0x80) != 0 && ((cpu->A ^ (uint8_t)difference) & 0x80) != 0; \
+    cpu->A = (uint8_t)difference; \
+    CPU_NZ(cpu->A) \
+    cpu->C = difference >= 0; \
+    CPU_CYCLES(opcode)
+
+#define CPU_OP_DEC(opcode, mode)    value = cpu_fast_read(cpu, address) - 1; cpu_fast_write(cpu, address, value); CPU_NZ(value) CPU_CYCLES(opcode)
+#define CPU_OP_INC(opcode, mode)    value = cpu_fast_read(cpu, address) + 1; cpu_fast_write(cpu, address, value); CPU_NZ(value) CPU_CYCLES(opcode)
+#define CPU_OP_DEY(opcode, mode)    cpu->Y--; CPU_NZ(cpu->Y) cpu->cycle = 2;
+#define CPU_OP_INY(opcode, mode)    cpu->Y++; CPU_NZ(cpu->Y) cpu->cycle = 2;
+#define CPU_OP_DEX(opcode, mode)    cpu->X--; CPU_NZ(cpu->X) cpu->cycle = 2;
+#define CPU_OP_INX(opcode, mode)    cpu->X++; CPU_NZ(cpu->X) cpu->cycle = 2;
+
+#define CPU_OP_LDA(opcode, mode)    cpu->A = CPU_READ(mode); CPU_NZ(cpu->A) CPU_CYCLES(opcode)
+#define CPU_OP_LDX(opcode, mode)    cpu->X = CPU_READ(mode); CPU_NZ(cpu->X) CPU_CYCLES(opcode)
+#define CPU_OP_LDY(opcode, mode)    cpu->Y = CPU_READ(mode); CPU_NZ(cpu->Y) CPU_CYCLES(opcode)
+#define CPU_OP_STA(opcode, mode)    cpu_fast_write(cpu, address, cpu->A); CPU_CYCLES(opcode)
+#define CPU_OP_STX(opcode, mode)    cpu_fast_write(cpu, address, cpu->X); CPU_CYCLES(opcode)
+#define CPU_OP_STY(opcode, mode)    cpu_fast_write(cpu, address, cpu->Y); CPU_CYCLES(opcode)
+
+#define CPU_OP_TXA(opcode, mode)    cpu->A = cpu->X; CPU_NZ(cpu->A) cpu->cycle = 2;
+#define CPU_OP_TAX(opcode, mode)    cpu->X = cpu->A; CPU_NZ(cpu->X) cpu->cycle = 2;
+#define CPU_OP_TYA(opcode, mode)    cpu->A = cpu->Y; CPU_NZ(cpu->A) cpu->cycle = 2;
+#define CPU_OP_TAY(opcode, mode)    cpu->Y = cpu->A; CPU_NZ(cpu->Y) cpu->cycle = 2;
+#define CPU_OP_TXS(opcode, mode)    cpu->S = cpu->X; cpu->cycle = 2;
+#define CPU_OP_TSX(opcode, mode)    cpu->X = cpu->S; CPU_NZ(cpu->X) cpu->cycle = 2;
+
+#define CPU_BRANCH(condition) \
+    cpu->cycle = 2; \
+    if (condition) \
+    { \
+        cpu->cycle++; \
+        if (((cpu->PC + 2) & 0xff00) != ((address + 2) & 0xff00)) \
+            cpu->cycle++; \
+        cpu->PC = address; \
+    }
+#define CPU_OP_BPL(opcode, mode)    CPU_BRANCH(!cpu_flag_n(cpu))
+#define CPU_OP_BMI(opcode, mode)    CPU_BRANCH(cpu_flag_n(cpu))
+#define CPU_OP_BVC(opcode, mode)    CPU_BRANCH(!cpu->V)
+#define CPU_OP_BVS(opcode, mode)    CPU_BRANCH(cpu->V)
+#define CPU_OP_BCC(opcode, mode)    CPU_BRANCH(!cpu->C)
+#define CPU_OP_BCS(opcode, mode)    CPU_BRANCH(cpu->C)
+#define CPU_OP_BNE(opcode, mode)    CPU_BRANCH(!cpu_flag_z(cpu))
+#define CPU_OP_BEQ(opcode, mode)    CPU_BRANCH(cpu_flag_z(cpu))
+
+// Jumps land 3 bytes early (1 for the returns) to make up for the length of the instruction added afterwards
+#define CPU_OP_JMP(opcode, mode)    cpu->PC = address - 3; CPU_CYCLES(opcode)
+#define CPU_OP_JSR(opcode, mode)    cpu_push_word(cpu, cpu->PC + 2); cpu->PC = address - 3; cpu->cycle = 6;
+#define CPU_OP_RTS(opcode, mode)    cpu->PC = cpu_pop_word(cpu); cpu->cycle = 6;
+#define CPU_OP_RTI(opcode, mode)    cpu_set_flags(cpu, cpu_pop_byte(cpu)); cpu->PC = cpu_pop_word(cpu) - 1; cpu->cycle = 6;
+#define CPU_OP_BRK(opcode, mode) \
+    if (cpu->nmi_requested) \
+    { \
+        cpu_throw_interrupt(cpu, cpu_read_word(cpu, CPU_NMI_VECTOR), cpu->PC + 2, true, false); \
+        cpu->I = true; \
+        cpu->nmi_requested = false; \
+    } \
+    else \
+        cpu_throw_interrupt(cpu, cpu_read_word(cpu, CPU_BRK_VECTOR), cpu->PC + 2, true, false); \
+    cpu->PC--; \
+    cpu->nmi_last_requested = false;
+#define CPU_OP_NOP(opcode, mode)    cpu->cycle = 2;
+
+// Unofficial, same as the handlers of rp_2a03_cpu.c
+#define CPU_ORA_VALUE               cpu->A |= value; CPU_NZ(cpu->A)
+#define CPU_AND_VALUE               cpu->A &= value; CPU_NZ(cpu->A)
+#define CPU_EOR_VALUE               cpu->A ^= value; CPU_NZ(cpu->A)
+#define CPU_OP_SLO(opcode, mode)    CPU_RMW(opcode, mode, cpu->C = (value >> 7); value <<= 1;) CPU_ORA_VALUE
+#define CPU_OP_RLA(opcode, mode)    CPU_RMW(opcode, mode, carry = cpu->C; cpu->C = (value >> 7); value <<= 1; value |= carry;) CPU_AND_VALUE
+#define CPU_OP_SRE(opcode, mode)    CPU_RMW(opcode, mode, cpu->C = (value & 1); value >>= 1;) CPU_EOR_VALUE
+#define CPU_OP_RRA(opcode, mode) \
+    CPU_RMW(opcode, mode, carry = cpu->C; cpu->C = (value & 1); value >>= 1; value |= (carry << 7);) \
+    sum = cpu->A + value + cpu->C; \
+    cpu->V = (((cpu->A ^ sum) & (value ^ sum)) >> 7) & 1; \
+    cpu->A = (uint8_t)sum; \
+    CPU_NZ(cpu->A) \
+    cpu->C = (sum >> 8) & 1;
+#define CPU_OP_SAX(opcode, mode)    cpu_fast_write(cpu, address, cpu->A & cpu->X); CPU_CYCLES(opcode)
+#define CPU_OP_LAX(opcode, mode)    cpu->A = cpu->X = CPU_READ(mode); CPU_NZ(cpu->A) CPU_CYCLES(opcode)
+#define CPU_OP_DCP(opcode, mode) \
+    value = cpu_fast_read(cpu, address) - 1; \
+    cpu_fast_write(cpu, address, value); \
+    cpu->nz = (uint8_t)(cpu->A - value); \
+    cpu->C = (cpu->A >= value); \
+    CPU_CYCLES(opcode)
+#define CPU_OP_ISC(opcode, mode) \
+    value = cpu_fast_read(cpu, address) + 1; \
+    cpu_fast_write(cpu, address, value); \
+    difference = cpu->A - value - 1 + cpu->C; \
+    cpu->V = ((cpu->A ^ value) & 0x80) != 0 && ((cpu->A ^ (uint8_t)difference) & 0x80) != 0; \
+    cpu->A = (uint8_t)difference; \
+    CPU_NZ(cpu->A) \
+    cpu->C = difference >= 0; \
+    CPU_CYCLES(opcode)
+
+#define CPU_OP_ANC(opcode, mode)    cpu->A &= CPU_READ(mode); CPU_NZ(cpu->A) cpu->C = (cpu->A >> 7); cpu->cycle = 2;
+#define CPU_OP_ALR(opcode, mode)    cpu->A &= CPU_READ(mode); cpu->C = (cpu->A & 1); cpu->A >>= 1; CPU_NZ(cpu->A) cpu->cycle = 2;
+#define CPU_OP_ARR(opcode, mode) \
+    cpu->A &= CPU_READ(mode); \
+    cpu->A = (cpu->A >> 1) | (cpu->C << 7); \
+    CPU_NZ(cpu->A) \
+    cpu->C = (cpu->A >> 6) & 1; \
+    cpu->V = ((cpu->A >> 6) ^ (cpu->A >> 5)) & 1; \
+    cpu->cycle = 2;
+#define CPU_OP_ANE(opcode, mode)    cpu->A = (cpu->A | CPU_UNSTABLE_MAGIC) & cpu->X & CPU_READ(mode); CPU_NZ(cpu->A) cpu->cycle = 2;
+#define CPU_OP_LXA(opcode, mode)    cpu->A = cpu->X = (cpu->A | CPU_UNSTABLE_MAGIC) & CPU_READ(mode); CPU_NZ(cpu->A) cpu->cycle = 2;
+#define CPU_OP_SBX(opcode, mode) \
+    value = CPU_READ(mode); \
+    sum = cpu->A & cpu->X; \
+    cpu->X = sum - value; \
+    CPU_NZ(cpu->X) \
+    cpu->C = (sum >= value); \
+    cpu->cycle = 2;
+
+#define CPU_OP_LAS(opcode, mode)    cpu->A = cpu->X = cpu->S = CPU_READ(mode) & cpu->S; CPU_NZ(cpu->A) CPU_CYCLES(opcode)
+// The register ANDed with the high byte of the base address plus 1, that also replaces the high byte of the address
+// when indexing crossed a page
+#define CPU_STORE_AND_HIGH(opcode, index, register) \
+    value = (register) & (((uint16_t)(address - (index)) >> 8) + 1); \
+    if (cpu->page_boundary_crossed) \
+        address = (value << 8) | (address & 0xff); \
+    cpu_fast_write(cpu, address, value); \
+    CPU_CYCLES(opcode)
+#define CPU_OP_TAS(opcode, mode)    cpu->S = cpu->A & cpu->X; CPU_STORE_AND_HIGH(opcode, cpu->Y, cpu->S)
+#define CPU_OP_SHA(opcode, mode)    CPU_STORE_AND_HIGH(opcode, cpu->Y, cpu->A & cpu->X)
+#define CPU_OP_SHX(opcode, mode)    CPU_STORE_AND_HIGH(opcode, cpu->Y, cpu->X)
+#define CPU_OP_SHY(opcode, mode)    CPU_STORE_AND_HIGH(opcode, cpu->X, cpu->Y)
+
+#define CPU_OP_IGN(opcode, mode)    (void)CPU_READ(mode); CPU_CYCLES(opcode)
+#define CPU_OP_JAM(opcode, mode)    cpu->jammed = true; cpu->PC--; cpu->cycle = 2;
+
+// Operand bytes following each opcode
+#define CPU_OPERAND_BYTES_A         0
+#define CPU_OPERAND_BYTES_IMPL      0
+#define CPU_OPERAND_BYTES_IMM       1
+#define CPU_OPERAND_BYTES_ZPG       1
+#define CPU_OPERAND_BYTES_ZPG_X     1
+#define CPU_OPERAND_BYTES_ZPG_Y     1
+#define CPU_OPERAND_BYTES_REL       1
+#define CPU_OPERAND_BYTES_X_IND     1
+#define CPU_OPERAND_BYTES_IND_Y     1
+#define CPU_OPERAND_BYTES_ABS       2
+#define CPU_OPERAND_BYTES_ABS_X     2
+#define CPU_OPERAND_BYTES_ABS_Y     2
+#define CPU_OPERAND_BYTES_IND       2
+
+#define CPU_OPERAND_BYTES_ENTRY(opcode, instruction, mode)  CPU_OPERAND_BYTES_##mode,
+#define CPU_JAM_BYTES_ENTRY(opcode)                         0,
+
+static const uint8_t cpu_operand_bytes[256] = { CPU_OPCODES(CPU_OPERAND_BYTES_ENTRY, CPU_JAM_BYTES_ENTRY) };
+
+// Superinstructions, P(idiom, first, second) for pairs and T(idiom, first, second, third) for triples, each instruction
+// given by its opcode, operation and mode
+// No instruction of an idiom changes an index a later one addresses with, so all the operands are checked to be ram, rom
+// or PRG RAM before the first one runs
+#define CPU_SUPERINSTRUCTIONS(P, T) \
+    P(STEP_BRANCH, 0xCA, DEX, IMPL, 0xD0, BNE, REL) \
+    P(STEP_BRANCH, 0xCA, DEX, IMPL, 0xF0, BEQ, REL) \
+    P(STEP_BRANCH, 0xCA, DEX, IMPL, 0x10, BPL, REL) \
+    P(STEP_BRANCH, 0xCA, DEX, IMPL, 0x30, BMI, REL) \
+    P(STEP_BRANCH, 0x88, DEY, IMPL, 0xD0, BNE, REL) \
+    P(STEP_BRANCH, 0x88, DEY, IMPL, 0xF0, BEQ, REL) \
+    P(STEP_BRANCH, 0x88, DEY, IMPL, 0x10, BPL, REL) \
+    P(STEP_BRANCH, 0x88, DEY, IMPL, 0x30, BMI, REL) \
+    P(STEP_BRANCH, 0xE8, INX, IMPL, 0xD0, BNE, REL) \
+    P(STEP_BRANCH, 0xE8, INX, IMPL, 0xF0, BEQ, REL) \
+    P(STEP_BRANCH, 0xE8, INX, IMPL, 0x10, BPL, REL) \
+    P(STEP_BRANCH, 0xE8, INX, IMPL, 0x30, BMI, REL) \
+    P(STEP_BRANCH, 0xC8, INY, IMPL, 0xD0, BNE, REL) \
+    P(STEP_BRANCH, 0xC8, INY, IMPL, 0xF0, BEQ, REL) \
+    P(STEP_BRANCH, 0xC8, INY, IMPL, 0x10, BPL, REL) \
+    P(STEP_BRANCH, 0xC8, INY, IMPL, 0x30, BMI, REL) \
+    P(LOAD_STORE, 0xA9, LDA, IMM, 0x85, STA, ZPG) \
+    P(LOAD_STORE, 0xA9, LDA, IMM, 0x95, STA, ZPG_X) \
+    P(LOAD_STORE, 0xA9, LDA, IMM, 0x8D, STA, ABS) \
+    P(LOAD_STORE, 0xA9, LDA, IMM, 0x9D, STA, ABS_X) \
+    P(LOAD_STORE, 0xA9, LDA, IMM, 0x99, STA, ABS_Y) \
+    P(LOAD_STORE, 0xA5, LDA, ZPG, 0x85, STA, ZPG) \
+    P(LOAD_STORE, 0xA5, LDA, ZPG, 0x95, STA, ZPG_X) \
+    P(LOAD_STORE, 0xA5, LDA, ZPG, 0x8D, STA, ABS) \
+    P(LOAD_STORE, 0xA5, LDA, ZPG, 0x9D, STA, ABS_X) \
+    P(LOAD_STORE, 0xA5, LDA, ZPG, 0x99, STA, ABS_Y) \
+    P(LOAD_STORE, 0xB5, LDA, ZPG_X, 0x85, STA, ZPG) \
+    P(LOAD_STORE, 0xB5, LDA, ZPG_X, 0x95, STA, ZPG_X) \
+    P(LOAD_STORE, 0xB5, LDA, ZPG_X, 0x8D, STA, ABS) \
+    P(LOAD_STORE, 0xB5, LDA, ZPG_X, 0x9D, STA, ABS_X) \
+    P(LOAD_STORE, 0xB5, LDA, ZPG_X, 0x99, STA, ABS_Y) \
+    P(LOAD_STORE, 0xAD, LDA, ABS, 0x85, STA, ZPG) \
+    P(LOAD_STORE, 0xAD, LDA, ABS, 0x95, STA, ZPG_X) \
+    P(LOAD_STORE, 0xAD, LDA, ABS, 0x8D, STA, ABS) \
+    P(LOAD_STORE, 0xAD, LDA, ABS, 0x9D, STA, ABS_X) \
+    P(LOAD_STORE, 0xAD, LDA, ABS, 0x99, STA, ABS_Y) \
+    P(LOAD_STORE, 0xBD, LDA, ABS_X, 0x85, STA, ZPG) \
+    P(LOAD_STORE, 0xBD, LDA, ABS_X, 0x95, STA, ZPG_X) \
+    P(LOAD_STORE, 0xBD, LDA, ABS_X, 0x8D, STA, ABS) \
+    P(LOAD_STORE, 0xBD, LDA, ABS_X, 0x9D, STA, ABS_X) \
+    P(LOAD_STORE, 0xBD, LDA, ABS_X, 0x99, STA, ABS_Y) \
+    P(LOAD_STORE, 0xB9, LDA, ABS_Y, 0x85, STA, ZPG) \
+    P(LOAD_STORE, 0xB9, LDA, ABS_Y, 0x95, STA, ZPG_X) \
+    P(LOAD_STORE, 0xB9, LDA, ABS_Y, 0x8D, STA, ABS) \
+    P(LOAD_STORE, 0xB9, LDA, ABS_Y, 0x9D, STA, ABS_X) \
+    P(LOAD_STORE, 0xB9, LDA, ABS_Y, 0x99, STA, ABS_Y) \
+    P(COMPARE_BRANCH, 0xC9, CMP, IMM, 0xD0, BNE, REL) \
+    P(COMPARE_BRANCH, 0xC9, CMP, IMM, 0xF0, BEQ, REL) \
+    P(COMPARE_BRANCH, 0xC9, CMP, IMM, 0x90, BCC, REL) \
+    P(COMPARE_BRANCH, 0xC9, CMP, IMM, 0xB0, BCS, REL) \
+    P(COMPARE_BRANCH, 0xC5, CMP, ZPG, 0xD0, BNE, REL) \
+    P(COMPARE_BRANCH, 0xC5, CMP, ZPG, 0xF0, BEQ, REL) \
+    P(COMPARE_BRANCH, 0xC5, CMP, ZPG, 0x90, BCC, REL) \
+    P(COMPARE_BRANCH, 0xC5, CMP, ZPG, 0xB0, BCS, REL) \
+    P(COMPARE_BRANCH, 0xCD, CMP, ABS, 0xD0, BNE, REL) \
+    P(COMPARE_BRANCH, 0xCD, CMP, ABS, 0xF0, BEQ, REL) \
+    P(COMPARE_BRANCH, 0xCD, CMP, ABS, 0x90, BCC, REL) \
+    P(COMPARE_BRANCH, 0xCD, CMP, ABS, 0xB0, BCS, REL) \
+    P(COMPARE_BRANCH, 0xE0, CPX, IMM, 0xD0, BNE, REL) \
+    P(COMPARE_BRANCH, 0xE0, CPX, IMM, 0xF0, BEQ, REL) \
+    P(COMPARE_BRANCH, 0xE0, CPX, IMM, 0x90, BCC, REL) \
+    P(COMPARE_BRANCH, 0xE0, CPX, IMM, 0xB0, BCS, REL) \
+    P(COMPARE_BRANCH, 0xE4, CPX, ZPG, 0xD0, BNE, REL) \
+    P(COMPARE_BRANCH, 0xE4, CPX, ZPG, 0xF0, BEQ, REL) \
+    P(COMPARE_BRANCH, 0xE4, CPX, ZPG, 0x90, BCC, REL) \
+    P(COMPARE_BRANCH, 0xE4, CPX, ZPG, 0xB0, BCS, REL) \
+    P(COMPARE_BRANCH, 0xEC, CPX, ABS, 0xD0, BNE, REL) \
+    P(COMPARE_BRANCH, 0xEC, CPX, ABS, 0xF0, BEQ, REL) \
+    P(COMPARE_BRANCH, 0xEC, CPX, ABS, 0x90, BCC, REL) \
+    P(COMPARE_BRANCH, 0xEC, CPX, ABS, 0xB0, BCS, REL) \
+    P(COMPARE_BRANCH, 0xC0, CPY, IMM, 0xD0, BNE, REL) \
+    P(COMPARE_BRANCH, 0xC0, CPY, IMM, 0xF0, BEQ, REL) \
+    P(COMPARE_BRANCH, 0xC0, CPY, IMM, 0x90, BCC, REL) \
+    P(COMPARE_BRANCH, 0xC0, CPY, IMM, 0xB0, BCS, REL) \
+    P(COMPARE_BRANCH, 0xC4, CPY, ZPG, 0xD0, BNE, REL) \
+    P(COMPARE_BRANCH, 0xC4, CPY, ZPG, 0xF0, BEQ, REL) \
+    P(COMPARE_BRANCH, 0xC4, CPY, ZPG, 0x90, BCC, REL) \
+    P(COMPARE_BRANCH, 0xC4, CPY, ZPG, 0xB0, BCS, REL) \
+    P(COMPARE_BRANCH, 0xCC, CPY, ABS, 0xD0, BNE, REL) \
+    P(COMPARE_BRANCH, 0xCC, CPY, ABS, 0xF0, BEQ, REL) \
+    P(COMPARE_BRANCH, 0xCC, CPY, ABS, 0x90, BCC, REL) \
+    P(COMPARE_BRANCH, 0xCC, CPY, ABS, 0xB0, BCS, REL) \
+    T(STEP_COMPARE_BRANCH, 0xCA, DEX, IMPL, 0xE0, CPX, IMM, 0xD0, BNE, REL) \
+    T(STEP_COMPARE_BRANCH, 0xCA, DEX, IMPL, 0xE0, CPX, IMM, 0xF0, BEQ, REL) \
+    T(STEP_COMPARE_BRANCH, 0xCA, DEX, IMPL, 0xE0, CPX, IMM, 0x90, BCC, REL) \
+    T(STEP_COMPARE_BRANCH, 0xCA, DEX, IMPL, 0xE0, CPX, IMM, 0xB0, BCS, REL) \
+    T(STEP_COMPARE_BRANCH, 0x88, DEY, IMPL, 0xC0, CPY, IMM, 0xD0, BNE, REL) \
+    T(STEP_COMPARE_BRANCH, 0x88, DEY, IMPL, 0xC0, CPY, IMM, 0xF0, BEQ, REL) \
+    T(STEP_COMPARE_BRANCH, 0x88, DEY, IMPL, 0xC0, CPY, IMM, 0x90, BCC, REL) \
+    T(STEP_COMPARE_BRANCH, 0x88, DEY, IMPL, 0xC0, CPY, IMM, 0xB0, BCS, REL) \
+    T(STEP_COMPARE_BRANCH, 0xE8, INX, IMPL, 0xE0, CPX, IMM, 0xD0, BNE, REL) \
+    T(STEP_COMPARE_BRANCH, 0xE8, INX, IMPL, 0xE0, CPX, IMM, 0xF0, BEQ, REL) \
+    T(STEP_COMPARE_BRANCH, 0xE8, INX, IMPL, 0xE0, CPX, IMM, 0x90, BCC, REL) \
+    T(STEP_COMPARE_BRANCH, 0xE8, INX, IMPL, 0xE0, CPX, IMM, 0xB0, BCS, REL) \
+    T(STEP_COMPARE_BRANCH, 0xC8, INY, IMPL, 0xC0, CPY, IMM, 0xD0, BNE, REL) \
+    T(STEP_COMPARE_BRANCH, 0xC8, INY, IMPL, 0xC0, CPY, IMM, 0xF0, BEQ, REL) \
+    T(STEP_COMPARE_BRANCH, 0xC8, INY, IMPL, 0xC0, CPY, IMM, 0x90, BCC, REL) \
+    T(STEP_COMPARE_BRANCH, 0xC8, INY, IMPL, 0xC0, CPY, IMM, 0xB0, BCS, REL)
+
+typedef struct CPU_SUPERINSTRUCTION
+{
+    CPU_IDIOM idiom;
+    uint8_t length;     // Instructions
+    uint8_t opcodes[3];
+} CPU_SUPERINSTRUCTION;
+
+#define CPU_SUPERINSTRUCTION_PAIR_ENTRY(idiom, o1, i1, m1, o2, i2, m2)                  { CPU_IDIOM_##idiom, 2, { o1, o2, 0 } },
+#define CPU_SUPERINSTRUCTION_TRIPLE_ENTRY(idiom, o1, i1, m1, o2, i2, m2, o3, i3, m3)    { CPU_IDIOM_##idiom, 3, { o1, o2, o3 } },
+
+// Index 0 is none
+static const CPU_SUPERINSTRUCTION cpu_superinstructions[] =
+{
+    { 0, 0, { 0 } },
+    CPU_SUPERINSTRUCTIONS(CPU_SUPERINSTRUCTION_PAIR_ENTRY, CPU_SUPERINSTRUCTION_TRIPLE_ENTRY)
+};
+
+#define CPU_SUPERINSTRUCTION_COUNT  (sizeof(cpu_superinstructions) / sizeof(cpu_superinstructions[0]))
+
+// Superinstruction starting at offset of a rom page, it has to end in the page
+static uint8_t cpu_find_superinstruction(const uint8_t* page, uint16_t offset)
+{
+    for (uint8_t i = 1; i < CPU_SUPERINSTRUCTION_COUNT; i++)
+    {
+        const CPU_SUPERINSTRUCTION* superinstruction = &cpu_superinstructions[i];
+        uint16_t at = offset;
+        uint8_t k = 0;
+        while (k < superinstruction->length && at < CPU_PAGE_SIZE && page[at] == superinstruction->opcodes[k])
+            at += 1 + cpu_operand_bytes[page[at]], k++;
+        if (k == superinstruction->length && at <= CPU_PAGE_SIZE)
+            return i;
+    }
+    return 0;
+}
+
+#define CPU_HANDLER_ADDRESS(opcode, instruction, mode)  &&opcode_##opcode,
+#define CPU_JAM_ADDRESS(opcode)                         &&opcode_##opcode,
+
+#define CPU_FUSED_HANDLER(opcode, instruction, mode) \
+opcode_##opcode: \
+    LOG("0x%x | 0x%x : ", cpu->PC, opcode); \
+    CPU_OPERAND_##mode \
+    cpu->operand_address = address; \
+    cpu->addressing_mode = AM_##mode; \
+    LOG(#instruction); \
+    CPU_OP_##instruction(opcode, mode) \
+    cpu->PC += instruction_length[AM_##mode]; \
+    cpu->instructions++; \
+    LOG(" | %s\n", addressing_mode_text[AM_##mode]); \
+    return;
+#define CPU_JAM_HANDLER(opcode)                         CPU_FUSED_HANDLER(opcode, JAM, IMPL)
+
+void cpu_execute_specialized(CPU* cpu)
+{
+    static void* const handlers[256] = { CPU_OPCODES(CPU_HANDLER_ADDRESS, CPU_JAM_ADDRESS) };
+
+    uint16_t address, pointer, sum, operand;
+    int16_t difference;
+    uint8_t opcode, value, zero_page, carry;
+
+    uint16_t offset = cpu->PC & (CPU_PAGE_SIZE - 1);
+    CPU_DECODED* decoded = cpu->pages[cpu->PC >> CPU_PAGE_SHIFT].decoded;
+
+    if (decoded != NULL && decoded[offset].valid)
+    {
+        opcode = decoded[offset].opcode;
+        operand = decoded[offset].operand;
+    }
+    else
+    {
+        opcode = cpu_fast_read(cpu, cpu->PC);
+        switch (cpu_operand_bytes[opcode])
+        {
+        case 1:
+            operand = cpu_fast_read(cpu, cpu->PC + 1);
+            break;
+        case 2:
+            operand = cpu_fast_read_word(cpu, cpu->PC + 1);
+            break;
+        default:
+            operand = 0;
+        }
+
+        // An instruction running into the next page can't be kept, that page may be switched to another bank
+        if (decoded != NULL && offset + cpu_operand_bytes[opcode] < CPU_PAGE_SIZE)
+        {
+            decoded[offset].operand = operand;
+            decoded[offset].opcode = opcode;
+            decoded[offset].superinstruction = cpu_find_superinstruction(cpu->pages[cpu->PC >> CPU_PAGE_SHIFT].read, offset);
+            decoded[offset].valid = true;
+        }
+    }
+
+    goto *handlers[opcode];
+
+    CPU_OPCODES(CPU_FUSED_HANDLER, CPU_JAM_HANDLER)
+}
+
+// Operand of the instruction at a position of the superinstruction, straight from the rom
+#define CPU_SUPERINSTRUCTION_OPERAND(at, mode) \
+    (CPU_OPERAND_BYTES_##mode == 0 ? 0 : CPU_OPERAND_BYTES_##mode == 1 ? code[(at) + 1] : code[(at) + 1] | (code[(at) + 2] << 8))
+
+// Whether the operand of an instruction is ram, rom or PRG RAM, the zero page always is
+#define CPU_READABLE_IMPL(operand)      true
+#define CPU_READABLE_IMM(operand)       true
+#define CPU_READABLE_REL(operand)       true
+#define CPU_READABLE_ZPG(operand)       true
+#define CPU_READABLE_ZPG_X(operand)     true
+#define CPU_READABLE_ABS(operand)       (cpu->pages[(uint16_t)(operand) >> CPU_PAGE_SHIFT].read != NULL)
+#define CPU_READABLE_ABS_X(operand)     (cpu->pages[(uint16_t)((operand) + cpu->X) >> CPU_PAGE_SHIFT].read != NULL)
+#define CPU_READABLE_ABS_Y(operand)     (cpu->pages[(uint16_t)((operand) + cpu->Y) >> CPU_PAGE_SHIFT].read != NULL)
+#define CPU_WRITABLE_ZPG(operand)       true
+#define CPU_WRITABLE_ZPG_X(operand)     true
+#define CPU_WRITABLE_ABS(operand)       (cpu->pages[(uint16_t)(operand) >> CPU_PAGE_SHIFT].write != NULL)
+#define CPU_WRITABLE_ABS_X(operand)     (cpu->pages[(uint16_t)((operand) + cpu->X) >> CPU_PAGE_SHIFT].write != NULL)
+#define CPU_WRITABLE_ABS_Y(operand)     (cpu->pages[(uint16_t)((operand) + cpu->Y) >> CPU_PAGE_SHIFT].write != NULL)
+
+#define CPU_SAFE_LDA(mode, operand)     CPU_READABLE_##mode(operand)
+#define CPU_SAFE_CMP(mode, operand)     CPU_READABLE_##mode(operand)
+#define CPU_SAFE_CPX(mode, operand)     CPU_READABLE_##mode(operand)
+#define CPU_SAFE_CPY(mode, operand)     CPU_READABLE_##mode(operand)
+#define CPU_SAFE_STA(mode, operand)     CPU_WRITABLE_##mode(operand)
+#define CPU_SAFE_DEX(mode, operand)     true
+#define CPU_SAFE_DEY(mode, operand)     true
+#define CPU_SAFE_INX(mode, operand)     true
+#define CPU_SAFE_INY(mode, operand)     true
+#define CPU_SAFE_BNE(mode, operand)     true
+#define CPU_SAFE_BEQ(mode, operand)     true
+#define CPU_SAFE_BPL(mode, operand)     true
+#define CPU_SAFE_BMI(mode, operand)     true
+#define CPU_SAFE_BCC(mode, operand)     true
+#define CPU_SAFE_BCS(mode, operand)     true
+
+// One instruction of a superinstruction, like its handler in cpu_execute_specialized
+#define CPU_SUPERINSTRUCTION_STEP(opcode, instruction, mode, value_of_operand) \
+    operand = (value_of_operand); \
+    CPU_OPERAND_##mode \
+    cpu->operand_address = address; \
+    cpu->addressing_mode = AM_##mode; \
+    CPU_OP_##instruction(opcode, mode) \
+    cpu->PC += instruction_length[AM_##mode]; \
+    cpu->instructions++; \
+    cycles += cpu->cycle;
+
+#define CPU_SUPERINSTRUCTION_PAIR_ADDRESS(idiom, o1, i1, m1, o2, i2, m2)                &&super_##o1##_##o2,
+#define CPU_SUPERINSTRUCTION_TRIPLE_ADDRESS(idiom, o1, i1, m1, o2, i2, m2, o3, i3, m3)  &&super_##o1##_##o2##_##o3,
+
+#define CPU_SUPERINSTRUCTION_PAIR_HANDLER(idiom, o1, i1, m1, o2, i2, m2) \
+super_##o1##_##o2: \
+    operands[0] = CPU_SUPERINSTRUCTION_OPERAND(0, m1); \
+    operands[1] = CPU_SUPERINSTRUCTION_OPERAND(instruction_length[AM_##m1], m2); \
+    if (!CPU_SAFE_##i1(m1, operands[0]) || !CPU_SAFE_##i2(m2, operands[1])) \
+        return false; \
+    LOG("0x%x | superinstruction " #i1 " " #i2 "\n", cpu->PC); \
+    CPU_SUPERINSTRUCTION_STEP(o1, i1, m1, operands[0]) \
+    CPU_SUPERINSTRUCTION_STEP(o2, i2, m2, operands[1]) \
+    cpu->idioms[CPU_IDIOM_##idiom]++; \
+    cpu->cycle = cycles; \
+    return true;
+
+#define CPU_SUPERINSTRUCTION_TRIPLE_HANDLER(idiom, o1, i1, m1, o2, i2, m2, o3, i3, m3) \
+super_##o1##_##o2##_##o3: \
+    operands[0] = CPU_SUPERINSTRUCTION_OPERAND(0, m1); \
+    operands[1] = CPU_SUPERINSTRUCTION_OPERAND(instruction_length[AM_##m1], m2); \
+    operands[2] = CPU_SUPERINSTRUCTION_OPERAND(instruction_length[AM_##m1] + instruction_length[AM_##m2], m3); \
+    if (!CPU_SAFE_##i1(m1, operands[0]) || !CPU_SAFE_##i2(m2, operands[1]) || !CPU_SAFE_##i3(m3, operands[2])) \
+        return false; \
+    LOG("0x%x | superinstruction " #i1 " " #i2 " " #i3 "\n", cpu->PC); \
+    CPU_SUPERINSTRUCTION_STEP(o1, i1, m1, operands[0]) \
+    CPU_SUPERINSTRUCTION_STEP(o2, i2, m2, operands[1]) \
+    CPU_SUPERINSTRUCTION_STEP(o3, i3, m3, operands[2]) \
+    cpu->idioms[CPU_IDIOM_##idiom]++; \
+    cpu->cycle = cycles; \
+    return true;
+
+// Runs the superinstruction at PC if there is one and it fits the cycles left, the caller runs the instruction otherwise
+bool cpu_execute_superinstruction(CPU* cpu, uint16_t max_cycles)
+{
+    static void* const handlers[] =
+    {
+        NULL,
+        CPU_SUPERINSTRUCTIONS(CPU_SUPERINSTRUCTION_PAIR_ADDRESS, CPU_SUPERINSTRUCTION_TRIPLE_ADDRESS)
+    };
+
+    CPU_PAGE* page = &cpu->pages[cpu->PC >> CPU_PAGE_SHIFT];
+    uint16_t offset = cpu->PC & (CPU_PAGE_SIZE - 1);
+    if (page->decoded == NULL || !page->decoded[offset].valid || page->decoded[offset].superinstruction == 0 ||
+        cpu_block_budget(cpu, max_cycles) < CPU_SUPERINSTRUCTION_MAX_CYCLES)
+        return false;
+
+    const uint8_t* code = &page->read[offset];
+    uint16_t address, pointer, operand, operands[3];
+    uint8_t value;
+    uint32_t cycles = 0;
+
+    goto *handlers[page->decoded[offset].superinstruction];
+
+    CPU_SUPERINSTRUCTIONS(CPU_SUPERINSTRUCTION_PAIR_HANDLER, CPU_SUPERINSTRUCTION_TRIPLE_HANDLER)
+
+    return false;
+}
@@ -0,0 +1,211 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "run_ahead.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static double run_ahead_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.;
+}
+
+static void run_ahead_frames(NES_RUN_AHEAD* run_ahead, NES* nes, uint32_t frames)
+{
+    double start = run_ahead_time();
+    for (uint32_t i = 0; i < frames; i++)
+    {
+        nes->ppu.skip_render = i + 1 != frames;     // Only the last one is shown
+        nes_run_frame(nes);
+    }
+    run_ahead->ahead_time += run_ahead_time() - start;
+}
+
+static void run_ahead_restore(NES_RUN_AHEAD* run_ahead, NES* nes)
+{
+    double start = run_ahead_time();
+    run_ahead->state.position = 0;
+    NES_STREAM stream = nes_memory_stream(&run_ahead->state);
+    nes_load_state(nes, &stream);
+    run_ahead->load_time += run_ahead_time() - start;
+}
+
+static void* run_ahead_thread(void* arg)
+{
+    NES_RUN_AHEAD* run_ahead = (NES_RUN_AHEAD*)arg;
+
+    pthread_mutex_lock(&run_ahead->lock);
+    while (true)
+    {
+        while (!run_ahead->pending && !run_ahead->quit)
+            pthread_cond_wait(&run_ahead->cond, &run_ahead->lock);
+        if (run_ahead->quit)
+            break;
+        pthread_mutex_unlock(&run_ahead->lock);
+
+        // The shadow starts from before the real frame so it runs it too
+        run_ahead_restore(run_ahead, run_ahead->shadow);
+        run_ahead_frames(run_ahead, run_ahead->shadow, run_ahead->frames + 1);
+
+        pthread_mutex_lock(&run_ahead->lock);
+        run_ahead->pending = false;
+        pthread_cond_broadcast(&run_ahead->cond);
+    }
+    pthread_mutex_unlock(&run_ahead->lock);
+
+    return NULL;
+}
+
+bool nes_run_ahead_init(NES_RUN_AHEAD* run_ahead, char* path_to_rom, uint32_t frames, bool second_instance)
+{
+    memset(run_ahead, 0, sizeof(NES_RUN_AHEAD));
+    run_ahead->frames = frames > RUN_AHEAD_MAX_FRAMES ? RUN_AHEAD_MAX_FRAMES : frames;
+
+    if (!second_instance || run_ahead->frames == 0)
+        return true;
+
+    run_ahead->shadow = (NES*)malloc(sizeof(NES));
+    if (run_ahead->shadow == NULL)
+        return false;
+
+    *run_ahead->shadow = nes_create();
+    run_ahead->shadow->verbose = false;
+    nes_init(run_ahead->shadow);
+    if (!nes_load_game(run_ahead->shadow, path_to_rom))
+    {
+        nes_destroy(run_ahead->shadow);
+        free(run_ahead->shadow);
+        run_ahead->shadow = NULL;
+        return false;
+    }
+
+    pthread_mutex_init(&run_ahead->lock, NULL);
+    pthread_cond_init(&run_ahead->cond, NULL);
+    pthread_create(&run_ahead->thread, NULL, run_ahead_thread, run_ahead);
+    return true;
+}
+
+void nes_run_ahead_destroy(NES_RUN_AHEAD* run_ahead)
+{
+    if (run_ahead->shadow != NULL)
+    {
+        pthread_mutex_lock(&run_ahead->lock);
+        run_ahead->quit = true;
+        pthread_cond_broadcast(&run_ahead->cond);
+        pthread_mutex_unlock(&run_ahead->lock);
+        pthread_join(run_ahead->thread, NULL);
+
+        pthread_cond_destroy(&run_ahead->cond);
+        pthread_mutex_destroy(&run_ahead->lock);
+        nes_destroy(run_ahead->shadow);
+        free(run_ahead->shadow);
+    }
+
+    nes_memory_stream_free(&run_ahead->state);
+    free(run_ahead->dirty);
+    memset(run_ahead, 0, sizeof(NES_RUN_AHEAD));
+}
+
+static void run_ahead_copy_dirty(NES_RUN_AHEAD* run_ahead, NES* nes, bool save)
+{
+    size_t words[4] = { nes_dirty_words(0x800), nes_dirty_words(0x1000), nes_dirty_words(0x2000), nes_dirty_words(nes->PRG_RAM_size) };
+    uint64_t* maps[4] = { nes->dirty_ram, nes->dirty_vram, nes->dirty_chr_ram, nes->dirty_prg_ram };
+
+    size_t total = words[0] + words[1] + words[2] + (maps[3] != NULL ? words[3] : 0);
+    if (total > run_ahead->dirty_words)
+    {
+        run_ahead->dirty = (uint64_t*)realloc(run_ahead->dirty, total * sizeof(uint64_t));
+        run_ahead->dirty_words = total;
+    }
+
+    uint64_t* saved = run_ahead->dirty;
+    for (uint32_t i = 0; i < 4; i++)
+    {
+        if (maps[i] == NULL)
+            continue;
+        if (save)
+            memcpy(saved, maps[i], words[i] * sizeof(uint64_t));
+        else
+            memcpy(maps[i], saved, words[i] * sizeof(uint64_t));
+        saved += words[i];
+    }
+}
+
+// Runs the real frame, undrawn, and draws the one `frames` ahead of it
+NES_RUN_RESULT nes_run_ahead_frame(NES_RUN_AHEAD* run_ahead, NES* nes)
+{
+    if (run_ahead->frames == 0)
+        return nes_run_frame(nes);
+
+    double start = run_ahead_time();
+    run_ahead->state.size = 0;
+    NES_STREAM stream = nes_memory_stream(&run_ahead->state);
+
+    NES_RUN_RESULT result;
+    if (run_ahead->shadow != NULL)
+    {
+        nes_save_state(nes, &stream);
+        run_ahead->save_time += run_ahead_time() - start;
+
+        // Set from the ui thread through the commands, which the shadow doesn't get
+        memcpy(run_ahead->shadow->ppu.ntsc_palette, nes->ppu.ntsc_palette, sizeof(nes->ppu.ntsc_palette));
+        memcpy(run_ahead->shadow->ppu.palette_lut, nes->ppu.palette_lut, sizeof(nes->ppu.palette_lut));
+
+        pthread_mutex_lock(&run_ahead->lock);
+        run_ahead->pending = true;
+        pthread_cond_broadcast(&run_ahead->cond);
+        pthread_mutex_unlock(&run_ahead->lock);
+
+        nes->ppu.skip_render = true;
+        result = nes_run_frame(nes);
+
+        pthread_mutex_lock(&run_ahead->lock);
+        while (run_ahead->pending)
+            pthread_cond_wait(&run_ahead->cond, &run_ahead->lock);
+        pthread_mutex_unlock(&run_ahead->lock);
+    }
+    else
+    {
+        nes->ppu.skip_render = true;
+        result = nes_run_frame(nes);
+
+        start = run_ahead_time();
+        nes_save_state(nes, &stream);
+        run_ahead_copy_dirty(run_ahead, nes, true);
+        run_ahead->save_time += run_ahead_time() - start;
+
+        run_ahead_frames(run_ahead, nes, run_ahead->frames);
+        run_ahead_restore(run_ahead, nes);
+        run_ahead_copy_dirty(run_ahead, nes, false);
+
+        // The restore brings back the skip decision of the real frame
+        nes->ppu.skip_render = nes->render_interval == 0 || nes->ppu.frame_count % nes->render_interval != 0;
+    }
+
+    run_ahead->runs++;
+    return result;
+}
+
+// Ppu whose frames are to be shown
+PPU* nes_run_ahead_screen(NES_RUN_AHEAD* run_ahead, NES* nes)
+{
+    return run_ahead->shadow != NULL ? &run_ahead->shadow->ppu : &nes->ppu;
+}
+
+NES_RUN_AHEAD_STATS nes_run_ahead_stats(NES_RUN_AHEAD* run_ahead)
+{
+    NES_RUN_AHEAD_STATS stats = { 0 };
+    if (run_ahead->runs == 0)
+        return stats;
+
+    uint32_t frames = run_ahead->frames + (run_ahead->shadow != NULL);
+    stats.runs = run_ahead->runs;
+    stats.save_us = run_ahead->save_time / run_ahead->runs * 1000000.;
+    stats.load_us = run_ahead->load_time / run_ahead->runs * 1000000.;
+    stats.frame_us = run_ahead->ahead_time / (run_ahead->runs * frames) * 1000000.;
+    stats.total_us = stats.save_us + stats.load_us + run_ahead->ahead_time / run_ahead->runs * 1000000.;
+    return stats;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "nes.h"
+#include "save_state.h"
+
+#include <pthread.h>
+
+#define RUN_AHEAD_MAX_FRAMES    8
+
+// Hides the input lag of the game : every host frame shows the console `frames` frames in the future, emulated with the current input
+typedef struct NES_RUN_AHEAD
+{
+    uint32_t frames;            // 0 disables
+    NES_MEMORY_STREAM state;    // Real frame the speculative ones start from
+    uint64_t* dirty;            // Dirty pages of the real frame, a restore would mark everything
+    size_t dirty_words;
+
+    // Second instance : the speculative frames run on a copy of the console on its own thread, the real one is never restored
+    NES* shadow;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool pending;               // Speculation requested, cleared by the shadow thread when done
+    bool quit;
+
+    // Host time spent on the speculation, in seconds
+    double save_time, load_time, ahead_time;
+    uint64_t runs;
+} NES_RUN_AHEAD;
+
+typedef struct NES_RUN_AHEAD_STATS
+{
+    double save_us, load_us;    // Per host frame
+    double frame_us;            // Per speculative frame
+    double total_us;            // Extra cost per host frame
+    uint64_t runs;
+} NES_RUN_AHEAD_STATS;
+
+bool nes_run_ahead_init(NES_RUN_AHEAD* run_ahead, char* path_to_rom, uint32_t frames, bool second_instance);
+void nes_run_ahead_destroy(NES_RUN_AHEAD* run_ahead);
+NES_RUN_RESULT nes_run_ahead_frame(NES_RUN_AHEAD* run_ahead, NES* nes);
+PPU* nes_run_ahead_screen(NES_RUN_AHEAD* run_ahead, NES* nes);
+NES_RUN_AHEAD_STATS nes_run_ahead_stats(NES_RUN_AHEAD* run_ahead);
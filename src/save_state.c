@@ -0,0 +1,601 @@
+#include "save_state.h"
+#include "nes.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Small chunks are (de)serialized field by field by a single function so both directions can't drift apart
+typedef struct STATE_BUFFER
+{
+    uint8_t* data;      // NULL to only measure the size
+    uint32_t size;
+    uint32_t position;
+    bool loading;
+    bool overflow;
+} STATE_BUFFER;
+
+typedef struct STATE_CHUNK
+{
+    char tag[4];
+    void (*sync)(STATE_BUFFER* buffer, NES* nes);   // Small chunks
+    uint8_t* (*memory)(NES* nes, uint32_t* size);   // Raw memory chunks, size 0 if the game has none
+} STATE_CHUNK;
+
+static void state_bytes(STATE_BUFFER* buffer, void* data, uint32_t size)
+{
+    if (buffer->data != NULL && buffer->position + size > buffer->size)
+    {
+        buffer->overflow = true;
+        return;
+    }
+
+    if (buffer->data != NULL)
+    {
+        if (buffer->loading)
+            memcpy(data, &buffer->data[buffer->position], size);
+        else
+            memcpy(&buffer->data[buffer->position], data, size);
+    }
+    buffer->position += size;
+}
+
+static void state_uint(STATE_BUFFER* buffer, void* value, uint8_t size)
+{
+    uint8_t bytes[8];
+    uint64_t v = 0;
+
+    if (!buffer->loading)
+    {
+        memcpy(&v, value, size);    // Host is little endian like the rest of the code assumes, bytes are still written explicitly
+        for (uint8_t i = 0; i < size; i++)
+            bytes[i] = v >> (8 * i);
+    }
+
+    state_bytes(buffer, bytes, size);
+
+    if (buffer->loading && !buffer->overflow)
+    {
+        for (uint8_t i = 0; i < size; i++)
+            v |= (uint64_t)bytes[i] << (8 * i);
+        memcpy(value, &v, size);
+    }
+}
+
+#define state_u8(buffer, value)     state_uint(buffer, value, 1)
+#define state_u16(buffer, value)    state_uint(buffer, value, 2)
+#define state_u32(buffer, value)    state_uint(buffer, value, 4)
+#define state_u64(buffer, value)    state_uint(buffer, value, 8)
+#define state_bool(buffer, value)   state_uint(buffer, value, sizeof(bool))
+#define state_enum(buffer, value)   state_uint(buffer, value, sizeof(*(value)))
+#define state_double(buffer, value) state_uint(buffer, value, sizeof(double))
+
+// Identifies the game the state was made with, checked on load but never applied
+typedef struct STATE_INFO
+{
+    uint64_t rom_hash;
+    uint32_t mapper;
+    uint32_t prg_ram_size;
+    bool chr_ram;
+} STATE_INFO;
+
+static STATE_INFO state_info(NES* nes)
+{
+    STATE_INFO info = { nes->rom_hash, (uint32_t)nes->mapper, nes->PRG_RAM_size, nes->CHR_RAM };
+    return info;
+}
+
+static void state_sync_info_fields(STATE_BUFFER* buffer, STATE_INFO* info)
+{
+    state_u64(buffer, &info->rom_hash);
+    state_u32(buffer, &info->mapper);
+    state_u32(buffer, &info->prg_ram_size);
+    state_bool(buffer, &info->chr_ram);
+}
+
+static void state_sync_info(STATE_BUFFER* buffer, NES* nes)
+{
+    STATE_INFO info = state_info(nes);
+    state_sync_info_fields(buffer, &info);
+}
+
+static void state_sync_nes(STATE_BUFFER* buffer, NES* nes)
+{
+    state_u64(buffer, &nes->master_clock);
+    state_u64(buffer, &nes->cpu_timestamp);
+    state_u64(buffer, &nes->ppu_timestamp);
+    state_enum(buffer, &nes->system);
+
+    state_u8(buffer, &nes->key_status);
+    state_u8(buffer, &nes->key_status_control);
+    state_bool(buffer, &nes->key_strobe);
+
+    state_u64(buffer, &nes->rng_seed);
+    state_u64(buffer, &nes->rng_state);
+}
+
+static void state_sync_mapper(STATE_BUFFER* buffer, NES* nes)
+{
+    state_u8(buffer, &nes->selected_prgrom_bank_0);
+    state_u8(buffer, &nes->selected_prgram_bank);
+    state_u8(buffer, &nes->selected_chrrom_bank_0);
+    state_u8(buffer, &nes->selected_chrrom_bank_1);
+
+    state_u8(buffer, &nes->mmc1_shift_register);
+    state_u8(buffer, &nes->mmc1_bits_shifted);
+    state_u8(buffer, &nes->mmc1_control);
+}
+
+static void state_sync_cpu(STATE_BUFFER* buffer, NES* nes)
+{
+    CPU* cpu = &nes->cpu;
+    uint8_t P = cpu_get_flags(cpu);     // Saved packed
+
+    state_u8(buffer, &cpu->A);
+    state_u8(buffer, &cpu->X);
+    state_u8(buffer, &cpu->Y);
+    state_u16(buffer, &cpu->PC);
+    state_u8(buffer, &cpu->S);
+    state_u8(buffer, &P);
+    if (buffer->loading)
+        cpu_set_flags(cpu, P);
+
+    state_u16(buffer, &cpu->cycle);
+    state_u16(buffer, &cpu->operand_address);
+    state_enum(buffer, &cpu->addressing_mode);
+    state_u8(buffer, &cpu->page_boundary_crossed);
+
+    state_bool(buffer, &cpu->nmi);
+    state_bool(buffer, &cpu->nmi_last_requested_state);
+    state_bool(buffer, &cpu->nmi_requested);
+    state_bool(buffer, &cpu->nmi_last_requested);
+    state_u8(buffer, &cpu->nmi_latch);
+
+    state_bool(buffer, &cpu->dma);
+    state_u8(buffer, &cpu->dma_page);
+    state_u8(buffer, &cpu->dma_counter);
+    state_u32(buffer, &cpu->apu_counter);
+
+    // Since version 2
+    if (buffer->loading)
+        cpu->jammed = false;
+    state_bool(buffer, &cpu->jammed);
+}
+
+static void state_sync_ppu(STATE_BUFFER* buffer, NES* nes)
+{
+    PPU* ppu = &nes->ppu;
+
+    state_u8(buffer, (uint8_t*)&ppu->PPUCTRL);
+    state_u8(buffer, (uint8_t*)&ppu->PPUMASK);
+    state_u8(buffer, (uint8_t*)&ppu->PPUSTATUS);
+    state_u8(buffer, &ppu->OAMADDR);
+    state_u8(buffer, &ppu->OAMDATA);
+    state_u8(buffer, &ppu->PPUDATA);
+    state_u8(buffer, &ppu->OAMDMA);
+    state_enum(buffer, &ppu->mirroring);
+
+    state_bool(buffer, &ppu->w);
+    state_u16(buffer, (uint16_t*)&ppu->t);
+    state_u16(buffer, (uint16_t*)&ppu->v);
+    state_u8(buffer, &ppu->x);
+    uint8_t fine_x = ppu->x;    // Fine x of the pixel being drawn before version 3, x stands for it since
+    state_u8(buffer, &fine_x);
+    state_bool(buffer, &ppu->odd_frame);
+    state_u8(buffer, &ppu->last_read);
+
+    state_bytes(buffer, ppu->secondary_oam_memory, sizeof(ppu->secondary_oam_memory));
+    state_u8(buffer, &ppu->sprite_0_prepared);
+    state_u8(buffer, &ppu->oam_byte_read);
+    state_bool(buffer, &ppu->sprite_eval_finished);
+    state_u8(buffer, &ppu->oamaddr_n);
+    state_u8(buffer, &ppu->oamaddr_m);
+    state_u8(buffer, &ppu->secondary_oam_addr);
+    state_bool(buffer, &ppu->sprite_in_range);
+    state_u8(buffer, &ppu->overflow_copy_counter);
+
+    state_u16(buffer, &ppu->scanline);
+    state_u16(buffer, &ppu->cycle);
+
+    state_bytes(buffer, ppu->sprites_to_render, sizeof(ppu->sprites_to_render));
+    state_u8(buffer, &ppu->num_sprites_to_render);
+    state_u8(buffer, &ppu->sprite_0_rendered);
+
+    state_u64(buffer, &ppu->frame_count);
+    state_bool(buffer, &ppu->can_nmi);
+    state_bool(buffer, &ppu->horizontal_increment);
+    state_bool(buffer, &ppu->vertical_increment);
+    state_bool(buffer, &ppu->rendering_enabled);
+    state_bool(buffer, &ppu->last_frame_rendering_enabled);
+
+    // Since version 3
+    if (buffer->loading)
+    {
+        memset(ppu->bg_tiles, 0, sizeof(ppu->bg_tiles));
+        memset(ppu->bg_next_row, 0, sizeof(ppu->bg_next_row));
+        ppu->bg_next_tile = ppu->bg_next_palette = 0;
+    }
+    state_bytes(buffer, ppu->bg_tiles, sizeof(ppu->bg_tiles));
+    state_u8(buffer, &ppu->bg_next_tile);
+    state_u8(buffer, &ppu->bg_next_palette);
+    state_bytes(buffer, ppu->bg_next_row, sizeof(ppu->bg_next_row));
+}
+
+static void state_sync_pulse_channel(STATE_BUFFER* buffer, APU_PULSE_CHANNEL* channel)
+{
+    state_u8(buffer, &channel->selected_duty);
+    state_u16(buffer, &channel->timer_period);
+    state_u16(buffer, &channel->timer);
+    state_u16(buffer, &channel->length_counter);
+    state_bool(buffer, &channel->lc_halt);
+    state_u8(buffer, &channel->volume);
+    state_u8(buffer, &channel->decay_volume);
+    state_bool(buffer, &channel->start_flag);
+    state_u8(buffer, &channel->envelope_divider);
+    state_bool(buffer, &channel->constant_volume);
+    state_bool(buffer, &channel->sweep_enabled);
+    state_u16(buffer, &channel->target_period);
+    state_u8(buffer, &channel->sweep_period);
+    state_u8(buffer, &channel->sweep_divider);
+    state_u8(buffer, &channel->sweep_shift);
+    state_bool(buffer, &channel->sweep_reload);
+    state_bool(buffer, &channel->sweep_negate);
+    state_u8(buffer, &channel->sequencer);
+    state_u8(buffer, &channel->smooth_sequencer);
+    state_double(buffer, &channel->smooth_timer);
+}
+
+static void state_sync_apu(STATE_BUFFER* buffer, NES* nes)
+{
+    APU* apu = &nes->apu;
+
+    state_bool(buffer, &apu->sequencer_mode);
+    state_bool(buffer, &apu->irq_inhibit);
+    state_u8(buffer, (uint8_t*)&apu->status);
+    state_double(buffer, &apu->samples);
+    state_u64(buffer, &apu->total_cycles);
+    state_u64(buffer, &apu->cpu_cycles);
+
+    state_sync_pulse_channel(buffer, &apu->pulse1);
+    state_sync_pulse_channel(buffer, &apu->pulse2);
+}
+
+static uint8_t* state_ram(NES* nes, uint32_t* size)
+{
+    *size = sizeof(nes->cpu.memory_low);
+    return nes->cpu.memory_low;
+}
+
+static uint8_t* state_vram(NES* nes, uint32_t* size)
+{
+    *size = sizeof(nes->ppu.VRAM);
+    return nes->ppu.VRAM;
+}
+
+static uint8_t* state_oam(NES* nes, uint32_t* size)
+{
+    *size = sizeof(nes->ppu.oam_memory);
+    return nes->ppu.oam_memory;
+}
+
+static uint8_t* state_palette_ram(NES* nes, uint32_t* size)
+{
+    *size = sizeof(nes->ppu.palette_ram);
+    return nes->ppu.palette_ram;
+}
+
+static uint8_t* state_prg_ram(NES* nes, uint32_t* size)
+{
+    *size = nes->PRG_RAM_data != NULL ? nes->PRG_RAM_size : 0;
+    return nes->PRG_RAM_data;
+}
+
+static uint8_t* state_chr_ram(NES* nes, uint32_t* size)
+{
+    *size = nes->CHR_RAM ? nes->CHR_ROM_size : 0;
+    return nes->CHR_ROM_data;
+}
+
+// INFO has to stay first, it is validated before anything gets applied
+static const STATE_CHUNK state_chunks[] =
+{
+    { "INFO", &state_sync_info, NULL },
+    { "NES ", &state_sync_nes, NULL },
+    { "MAPR", &state_sync_mapper, NULL },
+    { "CPU ", &state_sync_cpu, NULL },
+    { "PPU ", &state_sync_ppu, NULL },
+    { "APU ", &state_sync_apu, NULL },
+    { "RAM ", NULL, &state_ram },
+    { "VRAM", NULL, &state_vram },
+    { "OAM ", NULL, &state_oam },
+    { "PAL ", NULL, &state_palette_ram },
+    { "PRAM", NULL, &state_prg_ram },
+    { "CRAM", NULL, &state_chr_ram }
+};
+
+#define STATE_NUM_CHUNKS    (sizeof(state_chunks) / sizeof(STATE_CHUNK))
+
+static void state_put_u32(uint8_t* data, uint32_t value)
+{
+    for (uint8_t i = 0; i < 4; i++)
+        data[i] = value >> (8 * i);
+}
+
+static uint32_t state_get_u32(const uint8_t* data)
+{
+    return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+static bool state_write_chunk(NES_STREAM* stream, const char* tag, const void* data, uint32_t size)
+{
+    uint8_t header[8];
+    memcpy(header, tag, 4);
+    state_put_u32(&header[4], size);
+
+    return stream->write(stream->user, header, 8) == 8 && (size == 0 || stream->write(stream->user, data, size) == size);
+}
+
+static uint32_t state_sync_size(NES* nes, const STATE_CHUNK* chunk)
+{
+    STATE_BUFFER buffer = { NULL, 0, 0, false, false };
+    chunk->sync(&buffer, nes);
+    return buffer.position;
+}
+
+bool nes_save_state(NES* nes, NES_STREAM* stream)
+{
+    if (nes->created != NES_CREATED_MAGIC_DWORD)
+    {
+        printf("NES object used while not initialized\n");
+        return false;
+    }
+
+    uint8_t header[8];
+    memcpy(header, SAVE_STATE_MAGIC, 4);
+    state_put_u32(&header[4], SAVE_STATE_VERSION);
+    if (stream->write(stream->user, header, 8) != 8)
+        return false;
+
+    for (uint32_t i = 0; i < STATE_NUM_CHUNKS; i++)
+    {
+        const STATE_CHUNK* chunk = &state_chunks[i];
+        bool written;
+
+        if (chunk->sync != NULL)
+        {
+            uint8_t data[512];
+            STATE_BUFFER buffer = { data, sizeof(data), 0, false, false };
+            chunk->sync(&buffer, nes);
+            written = !buffer.overflow && state_write_chunk(stream, chunk->tag, data, buffer.position);
+        }
+        else
+        {
+            uint32_t size;
+            uint8_t* data = chunk->memory(nes, &size);
+            written = size == 0 || state_write_chunk(stream, chunk->tag, data, size);
+        }
+
+        if (!written)
+            return false;
+    }
+
+    return state_write_chunk(stream, "END ", NULL, 0);
+}
+
+bool nes_load_state(NES* nes, NES_STREAM* stream)
+{
+    if (nes->created != NES_CREATED_MAGIC_DWORD)
+    {
+        printf("NES object used while not initialized\n");
+        return false;
+    }
+
+    uint8_t header[8];
+    if (stream->read(stream->user, header, 8) != 8 || memcmp(header, SAVE_STATE_MAGIC, 4) != 0)
+    {
+        printf("Couldn't load save state: not a save state\n");
+        return false;
+    }
+    uint32_t version = state_get_u32(&header[4]);     // Newer ones load too, what they added is skipped
+
+    // Everything is read and checked before the machine is touched so a bad state leaves it as it was
+    uint8_t* payloads[STATE_NUM_CHUNKS] = { NULL };
+    uint32_t sizes[STATE_NUM_CHUNKS] = { 0 };
+    bool success = false;
+
+    while (true)
+    {
+        if (stream->read(stream->user, header, 8) != 8)
+        {
+            printf("Couldn't load save state: truncated\n");
+            goto end;
+        }
+
+        uint32_t size = state_get_u32(&header[4]);
+        if (memcmp(header, "END ", 4) == 0)
+            break;
+        if (size > SAVE_STATE_MAX_CHUNK)
+        {
+            printf("Couldn't load save state: corrupted chunk\n");
+            goto end;
+        }
+
+        uint8_t* payload = (uint8_t*)malloc(size ? size : 1);
+        if (stream->read(stream->user, payload, size) != size)
+        {
+            free(payload);
+            printf("Couldn't load save state: truncated\n");
+            goto end;
+        }
+
+        bool known = false;
+        for (uint32_t i = 0; i < STATE_NUM_CHUNKS && !known; i++)
+        {
+            if (memcmp(header, state_chunks[i].tag, 4) == 0)
+            {
+                free(payloads[i]);
+                payloads[i] = payload;
+                sizes[i] = size;
+                known = true;
+            }
+        }
+        if (!known)
+            free(payload);      // Chunk from a newer version
+    }
+
+    for (uint32_t i = 0; i < STATE_NUM_CHUNKS; i++)
+    {
+        const STATE_CHUNK* chunk = &state_chunks[i];
+        uint32_t expected;
+        if (chunk->sync != NULL)
+            expected = state_sync_size(nes, chunk);
+        else
+            chunk->memory(nes, &expected);
+
+        // Versions only make small chunks longer : a shorter one is from an older version, the fields it lacks are left to
+        // the sync function, and the fields a longer one has past the known ones are ignored
+        if ((expected != 0 && payloads[i] == NULL) || (chunk->sync != NULL ? sizes[i] < expected && version >= SAVE_STATE_VERSION : sizes[i] != expected))
+        {
+            printf("Couldn't load save state: chunk \"%.4s\" is missing or doesn't match the game\n", chunk->tag);
+            goto end;
+        }
+    }
+
+    {
+        STATE_INFO info = { 0 }, game = state_info(nes);
+        STATE_BUFFER buffer = { payloads[0], sizes[0], 0, true, false };
+        state_sync_info_fields(&buffer, &info);
+
+        if (info.rom_hash != game.rom_hash || info.mapper != game.mapper || info.prg_ram_size != game.prg_ram_size || info.chr_ram != game.chr_ram)
+        {
+            printf("Couldn't load save state: it was made with another game\n");
+            goto end;
+        }
+    }
+
+    for (uint32_t i = 1; i < STATE_NUM_CHUNKS; i++)
+    {
+        const STATE_CHUNK* chunk = &state_chunks[i];
+        if (chunk->sync != NULL)
+        {
+            STATE_BUFFER buffer = { payloads[i], sizes[i], 0, true, false };
+            chunk->sync(&buffer, nes);
+        }
+        else if (sizes[i] != 0)
+        {
+            uint32_t size;
+            uint8_t* data = chunk->memory(nes, &size);
+            memcpy(data, payloads[i], size);
+        }
+    }
+
+    cpu_map_memory(&nes->cpu);     // Banks may have changed
+    if (nes->CHR_RAM)
+        ppu_flush_tiles(&nes->ppu);
+    ppu_build_sprite_line(&nes->ppu);  // Derived from the sprites to render
+    nes->idle.armed = false;
+    nes_mark_all_dirty(nes);
+    success = true;
+
+end:
+    for (uint32_t i = 0; i < STATE_NUM_CHUNKS; i++)
+        free(payloads[i]);
+    return success;
+}
+
+bool nes_save_state_file(NES* nes, const char* path)
+{
+    FILE* f = fopen(path, "wb");
+    if (f == NULL)
+    {
+        printf("Couldn't open \"%s\"\n", path);
+        return false;
+    }
+
+    NES_STREAM stream = nes_file_stream(f);
+    bool success = nes_save_state(nes, &stream);
+    fclose(f);
+
+    if (success)
+        nes_log(nes, "Saved state to \"%s\"\n", path);
+    else
+        printf("Couldn't write save state to \"%s\"\n", path);
+    return success;
+}
+
+bool nes_load_state_file(NES* nes, const char* path)
+{
+    FILE* f = fopen(path, "rb");
+    if (f == NULL)
+    {
+        printf("Couldn't open \"%s\"\n", path);
+        return false;
+    }
+
+    NES_STREAM stream = nes_file_stream(f);
+    bool success = nes_load_state(nes, &stream);
+    fclose(f);
+
+    if (success)
+        nes_log(nes, "Loaded state from \"%s\"\n", path);
+    return success;
+}
+
+static size_t nes_file_write(void* user, const void* data, size_t size)
+{
+    return fwrite(data, 1, size, (FILE*)user);
+}
+
+static size_t nes_file_read(void* user, void* data, size_t size)
+{
+    return fread(data, 1, size, (FILE*)user);
+}
+
+NES_STREAM nes_file_stream(FILE* f)
+{
+    NES_STREAM stream = { &nes_file_write, &nes_file_read, f };
+    return stream;
+}
+
+static size_t nes_memory_write(void* user, const void* data, size_t size)
+{
+    NES_MEMORY_STREAM* memory = (NES_MEMORY_STREAM*)user;
+    if (memory->size + size > memory->capacity)
+    {
+        size_t capacity = memory->capacity ? memory->capacity : 0x4000;
+        while (capacity < memory->size + size)
+            capacity *= 2;
+
+        uint8_t* data = (uint8_t*)realloc(memory->data, capacity);
+        if (data == NULL)
+            return 0;
+        memory->data = data;
+        memory->capacity = capacity;
+    }
+
+    memcpy(&memory->data[memory->size], data, size);
+    memory->size += size;
+    return size;
+}
+
+static size_t nes_memory_read(void* user, void* data, size_t size)
+{
+    NES_MEMORY_STREAM* memory = (NES_MEMORY_STREAM*)user;
+    if (size > memory->size - memory->position)
+        size = memory->size - memory->position;
+
+    memcpy(data, &memory->data[memory->position], size);
+    memory->position += size;
+    return size;
+}
+
+NES_STREAM nes_memory_stream(NES_MEMORY_STREAM* memory)
+{
+    NES_STREAM stream = { &nes_memory_write, &nes_memory_read, memory };
+    return stream;
+}
+
+void nes_memory_stream_free(NES_MEMORY_STREAM* memory)
+{
+    free(memory->data);
+    memset(memory, 0, sizeof(NES_MEMORY_STREAM));
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "nes.h"
+
+#include <stddef.h>
+#include <stdio.h>
+
+// File layout : "SNST" | version (u32) | chunks... | "END " chunk
+// Chunk : tag (4 chars) | payload size (u32) | payload ; everything is little endian
+// Versions only append fields to a chunk or add chunks, so states of any version load : older readers ignore both,
+// newer ones give the fields an older state lacks their default
+#define SAVE_STATE_MAGIC        "SNST"
+// Version 2 : the cpu chunk ends with the jammed flag
+// Version 3 : the ppu chunk ends with the background fetch pipeline
+#define SAVE_STATE_VERSION      3
+
+#define SAVE_STATE_MAX_CHUNK    0x100000    // Sanity limit when reading
+
+// Sink / source the state goes through, both return the number of bytes transferred
+typedef struct NES_STREAM
+{
+    size_t (*write)(void* user, const void* data, size_t size);
+    size_t (*read)(void* user, void* data, size_t size);
+    void* user;
+} NES_STREAM;
+
+// Growable memory buffer, writes append and reads start from position
+typedef struct NES_MEMORY_STREAM
+{
+    uint8_t* data;
+    size_t size, capacity;
+    size_t position;
+} NES_MEMORY_STREAM;
+
+NES_STREAM nes_file_stream(FILE* f);
+NES_STREAM nes_memory_stream(NES_MEMORY_STREAM* memory);
+void nes_memory_stream_free(NES_MEMORY_STREAM* memory);
+
+bool nes_save_state(NES* nes, NES_STREAM* stream);
+bool nes_load_state(NES* nes, NES_STREAM* stream);
+bool nes_save_state_file(NES* nes, const char* path);
+bool nes_load_state_file(NES* nes, const char* path);